@@ -158,6 +158,36 @@ static void benchmark_read(void) {
     printf(" %.1f KB/s\n", (double)(BENCHMARK_SIZE) / duration / 1024);
 }
 
+static void benchmark_mount(struct combination_map *setting) {
+    int err = fs_unmount("/");
+    if (err == -1) {
+        printf("fs_unmount / error: %s\n", fs_strerror(errno));
+        return;
+    }
+
+    absolute_time_t start_at = get_absolute_time();
+    err = fs_mount("/", setting->filesystem, setting->device);
+    if (err == -1) {
+        printf("fs_mount / error: %s\n", fs_strerror(errno));
+        return;
+    }
+    int64_t mount_us = absolute_time_diff_us(start_at, get_absolute_time());
+
+    int fd = open("/log", O_WRONLY|O_CREAT|O_APPEND);
+    if (fd == -1) {
+        printf("open error: %s\n", strerror(errno));
+        return;
+    }
+    const char message[] = "boot\n";
+    if (write(fd, message, sizeof(message) - 1) == -1) {
+        printf("write error: %s\n", strerror(errno));
+    }
+    close(fd);
+    int64_t first_write_us = absolute_time_diff_us(start_at, get_absolute_time());
+
+    printf("Mount %.1f ms, first write %.1f ms\n", (double)mount_us / 1000, (double)first_write_us / 1000);
+}
+
 int main(void) {
     stdio_init_all();
     init_filesystem_combination();
@@ -183,6 +213,7 @@ int main(void) {
 
         benchmark_write();
         benchmark_read();
+        benchmark_mount(&setting);
 
         err = fs_unmount("/");
         if (err == 01) {
@@ -12,11 +12,21 @@
 #include <pico/cyw43_arch.h>
 #include <pico/stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include "blockdevice/loopback.h"
+#include "storage/pqueue.h"
 
 #define MQTT_SERVER             "io.adafruit.com"  // See https://io.adafruit.com
 #define MQTT_TOPIC              (MQTT_USER "/feeds/temperature")
 #define MQTT_QOS_AT_LEAST_ONCE  1
-#define LOCAL_QUEUE_PATH        "/temperature.txt"
+#define LOCAL_QUEUE_PATH        "/temperature.queue"
+#define LOCAL_QUEUE_SIZE        (64 * 1024)
+#define PUBLISH_BATCH_SIZE      8
+
+typedef struct {
+    char timestamp[30];
+    float value;
+} sample_t;
 
 extern bool ntp_sync(void);
 extern const char *get_timestamp(void);
@@ -111,42 +121,79 @@ static float read_sensor_data() {
     return temperature;
 }
 
-static void publish_message(mqtt_client_t *client, float data, const char *timestamp) {
+static bool publish_message(mqtt_client_t *client, float data, const char *timestamp) {
     (void)client;
     char payload[100] = {0};
     snprintf(payload, sizeof(payload), "{\"timestamp\":\"%s\", \"value\":%.2f}", timestamp, data);
 
     cyw43_arch_lwip_begin();
-    mqtt_publish(client, MQTT_TOPIC, payload, strlen(payload), MQTT_QOS_AT_LEAST_ONCE, 0, NULL, NULL);
+    err_t err = mqtt_publish(client, MQTT_TOPIC, payload, strlen(payload), MQTT_QOS_AT_LEAST_ONCE, 0, NULL, NULL);
     cyw43_arch_lwip_end();
+    if (err != ERR_OK) {
+        printf("Publish failed: err=%d\n", err);
+        return false;
+    }
 
     printf("Publish: %s\n", payload);
+    return true;
 }
 
-static void publish_message_from_file(mqtt_client_t *client) {
-    FILE *fp = fopen(LOCAL_QUEUE_PATH, "r");
-    if (fp == NULL) {
-        return;
+// Samples queued during a network outage are kept in a persistent queue in a file
+static pq_t *open_local_queue(void) {
+    blockdevice_t *device = blockdevice_loopback_create(LOCAL_QUEUE_PATH, LOCAL_QUEUE_SIZE, 512);
+    if (device == NULL) {
+        printf("blockdevice_loopback_create failed\n");
+        return NULL;
     }
+    pq_t *queue = pq_open(device);
+    if (queue == NULL) {
+        int err = pq_format(device);
+        if (err != 0) {
+            printf("pq_format failed: %s\n", strerror(-err));
+            return NULL;
+        }
+        queue = pq_open(device);
+    }
+    if (queue == NULL)
+        printf("pq_open failed: %s\n", strerror(errno));
+    return queue;
+}
 
-    char timestamp[30] = {0};
-    float data = 0;
-    while (fscanf(fp, "%[^,],%f\n", timestamp, &data) != EOF) {
-        publish_message(client, data, timestamp);
+static void publish_queued_messages(mqtt_client_t *client, pq_t *queue) {
+    pq_message_t messages[PUBLISH_BATCH_SIZE];
+    sample_t samples[PUBLISH_BATCH_SIZE];
+    while (true) {
+        ssize_t count = pq_peek_batch(queue, messages, PUBLISH_BATCH_SIZE, samples, sizeof(samples));
+        if (count <= 0)
+            return;
+
+        // Only the samples that were handed over to MQTT are removed from the queue
+        size_t published = 0;
+        for (ssize_t i = 0; i < count; i++) {
+            sample_t sample;
+            memcpy(&sample, messages[i].data, sizeof(sample));
+            if (!publish_message(client, sample.value, sample.timestamp))
+                break;
+            published++;
+        }
+        if (published > 0)
+            pq_pop_commit(queue, published);
+        if (published < (size_t)count)
+            return;
     }
-    fclose(fp);
-    remove(LOCAL_QUEUE_PATH);
 }
 
-static void save_data_to_file(float data, const char *timestamp) {
-    FILE *fp = fopen(LOCAL_QUEUE_PATH, "a");
-    if (fp == NULL) {
-        printf("fopen failed: %s\n", strerror(errno));
+static void save_data_to_queue(pq_t *queue, float data, const char *timestamp) {
+    sample_t sample = {.value = data};
+    snprintf(sample.timestamp, sizeof(sample.timestamp), "%s", timestamp);
+    int err = pq_push(queue, &sample, sizeof(sample));
+    if (err == 0)
+        err = pq_sync(queue);
+    if (err != 0) {
+        printf("pq_push failed: %s\n", strerror(-err));
         return;
     }
-    fprintf(fp, "%s,%.2f\n", timestamp, data);
     printf("Queue: %s,%.2f\n", timestamp, data);
-    fclose(fp);
 }
 
 int main(void) {
@@ -161,16 +208,18 @@ int main(void) {
         printf("network_init failed\n");
     }
     mqtt_client_t *client = mqtt_client_new();
+    pq_t *queue = open_local_queue();
     while (1) {
         float sensor_value = read_sensor_data();
         const char *timestamp = get_timestamp();
         if (mantain_network_connection(client, &mqtt_server_addr)) {
             // Normal operation
-            publish_message_from_file(client);
+            if (queue != NULL)
+                publish_queued_messages(client, queue);
             publish_message(client, sensor_value, timestamp);
-        } else {
+        } else if (queue != NULL) {
             // Network outage operation
-            save_data_to_file(sensor_value, timestamp);
+            save_data_to_queue(queue, sensor_value, timestamp);
         }
         sleep_ms(10 * 1000);
     }
@@ -3,8 +3,8 @@
  *
  * This code is not specifically tuned. The data is substituted with random numbers,
  * and the actual application will probably be reading the ADC or communicating with
- * the sensor chip. Also, the method of outputting CSV files is slow. The method of
- * outputting binary data is faster.
+ * the sensor chip. The samples are stored in a time-series file, which is delta
+ * encoded and indexed by timestamp, rather than formatted as CSV.
  *
  * Copyright 2024, Hiroyuki OYAMA
  *
@@ -17,12 +17,15 @@
 #include <pico/util/queue.h>
 #include <stdio.h>
 #include <string.h>
+#include "filesystem/timeseries.h"
 #include "filesystem/vfs.h"
 
 #if !defined(SAMPLING_RATE_HZ)
 #define SAMPLING_RATE_HZ  1000
 #endif
 
+#define SENSOR_VALUE_COUNT  9
+
 typedef struct {
     float accel_x;
     float accel_y;
@@ -37,7 +40,6 @@ typedef struct {
 } sensor_data_t;
 
 queue_t sensor_queue;
-static char write_buffer[1024 * 8];
 
 static float normal_random(float mean, float stddev) {
     static bool has_spare = false;
@@ -96,12 +98,11 @@ int main(void) {
     }
 
     queue_init(&sensor_queue, sizeof(sensor_data_t), 1024);
-    FILE *fp = fopen("/sd/sensor_data.csv", "w");
-    if (fp == NULL) {
-        printf("fopen failed: %s\n", strerror(errno));
+    fs_timeseries_t *ts = fs_timeseries_open("/sd/sensor_data.ts", SENSOR_VALUE_COUNT);
+    if (ts == NULL) {
+        printf("fs_timeseries_open failed: %s\n", strerror(errno));
+        return -1;
     }
-    setvbuf(fp, write_buffer, _IOFBF, sizeof(write_buffer));
-    fprintf(fp, "Time,AccelX,AccelY,AccelZ,GyroX,GyroY,GyroZ,MagX,MagY,Magz\n");
 
     multicore_reset_core1();
     sleep_ms(100);
@@ -112,11 +113,12 @@ int main(void) {
     uint32_t n = 0;
     while (1) {
         queue_remove_blocking(&sensor_queue, &entry);
-        fprintf(fp, "%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f\n",
-                (double)entry.timestamp / 1000 / 1000,
-                entry.accel_x, entry.accel_y, entry.accel_z,
-                entry.gyro_x, entry.gyro_y, entry.gyro_x,
-                entry.mag_x, entry.mag_y, entry.mag_z);
+        float values[SENSOR_VALUE_COUNT] = {
+            entry.accel_x, entry.accel_y, entry.accel_z,
+            entry.gyro_x, entry.gyro_y, entry.gyro_z,
+            entry.mag_x, entry.mag_y, entry.mag_z,
+        };
+        fs_timeseries_append(ts, entry.timestamp, values);
         n += 1;
         absolute_time_t now = get_absolute_time();
         int64_t duration = absolute_time_diff_us(last_checkpoint, now);
@@ -125,10 +127,11 @@ int main(void) {
                    n, queue_get_level(&sensor_queue));
             n = 0;
             last_checkpoint = now;
+            fs_timeseries_sync(ts);
         }
     }
 
-    fclose(fp);
+    fs_timeseries_close(ts);
     queue_free(&sensor_queue);
 
     while (1)
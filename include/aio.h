@@ -0,0 +1,140 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+/** \defgroup filesystem_aio filesystem_aio
+ *  \ingroup filesystem
+ *  \brief Asynchronous I/O
+ *
+ * POSIX asynchronous I/O on top of the file descriptors of pico-vfs, provided by the
+ * `filesystem_aio` library. Requests are executed in order by a single worker that is started
+ * by the first request: a FreeRTOS task when FreeRTOS is used, a job of the shared loop on
+ * core1 on bare metal (filesystem_core1), or a pthread on the host. While the I/O service owns
+ * core1, the worker cannot start and requests fail with `EAGAIN`.
+ *
+ * The buffer of a request is used in place and belongs to the caller again once aio_error()
+ * no longer reports `EINPROGRESS`. Completion is reported by polling aio_error() or by
+ * aio_suspend(); signal notification (`aio_sigevent`) is not supported.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+#include <time.h>
+
+#if !defined(PICO_VFS_AIO_QUEUE_DEPTH)
+/*! \brief Maximum number of queued asynchronous requests
+ * \ingroup filesystem_aio
+ */
+#define PICO_VFS_AIO_QUEUE_DEPTH    8
+#endif
+
+#define AIO_CANCELED       0
+#define AIO_NOTCANCELED    1
+#define AIO_ALLDONE        2
+
+#define LIO_READ           0
+#define LIO_WRITE          1
+#define LIO_NOP            2
+
+struct aiocb {
+    int aio_fildes;
+    off_t aio_offset;
+    volatile void *aio_buf;
+    size_t aio_nbytes;
+    int aio_reqprio;     // Ignored, requests are executed in order
+    int aio_lio_opcode;  // Ignored, lio_listio() is not supported
+
+    // Private, managed by the library
+    int __opcode;
+    volatile int __error_code;
+    volatile ssize_t __return_value;
+};
+
+/*! \brief Queue an asynchronous read
+ * \ingroup filesystem_aio
+ *
+ * Reads `aio_nbytes` bytes at `aio_offset` of `aio_fildes` into `aio_buf`, like pread().
+ *
+ * \param aiocbp Control block. Must remain valid until the request completes.
+ * \retval 0 The request was queued.
+ * \retval -1 The request was not queued. errno is `EAGAIN` if the queue is full, or
+ *            if the worker cannot start.
+ */
+int aio_read(struct aiocb *aiocbp);
+
+/*! \brief Queue an asynchronous write
+ * \ingroup filesystem_aio
+ *
+ * Writes `aio_nbytes` bytes from `aio_buf` at `aio_offset` of `aio_fildes`, like pwrite().
+ *
+ * \param aiocbp Control block. Must remain valid until the request completes.
+ * \retval 0 The request was queued.
+ * \retval -1 The request was not queued. errno is `EAGAIN` if the queue is full, or
+ *            if the worker cannot start.
+ */
+int aio_write(struct aiocb *aiocbp);
+
+/*! \brief Queue an asynchronous file synchronization
+ * \ingroup filesystem_aio
+ *
+ * Calls fsync() on `aio_fildes` after all previously queued requests have completed.
+ *
+ * \param op `O_SYNC` or `O_DSYNC`, both are handled as fsync().
+ * \param aiocbp Control block. Must remain valid until the request completes.
+ * \retval 0 The request was queued.
+ * \retval -1 The request was not queued. Error codes are indicated by errno.
+ */
+int aio_fsync(int op, struct aiocb *aiocbp);
+
+/*! \brief Error status of an asynchronous request
+ * \ingroup filesystem_aio
+ *
+ * \param aiocbp Control block of a queued request.
+ * \return `EINPROGRESS` while the request has not completed, `ECANCELED` if it was canceled,
+ *         otherwise 0 or the errno value of the operation.
+ */
+int aio_error(const struct aiocb *aiocbp);
+
+/*! \brief Return value of a completed asynchronous request
+ * \ingroup filesystem_aio
+ *
+ * \param aiocbp Control block of a completed request.
+ * \return The value the synchronous read, write or fsync would have returned.
+ */
+ssize_t aio_return(struct aiocb *aiocbp);
+
+/*! \brief Wait for asynchronous requests
+ * \ingroup filesystem_aio
+ *
+ * Waits until at least one of the requests in `list` has completed. NULL entries are ignored.
+ *
+ * \param list Control blocks to wait for.
+ * \param nent Number of entries in `list`.
+ * \param timeout Maximum time to wait, or NULL to wait indefinitely.
+ * \retval 0 A request has completed.
+ * \retval -1 errno is `EAGAIN` if the time limit expired.
+ */
+int aio_suspend(const struct aiocb *const list[], int nent, const struct timespec *timeout);
+
+/*! \brief Cancel asynchronous requests
+ * \ingroup filesystem_aio
+ *
+ * Cancels queued requests of `fildes` that have not started yet.
+ *
+ * \param fildes File descriptor of the requests.
+ * \param aiocbp Request to cancel, or NULL to cancel all requests of `fildes`.
+ * \retval AIO_CANCELED The requests were canceled.
+ * \retval AIO_NOTCANCELED A request is in progress and cannot be canceled.
+ * \retval AIO_ALLDONE The requests had already completed.
+ * \retval -1 Error codes are indicated by errno.
+ */
+int aio_cancel(int fildes, struct aiocb *aiocbp);
+
+#ifdef __cplusplus
+}
+#endif
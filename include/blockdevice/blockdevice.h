@@ -38,6 +38,8 @@ typedef struct blockdevice {
     int (*erase)(struct blockdevice *device, bd_size_t addr, bd_size_t size);
     int (*trim)(struct blockdevice *device, bd_size_t addr, bd_size_t size);
     bd_size_t (*size)(struct blockdevice *device);
+    // Optional, NULL if the device is not memory mapped. Returns a pointer to the data at addr.
+    const void *(*map)(struct blockdevice *device, bd_size_t addr, bd_size_t size);
     size_t read_size;
     size_t erase_size;
     size_t program_size;
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+/** \defgroup filesystem_core1 filesystem_core1
+ *  \ingroup filesystem
+ *  \brief Shared owner of core1 for background work
+ *
+ * On bare metal, the background work of the libraries runs on core1: the `filesystem_aio`
+ * worker, the fs_gc_start_background() maintenance and the fs_stage_start_destager()
+ * destager. They are jobs of one loop, so they can be used together. The loop calls every job in turn, and sleeps with WFE when none of them
+ * had work, until fs_core1_notify() or the shortest interval of the jobs.
+ *
+ * The I/O service of fs_io_service_start_core1() needs core1 for itself. Its core0 callers
+ * wait for core1 while they hold the VFS lock, which a job on core1 may be waiting for. So
+ * core1 is either shared by jobs or claimed by one loop, and the other request fails with
+ * EBUSY. An application that launches core1 itself must not use either.
+ *
+ * Under FreeRTOS, the libraries create tasks instead and do not use this library.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#if !defined(PICO_VFS_CORE1_MAX_JOBS)
+#define PICO_VFS_CORE1_MAX_JOBS    4
+#endif
+
+/*! \brief Add a job to the loop on core1
+ * \ingroup filesystem_core1
+ *
+ * Launches the loop on core1 with the first job.
+ *
+ * \param job Function that does a bounded amount of work, and returns true if more is ready.
+ * \param interval_us Longest time in microseconds before the job is called again when no job
+ *                    had work, or 0 to wait for fs_core1_notify().
+ * \retval 0 The job was added.
+ * \retval -1 Failed, with errno set to `EBUSY` if core1 is claimed, or `ENOSPC` if
+ *            `PICO_VFS_CORE1_MAX_JOBS` (default 4) jobs were added.
+ */
+int fs_core1_add_job(bool (*job)(void), uint32_t interval_us);
+
+/*! \brief Run a loop of its own on core1
+ * \ingroup filesystem_core1
+ *
+ * \param entry Function that core1 runs. It does not return.
+ * \retval 0 core1 was launched.
+ * \retval -1 Failed, with errno set to `EBUSY` if core1 is claimed or runs jobs.
+ */
+int fs_core1_claim(void (*entry)(void));
+
+/*! \brief Wake the loop on core1
+ * \ingroup filesystem_core1
+ *
+ * Called after work was queued for a job. A notification that comes while the jobs run is not
+ * lost; the next wait returns at once.
+ */
+void fs_core1_notify(void);
+
+#ifdef __cplusplus
+}
+#endif
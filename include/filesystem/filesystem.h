@@ -15,15 +15,28 @@ extern "C" {
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include "blockdevice/blockdevice.h"
 
 #define PATH_MAX   256
 
+#if !defined(PICO_VFS_MAX_OPEN_FILES)
+#define PICO_VFS_MAX_OPEN_FILES    16
+#endif
+#if !defined(PICO_VFS_MAX_OPEN_DIRS)
+#define PICO_VFS_MAX_OPEN_DIRS     8
+#endif
+
 enum {
     FILESYSTEM_TYPE_FAT,
     FILESYSTEM_TYPE_LITTLEFS,
+    FILESYSTEM_TYPE_TMPFS,
+    FILESYSTEM_TYPE_ROMFS,
+    FILESYSTEM_TYPE_OVERLAY,
 };
 
 enum {
@@ -58,6 +71,84 @@ typedef struct {
     struct dirent current;
 } fs_dir_t;
 
+/*! \brief Pool of per-file or per-directory contexts
+ * \ingroup filesystem
+ *
+ * File system implementations use an object pool to recycle the context objects attached
+ * to fs_file_t and fs_dir_t. Objects are allocated on first use up to the pool capacity and
+ * released objects are kept on an intrusive free list, so repeated open/close cycles do
+ * not allocate from the heap.
+ */
+typedef struct {
+    void *free_list;
+    size_t object_size;
+    size_t capacity;
+    size_t allocated;
+} fs_object_pool_t;
+
+/*! \brief Initialize object pool
+ * \ingroup filesystem
+ *
+ * \param pool Pointer to the pool
+ * \param object_size Size of one object. Must be at least the size of a pointer
+ * \param capacity Maximum number of objects allocated from the heap
+ */
+static inline void fs_object_pool_init(fs_object_pool_t *pool, size_t object_size, size_t capacity) {
+    pool->free_list = NULL;
+    pool->object_size = object_size < sizeof(void *) ? sizeof(void *) : object_size;
+    pool->capacity = capacity;
+    pool->allocated = 0;
+}
+
+/*! \brief Take a zero-initialized object from the pool
+ * \ingroup filesystem
+ *
+ * \param pool Pointer to the pool
+ * \retval NULL The pool has reached its capacity or the heap is exhausted
+ */
+static inline void *fs_object_pool_acquire(fs_object_pool_t *pool) {
+    void *object = pool->free_list;
+    if (object != NULL) {
+        pool->free_list = *(void **)object;
+    } else {
+        if (pool->allocated >= pool->capacity)
+            return NULL;
+        object = malloc(pool->object_size);
+        if (object == NULL)
+            return NULL;
+        pool->allocated++;
+    }
+    memset(object, 0, pool->object_size);
+    return object;
+}
+
+/*! \brief Return an object to the pool
+ * \ingroup filesystem
+ *
+ * \param pool Pointer to the pool
+ * \param object Object obtained with fs_object_pool_acquire(), or NULL
+ */
+static inline void fs_object_pool_release(fs_object_pool_t *pool, void *object) {
+    if (object == NULL)
+        return;
+    *(void **)object = pool->free_list;
+    pool->free_list = object;
+}
+
+/*! \brief Free the objects kept by the pool
+ * \ingroup filesystem
+ *
+ * \param pool Pointer to the pool
+ */
+static inline void fs_object_pool_deinit(fs_object_pool_t *pool) {
+    while (pool->free_list != NULL) {
+        void *object = pool->free_list;
+        pool->free_list = *(void **)object;
+        free(object);
+        pool->allocated--;
+    }
+}
+
 /*! \brief file system abstract object
  *  \ingroup filesystem
  *
@@ -91,6 +182,25 @@ typedef struct filesystem {
     int (*dir_open)(struct filesystem *fs, fs_dir_t *dir, const char *path);
     int (*dir_close)(struct filesystem *fs, fs_dir_t *dir);
     int (*dir_read)(struct filesystem *fs, fs_dir_t *dir, struct dirent *ent);
+
+    // Optional operations, NULL if not supported by the file system
+    int (*gc)(struct filesystem *fs, uint32_t budget_us);
+    // Vectored I/O at offset, or at the current position if offset is -1. A positional
+    // transfer leaves the current position unchanged.
+    ssize_t (*file_preadv)(struct filesystem *fs, fs_file_t *file, const struct iovec *iov, int iovcnt, off_t offset);
+    ssize_t (*file_pwritev)(struct filesystem *fs, fs_file_t *file, const struct iovec *iov, int iovcnt, off_t offset);
+    // Device address of a range of the file if the range is stored contiguously on the device.
+    // Returns -ENOTSUP if it is not.
+    int (*file_extent)(struct filesystem *fs, fs_file_t *file, off_t offset, size_t length, bd_size_t *addr);
+    // Copy between two files of the same file system from their current positions, using the
+    // buffer supplied by the caller. Returns -ENOTSUP to fall back to a read/write loop.
+    ssize_t (*file_copy)(struct filesystem *fs, fs_file_t *in, fs_file_t *out, size_t len, void *buffer, size_t buffer_size);
+    // Flush several open files of the file system as one group, with a single block device
+    // sync at the end.
+    int (*sync)(struct filesystem *fs, fs_file_t *const *files, size_t count);
+    // Allocate storage for a range of the file, extending the file if the range ends beyond
+    // its end. The content of the extension is undefined.
+    int (*file_allocate)(struct filesystem *fs, fs_file_t *file, off_t offset, off_t length);
 } filesystem_t;
 
 #ifdef __cplusplus
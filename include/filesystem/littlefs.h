@@ -18,6 +18,27 @@ extern "C" {
 
 #define LFS_DBG   0
 
+#if !defined(PICO_VFS_LITTLEFS_FILE_CACHES)
+/*! \brief Number of per-file caches preallocated at mount time
+ * \ingroup filesystem_littlefs
+ *
+ * Each cache is one erase block in size. Files opened while all caches are in use fall
+ * back to a cache allocated by littlefs.
+ */
+#define PICO_VFS_LITTLEFS_FILE_CACHES   4
+#endif
+
+#if !defined(PICO_VFS_LITTLEFS_ALLOC_HINT)
+/*! \brief Persist the allocator state at unmount
+ * \ingroup filesystem_littlefs
+ *
+ * When enabled, a clean unmount stores the free blocks of one lookahead window in a custom
+ * attribute (type 0x70) of the root directory, and the next mount preloads it so that the
+ * first allocations do not traverse the whole file system. Requires littlefs v2.9 or later.
+ */
+#define PICO_VFS_LITTLEFS_ALLOC_HINT    0
+#endif
+
 /*! \brief Create littlefs file system object
  * \ingroup filesystem_littlefs
  *
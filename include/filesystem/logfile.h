@@ -0,0 +1,104 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+/** \defgroup filesystem_logfile filesystem_logfile
+ *  \ingroup filesystem
+ *  \brief Rotating log files
+ *
+ * Appends to the files `name.1`, `name.2`, ... and moves on to the next file when the current
+ * one reaches a size or an age. Only the newest generations are kept. The next file is created
+ * and preallocated ahead of time by fs_logfile_prepare_all(), which fs_logfile_open() registers
+ * with fs_gc_register_idle(), so that a rotation only switches file descriptors. Closing the
+ * previous file and removing the oldest one are deferred in the same way.
+ *
+ * The length of the data in the current file is recorded in `name.state` by fs_logfile_sync(),
+ * so that fs_logfile_open() can drop the rest of the preallocated area after a power failure.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*! \brief Rotating log file object
+ * \ingroup filesystem_logfile
+ */
+typedef struct fs_logfile fs_logfile_t;
+
+/*! \brief Open a rotating log file
+ * \ingroup filesystem_logfile
+ *
+ * Starts a new file after the newest existing generation of `name`. If the log was not closed,
+ * the last file is first cut back to the data that was synced, and the files after it are
+ * removed.
+ *
+ * \param name Path of the log without the generation suffix.
+ * \param max_size Size in bytes at which the file is rotated, 0 for no limit. A write is not
+ *                 split across files. Files are preallocated to this size.
+ * \param max_age_ms Age in milliseconds at which the file is rotated, 0 for no limit.
+ * \param generations Number of files kept, including the current one. At least 1.
+ * \return Log file object. Returnes NULL in case of failure, with errno set.
+ * \retval NULL Failed to open the log.
+ */
+fs_logfile_t *fs_logfile_open(const char *name, size_t max_size, uint32_t max_age_ms, unsigned generations);
+
+/*! \brief Append to a rotating log file
+ * \ingroup filesystem_logfile
+ *
+ * \param log Log file object.
+ * \param data Data to append.
+ * \param size Size of the data in bytes.
+ * \return Number of bytes written.
+ * \retval -1 Write failed. Error codes are indicated by errno.
+ */
+ssize_t fs_logfile_write(fs_logfile_t *log, const void *data, size_t size);
+
+/*! \brief Rotate a log file now
+ * \ingroup filesystem_logfile
+ *
+ * \param log Log file object.
+ * \retval 0 Rotation succeeded.
+ * \retval -1 Rotation failed. Error codes are indicated by errno.
+ */
+int fs_logfile_rotate(fs_logfile_t *log);
+
+/*! \brief Flush a log file
+ * \ingroup filesystem_logfile
+ *
+ * Makes the data written so far durable and records its length in the state file.
+ *
+ * \param log Log file object.
+ * \retval 0 Sync succeeded.
+ * \retval -1 Sync failed. Error codes are indicated by errno.
+ */
+int fs_logfile_sync(fs_logfile_t *log);
+
+/*! \brief Close a rotating log file
+ * \ingroup filesystem_logfile
+ *
+ * Truncates the current file to the data written, and removes the prepared next file.
+ *
+ * \param log Log file object.
+ * \retval 0 Close succeeded.
+ * \retval -1 Close failed. Error codes are indicated by errno. The object is released anyway.
+ */
+int fs_logfile_close(fs_logfile_t *log);
+
+/*! \brief Prepare the next file of every open log file
+ * \ingroup filesystem_logfile
+ *
+ * Closes files that were rotated out, removes generations beyond the limit, and creates and
+ * preallocates the next file of each log. Log files that are being written are skipped.
+ * fs_logfile_open() registers it with fs_gc_register_idle(), so fs_gc_idle_poll() calls it; can
+ * also be called from an idle loop or a low-priority task.
+ */
+void fs_logfile_prepare_all(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+/** \defgroup filesystem_overlay filesystem_overlay
+ *  \ingroup filesystem
+ *  \brief Writable file system stacked over a read-only one
+ *
+ * The overlay presents the merged tree of two file systems. The lower one, for example a romfs
+ * image with factory defaults, is never written. The upper one, for example littlefs on flash
+ * or a tmpfs, receives every change:
+ *
+ * - A lower file opened for writing is first copied up to the upper file system, with any
+ *   missing parent directories.
+ * - Removing an entry that exists in the lower file system creates a whiteout, an empty file
+ *   named `.wh.<name>`, in the upper file system. A directory created over a whiteout gets an
+ *   `.wh..wh..opq` marker that hides the lower directory of the same name.
+ * - readdir() returns the upper entries followed by the lower entries that are neither
+ *   replaced nor whited out.
+ *
+ * The paths that exist in the upper file system are kept in a hash set, built at mount. A path
+ * that is not in the set is looked up in the lower file system only, so reads of unmodified
+ * files cost no upper file system access.
+ *
+ * Renaming a directory that has lower content fails with `EXDEV`. fs_format() empties the upper
+ * file system, which restores the lower content.
+ *
+ *     filesystem_t *overlay = filesystem_overlay_create(romfs, rom, lfs, flash);
+ *     fs_mount("/", overlay, NULL);
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "filesystem/filesystem.h"
+
+/*! \brief Create overlay file system object
+ * \ingroup filesystem_overlay
+ *
+ * The layers are mounted and unmounted with the overlay. They are not released by
+ * filesystem_overlay_free().
+ *
+ * \param lower Read-only lower file system.
+ * \param lower_device Block device of the lower file system, or NULL for an in-memory one.
+ * \param upper Writable upper file system.
+ * \param upper_device Block device of the upper file system, or NULL for an in-memory one.
+ * \return File system object. Returns NULL in case of failure.
+ * \retval NULL failed to create file system object.
+ */
+filesystem_t *filesystem_overlay_create(filesystem_t *lower, blockdevice_t *lower_device,
+                                        filesystem_t *upper, blockdevice_t *upper_device);
+
+/*! \brief Release overlay file system object
+ * \ingroup filesystem_overlay
+ *
+ * \param fs overlay file system object
+ */
+void filesystem_overlay_free(filesystem_t *fs);
+
+#ifdef __cplusplus
+}
+#endif
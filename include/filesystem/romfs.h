@@ -0,0 +1,50 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+/** \defgroup filesystem_romfs filesystem_romfs
+ *  \ingroup filesystem
+ *  \brief Read-only file system for images built on the host
+ *
+ * The image is built from a directory tree by `tools/mkromfs.py`, usually as a build step with
+ * the `pico_add_romfs_image()` CMake function. It holds a table of entries in which the entries
+ * of each directory are consecutive and sorted by name, so a path component is looked up by
+ * binary search, followed by the names and the contiguous file data.
+ *
+ * On a memory mapped block device, such as the on-board flash, the table and the data are used
+ * in place: nothing is loaded at mount, read() is a memcpy() from XIP flash and mmap() returns
+ * a pointer into flash. On other devices, the table is loaded into RAM at mount.
+ *
+ *     extern const uint8_t assets[];
+ *     extern const size_t assets_size;
+ *
+ *     blockdevice_t *rom = blockdevice_flash_create((uint32_t)assets - XIP_BASE, assets_size);
+ *     fs_mount("/rom", filesystem_romfs_create(), rom);
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "filesystem/filesystem.h"
+
+/*! \brief Create romfs file system object
+ * \ingroup filesystem_romfs
+ *
+ * \return File system object. Returns NULL in case of failure.
+ * \retval NULL failed to create file system object.
+ */
+filesystem_t *filesystem_romfs_create(void);
+
+/*! \brief Release romfs file system object
+ * \ingroup filesystem_romfs
+ *
+ * \param fs romfs file system object
+ */
+void filesystem_romfs_free(filesystem_t *fs);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+/** \defgroup filesystem_stage filesystem_stage
+ *  \ingroup filesystem
+ *  \brief RAM staging tier in front of a slower file system
+ *
+ * A staging file system wraps a backing file system, typically FAT on an SD card, and absorbs
+ * write bursts that exceed the sustained write speed of the device. write() copies the data
+ * into a bounded staging area in RAM or PSRAM and returns. The staged data is later written
+ * to the backing file system in chunks of PICO_VFS_STAGE_CHUNK_SIZE bytes, aligned to the same
+ * size in the file, in the order it was written:
+ *
+ * - by the destager started with fs_stage_start_destager(), or by fs_gc(), as soon as a chunk
+ *   is full, or PICO_VFS_STAGE_AGE_US after its first byte was staged;
+ * - by the writer itself when the staging area is full, which is the back-pressure;
+ * - by fsync() and close(), which return once the data of the file is in the backing file
+ *   system.
+ *
+ * read() returns the staged data over the data of the backing file system, and fstat() and
+ * stat() include the staged size. A destage failure is returned by the next write(), fsync()
+ * or close() of the file. Other descriptors of the same file see its staged data only after
+ * it has been destaged.
+ *
+ *     filesystem_t *stage = filesystem_stage_create(filesystem_fat_create(), NULL, 32 * 1024);
+ *     fs_mount("/sd", stage, blockdevice_sd_create(...));
+ *     fs_stage_start_destager();
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "filesystem/filesystem.h"
+
+#if !defined(PICO_VFS_STAGE_CHUNK_SIZE)
+#define PICO_VFS_STAGE_CHUNK_SIZE    4096
+#endif
+#if !defined(PICO_VFS_STAGE_AGE_US)
+#define PICO_VFS_STAGE_AGE_US        100000
+#endif
+
+/*! \brief Create staging file system object
+ * \ingroup filesystem_stage
+ *
+ * The staging file system is mounted with the block device of the backing file system. The
+ * backing file system is not released by filesystem_stage_free().
+ *
+ * \param backing File system that receives the staged data.
+ * \param buffer Staging area, for example in PSRAM, or NULL to allocate it from the heap.
+ * \param size Size of the staging area in bytes, at least PICO_VFS_STAGE_CHUNK_SIZE.
+ * \return File system object. Returns NULL in case of failure.
+ * \retval NULL failed to create file system object.
+ */
+filesystem_t *filesystem_stage_create(filesystem_t *backing, void *buffer, size_t size);
+
+/*! \brief Release staging file system object
+ * \ingroup filesystem_stage
+ *
+ * \param fs staging file system object
+ */
+void filesystem_stage_free(filesystem_t *fs);
+
+/*! \brief Start the background destager
+ * \ingroup filesystem_stage
+ *
+ * One destager serves every staging file system. Under FreeRTOS it is a task with priority
+ * PICO_VFS_STAGE_TASK_PRIORITY. On bare metal it is a job of the shared loop on core1, next to
+ * the gc and the aio worker, see filesystem_core1. It cannot run while the I/O service of
+ * fs_io_service_start_core1() owns core1. When core1 programs the on-board flash, core0 must
+ * allow the flash lockout with multicore_lockout_victim_init().
+ *
+ * \retval 0 on success
+ * \retval -1 on failure, with errno set to EBUSY if the destager is already running, or if the
+ *            I/O service owns core1
+ */
+int fs_stage_start_destager(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+/** \defgroup filesystem_timeseries filesystem_timeseries
+ *  \ingroup filesystem
+ *  \brief Indexed binary time-series files
+ *
+ * Samples of a fixed number of `float` values with a 64-bit timestamp are stored in a file made
+ * of blocks of `PICO_VFS_TIMESERIES_BLOCK_SIZE` bytes. Each chunk block holds the samples with
+ * the timestamps and the values delta encoded as variable-length integers. After every group of
+ * chunks that one block of index entries can describe, an index block of (first timestamp,
+ * offset) entries is appended. A range query searches the index blocks and reads only the chunks
+ * that overlap the range.
+ *
+ * Samples are buffered in RAM until their chunk is full or fs_timeseries_sync() is called.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#if !defined(PICO_VFS_TIMESERIES_BLOCK_SIZE)
+#define PICO_VFS_TIMESERIES_BLOCK_SIZE  512
+#endif
+
+#if !defined(PICO_VFS_TIMESERIES_MAX_VALUES)
+#define PICO_VFS_TIMESERIES_MAX_VALUES  16
+#endif
+
+/*! \brief Time-series file object
+ * \ingroup filesystem_timeseries
+ */
+typedef struct fs_timeseries fs_timeseries_t;
+
+/*! \brief Range query state
+ * \ingroup filesystem_timeseries
+ *
+ * Set up by fs_timeseries_query(). The members are private.
+ */
+typedef struct {
+    fs_timeseries_t *ts;
+    uint64_t from;
+    uint64_t to;
+    uint32_t chunk;      // Chunk being read
+    uint16_t sample;     // Samples of the chunk already read
+    uint16_t offset;     // Offset of the next sample in the chunk
+    uint64_t timestamp;  // Previous sample, the base of the deltas
+    uint32_t values[PICO_VFS_TIMESERIES_MAX_VALUES];
+} fs_timeseries_iter_t;
+
+/*! \brief Open a time-series file
+ * \ingroup filesystem_timeseries
+ *
+ * Creates the file if it does not exist. Samples are appended after the existing ones.
+ *
+ * \param path Path of the file.
+ * \param value_count Number of values per sample, from 1 to `PICO_VFS_TIMESERIES_MAX_VALUES`.
+ *                    0 to take the number from an existing file.
+ * \return Time-series object. Returnes NULL in case of failure, with errno set.
+ * \retval NULL Failed to open the file.
+ */
+fs_timeseries_t *fs_timeseries_open(const char *path, unsigned value_count);
+
+/*! \brief Append a sample
+ * \ingroup filesystem_timeseries
+ *
+ * \param ts Time-series object.
+ * \param timestamp Timestamp of the sample, not less than that of the previous sample.
+ * \param values `fs_timeseries_value_count()` values.
+ * \retval 0 Append succeeded.
+ * \retval -1 Append failed. Error codes are indicated by errno. `EINVAL` if the timestamp goes
+ *            backwards.
+ */
+int fs_timeseries_append(fs_timeseries_t *ts, uint64_t timestamp, const float *values);
+
+/*! \brief Write out the buffered samples
+ * \ingroup filesystem_timeseries
+ *
+ * \param ts Time-series object.
+ * \retval 0 Sync succeeded.
+ * \retval -1 Sync failed. Error codes are indicated by errno.
+ */
+int fs_timeseries_sync(fs_timeseries_t *ts);
+
+/*! \brief Close a time-series file
+ * \ingroup filesystem_timeseries
+ *
+ * Writes out the buffered samples and releases the object.
+ *
+ * \param ts Time-series object.
+ * \retval 0 Close succeeded.
+ * \retval -1 Close failed. Error codes are indicated by errno. The object is released anyway.
+ */
+int fs_timeseries_close(fs_timeseries_t *ts);
+
+/*! \brief Number of values per sample
+ * \ingroup filesystem_timeseries
+ *
+ * \param ts Time-series object.
+ * \return Number of values.
+ */
+unsigned fs_timeseries_value_count(fs_timeseries_t *ts);
+
+/*! \brief Start a range query
+ * \ingroup filesystem_timeseries
+ *
+ * Positions `iter` at the chunk that holds the first sample at or after `from`. Samples
+ * appended while the query runs are returned if they are in the range.
+ *
+ * \param ts Time-series object.
+ * \param iter Query state.
+ * \param from Smallest timestamp returned.
+ * \param to Largest timestamp returned.
+ * \retval 0 Query started.
+ * \retval -1 Failed to read the index. Error codes are indicated by errno.
+ */
+int fs_timeseries_query(fs_timeseries_t *ts, fs_timeseries_iter_t *iter, uint64_t from, uint64_t to);
+
+/*! \brief Read the next sample of a range query
+ * \ingroup filesystem_timeseries
+ *
+ * \param iter Query state.
+ * \param timestamp Receives the timestamp of the sample.
+ * \param values Receives `fs_timeseries_value_count()` values.
+ * \retval 1 A sample was read.
+ * \retval 0 No more samples in the range.
+ * \retval -1 Read failed. Error codes are indicated by errno. `EIO` if a block is corrupted.
+ */
+int fs_timeseries_next(fs_timeseries_iter_t *iter, uint64_t *timestamp, float *values);
+
+#ifdef __cplusplus
+}
+#endif
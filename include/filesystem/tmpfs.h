@@ -0,0 +1,54 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+/** \defgroup filesystem_tmpfs filesystem_tmpfs
+ *  \ingroup filesystem
+ *  \brief In-memory file system
+ *
+ * Files are lists of heap chunks and directories are hash tables of their entries, so there
+ * is no block device and no on-media metadata. Mount it without a block device:
+ *
+ *     fs_mount("/tmp", filesystem_tmpfs_create(64 * 1024), NULL);
+ *
+ * Mounted at `/tmp`, it backs tmpfile() and mkstemp(). A file removed while it is open stays
+ * readable and writable through the open descriptors, and its memory is released by the last
+ * close.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "filesystem/filesystem.h"
+
+#if !defined(PICO_VFS_TMPFS_CHUNK_SIZE)
+/*! \brief Size of the data chunks of a file in bytes
+ * \ingroup filesystem_tmpfs
+ */
+#define PICO_VFS_TMPFS_CHUNK_SIZE  512
+#endif
+
+/*! \brief Create tmpfs file system object
+ * \ingroup filesystem_tmpfs
+ * \param max_bytes Limit of the memory used by files, directories and their names in bytes.
+ *                  0 for no limit other than the heap.
+ * \return File system object. Returns NULL in case of failure.
+ * \retval NULL failed to create file system object.
+ */
+filesystem_t *filesystem_tmpfs_create(size_t max_bytes);
+
+/*! \brief Release tmpfs file system object
+ * \ingroup filesystem_tmpfs
+ *
+ * The content of the file system is released too.
+ *
+ * \param fs tmpfs file system object
+ */
+void filesystem_tmpfs_free(filesystem_t *fs);
+
+#ifdef __cplusplus
+}
+#endif
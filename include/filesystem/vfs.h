@@ -15,6 +15,29 @@ extern "C" {
 #include "blockdevice/blockdevice.h"
 
 
+#if !defined(O_RDBUF)
+/*! \brief open() flag to buffer reads in the VFS
+ * \ingroup filesystem
+ *
+ * Small reads are served from a per-descriptor buffer of one erase block of the device, at
+ * most `PICO_VFS_FILE_BUFFER_SIZE` bytes. Writes, seeks and positional I/O on the descriptor
+ * discard the buffer.
+ */
+#define O_RDBUF                      0x10000000
+#endif
+
+#if !defined(O_WRBUF)
+/*! \brief open() flag to combine small writes in the VFS
+ * \ingroup filesystem
+ *
+ * Writes smaller than the buffer are collected in a per-descriptor buffer of the same size as
+ * the `O_RDBUF` buffer and passed to the file system when it is full. The buffer is written out
+ * by fsync(), close(), seeks, reads and mmap() on the descriptor, stat() or a reading open() of
+ * the file, and by fs_flush_buffers().
+ */
+#define O_WRBUF                      0x20000000
+#endif
+
 #if !defined(PICO_FS_DEFAULT_SIZE)
 #define PICO_FS_DEFAULT_SIZE         (1408 * 1024)   // Can share storage with MicroPython for RP2
 #endif
@@ -36,7 +59,7 @@ bool fs_init(void);
  * Block devices can be formatted and made available as a file system.
  *
  * \param fs File system object. Format the block device according to the specified file system.
- * \param device Block device used in the file system.
+ * \param device Block device used in the file system. NULL for an in-memory file system.
  * \retval 0 Format succeeded.
  * \retval -1 Format failed. Error codes are indicated by errno.
  */
@@ -50,6 +73,7 @@ int fs_format(filesystem_t *fs, blockdevice_t *device);
  * \param path Directory path of the mount point. Specify a string beginning with a slash.
  * \param fs File system object.
  * \param device Block device used in the file system. Block devices must be formatted with a file system.
+ *               NULL for an in-memory file system such as tmpfs.
  * \retval 0 Mount succeeded.
  * \retval -1 Mount failed. Error codes are indicated by errno.
  */
@@ -88,6 +112,192 @@ int fs_reformat(const char *path);
  */
 int fs_info(const char *path, filesystem_t **fs, blockdevice_t **device);
 
+/*! \brief Copy data between two open files
+ * \ingroup filesystem
+ *
+ * Copies up to `len` bytes from the current position of `fd_in` to the current position of
+ * `fd_out` and advances both. The data is moved through a buffer owned by the library in
+ * chunks that are a multiple of the optimal I/O size of both devices. When both files are on
+ * the same file system, the file system may copy directly; FAT preallocates an empty
+ * destination contiguously and transfers whole sectors.
+ *
+ * \param fd_in File descriptor to read from.
+ * \param fd_out File descriptor to write to. Must differ from `fd_in`.
+ * \param len Maximum number of bytes to copy.
+ * \return Number of bytes copied. 0 at the end of the input file.
+ * \retval -1 Copy failed. Error codes are indicated by errno.
+ */
+ssize_t fs_copy_file_range(int fd_in, int fd_out, size_t len);
+
+/*! \brief Flush all open files of every mounted file system
+ * \ingroup filesystem
+ *
+ * The open files of each file system are committed as one group, followed by a single sync
+ * of its block device.
+ *
+ * \retval 0 All file systems were flushed.
+ * \retval -1 A flush failed. Error codes are indicated by errno.
+ */
+int fs_sync_all(void);
+
+/*! \brief Flush all open files of the file system containing a file
+ * \ingroup filesystem
+ *
+ * Like fs_sync_all(), limited to the file system that `fildes` belongs to.
+ *
+ * \param fildes Open file descriptor on the file system.
+ * \retval 0 The file system was flushed.
+ * \retval -1 The flush failed. Error codes are indicated by errno.
+ */
+int syncfs(int fildes);
+
+/*! \brief Allocate storage for a range of an open file
+ * \ingroup filesystem
+ *
+ * Allocates the storage for `len` bytes at `offset` ahead of the writes, and extends the file
+ * if the range ends beyond its end. FAT allocates an empty file as one contiguous area with
+ * `f_expand()`. The extended part of a FAT file holds undefined data instead of zeros.
+ *
+ * \param fildes File descriptor opened for writing.
+ * \param offset Start of the range.
+ * \param len Length of the range in bytes.
+ * \retval 0 Allocation succeeded.
+ * \retval EOPNOTSUPP The file system does not support preallocation.
+ * \retval >0 Other error number. errno is not set.
+ */
+int posix_fallocate(int fildes, off_t offset, off_t len);
+
+/*! \brief Write out aged write buffers
+ * \ingroup filesystem
+ *
+ * Passes the data of `O_WRBUF` descriptors that has been buffered for at least `age_us`
+ * microseconds to the file system. fs_gc_idle_poll() does this with
+ * `PICO_VFS_WRITE_BUFFER_AGE_US`, so the background maintenance task acts as the flush timer.
+ *
+ * \param age_us Minimum age in microseconds of the buffers to write out, 0 for all.
+ * \retval 0 The buffers were written out.
+ * \retval -1 A write failed. Error codes are indicated by errno. The data stays in the buffer,
+ *            and the next write(), fsync() or close() of the descriptor reports the error too.
+ */
+int fs_flush_buffers(uint32_t age_us);
+
+/*! \brief Run file system maintenance
+ * \ingroup filesystem
+ *
+ * Performs deferred work of the file system mounted at the specified path, such as metadata
+ * compaction and erasing free blocks ahead of use, so that it does not occur inline in later
+ * write or close calls. File systems without maintenance work return immediately.
+ *
+ * \param path Directory path of the mount point.
+ * \param budget_us Approximate time limit in microseconds. A single block erase is not interrupted.
+ * \retval 0 No maintenance work remains.
+ * \retval 1 The budget was exhausted before all work was done.
+ * \retval -1 Maintenance failed. Error codes are indicated by errno.
+ */
+int fs_gc(const char *path, uint32_t budget_us);
+
+/*! \brief Run file system maintenance if the file systems are idle
+ * \ingroup filesystem
+ *
+ * Calls the maintenance of every mounted file system when no file system request has been
+ * made for `idle_us` microseconds. Returns immediately if another request is in progress.
+ * Intended to be called periodically from an idle loop or a background task. The maintenance
+ * holds the lock of each file system, not the VFS lock; a file system that is unmounted
+ * meanwhile is skipped, but it must not be freed while the call is in progress.
+ *
+ * \param idle_us Idle time in microseconds required before maintenance starts.
+ * \param budget_us Approximate time limit in microseconds for all file systems.
+ * \retval true Maintenance work remains.
+ * \retval false Nothing was done, or no work remains.
+ */
+bool fs_gc_idle_poll(uint32_t idle_us, uint32_t budget_us);
+
+/*! \brief Register idle work
+ * \ingroup filesystem
+ *
+ * Adds a function that fs_gc_idle_poll() calls after the file system maintenance, once the
+ * file systems are idle. The function is called without the VFS lock held, so it can make file
+ * system calls. Libraries with background work, such as the key-value store and the log files,
+ * register themselves when they are first used. Registering a function again has no effect.
+ *
+ * \param fn Function to call.
+ * \retval 0 The function is registered.
+ * \retval -1 Registration failed. errno is `ENOSPC` if `PICO_VFS_MAX_IDLE_HANDLERS` (default 4)
+ *            functions are already registered.
+ */
+int fs_gc_register_idle(void (*fn)(void));
+
+/*! \brief Start background file system maintenance
+ * \ingroup filesystem
+ *
+ * Starts a task that periodically calls fs_gc_idle_poll(). With FreeRTOS, the task is created
+ * with the lowest priority; otherwise it is a job of the shared loop on core1, see
+ * filesystem_core1. Provided by the `filesystem_gc` library.
+ *
+ * \param idle_us Idle time in microseconds required before maintenance starts.
+ * \param budget_us Approximate time limit in microseconds of each maintenance step.
+ * \retval 0 Background maintenance started.
+ * \retval -1 Start failed. Error codes are indicated by errno. `EBUSY` if it already runs, or
+ *            if the I/O service owns core1.
+ */
+int fs_gc_start_background(uint32_t idle_us, uint32_t budget_us);
+
+/*! \brief Run all file system operations on core1
+ * \ingroup filesystem
+ *
+ * Launches an I/O service on core1 and routes every operation of the mounted file systems, and
+ * of those mounted later, to it. Each core submits requests through its own ring without
+ * taking a lock and waits for the result, so the file systems and their block devices are only
+ * accessed from core1. The calling core still takes the VFS lock, which protects the descriptor
+ * and mount tables. A file system is attached while it is mounted, up to
+ * `PICO_VFS_IO_SERVICE_MAX_FILESYSTEMS` at a time. A file system on a loopback block device
+ * is not attached, as its image file is read through the VFS while the caller holds the VFS
+ * lock. Provided by the `filesystem_io_service` library. Not available with FreeRTOS. core1 runs nothing else, see filesystem_core1.
+ *
+ * \retval 0 The service started.
+ * \retval -1 Start failed. Error codes are indicated by errno. `EBUSY` if core1 already runs the
+ *            service, or the gc, aio or destager jobs. `ENOSPC` if more file systems are
+ *            mounted than can be attached; those keep running on the calling core.
+ */
+int fs_io_service_start_core1(void);
+
+/*! \brief I/O class of the requests of a task
+ * \ingroup filesystem
+ */
+typedef enum {
+    FS_IO_CLASS_REALTIME,  /*!< Served before any other pending request */
+    FS_IO_CLASS_NORMAL,    /*!< Default class */
+    FS_IO_CLASS_BULK,      /*!< Served when nothing else is pending */
+} fs_io_class_t;
+
+/*! \brief Run the operations of each file system on its own FreeRTOS task
+ * \ingroup filesystem
+ *
+ * Creates an I/O task for every mounted file system, and for those mounted later, and routes
+ * their operations to it. Requests wait in one queue per I/O class and the calling task blocks
+ * on a task notification until its request is done. While requests are pending, the I/O task
+ * inherits the highest priority of the waiting tasks, read again before and after each request. Provided by the `filesystem_io_service`
+ * library. Only available with FreeRTOS.
+ *
+ * \param priority Priority of the I/O tasks when no request is pending.
+ * \retval 0 The service started.
+ * \retval -1 Start failed. Error codes are indicated by errno. `ENOSPC` if more file systems are
+ *            mounted than can be attached, `ENOMEM` if an I/O task could not be created; those
+ *            file systems keep running on the calling task.
+ */
+int fs_io_service_start_freertos(uint32_t priority);
+
+/*! \brief Set the I/O class of the calling task
+ * \ingroup filesystem
+ *
+ * The class is kept in a thread local storage pointer of the task, see
+ * `PICO_VFS_IO_SERVICE_CLASS_TLS_INDEX`. Copies requested by a bulk task are split into
+ * chunks, so that other requests are served in between.
+ *
+ * \param io_class I/O class of the following requests of the calling task.
+ */
+void fs_io_service_set_class(fs_io_class_t io_class);
+
 /*! \brief File system error message
  * \ingroup filesystem
  *
@@ -0,0 +1,124 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+/** \defgroup filesystem_zfile filesystem_zfile
+ *  \ingroup filesystem
+ *  \brief Streaming compressed files
+ *
+ * A compressed file is written as a stream and read back as the original bytes. The data is
+ * split into frames of `PICO_VFS_ZFILE_FRAME_SIZE` uncompressed bytes, each compressed on its
+ * own with the LZ4 block format, so a reader decompresses only the frame that holds the
+ * position it seeks to. A frame that does not get smaller is stored as is.
+ *
+ * fs_zfile_close() appends an index of the frames to the file. A file without the index, for
+ * example after a power failure, is read by walking the frame headers, and a frame torn by the
+ * power failure is dropped. Appending to an existing file continues after its last complete
+ * frame.
+ *
+ * The compressed file is an ordinary file, so it works on any mounted file system.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#if !defined(PICO_VFS_ZFILE_FRAME_SIZE)
+#define PICO_VFS_ZFILE_FRAME_SIZE  4096
+#endif
+
+/*! \brief Compressed file object
+ * \ingroup filesystem_zfile
+ */
+typedef struct fs_zfile fs_zfile_t;
+
+/*! \brief Open a compressed file
+ * \ingroup filesystem_zfile
+ *
+ * A compressed file is opened either for reading or for appending. With `O_WRONLY`, the data
+ * is appended after the existing frames; `O_CREAT`, `O_EXCL` and `O_TRUNC` have their usual
+ * meaning.
+ *
+ * \param path Path of the file.
+ * \param flags `O_RDONLY`, or `O_WRONLY` with optional `O_CREAT`, `O_EXCL` and `O_TRUNC`.
+ * \return Compressed file object. Returns NULL in case of failure, with errno set. `EINVAL` for
+ *         `O_RDWR`, `EILSEQ` if the file is not a compressed file.
+ * \retval NULL Failed to open the file.
+ */
+fs_zfile_t *fs_zfile_open(const char *path, int flags);
+
+/*! \brief Append data
+ * \ingroup filesystem_zfile
+ *
+ * The data is buffered until its frame is full.
+ *
+ * \param zf Compressed file object opened with `O_WRONLY`.
+ * \param buffer Data to append.
+ * \param size Size of the data in bytes.
+ * \return Number of bytes appended.
+ * \retval -1 Write failed. Error codes are indicated by errno. The frames written before stay
+ *            in the file.
+ */
+ssize_t fs_zfile_write(fs_zfile_t *zf, const void *buffer, size_t size);
+
+/*! \brief Read data
+ * \ingroup filesystem_zfile
+ *
+ * \param zf Compressed file object opened with `O_RDONLY`.
+ * \param buffer Buffer that receives the data.
+ * \param size Size of the buffer in bytes.
+ * \return Number of bytes read, 0 at the end of the file.
+ * \retval -1 Read failed. Error codes are indicated by errno. `EIO` if a frame is corrupted.
+ */
+ssize_t fs_zfile_read(fs_zfile_t *zf, void *buffer, size_t size);
+
+/*! \brief Move the read position
+ * \ingroup filesystem_zfile
+ *
+ * \param zf Compressed file object opened with `O_RDONLY`.
+ * \param offset Position in the uncompressed data, relative to `whence`.
+ * \param whence `SEEK_SET`, `SEEK_CUR` or `SEEK_END`.
+ * \return New position in the uncompressed data.
+ * \retval -1 Seek failed. Error codes are indicated by errno.
+ */
+off_t fs_zfile_seek(fs_zfile_t *zf, off_t offset, int whence);
+
+/*! \brief Uncompressed size
+ * \ingroup filesystem_zfile
+ *
+ * \param zf Compressed file object.
+ * \return Size of the uncompressed data, including the data buffered by a writer.
+ */
+off_t fs_zfile_size(fs_zfile_t *zf);
+
+/*! \brief Write out the buffered data
+ * \ingroup filesystem_zfile
+ *
+ * Ends the current frame early and calls fsync(). Frequent syncs make the frames smaller and
+ * the compression worse.
+ *
+ * \param zf Compressed file object.
+ * \retval 0 Sync succeeded.
+ * \retval -1 Sync failed. Error codes are indicated by errno.
+ */
+int fs_zfile_sync(fs_zfile_t *zf);
+
+/*! \brief Close a compressed file
+ * \ingroup filesystem_zfile
+ *
+ * A writer writes out the buffered data and the frame index. The object is released.
+ *
+ * \param zf Compressed file object.
+ * \retval 0 Close succeeded.
+ * \retval -1 Close failed. Error codes are indicated by errno. The object is released anyway.
+ */
+int fs_zfile_close(fs_zfile_t *zf);
+
+#ifdef __cplusplus
+}
+#endif
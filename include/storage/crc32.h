@@ -0,0 +1,34 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+/** \defgroup storage storage
+ *  \brief Storage engines that work directly on block devices
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*! \brief Update a CRC-32 checksum
+ * \ingroup storage
+ *
+ * Computes the IEEE 802.3 CRC-32 with a 16-entry table, so that it does not occupy a large
+ * table in RAM or flash. Pass 0 as `crc` for the first block and the previous result for the
+ * following blocks.
+ *
+ * \param crc Checksum of the preceding data, 0 at the start.
+ * \param data Data to add to the checksum.
+ * \param size Size of the data in bytes.
+ * \return Updated checksum.
+ */
+uint32_t storage_crc32(uint32_t crc, const void *data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
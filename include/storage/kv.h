@@ -0,0 +1,191 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+/** \defgroup storage_kv storage_kv
+ *  \ingroup storage
+ *  \brief Key-value store on a block device
+ *
+ * Small values are stored under string keys without a file system, for example on a
+ * `blockdevice_flash` partition or, through `blockdevice_loopback`, in a file. Every update
+ * appends an entry with a CRC to a log of sectors of at least `PICO_VFS_KV_SECTOR_SIZE` bytes.
+ * Entries are packed into a RAM buffer of one program unit, so an update only copies the entry
+ * unless a page or sector boundary is crossed. kv_open() scans the log once and builds a hash
+ * index in RAM that maps each key to its newest entry.
+ *
+ * One sector is always kept free. When the log reaches it, the live entries of the oldest
+ * sector are copied to the new sector and the oldest sector is erased. kv_gc() does this ahead
+ * of time from an idle loop or a low-priority task, and kv_gc_all() for every open store, which
+ * kv_open() registers with fs_gc_register_idle() when the VFS is linked. Updates that have not been written out by
+ * kv_sync() may be lost on power failure; an interrupted compaction is completed or undone by
+ * the next kv_open().
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "blockdevice/blockdevice.h"
+
+#if !defined(PICO_VFS_KV_SECTOR_SIZE)
+/*! \brief Minimum sector size of a key-value store in bytes
+ * \ingroup storage_kv
+ *
+ * A sector is the unit that is compacted and erased. It is rounded up to a multiple of the
+ * erase size of the device, and limits the size of an entry.
+ */
+#define PICO_VFS_KV_SECTOR_SIZE   4096
+#endif
+
+/*! \brief Key-value store object
+ * \ingroup storage_kv
+ */
+typedef struct kv kv_t;
+
+/*! \brief Key iterator
+ * \ingroup storage_kv
+ *
+ * Initialized by kv_iter_init(). Keys that are set or deleted during the iteration may be
+ * skipped or returned twice.
+ */
+typedef struct {
+    kv_t *kv;     /*!< Store that is iterated */
+    size_t slot;  /*!< Next index slot */
+} kv_iter_t;
+
+/*! \brief Format a block device as an empty key-value store
+ * \ingroup storage_kv
+ *
+ * \param device Block device. At least three sectors are required.
+ * \retval 0 Format succeeded.
+ * \retval <0 Negative error code.
+ */
+int kv_format(blockdevice_t *device);
+
+/*! \brief Open a key-value store
+ * \ingroup storage_kv
+ *
+ * Scans the store formatted by kv_format() and builds the index. Entries that were not
+ * completely written before a power failure are discarded.
+ *
+ * \param device Block device holding the store.
+ * \return Key-value store object. Returnes NULL in case of failure, with errno set.
+ * \retval NULL Failed to open the store.
+ */
+kv_t *kv_open(blockdevice_t *device);
+
+/*! \brief Close a key-value store
+ * \ingroup storage_kv
+ *
+ * Writes out the buffered entries and releases the object.
+ *
+ * \param kv Key-value store object.
+ * \retval 0 Close succeeded.
+ * \retval <0 Negative error code. The object is released anyway.
+ */
+int kv_close(kv_t *kv);
+
+/*! \brief Get the value of a key
+ * \ingroup storage_kv
+ *
+ * \param kv Key-value store object.
+ * \param key NUL-terminated key of 1 to 255 bytes.
+ * \param value Buffer for the value. NULL to query the size only.
+ * \param size Size of the buffer in bytes.
+ * \return Size of the value in bytes.
+ * \retval -ENOENT The key does not exist.
+ * \retval -EMSGSIZE The buffer is too small.
+ * \retval <0 Other negative error code.
+ */
+ssize_t kv_get(kv_t *kv, const char *key, void *value, size_t size);
+
+/*! \brief Set the value of a key
+ * \ingroup storage_kv
+ *
+ * \param kv Key-value store object.
+ * \param key NUL-terminated key of 1 to 255 bytes.
+ * \param value Value data.
+ * \param size Size of the value in bytes. An entry must fit in a sector together with the
+ *             sector and compaction headers.
+ * \retval 0 Set succeeded.
+ * \retval -EMSGSIZE The value is too large.
+ * \retval -ENOSPC The live entries fill the store.
+ * \retval <0 Other negative error code.
+ */
+int kv_set(kv_t *kv, const char *key, const void *value, size_t size);
+
+/*! \brief Delete a key
+ * \ingroup storage_kv
+ *
+ * \param kv Key-value store object.
+ * \param key NUL-terminated key of 1 to 255 bytes.
+ * \retval 0 Delete succeeded.
+ * \retval -ENOENT The key does not exist.
+ * \retval <0 Other negative error code.
+ */
+int kv_delete(kv_t *kv, const char *key);
+
+/*! \brief Write out buffered entries
+ * \ingroup storage_kv
+ *
+ * Programs the partially filled page, padded to the program size, and syncs the device.
+ *
+ * \param kv Key-value store object.
+ * \retval 0 Sync succeeded.
+ * \retval <0 Negative error code.
+ */
+int kv_sync(kv_t *kv);
+
+/*! \brief Compact the oldest sector ahead of time
+ * \ingroup storage_kv
+ *
+ * Does the compaction that the next sector switch would otherwise do inline, if the free
+ * sector is the only one left, the sector being written is at least half full and the oldest
+ * sector is at most half live.
+ *
+ * \param kv Key-value store object.
+ * \retval 1 A sector was compacted.
+ * \retval 0 Nothing to do.
+ * \retval <0 Negative error code.
+ */
+int kv_gc(kv_t *kv);
+
+/*! \brief Compact every open store ahead of time
+ * \ingroup storage_kv
+ *
+ * Runs kv_gc() on each store opened with kv_open() and not yet closed. Stores that are being
+ * written are skipped. kv_open() registers it with fs_gc_register_idle() when the VFS is linked,
+ * so fs_gc_idle_poll() calls it; can also be called from an idle loop or a low-priority task.
+ */
+void kv_gc_all(void);
+
+/*! \brief Start iterating over the keys
+ * \ingroup storage_kv
+ *
+ * \param kv Key-value store object.
+ * \param iter Iterator to initialize.
+ */
+void kv_iter_init(kv_t *kv, kv_iter_t *iter);
+
+/*! \brief Get the next key
+ * \ingroup storage_kv
+ *
+ * Keys are returned in no particular order.
+ *
+ * \param iter Iterator.
+ * \param key Buffer for the NUL-terminated key.
+ * \param size Size of the buffer in bytes.
+ * \return Length of the key.
+ * \retval 0 No more keys.
+ * \retval -EMSGSIZE The buffer is too small. The iterator does not advance.
+ * \retval <0 Other negative error code.
+ */
+ssize_t kv_iter_next(kv_iter_t *iter, char *key, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,157 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+/** \defgroup storage_pqueue storage_pqueue
+ *  \ingroup storage
+ *  \brief Persistent FIFO queue on a block device
+ *
+ * Messages are kept for store-and-forward on a block device, for example a `blockdevice_flash`
+ * partition or, through `blockdevice_loopback`, a file. The queue is a ring log
+ * (storage_ringlog) of message records. Removing messages appends a small commit record that
+ * holds the position of the oldest remaining message, and syncs the log, so a push and a pop
+ * each cost one record append regardless of the number of queued messages. pq_open() reads
+ * the log once to find the newest commit.
+ *
+ * The log never drops messages that were not removed: when it is full, pq_push() fails with
+ * -ENOSPC until enough messages are removed to free its oldest sector.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "blockdevice/blockdevice.h"
+
+/*! \brief Persistent queue object
+ * \ingroup storage_pqueue
+ */
+typedef struct pq pq_t;
+
+/*! \brief Message returned by pq_peek_batch()
+ * \ingroup storage_pqueue
+ */
+typedef struct {
+    void *data;   /*!< Message data in the buffer passed to pq_peek_batch() */
+    size_t size;  /*!< Size of the message in bytes */
+} pq_message_t;
+
+/*! \brief Format a block device as an empty queue
+ * \ingroup storage_pqueue
+ *
+ * \param device Block device. See ringlog_format() for the requirements.
+ * \retval 0 Format succeeded.
+ * \retval <0 Negative error code.
+ */
+int pq_format(blockdevice_t *device);
+
+/*! \brief Open a persistent queue
+ * \ingroup storage_pqueue
+ *
+ * \param device Block device formatted by pq_format().
+ * \return Queue object. Returnes NULL in case of failure, with errno set.
+ * \retval NULL Failed to open the queue.
+ */
+pq_t *pq_open(blockdevice_t *device);
+
+/*! \brief Close a persistent queue
+ * \ingroup storage_pqueue
+ *
+ * Writes out the pushed messages and releases the object.
+ *
+ * \param pq Queue object.
+ * \retval 0 Close succeeded.
+ * \retval <0 Negative error code. The object is released anyway.
+ */
+int pq_close(pq_t *pq);
+
+/*! \brief Append a message to the queue
+ * \ingroup storage_pqueue
+ *
+ * The message is buffered until pq_sync() or pq_pop_commit().
+ *
+ * \param pq Queue object.
+ * \param message Message data.
+ * \param size Size of the message in bytes, from 1 to pq_max_message_size().
+ * \retval 0 Push succeeded.
+ * \retval -EMSGSIZE The message is too large.
+ * \retval -ENOSPC The queue is full.
+ * \retval <0 Other negative error code.
+ */
+int pq_push(pq_t *pq, const void *message, size_t size);
+
+/*! \brief Write out pushed messages
+ * \ingroup storage_pqueue
+ *
+ * \param pq Queue object.
+ * \retval 0 Sync succeeded.
+ * \retval <0 Negative error code.
+ */
+int pq_sync(pq_t *pq);
+
+/*! \brief Read the oldest message without removing it
+ * \ingroup storage_pqueue
+ *
+ * \param pq Queue object.
+ * \param buffer Buffer for the message data.
+ * \param size Size of the buffer in bytes.
+ * \return Size of the message in bytes.
+ * \retval 0 The queue is empty.
+ * \retval -EMSGSIZE The buffer is too small.
+ * \retval <0 Other negative error code.
+ */
+ssize_t pq_peek(pq_t *pq, void *buffer, size_t size);
+
+/*! \brief Read the oldest messages without removing them
+ * \ingroup storage_pqueue
+ *
+ * Messages are copied one after another into `buffer` until `count` messages are read, the
+ * next one does not fit, or the queue is exhausted.
+ *
+ * \param pq Queue object.
+ * \param messages Array that receives the position and size of each message.
+ * \param count Number of elements of `messages`.
+ * \param buffer Buffer for the message data.
+ * \param size Size of the buffer in bytes.
+ * \return Number of messages read.
+ * \retval 0 The queue is empty.
+ * \retval -EMSGSIZE The buffer is too small for the oldest message.
+ * \retval <0 Other negative error code.
+ */
+ssize_t pq_peek_batch(pq_t *pq, pq_message_t *messages, size_t count, void *buffer, size_t size);
+
+/*! \brief Remove the oldest messages
+ * \ingroup storage_pqueue
+ *
+ * Typically called with the number of messages returned by pq_peek_batch() once they have
+ * been delivered. The removal is committed to the device before the function returns.
+ *
+ * Every push leaves room for one commit record. Many removals in a row without a push can
+ * still fill the log, and a removal whose commit record would drop remaining messages fails
+ * with -ENOSPC; removing more messages at once frees the oldest sector.
+ *
+ * \param pq Queue object.
+ * \param count Number of messages to remove.
+ * \return Number of messages removed, less than `count` if the queue held fewer.
+ * \retval -ENOSPC The commit record does not fit. Nothing was removed.
+ * \retval <0 Other negative error code.
+ */
+ssize_t pq_pop_commit(pq_t *pq, size_t count);
+
+/*! \brief Maximum size of a message
+ * \ingroup storage_pqueue
+ *
+ * Smaller than ringlog_max_record_size() by the room that a push leaves for a commit record.
+ *
+ * \param pq Queue object.
+ * \return Size in bytes.
+ */
+size_t pq_max_message_size(pq_t *pq);
+
+#ifdef __cplusplus
+}
+#endif
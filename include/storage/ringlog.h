@@ -0,0 +1,195 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+/** \defgroup storage_ringlog storage_ringlog
+ *  \ingroup storage
+ *  \brief Circular log of records on a block device
+ *
+ * Records are appended to a block device without a file system. The device is divided into
+ * sectors of at least `PICO_VFS_RINGLOG_SECTOR_SIZE` bytes that are written in turn. Every
+ * sector starts with a header, and every record carries a sequence number and a CRC. Records
+ * are packed into a RAM buffer of one program unit, which is programmed when it is full, so an
+ * append only copies the record unless a page or sector boundary is crossed. The sector after
+ * the one being written is erased ahead of time. When the log is full, the oldest sector is
+ * dropped.
+ *
+ * Records that have not been written out by ringlog_sync() may be lost on power failure. At
+ * ringlog_open() the newest and oldest sectors are located by a binary search over the sector
+ * headers, and only the newest sector is scanned.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "blockdevice/blockdevice.h"
+
+#if !defined(PICO_VFS_RINGLOG_SECTOR_SIZE)
+/*! \brief Minimum sector size of a ring log in bytes
+ * \ingroup storage_ringlog
+ *
+ * A sector is the unit that is erased ahead and dropped when the log wraps around. It is
+ * rounded up to a multiple of the erase size of the device.
+ */
+#define PICO_VFS_RINGLOG_SECTOR_SIZE   4096
+#endif
+
+/*! \brief Bytes that a record takes in addition to its data
+ * \ingroup storage_ringlog
+ */
+#define RINGLOG_RECORD_OVERHEAD        16
+
+/*! \brief Ring log object
+ * \ingroup storage_ringlog
+ */
+typedef struct ringlog ringlog_t;
+
+/*! \brief Ring log reader
+ * \ingroup storage_ringlog
+ *
+ * Initialized by ringlog_iter_init(). Several readers can be used at the same time.
+ */
+typedef struct {
+    ringlog_t *log;     /*!< Log that is read */
+    size_t sector;      /*!< Sector of the next record */
+    size_t offset;      /*!< Offset of the next record in the sector */
+    uint64_t sequence;  /*!< Sequence number of the next record */
+} ringlog_iter_t;
+
+/*! \brief Format a block device as an empty ring log
+ * \ingroup storage_ringlog
+ *
+ * Every sector of the device is erased and its header is cleared.
+ *
+ * \param device Block device. At least four sectors are required.
+ * \retval 0 Format succeeded.
+ * \retval <0 Negative error code.
+ */
+int ringlog_format(blockdevice_t *device);
+
+/*! \brief Open a ring log
+ * \ingroup storage_ringlog
+ *
+ * Locates the newest and oldest records of a log formatted by ringlog_format(). Records that
+ * were not completely written before a power failure are discarded.
+ *
+ * \param device Block device holding the log.
+ * \return Ring log object. Returnes NULL in case of failure, with errno set.
+ * \retval NULL Failed to open the log.
+ */
+ringlog_t *ringlog_open(blockdevice_t *device);
+
+/*! \brief Close a ring log
+ * \ingroup storage_ringlog
+ *
+ * Writes out the buffered records and releases the object.
+ *
+ * \param log Ring log object.
+ * \retval 0 Close succeeded.
+ * \retval <0 Negative error code. The object is released anyway.
+ */
+int ringlog_close(ringlog_t *log);
+
+/*! \brief Append a record
+ * \ingroup storage_ringlog
+ *
+ * \param log Ring log object.
+ * \param record Record data.
+ * \param size Size of the record in bytes, from 1 to ringlog_max_record_size().
+ * \return Sequence number of the record.
+ * \retval -EMSGSIZE The record is too large.
+ * \retval <0 Other negative error code.
+ */
+int64_t ringlog_append(ringlog_t *log, const void *record, size_t size);
+
+/*! \brief Write out buffered records
+ * \ingroup storage_ringlog
+ *
+ * Programs the partially filled page, padded to the program size, and syncs the device. The
+ * next record starts at the following page.
+ *
+ * \param log Ring log object.
+ * \retval 0 Sync succeeded.
+ * \retval <0 Negative error code.
+ */
+int ringlog_sync(ringlog_t *log);
+
+/*! \brief Sequence number of the oldest record in the log
+ * \ingroup storage_ringlog
+ *
+ * \param log Ring log object.
+ * \return Sequence number. Equal to ringlog_next_sequence() if the log is empty.
+ */
+uint64_t ringlog_first_sequence(ringlog_t *log);
+
+/*! \brief Oldest record that would remain after an append
+ * \ingroup storage_ringlog
+ *
+ * Returns the value that ringlog_first_sequence() would have after appending a record of
+ * `size` bytes, without appending it. The value only changes when the append starts a new
+ * sector, which drops the oldest one. A writer can use it to stop before it overwrites records
+ * that have not been read.
+ *
+ * \param log Ring log object.
+ * \param size Size of the record in bytes, from 1 to ringlog_max_record_size().
+ * \return Sequence number.
+ * \retval -EINVAL The size is out of range.
+ * \retval <0 Other negative error code.
+ */
+int64_t ringlog_first_sequence_after(ringlog_t *log, size_t size);
+
+/*! \brief Sequence number of the next record to be appended
+ * \ingroup storage_ringlog
+ *
+ * \param log Ring log object.
+ * \return Sequence number.
+ */
+uint64_t ringlog_next_sequence(ringlog_t *log);
+
+/*! \brief Maximum size of a record
+ * \ingroup storage_ringlog
+ *
+ * \param log Ring log object.
+ * \return Size in bytes.
+ */
+size_t ringlog_max_record_size(ringlog_t *log);
+
+/*! \brief Start reading at a sequence number
+ * \ingroup storage_ringlog
+ *
+ * A sequence number older than the oldest record starts at the oldest record, one beyond the
+ * newest record starts at the end of the log.
+ *
+ * \param log Ring log object.
+ * \param iter Reader to initialize.
+ * \param sequence Sequence number of the first record to read.
+ * \retval 0 Reader initialized.
+ * \retval <0 Negative error code.
+ */
+int ringlog_iter_init(ringlog_t *log, ringlog_iter_t *iter, uint64_t sequence);
+
+/*! \brief Read the next record
+ * \ingroup storage_ringlog
+ *
+ * Records appended after the reader was initialized are returned as well.
+ *
+ * \param iter Reader.
+ * \param buffer Buffer for the record data.
+ * \param size Size of the buffer in bytes.
+ * \param sequence Sequence number of the record. May be NULL.
+ * \return Size of the record in bytes.
+ * \retval 0 No more records.
+ * \retval -EMSGSIZE The buffer is too small. The reader does not advance.
+ * \retval -EOVERFLOW The record was dropped because the log wrapped around.
+ * \retval <0 Other negative error code.
+ */
+ssize_t ringlog_iter_next(ringlog_iter_t *iter, void *buffer, size_t size, uint64_t *sequence);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,45 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+/*
+ * Memory mapping declarations for toolchains whose C library does not provide <sys/mman.h>,
+ * such as newlib for arm-none-eabi. pico-vfs supports read-only mappings of files.
+ */
+#if defined(__has_include_next) && __has_include_next(<sys/mman.h>)
+#include_next <sys/mman.h>
+#else
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+#define PROT_NONE        0x0
+#define PROT_READ        0x1
+#define PROT_WRITE       0x2
+#define PROT_EXEC        0x4
+
+#define MAP_SHARED       0x01
+#define MAP_PRIVATE      0x02
+#define MAP_FIXED        0x10
+
+#define MAP_FAILED       ((void *)-1)
+
+#define MS_ASYNC         0x1
+#define MS_INVALIDATE    0x2
+#define MS_SYNC          0x4
+
+void *mmap(void *addr, size_t len, int prot, int flags, int fildes, off_t off);
+int munmap(void *addr, size_t len);
+int msync(void *addr, size_t len, int flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,28 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+/*
+ * sendfile() declaration for toolchains whose C library does not provide <sys/sendfile.h>,
+ * such as newlib for arm-none-eabi.
+ */
+#if defined(__has_include_next) && __has_include_next(<sys/sendfile.h>)
+#include_next <sys/sendfile.h>
+#else
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
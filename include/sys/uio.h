@@ -0,0 +1,41 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+/*
+ * Vectored I/O declarations for toolchains whose C library does not provide <sys/uio.h>,
+ * such as newlib for arm-none-eabi.
+ */
+#if defined(__has_include_next) && __has_include_next(<sys/uio.h>)
+#include_next <sys/uio.h>
+#else
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#if !defined(IOV_MAX)
+#define IOV_MAX    64
+#endif
+
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+
+ssize_t readv(int fildes, const struct iovec *iov, int iovcnt);
+ssize_t writev(int fildes, const struct iovec *iov, int iovcnt);
+ssize_t preadv(int fildes, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t pwritev(int fildes, const struct iovec *iov, int iovcnt, off_t offset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
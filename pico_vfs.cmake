@@ -8,7 +8,7 @@ endif()
 
 function(pico_enable_filesystem TARGET)
   set(options "")
-  set(oneValueArgs SIZE AUTO_INIT MAX_FAT_VOLUME MAX_MOUNTPOINT)
+  set(oneValueArgs SIZE TMPFS_SIZE AUTO_INIT MAX_FAT_VOLUME MAX_MOUNTPOINT MAX_OPEN_FILES MAX_OPEN_DIRS DENTRY_CACHE_SIZE COPY_BUFFER_SIZE GROUP_COMMIT_WINDOW_US FILE_BUFFER_SIZE WRITE_BUFFER_AGE_US)
   set(multiValueArgs FS_INIT)
   cmake_parse_arguments(ARG "${options}" "${oneValueArgs}" "${multiValueArgs}" ${ARGN})
 
@@ -17,6 +17,12 @@ function(pico_enable_filesystem TARGET)
     target_compile_definitions(${TARGET} PRIVATE PICO_FS_DEFAULT_SIZE=${ARG_SIZE})
   endif()
 
+  # Size limit in bytes of the tmpfs the default fs_init() mounts at /tmp
+  if(ARG_TMPFS_SIZE)
+    target_compile_definitions(${TARGET} PRIVATE PICO_VFS_TMPFS_SIZE=${ARG_TMPFS_SIZE})
+    target_link_libraries(${TARGET} PRIVATE filesystem_tmpfs)
+  endif()
+
   # Add custom fs_init.c source files
   if(ARG_FS_INIT)
     target_sources(${TARGET} PRIVATE ${ARG_FS_INIT})
@@ -42,4 +48,69 @@ function(pico_enable_filesystem TARGET)
   else()
     target_compile_definitions(${TARGET} PRIVATE PICO_VFS_MAX_MOUNTPOINT=8)
   endif()
+
+  # Maximum number of simultaneously open files
+  if(ARG_MAX_OPEN_FILES)
+    target_compile_definitions(${TARGET} PRIVATE PICO_VFS_MAX_OPEN_FILES=${ARG_MAX_OPEN_FILES})
+  else()
+    target_compile_definitions(${TARGET} PRIVATE PICO_VFS_MAX_OPEN_FILES=16)
+  endif()
+
+  # Maximum number of simultaneously open directories
+  if(ARG_MAX_OPEN_DIRS)
+    target_compile_definitions(${TARGET} PRIVATE PICO_VFS_MAX_OPEN_DIRS=${ARG_MAX_OPEN_DIRS})
+  else()
+    target_compile_definitions(${TARGET} PRIVATE PICO_VFS_MAX_OPEN_DIRS=8)
+  endif()
+
+  # Number of cached path lookups, 0 disables the cache
+  if(DEFINED ARG_DENTRY_CACHE_SIZE)
+    target_compile_definitions(${TARGET} PRIVATE PICO_VFS_DENTRY_CACHE_SIZE=${ARG_DENTRY_CACHE_SIZE})
+  endif()
+
+  # Size of the buffer used by fs_copy_file_range and sendfile
+  if(ARG_COPY_BUFFER_SIZE)
+    target_compile_definitions(${TARGET} PRIVATE PICO_VFS_COPY_BUFFER_SIZE=${ARG_COPY_BUFFER_SIZE})
+  endif()
+
+  # Time in microseconds that fsync waits to commit concurrent fsync calls as one group
+  if(ARG_GROUP_COMMIT_WINDOW_US)
+    target_compile_definitions(${TARGET} PRIVATE PICO_VFS_GROUP_COMMIT_WINDOW_US=${ARG_GROUP_COMMIT_WINDOW_US})
+  endif()
+
+  # Maximum size of the per-descriptor buffer of O_RDBUF and O_WRBUF
+  if(ARG_FILE_BUFFER_SIZE)
+    target_compile_definitions(${TARGET} PRIVATE PICO_VFS_FILE_BUFFER_SIZE=${ARG_FILE_BUFFER_SIZE})
+  endif()
+
+  # Age in microseconds after which background maintenance writes out O_WRBUF buffers
+  if(ARG_WRITE_BUFFER_AGE_US)
+    target_compile_definitions(${TARGET} PRIVATE PICO_VFS_WRITE_BUFFER_AGE_US=${ARG_WRITE_BUFFER_AGE_US})
+  endif()
+endfunction()
+
+#
+# Build a romfs image from a directory and link it into the target as a C array
+#
+#   pico_add_romfs_image(TARGET SYMBOL SOURCE_DIR)
+#
+# The array `const uint8_t SYMBOL[]` and its size `const size_t SYMBOL_size` are aligned to
+# flash sectors, so the image can be mounted with blockdevice_flash_create() and
+# filesystem_romfs_create().
+#
+function(pico_add_romfs_image TARGET SYMBOL SOURCE_DIR)
+  find_package(Python3 REQUIRED COMPONENTS Interpreter)
+  get_filename_component(SOURCE_DIR "${SOURCE_DIR}" ABSOLUTE)
+  file(GLOB_RECURSE ROMFS_FILES CONFIGURE_DEPENDS "${SOURCE_DIR}/*")
+  set(OUTPUT "${CMAKE_CURRENT_BINARY_DIR}/${SYMBOL}.c")
+  add_custom_command(
+    OUTPUT "${OUTPUT}"
+    COMMAND ${Python3_EXECUTABLE} "${PICO_VFS_PATH}/tools/mkromfs.py"
+            --c-source "${OUTPUT}" --symbol ${SYMBOL} "${SOURCE_DIR}"
+    DEPENDS "${PICO_VFS_PATH}/tools/mkromfs.py" ${ROMFS_FILES}
+    COMMENT "Building romfs image ${SYMBOL} from ${SOURCE_DIR}"
+    VERBATIM
+  )
+  target_sources(${TARGET} PRIVATE "${OUTPUT}")
+  target_link_libraries(${TARGET} PRIVATE filesystem_romfs)
 endfunction()
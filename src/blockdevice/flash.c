@@ -122,6 +122,11 @@ static bd_size_t size(blockdevice_t *device) {
     return (bd_size_t)config->length;
 }
 
+static const void *map(blockdevice_t *device, bd_size_t addr, bd_size_t size) {
+    (void)size;
+    return (const void *)(XIP_BASE + flash_target_offset(device) + (size_t)addr);
+}
+
 blockdevice_t *blockdevice_flash_create(uint32_t start, size_t length) {
     assert(start % FLASH_SECTOR_SIZE == 0);
     assert(length % FLASH_SECTOR_SIZE == 0);
@@ -146,6 +151,7 @@ blockdevice_t *blockdevice_flash_create(uint32_t start, size_t length) {
     device->trim = trim;
     device->sync = sync;
     device->size = size;
+    device->map = map;
     device->read_size = 1;
     device->erase_size = FLASH_SECTOR_SIZE;  // 4096 byte
     device->program_size = FLASH_PAGE_SIZE;  // 256 byte
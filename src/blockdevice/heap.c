@@ -115,6 +115,14 @@ static bd_size_t size(blockdevice_t *device) {
     return (bd_size_t)config->size;
 }
 
+static const void *map(blockdevice_t *device, bd_size_t addr, bd_size_t length) {
+    (void)length;
+    blockdevice_heap_config_t *config = device->config;
+    if (config->heap == NULL)
+        return NULL;
+    return config->heap + (size_t)addr;
+}
+
 blockdevice_t *blockdevice_heap_create(size_t length) {
     blockdevice_t *device = calloc(1, sizeof(blockdevice_t));
     if (device == NULL) {
@@ -134,6 +142,7 @@ blockdevice_t *blockdevice_heap_create(size_t length) {
     device->trim = trim;
     device->sync = sync;
     device->size = size;
+    device->map = map;
     device->read_size = PICO_VFS_BLOCKDEVICE_HEAP_BLOCK_SIZE;
     device->erase_size = PICO_VFS_BLOCKDEVICE_HEAP_BLOCK_SIZE;
     device->program_size = PICO_VFS_BLOCKDEVICE_HEAP_BLOCK_SIZE;
@@ -65,8 +65,11 @@ static int deinit(blockdevice_t *device) {
 }
 
 static int __sync(blockdevice_t *device) {
-    (void)device;
-    return BD_ERROR_OK;
+    blockdevice_loopback_config_t *config = device->config;
+    mutex_enter_blocking(&config->_mutex);
+    int err = fsync(config->fildes);
+    mutex_exit(&config->_mutex);
+    return err == -1 ? -errno : BD_ERROR_OK;
 }
 
 static int __read(blockdevice_t *device, const void *buffer, bd_size_t addr, bd_size_t length) {
@@ -0,0 +1,314 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <aio.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pico/mutex.h>
+#include <pico/time.h>
+#include "filesystem/vfs.h"
+#if LIB_FREERTOS_KERNEL
+#include <FreeRTOS.h>
+#include <task.h>
+#elif PICO_ON_DEVICE
+#include <hardware/sync.h>
+#include "filesystem/core1.h"
+#else
+#include <pthread.h>
+#endif
+
+#if !defined(PICO_VFS_AIO_TASK_PRIORITY)
+#define PICO_VFS_AIO_TASK_PRIORITY    (tskIDLE_PRIORITY + 1)
+#endif
+
+#define AIO_OP_FSYNC                  (LIO_NOP + 1)
+#if !defined(O_DSYNC)
+#define O_DSYNC                       O_SYNC
+#endif
+
+static struct aiocb *queue[PICO_VFS_AIO_QUEUE_DEPTH];
+static size_t queue_head = 0;
+static size_t queue_count = 0;
+static struct aiocb *running = NULL;
+static bool worker_started = false;
+auto_init_mutex(_aio_mutex);
+
+static bool aio_run_one(void);
+#if !PICO_ON_DEVICE || LIB_FREERTOS_KERNEL
+static void aio_worker(void);
+#endif
+
+extern ssize_t vfs_aio_transfer(int fildes, void *buf, size_t nbyte, off_t offset, bool write);
+extern int vfs_aio_fsync(int fildes);
+
+/*
+ * Worker backends. worker_notify() and worker_wait() behave like a counting semaphore, so a
+ * request queued between the queue check and the wait is not lost. On bare metal the worker is
+ * a job of the shared loop on core1, which the notification wakes the same way.
+ */
+#if LIB_FREERTOS_KERNEL
+
+static TaskHandle_t worker_task = NULL;
+
+static void aio_task(void *params) {
+    (void)params;
+    aio_worker();
+}
+
+static bool worker_start(void) {
+    return xTaskCreate(aio_task, "fs_aio", configMINIMAL_STACK_SIZE * 4, NULL,
+                       PICO_VFS_AIO_TASK_PRIORITY, &worker_task) == pdPASS;
+}
+
+static void worker_notify(void) {
+    xTaskNotifyGive(worker_task);
+}
+
+static void worker_wait(void) {
+    ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+}
+
+static void completion_notify(void) {
+}
+
+static void completion_wait(absolute_time_t until) {
+    (void)until;
+    vTaskDelay(1);
+}
+
+#elif PICO_ON_DEVICE
+
+// A job of the shared loop on core1, together with the gc and the destager
+static bool worker_start(void) {
+    return fs_core1_add_job(aio_run_one, 0) == 0;
+}
+
+static void worker_notify(void) {
+    fs_core1_notify();
+}
+
+static void completion_notify(void) {
+    __sev();
+}
+
+static void completion_wait(absolute_time_t until) {
+    best_effort_wfe_or_timeout(until);
+}
+
+#else
+
+static pthread_mutex_t worker_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t completion_cond = PTHREAD_COND_INITIALIZER;
+static unsigned worker_pending = 0;
+
+static void *aio_thread(void *params) {
+    (void)params;
+    aio_worker();
+    return NULL;
+}
+
+static bool worker_start(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, aio_thread, NULL) != 0)
+        return false;
+    pthread_detach(thread);
+    return true;
+}
+
+static void worker_notify(void) {
+    pthread_mutex_lock(&worker_mutex);
+    worker_pending++;
+    pthread_cond_signal(&worker_cond);
+    pthread_mutex_unlock(&worker_mutex);
+}
+
+static void worker_wait(void) {
+    pthread_mutex_lock(&worker_mutex);
+    while (worker_pending == 0)
+        pthread_cond_wait(&worker_cond, &worker_mutex);
+    worker_pending--;
+    pthread_mutex_unlock(&worker_mutex);
+}
+
+static void completion_notify(void) {
+    pthread_mutex_lock(&worker_mutex);
+    pthread_cond_broadcast(&completion_cond);
+    pthread_mutex_unlock(&worker_mutex);
+}
+
+static void completion_wait(absolute_time_t until) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t wait_us = absolute_time_diff_us(get_absolute_time(), until);
+    if (wait_us > 1000 || wait_us < 0)
+        wait_us = 1000;  // Recheck periodically, a completion may precede the wait
+    ts.tv_nsec += wait_us * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec += 1;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&worker_mutex);
+    pthread_cond_timedwait(&completion_cond, &worker_mutex, &ts);
+    pthread_mutex_unlock(&worker_mutex);
+}
+#endif
+
+// errno is shared with the other core on bare metal, so the worker never reads it
+static void aio_execute(struct aiocb *aiocbp) {
+    ssize_t res;
+    switch (aiocbp->__opcode) {
+    case LIO_READ:
+        res = vfs_aio_transfer(aiocbp->aio_fildes, (void *)aiocbp->aio_buf, aiocbp->aio_nbytes, aiocbp->aio_offset, false);
+        break;
+    case LIO_WRITE:
+        res = vfs_aio_transfer(aiocbp->aio_fildes, (void *)aiocbp->aio_buf, aiocbp->aio_nbytes, aiocbp->aio_offset, true);
+        break;
+    default:
+        res = vfs_aio_fsync(aiocbp->aio_fildes);
+        break;
+    }
+
+    mutex_enter_blocking(&_aio_mutex);
+    aiocbp->__return_value = res < 0 ? -1 : res;
+    aiocbp->__error_code = res < 0 ? (int)-res : 0;
+    running = NULL;
+    mutex_exit(&_aio_mutex);
+}
+
+// Runs the oldest queued request, if any
+static bool aio_run_one(void) {
+    struct aiocb *aiocbp = NULL;
+    mutex_enter_blocking(&_aio_mutex);
+    if (queue_count > 0) {
+        aiocbp = queue[queue_head];
+        queue_head = (queue_head + 1) % PICO_VFS_AIO_QUEUE_DEPTH;
+        queue_count--;
+        running = aiocbp;
+    }
+    mutex_exit(&_aio_mutex);
+
+    if (aiocbp == NULL)
+        return false;
+    aio_execute(aiocbp);
+    completion_notify();
+    return true;
+}
+
+#if !PICO_ON_DEVICE || LIB_FREERTOS_KERNEL
+static void aio_worker(void) {
+    while (true) {
+        if (!aio_run_one())
+            worker_wait();
+    }
+}
+#endif
+
+static int aio_submit(struct aiocb *aiocbp, int opcode) {
+    if (aiocbp == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mutex_enter_blocking(&_aio_mutex);
+    if (!worker_started) {
+        if (!worker_start()) {
+            mutex_exit(&_aio_mutex);
+            errno = EAGAIN;
+            return -1;
+        }
+        worker_started = true;
+    }
+    if (queue_count == PICO_VFS_AIO_QUEUE_DEPTH) {
+        mutex_exit(&_aio_mutex);
+        errno = EAGAIN;
+        return -1;
+    }
+    aiocbp->__opcode = opcode;
+    aiocbp->__error_code = EINPROGRESS;
+    aiocbp->__return_value = 0;
+    queue[(queue_head + queue_count) % PICO_VFS_AIO_QUEUE_DEPTH] = aiocbp;
+    queue_count++;
+    mutex_exit(&_aio_mutex);
+
+    worker_notify();
+    return 0;
+}
+
+int aio_read(struct aiocb *aiocbp) {
+    return aio_submit(aiocbp, LIO_READ);
+}
+
+int aio_write(struct aiocb *aiocbp) {
+    return aio_submit(aiocbp, LIO_WRITE);
+}
+
+int aio_fsync(int op, struct aiocb *aiocbp) {
+    if (op != O_SYNC && op != O_DSYNC) {
+        errno = EINVAL;
+        return -1;
+    }
+    return aio_submit(aiocbp, AIO_OP_FSYNC);
+}
+
+int aio_error(const struct aiocb *aiocbp) {
+    return aiocbp->__error_code;
+}
+
+ssize_t aio_return(struct aiocb *aiocbp) {
+    return aiocbp->__return_value;
+}
+
+int aio_suspend(const struct aiocb *const list[], int nent, const struct timespec *timeout) {
+    absolute_time_t until = at_the_end_of_time;
+    if (timeout != NULL)
+        until = make_timeout_time_us((uint64_t)timeout->tv_sec * 1000000 + timeout->tv_nsec / 1000);
+
+    while (true) {
+        for (int i = 0; i < nent; i++) {
+            if (list[i] != NULL && list[i]->__error_code != EINPROGRESS)
+                return 0;
+        }
+        if (time_reached(until)) {
+            errno = EAGAIN;
+            return -1;
+        }
+        completion_wait(until);
+    }
+}
+
+int aio_cancel(int fildes, struct aiocb *aiocbp) {
+    if (aiocbp != NULL && aiocbp->aio_fildes != fildes) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mutex_enter_blocking(&_aio_mutex);
+    bool canceled = false;
+    size_t count = 0;
+    for (size_t i = 0; i < queue_count; i++) {
+        struct aiocb *request = queue[(queue_head + i) % PICO_VFS_AIO_QUEUE_DEPTH];
+        if (request->aio_fildes == fildes && (aiocbp == NULL || request == aiocbp)) {
+            request->__return_value = -1;
+            request->__error_code = ECANCELED;
+            canceled = true;
+        } else {
+            queue[(queue_head + count) % PICO_VFS_AIO_QUEUE_DEPTH] = request;
+            count++;
+        }
+    }
+    queue_count = count;
+    bool in_progress = running != NULL && running->aio_fildes == fildes &&
+                       (aiocbp == NULL || running == aiocbp);
+    mutex_exit(&_aio_mutex);
+
+    if (canceled)
+        completion_notify();
+    if (in_progress)
+        return AIO_NOTCANCELED;
+    return canceled ? AIO_CANCELED : AIO_ALLDONE;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pico/multicore.h>
+#include <pico/mutex.h>
+#include <pico/time.h>
+#include "filesystem/core1.h"
+#if PICO_ON_DEVICE
+#include <hardware/sync.h>
+#endif
+
+typedef struct {
+    bool (*job)(void);
+    uint32_t interval_us;
+} core1_job_t;
+
+static core1_job_t jobs[PICO_VFS_CORE1_MAX_JOBS];
+static size_t job_count = 0;
+static bool claimed = false;  // core1 runs a loop of its own
+auto_init_mutex(_core1_mutex);
+
+static void core1_wait(uint32_t interval_us) {
+#if PICO_ON_DEVICE
+    best_effort_wfe_or_timeout(interval_us == 0 ? at_the_end_of_time : make_timeout_time_us(interval_us));
+#else
+    sleep_us(interval_us == 0 || interval_us > 1000 ? 1000 : interval_us);
+#endif
+}
+
+static void core1_loop(void) {
+    while (true) {
+        core1_job_t current[PICO_VFS_CORE1_MAX_JOBS];
+        mutex_enter_blocking(&_core1_mutex);
+        size_t count = job_count;
+        memcpy(current, jobs, sizeof(jobs));
+        mutex_exit(&_core1_mutex);
+
+        bool busy = false;
+        uint32_t interval_us = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (current[i].job())
+                busy = true;
+            if (current[i].interval_us > 0 && (interval_us == 0 || current[i].interval_us < interval_us))
+                interval_us = current[i].interval_us;
+        }
+        if (!busy)
+            core1_wait(interval_us);
+    }
+}
+
+int fs_core1_add_job(bool (*job)(void), uint32_t interval_us) {
+    mutex_enter_blocking(&_core1_mutex);
+    if (claimed) {
+        mutex_exit(&_core1_mutex);
+        errno = EBUSY;
+        return -1;
+    }
+    if (job_count == PICO_VFS_CORE1_MAX_JOBS) {
+        mutex_exit(&_core1_mutex);
+        errno = ENOSPC;
+        return -1;
+    }
+    jobs[job_count] = (core1_job_t){.job = job, .interval_us = interval_us};
+    job_count++;
+    bool launch = job_count == 1;
+    mutex_exit(&_core1_mutex);
+
+    if (launch)
+        multicore_launch_core1(core1_loop);
+    else
+        fs_core1_notify();
+    return 0;
+}
+
+int fs_core1_claim(void (*entry)(void)) {
+    mutex_enter_blocking(&_core1_mutex);
+    if (claimed || job_count > 0) {
+        mutex_exit(&_core1_mutex);
+        errno = EBUSY;
+        return -1;
+    }
+    claimed = true;
+    mutex_exit(&_core1_mutex);
+
+    multicore_launch_core1(entry);
+    return 0;
+}
+
+void fs_core1_notify(void) {
+#if PICO_ON_DEVICE
+    __sev();
+#endif
+}
@@ -14,8 +14,52 @@
 #include "filesystem/fat.h"
 #include "ff.h"
 #include "diskio.h"
+#if LIB_FREERTOS_KERNEL
+#include <FreeRTOS.h>
+#include <semphr.h>
+#define FAT_FREERTOS_MUTEX    (configUSE_MUTEXES && configSUPPORT_STATIC_ALLOCATION)
+#else
+#define FAT_FREERTOS_MUTEX    0
+#endif
 
 
+/*
+ * Context lock. Under FreeRTOS a FreeRTOS mutex is used, so that a task waiting for the lock
+ * lends its priority to the holder.
+ */
+#if FAT_FREERTOS_MUTEX
+typedef struct {
+    StaticSemaphore_t buffer;
+    SemaphoreHandle_t handle;
+} fat_mutex_t;
+
+static void fat_lock_init(fat_mutex_t *mutex) {
+    mutex->handle = xSemaphoreCreateMutexStatic(&mutex->buffer);
+}
+
+static void fat_lock(fat_mutex_t *mutex) {
+    xSemaphoreTake(mutex->handle, portMAX_DELAY);
+}
+
+static void fat_unlock(fat_mutex_t *mutex) {
+    xSemaphoreGive(mutex->handle);
+}
+#else
+typedef mutex_t fat_mutex_t;
+
+static void fat_lock_init(fat_mutex_t *mutex) {
+    mutex_init(mutex);
+}
+
+static void fat_lock(fat_mutex_t *mutex) {
+    mutex_enter_blocking(mutex);
+}
+
+static void fat_unlock(fat_mutex_t *mutex) {
+    mutex_exit(mutex);
+}
+#endif
+
 typedef struct {
     FIL file;
 } fat_file_t;
@@ -23,8 +67,10 @@ typedef struct {
 typedef struct {
     FATFS fatfs;
     int id;
-    mutex_t _mutex;
-    mutex_t _mutex_format;
+    fat_mutex_t _mutex;
+    fat_mutex_t _mutex_format;
+    fs_object_pool_t file_pool;
+    fs_object_pool_t dir_pool;
 } filesystem_fat_context_t;
 
 static const char FILESYSTEM_NAME[] = "FAT";
@@ -194,7 +240,7 @@ DWORD get_fattime(void) {
 
 static int mount(filesystem_t *fs, blockdevice_t *device, bool pending) {
     filesystem_fat_context_t *context = fs->context;
-    mutex_enter_blocking(&context->_mutex);
+    fat_lock(&context->_mutex);
 
     char _fsid[3] = {0};
     for (size_t i = 0; i < FF_VOLUMES; i++) {
@@ -205,17 +251,17 @@ static int mount(filesystem_t *fs, blockdevice_t *device, bool pending) {
             _fsid[1] = ':';
             _fsid[2] = '\0';
             FRESULT res = f_mount(&context->fatfs, _fsid, !pending);
-            mutex_exit(&context->_mutex);
+            fat_unlock(&context->_mutex);
             return fat_error_remap(res);
         }
     }
-    mutex_exit(&context->_mutex);
+    fat_unlock(&context->_mutex);
     return -ENOMEM;
 }
 
 static int unmount(filesystem_t *fs) {
     filesystem_fat_context_t *context = fs->context;
-    mutex_enter_blocking(&context->_mutex);
+    fat_lock(&context->_mutex);
 
     char _fsid[3] = "0:";
     _fsid[0] = '0' + context->id;
@@ -223,18 +269,18 @@ static int unmount(filesystem_t *fs) {
     FRESULT res = f_mount(NULL, _fsid, 0);
     _ffs[context->id] = NULL;
 
-    mutex_exit(&context->_mutex);
+    fat_unlock(&context->_mutex);
     return fat_error_remap(res);
 }
 
 static int format(filesystem_t *fs, blockdevice_t *device) {
     filesystem_fat_context_t *context = fs->context;
-    mutex_enter_blocking(&context->_mutex_format);
+    fat_lock(&context->_mutex_format);
 
     if (!device->is_initialized) {
         int err = device->init(device);
         if (err) {
-            mutex_exit(&context->_mutex_format);
+            fat_unlock(&context->_mutex_format);
             return err;
         }
     }
@@ -243,14 +289,14 @@ static int format(filesystem_t *fs, blockdevice_t *device) {
     bd_size_t header = 2 * device->erase_size;
     int err = device->erase(device, 0, header);
     if (err) {
-        mutex_exit(&context->_mutex_format);
+        fat_unlock(&context->_mutex_format);
         return err;
     }
 
     size_t program_size = device->program_size;
     void *buffer = malloc(program_size);
     if (!buffer) {
-        mutex_exit(&context->_mutex_format);
+        fat_unlock(&context->_mutex_format);
         return -ENOMEM;
     }
     memset(buffer, 0xFF, program_size);
@@ -258,7 +304,7 @@ static int format(filesystem_t *fs, blockdevice_t *device) {
         err = device->program(device, buffer, i, program_size);
         if (err) {
             free(buffer);
-            mutex_exit(&context->_mutex_format);
+            fat_unlock(&context->_mutex_format);
             return err;
         }
     }
@@ -267,13 +313,13 @@ static int format(filesystem_t *fs, blockdevice_t *device) {
     // trim entire device to indicate it is unneeded
     err = device->trim(device, 0, device->size(device));
     if (err) {
-        mutex_exit(&context->_mutex_format);
+        fat_unlock(&context->_mutex_format);
         return err;
     }
 
     err = fs->mount(fs, device, true);
     if (err) {
-        mutex_exit(&context->_mutex_format);
+        fat_unlock(&context->_mutex_format);
         return err;
     }
 
@@ -291,17 +337,17 @@ static int format(filesystem_t *fs, blockdevice_t *device) {
 
     if (res != FR_OK) {
         fs->unmount(fs);
-        mutex_exit(&context->_mutex_format);
+        fat_unlock(&context->_mutex_format);
         return fat_error_remap(res);
     }
 
     err = fs->unmount(fs);
     if (err) {
-        mutex_exit(&context->_mutex_format);
+        fat_unlock(&context->_mutex_format);
         return res;
     }
 
-    mutex_exit(&context->_mutex_format);
+    fat_unlock(&context->_mutex_format);
     return 0;
 }
 
@@ -323,9 +369,9 @@ static int file_remove(filesystem_t *fs, const char *path) {
     char fpath[PATH_MAX];
     fat_path_prefix(fpath, context->id, path);
 
-    mutex_enter_blocking(&context->_mutex);
+    fat_lock(&context->_mutex);
     FRESULT res = f_unlink(fpath);
-    mutex_exit(&context->_mutex);
+    fat_unlock(&context->_mutex);
 
     if (res != FR_OK) {
         debug_if(FFS_DBG, "f_unlink() failed: %d\n", res);
@@ -342,9 +388,9 @@ static int file_rename(filesystem_t *fs, const char *oldpath, const char *newpat
     fat_path_prefix(oldfpath, context->id, oldpath);
     fat_path_prefix(newfpath, context->id, newpath);
 
-    mutex_enter_blocking(&context->_mutex);
+    fat_lock(&context->_mutex);
     FRESULT res = f_rename(oldfpath, newfpath);
-    mutex_exit(&context->_mutex);
+    fat_unlock(&context->_mutex);
 
     if (res != FR_OK) {
         debug_if(FFS_DBG, "f_rename() failed: %d\n", res);
@@ -358,9 +404,9 @@ static int file_mkdir(filesystem_t *fs, const char *path, mode_t mode) {
     char fpath[PATH_MAX];
     fat_path_prefix(fpath, context->id, path);
 
-    mutex_enter_blocking(&context->_mutex);
+    fat_lock(&context->_mutex);
     FRESULT res = f_mkdir(fpath);
-    mutex_exit(&context->_mutex);
+    fat_unlock(&context->_mutex);
 
     if (res != FR_OK) {
         debug_if(FFS_DBG, "f_mkdir() failed: %d\n", res);
@@ -373,9 +419,9 @@ static int file_rmdir(filesystem_t *fs, const char *path) {
     char fpath[PATH_MAX];
     fat_path_prefix(fpath, context->id, path);
 
-    mutex_enter_blocking(&context->_mutex);
+    fat_lock(&context->_mutex);
     FRESULT res = f_unlink(fpath);
-    mutex_exit(&context->_mutex);
+    fat_unlock(&context->_mutex);
 
     if (res != FR_OK) {
         debug_if(FFS_DBG, "f_unlink() failed: %d\n", res);
@@ -389,9 +435,9 @@ static int file_stat(filesystem_t *fs, const char *path, struct stat *st) {
     fat_path_prefix(fpath, context->id, path);
     FILINFO f = {0};
 
-    mutex_enter_blocking(&context->_mutex);
+    fat_lock(&context->_mutex);
     FRESULT res = f_stat(fpath, &f);
-    mutex_exit(&context->_mutex);
+    fat_unlock(&context->_mutex);
 
     if (res != FR_OK) {
         return fat_error_remap(res);
@@ -425,20 +471,24 @@ static int file_open(filesystem_t *fs, fs_file_t *file, const char *path, int fl
     char fpath[PATH_MAX];
     filesystem_fat_context_t *context = fs->context;
     fat_path_prefix(fpath, context->id, path);
-    fat_file_t *fat_file = file->context = calloc(1, sizeof(fat_file_t));
+
+    fat_lock(&context->_mutex);
+    fat_file_t *fat_file = fs_object_pool_acquire(&context->file_pool);
     if (fat_file == NULL) {
+        fat_unlock(&context->_mutex);
         fprintf(stderr, "file_open: Out of memory\n");
         return -ENOMEM;
     }
-
-    mutex_enter_blocking(&context->_mutex);
     FRESULT res = f_open(&fat_file->file, fpath, open_mode);
-    mutex_exit(&context->_mutex);
-
     if (res != FR_OK) {
+        fs_object_pool_release(&context->file_pool, fat_file);
+        fat_unlock(&context->_mutex);
         debug_if(FFS_DBG, "f_open('w') failed: %d\n", res);
         return fat_error_remap(res);
     }
+    fat_unlock(&context->_mutex);
+
+    file->context = fat_file;
     return 0;
 }
 
@@ -447,11 +497,11 @@ static int file_close(filesystem_t *fs, fs_file_t *file) {
     filesystem_fat_context_t *context = fs->context;
     fat_file_t *fat_file = file->context;
 
-    mutex_enter_blocking(&context->_mutex);
+    fat_lock(&context->_mutex);
     FRESULT res = f_close(&fat_file->file);
-    mutex_exit(&context->_mutex);
+    fs_object_pool_release(&context->file_pool, fat_file);
+    fat_unlock(&context->_mutex);
 
-    free(file->context);
     file->context = NULL;
     return fat_error_remap(res);
 }
@@ -463,15 +513,15 @@ static ssize_t file_write(filesystem_t *fs, fs_file_t *file, const void *buffer,
 
     UINT n;
 
-    mutex_enter_blocking(&context->_mutex);
+    fat_lock(&context->_mutex);
     FRESULT res = f_write(&(fat_file->file), buffer, size, &n);
     if (res != FR_OK) {
-        mutex_exit(&context->_mutex);
+        fat_unlock(&context->_mutex);
         debug_if(FFS_DBG, "f_write() failed: %d", res);
         return fat_error_remap(res);
     }
     res = f_sync(&fat_file->file);
-    mutex_exit(&context->_mutex);
+    fat_unlock(&context->_mutex);
 
     if (res != FR_OK) {
         debug_if(FFS_DBG, "f_write() failed: %d", res);
@@ -487,9 +537,9 @@ static ssize_t file_read(filesystem_t *fs, fs_file_t *file, void *buffer, size_t
 
     UINT n;
 
-    mutex_enter_blocking(&context->_mutex);
+    fat_lock(&context->_mutex);
     FRESULT res = f_read(&fat_file->file, buffer, size, &n);
-    mutex_exit(&context->_mutex);
+    fat_unlock(&context->_mutex);
 
     if (res != FR_OK) {
         debug_if(FFS_DBG, "f_read() failed: %d\n", res);
@@ -498,14 +548,202 @@ static ssize_t file_read(filesystem_t *fs, fs_file_t *file, void *buffer, size_t
     return n;
 }
 
+static ssize_t file_preadv(filesystem_t *fs, fs_file_t *file, const struct iovec *iov, int iovcnt, off_t offset) {
+    filesystem_fat_context_t *context = fs->context;
+    FIL *fp = &((fat_file_t *)file->context)->file;
+
+    fat_lock(&context->_mutex);
+    FSIZE_t position = f_tell(fp);
+    if (offset >= 0) {
+        if ((FSIZE_t)offset >= f_size(fp)) {
+            fat_unlock(&context->_mutex);
+            return 0;  // f_lseek() would extend a file opened for writing
+        }
+        FRESULT res = f_lseek(fp, offset);
+        if (res != FR_OK) {
+            fat_unlock(&context->_mutex);
+            return fat_error_remap(res);
+        }
+    }
+    ssize_t total = 0;
+    FRESULT res = FR_OK;
+    for (int i = 0; i < iovcnt; i++) {
+        UINT n;
+        res = f_read(fp, iov[i].iov_base, iov[i].iov_len, &n);
+        if (res != FR_OK)
+            break;
+        total += n;
+        if (n < iov[i].iov_len)
+            break;
+    }
+    if (offset >= 0)
+        f_lseek(fp, position);
+    fat_unlock(&context->_mutex);
+
+    if (res != FR_OK && total == 0) {
+        debug_if(FFS_DBG, "f_read() failed: %d\n", res);
+        return fat_error_remap(res);
+    }
+    return total;
+}
+
+static ssize_t file_pwritev(filesystem_t *fs, fs_file_t *file, const struct iovec *iov, int iovcnt, off_t offset) {
+    filesystem_fat_context_t *context = fs->context;
+    FIL *fp = &((fat_file_t *)file->context)->file;
+
+    fat_lock(&context->_mutex);
+    FSIZE_t position = f_tell(fp);
+    if (offset >= 0) {
+        FRESULT res = f_lseek(fp, offset);
+        if (res != FR_OK) {
+            fat_unlock(&context->_mutex);
+            return fat_error_remap(res);
+        }
+    }
+    ssize_t total = 0;
+    FRESULT res = FR_OK;
+    for (int i = 0; i < iovcnt; i++) {
+        UINT n;
+        res = f_write(fp, iov[i].iov_base, iov[i].iov_len, &n);
+        if (res != FR_OK)
+            break;
+        total += n;
+        if (n < iov[i].iov_len)
+            break;
+    }
+    // One directory entry update for the whole vector
+    FRESULT sync_res = f_sync(fp);
+    if (res == FR_OK)
+        res = sync_res;
+    if (offset >= 0)
+        f_lseek(fp, position);
+    fat_unlock(&context->_mutex);
+
+    if (res != FR_OK && total == 0) {
+        debug_if(FFS_DBG, "f_write() failed: %d\n", res);
+        return fat_error_remap(res);
+    }
+    return total;
+}
+
+static int file_extent(filesystem_t *fs, fs_file_t *file, off_t offset, size_t length, bd_size_t *addr) {
+#if FF_USE_FASTSEEK
+    filesystem_fat_context_t *context = fs->context;
+    FIL *fp = &((fat_file_t *)file->context)->file;
+    DWORD table[2 + 2 * 8] = {sizeof(table) / sizeof(table[0])};  // Up to 8 fragments
+
+    fat_lock(&context->_mutex);
+    if (offset < 0 || (FSIZE_t)offset + length > f_size(fp)) {
+        fat_unlock(&context->_mutex);
+        return -EINVAL;
+    }
+    DWORD *cltbl = fp->cltbl;
+    fp->cltbl = table;
+    FRESULT res = f_lseek(fp, CREATE_LINKMAP);  // Does not move the file pointer
+    fp->cltbl = cltbl;
+    fat_unlock(&context->_mutex);
+    if (res == FR_NOT_ENOUGH_CORE)
+        return -ENOTSUP;
+    if (res != FR_OK)
+        return fat_error_remap(res);
+
+    WORD sector_size = disk_get_sector_size(context->fatfs.pdrv);
+    FSIZE_t cluster_size = (FSIZE_t)context->fatfs.csize * sector_size;
+    FSIZE_t start = 0;
+    for (DWORD *fragment = &table[1]; fragment[0] != 0; fragment += 2) {
+        FSIZE_t end = start + fragment[0] * cluster_size;
+        if ((FSIZE_t)offset < end) {
+            if ((FSIZE_t)offset + length > end)
+                return -ENOTSUP;  // The range spans fragments
+            LBA_t sector = context->fatfs.database + (LBA_t)(fragment[1] - 2) * context->fatfs.csize;
+            *addr = (bd_size_t)sector * sector_size + (offset - start);
+            return 0;
+        }
+        start = end;
+    }
+    return -ENOTSUP;  // Empty file
+#else
+    (void)fs;
+    (void)file;
+    (void)offset;
+    (void)length;
+    (void)addr;
+    return -ENOTSUP;
+#endif
+}
+
+static ssize_t file_copy(filesystem_t *fs, fs_file_t *in, fs_file_t *out, size_t len, void *buffer, size_t buffer_size) {
+    filesystem_fat_context_t *context = fs->context;
+    FIL *src = &((fat_file_t *)in->context)->file;
+    FIL *dst = &((fat_file_t *)out->context)->file;
+#if FF_MAX_SS == FF_MIN_SS
+    UINT sector_size = FF_MAX_SS;
+#else
+    UINT sector_size = context->fatfs.ssize;
+#endif
+    if (buffer_size < sector_size)
+        return -ENOTSUP;
+    buffer_size -= buffer_size % sector_size;
+
+    fat_lock(&context->_mutex);
+    FSIZE_t remaining = f_size(src) > f_tell(src) ? f_size(src) - f_tell(src) : 0;
+    if ((FSIZE_t)len < remaining)
+        remaining = len;
+
+    // Allocate the destination contiguously up front, so that the sector-aligned transfers
+    // below go straight to the disk as multi-sector writes without walking the FAT
+    bool expanded = false;
+    if (remaining > 0 && f_size(dst) == 0 && f_tell(dst) == 0)
+        expanded = f_expand(dst, remaining, 1) == FR_OK;
+
+    ssize_t total = 0;
+    FRESULT res = FR_OK;
+    while ((FSIZE_t)total < remaining) {
+        UINT chunk = buffer_size;
+        UINT misalign = f_tell(src) % sector_size;
+        if (misalign != 0)
+            chunk = sector_size - misalign;  // realign the source, then whole sectors bypass the window
+        if ((FSIZE_t)chunk > remaining - total)
+            chunk = remaining - total;
+
+        UINT n, written;
+        res = f_read(src, buffer, chunk, &n);
+        if (res != FR_OK || n == 0)
+            break;
+        res = f_write(dst, buffer, n, &written);
+        if (res != FR_OK)
+            break;
+        total += written;
+        if (written < n) {
+            f_lseek(src, f_tell(src) - (n - written));
+            break;
+        }
+    }
+    if (expanded && (FSIZE_t)total < remaining) {
+        FRESULT trunc_res = f_truncate(dst);  // drop the part of the allocation that was not copied
+        if (res == FR_OK)
+            res = trunc_res;
+    }
+    FRESULT sync_res = f_sync(dst);
+    if (res == FR_OK)
+        res = sync_res;
+    fat_unlock(&context->_mutex);
+
+    if (res != FR_OK && total == 0) {
+        debug_if(FFS_DBG, "file_copy() failed: %d\n", res);
+        return fat_error_remap(res);
+    }
+    return total;
+}
+
 static int file_sync(filesystem_t *fs, fs_file_t *file) {
     (void)fs;
     filesystem_fat_context_t *context = fs->context;
     fat_file_t *fat_file = file->context;
 
-    mutex_enter_blocking(&context->_mutex);
+    fat_lock(&context->_mutex);
     FRESULT res = f_sync(&fat_file->file);
-    mutex_exit(&context->_mutex);
+    fat_unlock(&context->_mutex);
 
     if (res != FR_OK) {
         debug_if(FFS_DBG, "f_sync() failed: %d\n", res);
@@ -513,19 +751,41 @@ static int file_sync(filesystem_t *fs, fs_file_t *file) {
     return fat_error_remap(res);
 }
 
+static int sync_files(filesystem_t *fs, fs_file_t *const *files, size_t count) {
+    filesystem_fat_context_t *context = fs->context;
+
+    fat_lock(&context->_mutex);
+    FRESULT res = FR_OK;
+    for (size_t i = 0; i < count; i++) {
+        fat_file_t *fat_file = files[i]->context;
+        FRESULT file_res = f_sync(&fat_file->file);
+        if (res == FR_OK)
+            res = file_res;
+    }
+    blockdevice_t *device = _ffs[context->id];
+    int err = device->sync(device);  // FatFs does not sync the device itself, do it once per group
+    fat_unlock(&context->_mutex);
+
+    if (res != FR_OK) {
+        debug_if(FFS_DBG, "f_sync() failed: %d\n", res);
+        return fat_error_remap(res);
+    }
+    return err;
+}
+
 static off_t file_seek(filesystem_t *fs, fs_file_t *file, off_t offset, int whence) {
     (void)fs;
     filesystem_fat_context_t *context = fs->context;
     fat_file_t *fat_file = file->context;
 
-    mutex_enter_blocking(&context->_mutex);
+    fat_lock(&context->_mutex);
     if (whence == SEEK_END)
         offset += f_size(&fat_file->file);
     else if (whence == SEEK_CUR)
         offset += f_tell(&fat_file->file);
 
     FRESULT res = res = f_lseek(&fat_file->file, offset);
-    mutex_exit(&context->_mutex);
+    fat_unlock(&context->_mutex);
 
     if (res != FR_OK) {
         debug_if(FFS_DBG, "lseek failed: %d\n", res);
@@ -539,9 +799,9 @@ static off_t file_tell(filesystem_t *fs, fs_file_t *file) {
     filesystem_fat_context_t *context = fs->context;
     fat_file_t *fat_file = file->context;
 
-    mutex_enter_blocking(&context->_mutex);
+    fat_lock(&context->_mutex);
     off_t res = f_tell(&fat_file->file);
-    mutex_exit(&context->_mutex);
+    fat_unlock(&context->_mutex);
 
     return res;
 }
@@ -551,9 +811,9 @@ static off_t file_size(filesystem_t *fs, fs_file_t *file) {
     filesystem_fat_context_t *context = fs->context;
     fat_file_t *fat_file = file->context;
 
-    mutex_enter_blocking(&context->_mutex);
+    fat_lock(&context->_mutex);
     off_t res = f_size(&fat_file->file);
-    mutex_exit(&context->_mutex);
+    fat_unlock(&context->_mutex);
 
     return res;
 }
@@ -563,20 +823,21 @@ static int file_truncate(filesystem_t *fs, fs_file_t *file, off_t length) {
     filesystem_fat_context_t *context = fs->context;
     fat_file_t *fat_file = file->context;
 
-    mutex_enter_blocking(&context->_mutex);
+    fat_lock(&context->_mutex);
     FSIZE_t old_offset = f_tell(&fat_file->file);
     FRESULT res = f_lseek(&fat_file->file, length);
     if (res) {
-        mutex_exit(&context->_mutex);
+        fat_unlock(&context->_mutex);
         return fat_error_remap(res);
     }
     res = f_truncate(&fat_file->file);
     if (res) {
-        mutex_exit(&context->_mutex);
+        fat_unlock(&context->_mutex);
         return fat_error_remap(res);
     }
-    res = f_lseek(&fat_file->file, old_offset);
-    mutex_exit(&context->_mutex);
+    // Seeking beyond the end would extend the file again in write mode
+    res = f_lseek(&fat_file->file, old_offset < (FSIZE_t)length ? old_offset : (FSIZE_t)length);
+    fat_unlock(&context->_mutex);
 
     if (res) {
         return fat_error_remap(res);
@@ -584,26 +845,59 @@ static int file_truncate(filesystem_t *fs, fs_file_t *file, off_t length) {
     return 0;
 }
 
+static int file_allocate(filesystem_t *fs, fs_file_t *file, off_t offset, off_t length) {
+    filesystem_fat_context_t *context = fs->context;
+    FIL *fp = &((fat_file_t *)file->context)->file;
+    FSIZE_t end = (FSIZE_t)offset + (FSIZE_t)length;
+    if (!(fp->flag & FA_WRITE))
+        return -EBADF;
+
+    fat_lock(&context->_mutex);
+    FRESULT res = FR_OK;
+    if (end > f_size(fp)) {
+        // An empty file gets one contiguous area if there is one, otherwise the cluster chain
+        // is extended by seeking beyond the end in write mode
+        if (f_size(fp) != 0 || f_expand(fp, end, 1) != FR_OK) {
+            FSIZE_t position = f_tell(fp);
+            res = f_lseek(fp, end);
+            if (res == FR_OK && f_tell(fp) < end) {
+                f_lseek(fp, position);
+                fat_unlock(&context->_mutex);
+                return -ENOSPC;
+            }
+            FRESULT seek_res = f_lseek(fp, position);
+            if (res == FR_OK)
+                res = seek_res;
+        }
+    }
+    fat_unlock(&context->_mutex);
+
+    if (res != FR_OK)
+        return fat_error_remap(res);
+    return 0;
+}
+
 static int dir_open(filesystem_t *fs, fs_dir_t *dir, const char *path) {
     filesystem_fat_context_t *context = fs->context;
     char fpath[PATH_MAX];
     fat_path_prefix(fpath, context->id, path);
 
-    FATFS_DIR *dh = calloc(1, sizeof(FATFS_DIR));
+    fat_lock(&context->_mutex);
+    FATFS_DIR *dh = fs_object_pool_acquire(&context->dir_pool);
     if (dh == NULL) {
+        fat_unlock(&context->_mutex);
         fprintf(stderr, "dir_open: Out of memory\n");
         return -ENOMEM;
     }
-
-    mutex_enter_blocking(&context->_mutex);
     FRESULT res = f_opendir(dh, fpath);
-    mutex_exit(&context->_mutex);
-
     if (res != FR_OK) {
+        fs_object_pool_release(&context->dir_pool, dh);
+        fat_unlock(&context->_mutex);
         debug_if(FFS_DBG, "f_opendir() failed: %d\n", res);
-        free(dh);
         return fat_error_remap(res);
     }
+    fat_unlock(&context->_mutex);
+
     dir->context = dh;
     dir->fd = -1;
     return 0;
@@ -615,11 +909,11 @@ static int dir_close(filesystem_t *fs, fs_dir_t *dir) {
 
     FATFS_DIR *dh = (FATFS_DIR *)dir->context;
 
-    mutex_enter_blocking(&context->_mutex);
+    fat_lock(&context->_mutex);
     FRESULT res = f_closedir(dh);
-    mutex_exit(&context->_mutex);
+    fs_object_pool_release(&context->dir_pool, dh);
+    fat_unlock(&context->_mutex);
 
-    free(dh);
     return fat_error_remap(res);
 }
 
@@ -630,9 +924,9 @@ static int dir_read(filesystem_t *fs, fs_dir_t *dir, struct dirent *ent) {
     FATFS_DIR *dh = (FATFS_DIR *)dir->context;
     FILINFO finfo = {0};
 
-    mutex_enter_blocking(&context->_mutex);
+    fat_lock(&context->_mutex);
     FRESULT res = f_readdir(dh, &finfo);
-    mutex_exit(&context->_mutex);
+    fat_unlock(&context->_mutex);
 
     if (res != FR_OK) {
         return fat_error_remap(res);
@@ -674,6 +968,12 @@ filesystem_t *filesystem_fat_create() {
     fs->dir_open = dir_open;
     fs->dir_close = dir_close;
     fs->dir_read = dir_read;
+    fs->file_preadv = file_preadv;
+    fs->file_pwritev = file_pwritev;
+    fs->file_extent = file_extent;
+    fs->file_copy = file_copy;
+    fs->sync = sync_files;
+    fs->file_allocate = file_allocate;
     filesystem_fat_context_t *context = calloc(1, sizeof(filesystem_fat_context_t));
     if (context == NULL) {
         fprintf(stderr, "filesystem_fat_create: Out of memory\n");
@@ -681,14 +981,19 @@ filesystem_t *filesystem_fat_create() {
         return NULL;
     }
     context->id = -1;
-    mutex_init(&context->_mutex);
-    mutex_init(&context->_mutex_format);
+    fat_lock_init(&context->_mutex);
+    fat_lock_init(&context->_mutex_format);
+    fs_object_pool_init(&context->file_pool, sizeof(fat_file_t), PICO_VFS_MAX_OPEN_FILES);
+    fs_object_pool_init(&context->dir_pool, sizeof(FATFS_DIR), PICO_VFS_MAX_OPEN_DIRS);
 
     fs->context = context;
     return fs;
 }
 
 void filesystem_fat_free(filesystem_t *fs) {
+    filesystem_fat_context_t *context = fs->context;
+    fs_object_pool_deinit(&context->file_pool);
+    fs_object_pool_deinit(&context->dir_pool);
     free(fs->context);
     fs->context = NULL;
     free(fs);
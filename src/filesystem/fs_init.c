@@ -7,6 +7,9 @@
 #include "blockdevice/flash.h"
 #include "filesystem/littlefs.h"
 #include "filesystem/vfs.h"
+#if PICO_VFS_TMPFS_SIZE > 0
+#include "filesystem/tmpfs.h"
+#endif
 
 
 bool __attribute__((weak)) fs_init(void) {
@@ -21,5 +24,18 @@ bool __attribute__((weak)) fs_init(void) {
         }
         err = fs_mount("/", fs, device);
     }
+#if PICO_VFS_TMPFS_SIZE > 0
+    // tmpfile() and mkstemp() create their files in /tmp
+    if (err == 0) {
+        filesystem_t *tmpfs = filesystem_tmpfs_create(PICO_VFS_TMPFS_SIZE);
+        if (tmpfs == NULL) {
+            return false;
+        }
+        err = fs_mount("/tmp", tmpfs, NULL);
+        if (err == -1) {
+            filesystem_tmpfs_free(tmpfs);
+        }
+    }
+#endif
     return err == 0;
 }
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "filesystem/vfs.h"
+#if LIB_FREERTOS_KERNEL
+#include <FreeRTOS.h>
+#include <task.h>
+#else
+#include "filesystem/core1.h"
+#endif
+
+#define GC_POLL_INTERVAL_MS    10
+
+static uint32_t gc_idle_us = 0;
+static uint32_t gc_budget_us = 0;
+static bool gc_started = false;
+
+#if LIB_FREERTOS_KERNEL
+static void gc_task(void *params) {
+    (void)params;
+    while (true) {
+        if (!fs_gc_idle_poll(gc_idle_us, gc_budget_us))
+            vTaskDelay(pdMS_TO_TICKS(GC_POLL_INTERVAL_MS));
+        else
+            taskYIELD();
+    }
+}
+
+int fs_gc_start_background(uint32_t idle_us, uint32_t budget_us) {
+    if (gc_started) {
+        errno = EBUSY;
+        return -1;
+    }
+    gc_idle_us = idle_us;
+    gc_budget_us = budget_us;
+    if (xTaskCreate(gc_task, "fs_gc", configMINIMAL_STACK_SIZE * 4, NULL, tskIDLE_PRIORITY, NULL) != pdPASS) {
+        errno = ENOMEM;
+        return -1;
+    }
+    gc_started = true;
+    return 0;
+}
+
+#else
+
+static bool gc_job(void) {
+    return fs_gc_idle_poll(gc_idle_us, gc_budget_us);
+}
+
+int fs_gc_start_background(uint32_t idle_us, uint32_t budget_us) {
+    if (gc_started) {
+        errno = EBUSY;
+        return -1;
+    }
+    gc_idle_us = idle_us;
+    gc_budget_us = budget_us;
+    if (fs_core1_add_job(gc_job, GC_POLL_INTERVAL_MS * 1000) != 0)
+        return -1;  // EBUSY while the I/O service owns core1
+    gc_started = true;
+    return 0;
+}
+#endif
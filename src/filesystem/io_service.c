@@ -0,0 +1,690 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pico/mutex.h>
+#include "filesystem/vfs.h"
+#if LIB_FREERTOS_KERNEL
+#include <FreeRTOS.h>
+#include <task.h>
+#elif PICO_ON_DEVICE
+#include <hardware/sync.h>
+#include <pico/platform.h>
+#include "filesystem/core1.h"
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if !defined(PICO_VFS_IO_SERVICE_RING_SIZE)
+#define PICO_VFS_IO_SERVICE_RING_SIZE          8
+#endif
+#if !defined(PICO_VFS_IO_SERVICE_MAX_FILESYSTEMS)
+#define PICO_VFS_IO_SERVICE_MAX_FILESYSTEMS    4
+#endif
+
+#if !defined(PICO_VFS_IO_SERVICE_STACK_SIZE)
+#define PICO_VFS_IO_SERVICE_STACK_SIZE         (configMINIMAL_STACK_SIZE * 4)
+#endif
+#if !defined(PICO_VFS_IO_SERVICE_NOTIFY_INDEX)
+#define PICO_VFS_IO_SERVICE_NOTIFY_INDEX       (configTASK_NOTIFICATION_ARRAY_ENTRIES - 1)
+#endif
+#if !defined(PICO_VFS_IO_SERVICE_CLASS_TLS_INDEX)
+#define PICO_VFS_IO_SERVICE_CLASS_TLS_INDEX    0
+#endif
+
+#if PICO_ON_DEVICE && !LIB_FREERTOS_KERNEL
+#define IO_SUBMITTERS    NUM_CORES
+#else
+#define IO_SUBMITTERS    1
+#endif
+#define IO_CLASSES       (FS_IO_CLASS_BULK + 1)
+
+typedef enum {
+    IO_MOUNT,
+    IO_UNMOUNT,
+    IO_FORMAT,
+    IO_REMOVE,
+    IO_RENAME,
+    IO_MKDIR,
+    IO_RMDIR,
+    IO_STAT,
+    IO_FILE_OPEN,
+    IO_FILE_CLOSE,
+    IO_FILE_WRITE,
+    IO_FILE_READ,
+    IO_FILE_SYNC,
+    IO_FILE_SEEK,
+    IO_FILE_TELL,
+    IO_FILE_SIZE,
+    IO_FILE_TRUNCATE,
+    IO_DIR_OPEN,
+    IO_DIR_CLOSE,
+    IO_DIR_READ,
+    IO_GC,
+    IO_FILE_PREADV,
+    IO_FILE_PWRITEV,
+    IO_FILE_EXTENT,
+    IO_FILE_COPY,
+    IO_SYNC,
+    IO_FILE_ALLOCATE,
+} io_op_t;
+
+typedef union {
+    void *p;
+    int64_t i;
+} io_arg_t;
+
+typedef struct io_request {
+    io_op_t op;
+    filesystem_t *fs;
+    io_arg_t arg[6];
+    int64_t result;
+    volatile bool done;
+#if LIB_FREERTOS_KERNEL
+    struct io_request *next;
+    TaskHandle_t waiter;  // Its priority is lent to the I/O task
+#endif
+} io_request_t;
+
+#if !LIB_FREERTOS_KERNEL
+/*
+ * Single producer, single consumer ring. On the device each core has its own ring and is its
+ * only producer, so no lock is taken. On the host all threads share one ring and are serialized
+ * by `producer`.
+ */
+typedef struct {
+    io_request_t *volatile slot[PICO_VFS_IO_SERVICE_RING_SIZE];
+    volatile uint32_t head;  // Advanced by the I/O core
+    volatile uint32_t tail;  // Advanced by the submitting core
+#if !PICO_ON_DEVICE
+    mutex_t producer;
+#endif
+} io_ring_t;
+#endif
+
+typedef struct {
+    filesystem_t *fs;
+    filesystem_t direct;  // Operations of the file system before it was attached
+#if LIB_FREERTOS_KERNEL
+    TaskHandle_t task;
+    io_request_t *head[IO_CLASSES];  // Pending requests per class, in arrival order
+    io_request_t *tail[IO_CLASSES];
+    io_request_t *serving;
+#endif
+} io_attached_t;
+
+#if !LIB_FREERTOS_KERNEL
+static io_ring_t rings[IO_SUBMITTERS];
+#endif
+static io_attached_t attached[PICO_VFS_IO_SERVICE_MAX_FILESYSTEMS];
+static volatile bool service_started = false;
+
+extern int vfs_io_service_attach_mounted(void);
+
+static io_attached_t *io_entry(filesystem_t *fs) {
+    for (size_t i = 0; i < PICO_VFS_IO_SERVICE_MAX_FILESYSTEMS; i++) {
+        if (attached[i].fs == fs)
+            return &attached[i];
+    }
+    return NULL;
+}
+
+static int64_t io_execute(io_request_t *r) {
+    const filesystem_t *d = &io_entry(r->fs)->direct;
+    filesystem_t *fs = r->fs;
+    io_arg_t *a = r->arg;
+    switch (r->op) {
+    case IO_MOUNT:
+        return d->mount(fs, a[0].p, a[1].i);
+    case IO_UNMOUNT:
+        return d->unmount(fs);
+    case IO_FORMAT:
+        return d->format(fs, a[0].p);
+    case IO_REMOVE:
+        return d->remove(fs, a[0].p);
+    case IO_RENAME:
+        return d->rename(fs, a[0].p, a[1].p);
+    case IO_MKDIR:
+        return d->mkdir(fs, a[0].p, a[1].i);
+    case IO_RMDIR:
+        return d->rmdir(fs, a[0].p);
+    case IO_STAT:
+        return d->stat(fs, a[0].p, a[1].p);
+    case IO_FILE_OPEN:
+        return d->file_open(fs, a[0].p, a[1].p, a[2].i);
+    case IO_FILE_CLOSE:
+        return d->file_close(fs, a[0].p);
+    case IO_FILE_WRITE:
+        return d->file_write(fs, a[0].p, a[1].p, a[2].i);
+    case IO_FILE_READ:
+        return d->file_read(fs, a[0].p, a[1].p, a[2].i);
+    case IO_FILE_SYNC:
+        return d->file_sync(fs, a[0].p);
+    case IO_FILE_SEEK:
+        return d->file_seek(fs, a[0].p, a[1].i, a[2].i);
+    case IO_FILE_TELL:
+        return d->file_tell(fs, a[0].p);
+    case IO_FILE_SIZE:
+        return d->file_size(fs, a[0].p);
+    case IO_FILE_TRUNCATE:
+        return d->file_truncate(fs, a[0].p, a[1].i);
+    case IO_DIR_OPEN:
+        return d->dir_open(fs, a[0].p, a[1].p);
+    case IO_DIR_CLOSE:
+        return d->dir_close(fs, a[0].p);
+    case IO_DIR_READ:
+        return d->dir_read(fs, a[0].p, a[1].p);
+    case IO_GC:
+        return d->gc(fs, a[0].i);
+    case IO_FILE_PREADV:
+        return d->file_preadv(fs, a[0].p, a[1].p, a[2].i, a[3].i);
+    case IO_FILE_PWRITEV:
+        return d->file_pwritev(fs, a[0].p, a[1].p, a[2].i, a[3].i);
+    case IO_FILE_EXTENT:
+        return d->file_extent(fs, a[0].p, a[1].i, a[2].i, a[3].p);
+    case IO_FILE_COPY:
+        return d->file_copy(fs, a[0].p, a[1].p, a[2].i, a[3].p, a[4].i);
+    case IO_SYNC:
+        return d->sync(fs, a[0].p, a[1].i);
+    case IO_FILE_ALLOCATE:
+        return d->file_allocate(fs, a[0].p, a[1].i, a[2].i);
+    }
+    return -EINVAL;
+}
+
+/*
+ * FreeRTOS transport. Each attached file system is served by its own task, so a slow device
+ * does not hold up the others. Pending requests are queued per class and the highest class is
+ * served first. While requests wait, the I/O task runs at the highest priority of the waiting
+ * tasks, so a low-priority I/O task cannot hold up a high-priority caller. A waiting task can
+ * itself be raised later, e.g. by a task that blocks on the VFS lock it holds, so the priorities
+ * are read again on every submission and before and after every request.
+ */
+#if LIB_FREERTOS_KERNEL
+
+static UBaseType_t service_priority = tskIDLE_PRIORITY + 1;
+
+static fs_io_class_t io_current_class(void) {
+#if configNUM_THREAD_LOCAL_STORAGE_POINTERS > PICO_VFS_IO_SERVICE_CLASS_TLS_INDEX
+    uintptr_t value = (uintptr_t)pvTaskGetThreadLocalStoragePointer(NULL, PICO_VFS_IO_SERVICE_CLASS_TLS_INDEX);
+    if (value != 0)
+        return (fs_io_class_t)(value - 1);  // Stored as class + 1, so that unset means normal
+#endif
+    return FS_IO_CLASS_NORMAL;
+}
+
+static UBaseType_t io_waiter_priority(const io_request_t *r, UBaseType_t priority) {
+    UBaseType_t waiter = uxTaskPriorityGet(r->waiter);  // Includes a priority it inherited
+    return waiter > priority ? waiter : priority;
+}
+
+// Called in a critical section. Lends the I/O task the priority of its most urgent waiter.
+static void io_lend_priority(io_attached_t *entry) {
+    UBaseType_t priority = service_priority;
+    if (entry->serving != NULL)
+        priority = io_waiter_priority(entry->serving, priority);
+    for (size_t i = 0; i < IO_CLASSES; i++) {
+        for (io_request_t *r = entry->head[i]; r != NULL; r = r->next)
+            priority = io_waiter_priority(r, priority);
+    }
+    if (priority != uxTaskPriorityGet(entry->task))
+        vTaskPrioritySet(entry->task, priority);
+}
+
+static void io_task(void *params) {
+    io_attached_t *entry = params;
+    while (true) {
+        io_request_t *r = NULL;
+        taskENTER_CRITICAL();
+        for (size_t i = 0; i < IO_CLASSES && r == NULL; i++) {
+            r = entry->head[i];
+            if (r != NULL) {
+                entry->head[i] = r->next;
+                if (entry->head[i] == NULL)
+                    entry->tail[i] = NULL;
+            }
+        }
+        entry->serving = r;
+        io_lend_priority(entry);
+        taskEXIT_CRITICAL();
+
+        if (r == NULL) {
+            ulTaskNotifyTakeIndexed(PICO_VFS_IO_SERVICE_NOTIFY_INDEX, pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        r->result = io_execute(r);
+        TaskHandle_t waiter = r->waiter;
+        taskENTER_CRITICAL();
+        entry->serving = NULL;
+        io_lend_priority(entry);
+        taskEXIT_CRITICAL();
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        r->done = true;  // The request may go out of scope from here on
+        xTaskNotifyGiveIndexed(waiter, PICO_VFS_IO_SERVICE_NOTIFY_INDEX);
+    }
+}
+
+static bool io_launch_task(io_attached_t *entry) {
+    if (entry->task != NULL)
+        return true;
+    return xTaskCreate(io_task, "fs_io", PICO_VFS_IO_SERVICE_STACK_SIZE, entry, service_priority,
+                       &entry->task) == pdPASS;
+}
+
+static int64_t io_submit(io_request_t *r) {
+    io_attached_t *entry = io_entry(r->fs);
+    // Before the scheduler starts there is no I/O task to wait for, and the I/O task must not
+    // wait for itself
+    if (xTaskGetSchedulerState() != taskSCHEDULER_RUNNING || xTaskGetCurrentTaskHandle() == entry->task)
+        return io_execute(r);
+
+    fs_io_class_t io_class = io_current_class();
+    r->waiter = xTaskGetCurrentTaskHandle();
+    r->next = NULL;
+    taskENTER_CRITICAL();
+    if (entry->tail[io_class] == NULL)
+        entry->head[io_class] = r;
+    else
+        entry->tail[io_class]->next = r;
+    entry->tail[io_class] = r;
+    io_lend_priority(entry);
+    taskEXIT_CRITICAL();
+    xTaskNotifyGiveIndexed(entry->task, PICO_VFS_IO_SERVICE_NOTIFY_INDEX);
+
+    while (!r->done)
+        ulTaskNotifyTakeIndexed(PICO_VFS_IO_SERVICE_NOTIFY_INDEX, pdTRUE, portMAX_DELAY);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return r->result;
+}
+
+#else
+
+/*
+ * Bare metal transport. On the device the I/O core sleeps with WFE and submitters wake it with
+ * SEV; on the host a thread stands in for core1.
+ */
+#if PICO_ON_DEVICE
+
+static void io_signal(void) {
+    __sev();
+}
+
+static void io_wait(void) {
+    __wfe();
+}
+
+static bool io_on_service_core(void) {
+    return get_core_num() == 1;
+}
+
+static unsigned io_submitter(void) {
+    return get_core_num();
+}
+
+static void io_service_loop(void);
+
+// core1 cannot also run the gc, aio or destager jobs: they may wait for the VFS lock that a
+// submitter holds while it waits for core1
+static bool io_launch(void) {
+    return fs_core1_claim(io_service_loop) == 0;
+}
+
+#else
+
+static pthread_t service_thread;
+
+static void io_signal(void) {
+}
+
+static void io_wait(void) {
+    sched_yield();
+}
+
+static bool io_on_service_core(void) {
+    return service_started && pthread_equal(pthread_self(), service_thread);
+}
+
+static unsigned io_submitter(void) {
+    return 0;
+}
+
+static void io_service_loop(void);
+
+static void *io_service_thread(void *params) {
+    (void)params;
+    io_service_loop();
+    return NULL;
+}
+
+static bool io_launch(void) {
+    if (pthread_create(&service_thread, NULL, io_service_thread, NULL) != 0) {
+        errno = EAGAIN;
+        return false;
+    }
+    pthread_detach(service_thread);
+    return true;
+}
+#endif
+
+static void io_service_loop(void) {
+    while (true) {
+        bool idle = true;
+        for (size_t i = 0; i < IO_SUBMITTERS; i++) {
+            io_ring_t *ring = &rings[i];
+            while (ring->head != ring->tail) {
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                io_request_t *r = ring->slot[ring->head % PICO_VFS_IO_SERVICE_RING_SIZE];
+                r->result = io_execute(r);
+                __atomic_thread_fence(__ATOMIC_RELEASE);
+                r->done = true;
+                ring->head++;
+                io_signal();
+                idle = false;
+            }
+        }
+        if (idle)
+            io_wait();
+    }
+}
+
+static int64_t io_submit(io_request_t *r) {
+    if (io_on_service_core()) {
+        // A stacked file system, such as a staging tier, calls its attached backing file
+        // system from the service itself
+        return io_execute(r);
+    }
+
+    io_ring_t *ring = &rings[io_submitter()];
+#if !PICO_ON_DEVICE
+    mutex_enter_blocking(&ring->producer);
+#endif
+    while (ring->tail - ring->head == PICO_VFS_IO_SERVICE_RING_SIZE)
+        io_wait();
+    ring->slot[ring->tail % PICO_VFS_IO_SERVICE_RING_SIZE] = r;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ring->tail++;
+#if !PICO_ON_DEVICE
+    mutex_exit(&ring->producer);
+#endif
+    io_signal();
+
+    while (!r->done)
+        io_wait();
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return r->result;
+}
+#endif
+
+#define IO_REQUEST(operation, ...) \
+    io_request_t r = {.op = (operation), .fs = fs, .arg = {__VA_ARGS__}}
+
+static int io_mount(filesystem_t *fs, blockdevice_t *device, bool pending) {
+    IO_REQUEST(IO_MOUNT, {.p = device}, {.i = pending});
+    return io_submit(&r);
+}
+
+static int io_unmount(filesystem_t *fs) {
+    IO_REQUEST(IO_UNMOUNT, {.p = NULL});
+    return io_submit(&r);
+}
+
+static int io_format(filesystem_t *fs, blockdevice_t *device) {
+    IO_REQUEST(IO_FORMAT, {.p = device});
+    return io_submit(&r);
+}
+
+static int io_remove(filesystem_t *fs, const char *path) {
+    IO_REQUEST(IO_REMOVE, {.p = (void *)path});
+    return io_submit(&r);
+}
+
+static int io_rename(filesystem_t *fs, const char *oldpath, const char *newpath) {
+    IO_REQUEST(IO_RENAME, {.p = (void *)oldpath}, {.p = (void *)newpath});
+    return io_submit(&r);
+}
+
+static int io_mkdir(filesystem_t *fs, const char *path, mode_t mode) {
+    IO_REQUEST(IO_MKDIR, {.p = (void *)path}, {.i = mode});
+    return io_submit(&r);
+}
+
+static int io_rmdir(filesystem_t *fs, const char *path) {
+    IO_REQUEST(IO_RMDIR, {.p = (void *)path});
+    return io_submit(&r);
+}
+
+static int io_stat(filesystem_t *fs, const char *path, struct stat *st) {
+    IO_REQUEST(IO_STAT, {.p = (void *)path}, {.p = st});
+    return io_submit(&r);
+}
+
+static int io_file_open(filesystem_t *fs, fs_file_t *file, const char *path, int flags) {
+    IO_REQUEST(IO_FILE_OPEN, {.p = file}, {.p = (void *)path}, {.i = flags});
+    return io_submit(&r);
+}
+
+static int io_file_close(filesystem_t *fs, fs_file_t *file) {
+    IO_REQUEST(IO_FILE_CLOSE, {.p = file});
+    return io_submit(&r);
+}
+
+static ssize_t io_file_write(filesystem_t *fs, fs_file_t *file, const void *buffer, size_t size) {
+    IO_REQUEST(IO_FILE_WRITE, {.p = file}, {.p = (void *)buffer}, {.i = size});
+    return io_submit(&r);
+}
+
+static ssize_t io_file_read(filesystem_t *fs, fs_file_t *file, void *buffer, size_t size) {
+    IO_REQUEST(IO_FILE_READ, {.p = file}, {.p = buffer}, {.i = size});
+    return io_submit(&r);
+}
+
+static int io_file_sync(filesystem_t *fs, fs_file_t *file) {
+    IO_REQUEST(IO_FILE_SYNC, {.p = file});
+    return io_submit(&r);
+}
+
+static off_t io_file_seek(filesystem_t *fs, fs_file_t *file, off_t offset, int whence) {
+    IO_REQUEST(IO_FILE_SEEK, {.p = file}, {.i = offset}, {.i = whence});
+    return io_submit(&r);
+}
+
+static off_t io_file_tell(filesystem_t *fs, fs_file_t *file) {
+    IO_REQUEST(IO_FILE_TELL, {.p = file});
+    return io_submit(&r);
+}
+
+static off_t io_file_size(filesystem_t *fs, fs_file_t *file) {
+    IO_REQUEST(IO_FILE_SIZE, {.p = file});
+    return io_submit(&r);
+}
+
+static int io_file_truncate(filesystem_t *fs, fs_file_t *file, off_t length) {
+    IO_REQUEST(IO_FILE_TRUNCATE, {.p = file}, {.i = length});
+    return io_submit(&r);
+}
+
+static int io_dir_open(filesystem_t *fs, fs_dir_t *dir, const char *path) {
+    IO_REQUEST(IO_DIR_OPEN, {.p = dir}, {.p = (void *)path});
+    return io_submit(&r);
+}
+
+static int io_dir_close(filesystem_t *fs, fs_dir_t *dir) {
+    IO_REQUEST(IO_DIR_CLOSE, {.p = dir});
+    return io_submit(&r);
+}
+
+static int io_dir_read(filesystem_t *fs, fs_dir_t *dir, struct dirent *ent) {
+    IO_REQUEST(IO_DIR_READ, {.p = dir}, {.p = ent});
+    return io_submit(&r);
+}
+
+static int io_gc(filesystem_t *fs, uint32_t budget_us) {
+    IO_REQUEST(IO_GC, {.i = budget_us});
+    return io_submit(&r);
+}
+
+static ssize_t io_file_preadv(filesystem_t *fs, fs_file_t *file, const struct iovec *iov, int iovcnt, off_t offset) {
+    IO_REQUEST(IO_FILE_PREADV, {.p = file}, {.p = (void *)iov}, {.i = iovcnt}, {.i = offset});
+    return io_submit(&r);
+}
+
+static ssize_t io_file_pwritev(filesystem_t *fs, fs_file_t *file, const struct iovec *iov, int iovcnt, off_t offset) {
+    IO_REQUEST(IO_FILE_PWRITEV, {.p = file}, {.p = (void *)iov}, {.i = iovcnt}, {.i = offset});
+    return io_submit(&r);
+}
+
+static int io_file_extent(filesystem_t *fs, fs_file_t *file, off_t offset, size_t length, bd_size_t *addr) {
+    IO_REQUEST(IO_FILE_EXTENT, {.p = file}, {.i = offset}, {.i = length}, {.p = addr});
+    return io_submit(&r);
+}
+
+static ssize_t io_file_copy(filesystem_t *fs, fs_file_t *in, fs_file_t *out, size_t len, void *buffer, size_t buffer_size) {
+#if LIB_FREERTOS_KERNEL
+    if (io_current_class() == FS_IO_CLASS_BULK)
+        return -ENOTSUP;  // Copy in chunks, so that more urgent requests are served in between
+#endif
+    IO_REQUEST(IO_FILE_COPY, {.p = in}, {.p = out}, {.i = len}, {.p = buffer}, {.i = buffer_size});
+    return io_submit(&r);
+}
+
+static int io_sync(filesystem_t *fs, fs_file_t *const *files, size_t count) {
+    IO_REQUEST(IO_SYNC, {.p = (void *)files}, {.i = count});
+    return io_submit(&r);
+}
+
+static int io_file_allocate(filesystem_t *fs, fs_file_t *file, off_t offset, off_t length) {
+    IO_REQUEST(IO_FILE_ALLOCATE, {.p = file}, {.i = offset}, {.i = length});
+    return io_submit(&r);
+}
+
+/*
+ * A loopback device reads its image file through the VFS, whose lock the submitter holds while
+ * it waits for the service, so the service would wait for the submitter. Such a file system
+ * stays on the calling core, and only the accesses to its image file go through the service.
+ */
+static bool io_is_loopback(const blockdevice_t *device) {
+    return device != NULL && device->name != NULL && strcmp(device->name, "loopback") == 0;
+}
+
+int fs_io_service_attach(filesystem_t *fs, blockdevice_t *device) {
+    if (!service_started || fs == NULL || fs->file_open == io_file_open)
+        return 0;
+    if (io_is_loopback(device))
+        return -ENOTSUP;
+
+    io_attached_t *entry = NULL;
+    for (size_t i = 0; i < PICO_VFS_IO_SERVICE_MAX_FILESYSTEMS; i++) {
+        if (attached[i].fs == fs || (entry == NULL && attached[i].fs == NULL))
+            entry = &attached[i];
+    }
+    if (entry == NULL)
+        return -ENOSPC;  // Raise PICO_VFS_IO_SERVICE_MAX_FILESYSTEMS
+
+    entry->direct = *fs;
+    entry->fs = fs;
+#if LIB_FREERTOS_KERNEL
+    if (!io_launch_task(entry)) {
+        entry->fs = NULL;
+        return -ENOMEM;
+    }
+#endif
+    fs->mount = io_mount;
+    fs->unmount = io_unmount;
+    fs->format = io_format;
+    fs->remove = io_remove;
+    fs->rename = io_rename;
+    fs->mkdir = io_mkdir;
+    fs->rmdir = io_rmdir;
+    fs->stat = io_stat;
+    fs->file_close = io_file_close;
+    fs->file_write = io_file_write;
+    fs->file_read = io_file_read;
+    fs->file_sync = io_file_sync;
+    fs->file_seek = io_file_seek;
+    fs->file_tell = io_file_tell;
+    fs->file_size = io_file_size;
+    fs->file_truncate = io_file_truncate;
+    fs->dir_open = io_dir_open;
+    fs->dir_close = io_dir_close;
+    fs->dir_read = io_dir_read;
+    // Optional operations stay NULL if the file system does not provide them
+    fs->gc = entry->direct.gc ? io_gc : NULL;
+    fs->file_preadv = entry->direct.file_preadv ? io_file_preadv : NULL;
+    fs->file_pwritev = entry->direct.file_pwritev ? io_file_pwritev : NULL;
+    fs->file_extent = entry->direct.file_extent ? io_file_extent : NULL;
+    fs->file_copy = entry->direct.file_copy ? io_file_copy : NULL;
+    fs->sync = entry->direct.sync ? io_sync : NULL;
+    fs->file_allocate = entry->direct.file_allocate ? io_file_allocate : NULL;
+    fs->file_open = io_file_open;  // Marks the file system as attached
+    return 0;
+}
+
+void fs_io_service_detach(filesystem_t *fs) {
+    if (fs == NULL || fs->file_open != io_file_open)
+        return;
+    io_attached_t *entry = io_entry(fs);
+    *fs = entry->direct;
+    entry->fs = NULL;  // Under FreeRTOS the task stays, and serves the next file system in the slot
+}
+
+int fs_io_service_start_core1(void) {
+#if LIB_FREERTOS_KERNEL
+    errno = ENOTSUP;  // core1 is scheduled by FreeRTOS
+    return -1;
+#else
+    if (service_started) {
+        errno = EBUSY;
+        return -1;
+    }
+#if !PICO_ON_DEVICE
+    for (size_t i = 0; i < IO_SUBMITTERS; i++)
+        mutex_init(&rings[i].producer);
+#endif
+    if (!io_launch())
+        return -1;  // errno is set
+    service_started = true;
+    int err = vfs_io_service_attach_mounted();
+    if (err < 0) {
+        errno = -err;
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+int fs_io_service_start_freertos(uint32_t priority) {
+#if LIB_FREERTOS_KERNEL
+    if (service_started) {
+        errno = EBUSY;
+        return -1;
+    }
+    service_priority = priority;
+    service_started = true;
+    int err = vfs_io_service_attach_mounted();
+    if (err < 0) {
+        errno = -err;
+        return -1;
+    }
+    return 0;
+#else
+    (void)priority;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+void fs_io_service_set_class(fs_io_class_t io_class) {
+#if LIB_FREERTOS_KERNEL && configNUM_THREAD_LOCAL_STORAGE_POINTERS > PICO_VFS_IO_SERVICE_CLASS_TLS_INDEX
+    if (io_class > FS_IO_CLASS_BULK)
+        io_class = FS_IO_CLASS_NORMAL;
+    vTaskSetThreadLocalStoragePointer(NULL, PICO_VFS_IO_SERVICE_CLASS_TLS_INDEX, (void *)((uintptr_t)io_class + 1));
+#else
+    (void)io_class;  // Requests are served in arrival order
+#endif
+}
@@ -5,23 +5,105 @@
  */
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <pico/mutex.h>
+#include <pico/time.h>
 #include "lfs.h"
 #include "blockdevice/blockdevice.h"
 #include "filesystem/littlefs.h"
+#if LIB_FREERTOS_KERNEL
+#include <FreeRTOS.h>
+#include <semphr.h>
+#define LITTLEFS_FREERTOS_MUTEX    (configUSE_MUTEXES && configSUPPORT_STATIC_ALLOCATION)
+#else
+#define LITTLEFS_FREERTOS_MUTEX    0
+#endif
 
 
+#if PICO_VFS_LITTLEFS_FILE_CACHES > 32
+#error "PICO_VFS_LITTLEFS_FILE_CACHES must be 32 or less"
+#endif
+
+/*
+ * Context lock. Under FreeRTOS a FreeRTOS mutex is used, so that a task waiting for the lock
+ * lends its priority to the holder.
+ */
+#if LITTLEFS_FREERTOS_MUTEX
+typedef struct {
+    StaticSemaphore_t buffer;
+    SemaphoreHandle_t handle;
+} littlefs_mutex_t;
+
+static void _context_lock_init(littlefs_mutex_t *mutex) {
+    mutex->handle = xSemaphoreCreateMutexStatic(&mutex->buffer);
+}
+
+static void _context_lock(littlefs_mutex_t *mutex) {
+    xSemaphoreTake(mutex->handle, portMAX_DELAY);
+}
+
+static void _context_unlock(littlefs_mutex_t *mutex) {
+    xSemaphoreGive(mutex->handle);
+}
+#else
+typedef mutex_t littlefs_mutex_t;
+
+static void _context_lock_init(littlefs_mutex_t *mutex) {
+    mutex_init(mutex);
+}
+
+static void _context_lock(littlefs_mutex_t *mutex) {
+    mutex_enter_blocking(mutex);
+}
+
+static void _context_unlock(littlefs_mutex_t *mutex) {
+    mutex_exit(mutex);
+}
+#endif
+
 typedef struct {
    lfs_file_t file;
+   struct lfs_file_config config;
+   int cache;
 } littlefs_file_t;
 
 typedef struct {
     lfs_t littlefs;
     struct lfs_config config;
     int id;
-    mutex_t _mutex;
+    littlefs_mutex_t _mutex;
+    fs_object_pool_t file_pool;
+    fs_object_pool_t dir_pool;
+
+    // Cache buffers handed to littlefs, allocated at mount time and reused across mounts
+    uint8_t *read_buffer;
+    uint8_t *prog_buffer;
+    uint8_t *lookahead_buffer;
+    uint8_t *file_caches;
+    uint32_t file_caches_used;
+    lfs_size_t cache_size;
+    lfs_size_t lookahead_size;
+
+    // Maintenance state, allocated on the first gc call
+    uint32_t *used_map;       // Blocks in use, from the last traversal
+    uint32_t *erased_map;     // Free blocks erased ahead of use
+    lfs_block_t map_blocks;
+    bool gc_dirty;            // The file system changed since the last completed gc
+    bool used_stale;          // A program or erase happened since the last traversal
+    uint32_t scan_us;         // Duration of the last compaction and traversal
+    bool mounted;
+
+    bool sync_deferred;       // A group sync is in progress, device syncs wait for its end
+    bool sync_needed;         // littlefs asked for a device sync while it was deferred
 } filesystem_littlefs_context_t;
 
+#define CONTEXT_FROM_CONFIG(c)  ((filesystem_littlefs_context_t *)((uint8_t *)(c) - offsetof(filesystem_littlefs_context_t, config)))
+#define MAP_TEST(map, n)        ((map)[(n) / 32] & (1U << ((n) % 32)))
+#define MAP_SET(map, n)         ((map)[(n) / 32] |= (1U << ((n) % 32)))
+#define MAP_CLEAR(map, n)       ((map)[(n) / 32] &= ~(1U << ((n) % 32)))
+
 static const char FILESYSTEM_NAME[] = "littlefs";
 
 static int _error_remap(int err) {
@@ -106,6 +188,13 @@ static int littlefs_read(const struct lfs_config *c, lfs_block_t block,
 
 static int littlefs_erase(const struct lfs_config *c, lfs_block_t block) {
     blockdevice_t *device = c->context;
+    filesystem_littlefs_context_t *context = CONTEXT_FROM_CONFIG(c);
+    context->gc_dirty = true;
+    context->used_stale = true;
+    if (context->erased_map != NULL && block < context->map_blocks && MAP_TEST(context->erased_map, block)) {
+        MAP_CLEAR(context->erased_map, block);  // Already erased by gc()
+        return 0;
+    }
     return device->erase(device, block * c->block_size, c->block_size);
 }
 
@@ -113,14 +202,101 @@ static int littlefs_program(const struct lfs_config *c, lfs_block_t block,
                          lfs_off_t off, const void *buffer, lfs_size_t size)
 {
     blockdevice_t *device = c->context;
+    filesystem_littlefs_context_t *context = CONTEXT_FROM_CONFIG(c);
+    context->gc_dirty = true;
+    context->used_stale = true;
+    if (context->erased_map != NULL && block < context->map_blocks)
+        MAP_CLEAR(context->erased_map, block);
     return device->program(device, buffer, block * c->block_size + off, size);
 }
 
 static int littlefs_sync(const struct lfs_config *c) {
     blockdevice_t *device = c->context;
+    filesystem_littlefs_context_t *context = CONTEXT_FROM_CONFIG(c);
+    if (context->sync_deferred) {
+        context->sync_needed = true;
+        return 0;
+    }
     return device->sync(device);
 }
 
+static void _free_maps(filesystem_littlefs_context_t *context) {
+    free(context->used_map);
+    free(context->erased_map);
+    context->used_map = NULL;
+    context->erased_map = NULL;
+    context->map_blocks = 0;
+}
+
+static void _free_buffers(filesystem_littlefs_context_t *context) {
+    free(context->read_buffer);
+    free(context->prog_buffer);
+    free(context->lookahead_buffer);
+    free(context->file_caches);
+    context->read_buffer = NULL;
+    context->prog_buffer = NULL;
+    context->lookahead_buffer = NULL;
+    context->file_caches = NULL;
+    context->cache_size = 0;
+    context->lookahead_size = 0;
+}
+
+/*
+ * Allocate the read, program and lookahead caches and the per-file cache pool for the
+ * current geometry. The buffers are kept while the geometry stays the same, so repeated
+ * mounts and file opens do not touch the heap.
+ */
+static int _init_buffers(filesystem_littlefs_context_t *context) {
+    struct lfs_config *config = &context->config;
+    if (context->cache_size != config->cache_size
+        || context->lookahead_size != config->lookahead_size)
+    {
+        _free_buffers(context);
+        context->read_buffer = malloc(config->cache_size);
+        context->prog_buffer = malloc(config->cache_size);
+        context->lookahead_buffer = malloc(config->lookahead_size);
+        if (PICO_VFS_LITTLEFS_FILE_CACHES > 0)
+            context->file_caches = malloc((size_t)config->cache_size * PICO_VFS_LITTLEFS_FILE_CACHES);
+        if (context->read_buffer == NULL || context->prog_buffer == NULL || context->lookahead_buffer == NULL
+            || (PICO_VFS_LITTLEFS_FILE_CACHES > 0 && context->file_caches == NULL))
+        {
+            _free_buffers(context);
+            return -ENOMEM;
+        }
+        context->cache_size = config->cache_size;
+        context->lookahead_size = config->lookahead_size;
+    }
+    context->file_caches_used = 0;
+    context->gc_dirty = true;
+    context->used_stale = true;
+    if (context->map_blocks != config->block_count)
+        _free_maps(context);
+    else if (context->erased_map != NULL)
+        memset(context->erased_map, 0, sizeof(uint32_t) * ((context->map_blocks + 31) / 32));
+    config->read_buffer = context->read_buffer;
+    config->prog_buffer = context->prog_buffer;
+    config->lookahead_buffer = context->lookahead_buffer;
+    return 0;
+}
+
+static void *_acquire_file_cache(filesystem_littlefs_context_t *context, int *index) {
+    uint32_t available = ~context->file_caches_used;
+    if (PICO_VFS_LITTLEFS_FILE_CACHES < 32)
+        available &= (1U << PICO_VFS_LITTLEFS_FILE_CACHES) - 1;
+    if (available == 0) {
+        *index = -1;
+        return NULL;  // littlefs allocates the cache itself
+    }
+    *index = __builtin_ctz(available);
+    context->file_caches_used |= 1U << *index;
+    return context->file_caches + (size_t)*index * context->cache_size;
+}
+
+static void _release_file_cache(filesystem_littlefs_context_t *context, int index) {
+    if (index >= 0)
+        context->file_caches_used &= ~(1U << index);
+}
+
 static void _init_config(struct lfs_config *config, blockdevice_t *device) {
     int32_t block_cycles = config->block_cycles;
     lfs_size_t lookahead_size = config->lookahead_size;
@@ -140,75 +316,274 @@ static void _init_config(struct lfs_config *config, blockdevice_t *device) {
     config->context = device;
 }
 
+static int _mark_used_block(void *data, lfs_block_t block) {
+    filesystem_littlefs_context_t *context = data;
+    if (block < context->map_blocks)
+        MAP_SET(context->used_map, block);
+    return 0;
+}
+
+/*
+ * Rebuild used_map from a traversal of the mounted file system.
+ */
+static int _scan_used_blocks(filesystem_littlefs_context_t *context) {
+    lfs_block_t block_count = context->config.block_count;
+    size_t map_size = sizeof(uint32_t) * ((block_count + 31) / 32);
+    if (context->used_map == NULL) {
+        context->used_map = malloc(map_size);
+        context->erased_map = calloc(1, map_size);
+        if (context->used_map == NULL || context->erased_map == NULL) {
+            _free_maps(context);
+            return -ENOMEM;
+        }
+        context->map_blocks = block_count;
+    }
+    memset(context->used_map, 0, map_size);
+    int err = lfs_fs_traverse(&context->littlefs, _mark_used_block, context);
+    return _error_remap(err);
+}
+
+static lfs_block_t _next_allocation(filesystem_littlefs_context_t *context) {
+    lfs_t *lfs = &context->littlefs;
+#if LFS_VERSION >= 0x00020009
+    return (lfs->lookahead.start + lfs->lookahead.next) % context->map_blocks;
+#else
+    return (lfs->free.off + lfs->free.i) % context->map_blocks;
+#endif
+}
+
+#if PICO_VFS_LITTLEFS_ALLOC_HINT && LFS_VERSION >= 0x00020009
+/*
+ * Allocation hint
+ *
+ * At a clean unmount the free-block state of one lookahead window is stored in a custom
+ * attribute of the root directory. The next mount reads it, overwrites it with a dirty
+ * copy (so a hint is never trusted twice or after an unclean shutdown) and preloads the
+ * littlefs lookahead buffer, letting the first allocations proceed without a traversal.
+ */
+#define ALLOC_HINT_ATTR       0x70
+#define ALLOC_HINT_MAGIC      0x48415650  // "PVAH"
+#define ALLOC_HINT_RETRY      4
+
+typedef struct {
+    uint32_t magic;
+    uint32_t block_count;
+    uint32_t start;
+    uint32_t size;
+    uint32_t clean;
+    uint8_t lookahead[];
+} alloc_hint_t;
+
+static size_t _alloc_hint_size(filesystem_littlefs_context_t *context) {
+    return sizeof(alloc_hint_t) + context->config.lookahead_size;
+}
+
+static lfs_block_t _window_free_blocks(filesystem_littlefs_context_t *context, lfs_block_t start, lfs_block_t size) {
+    lfs_block_t free_blocks = 0;
+    for (lfs_block_t i = 0; i < size; i++) {
+        if (!MAP_TEST(context->used_map, (start + i) % context->map_blocks))
+            free_blocks++;
+    }
+    return free_blocks;
+}
+
+static void _fill_lookahead(filesystem_littlefs_context_t *context, alloc_hint_t *hint) {
+    memset(hint->lookahead, 0, context->config.lookahead_size);
+    for (lfs_block_t i = 0; i < hint->size; i++) {
+        if (MAP_TEST(context->used_map, (hint->start + i) % context->map_blocks))
+            hint->lookahead[i / 8] |= 1U << (i % 8);
+    }
+}
+
+static int _save_alloc_hint(filesystem_littlefs_context_t *context) {
+    size_t hint_size = _alloc_hint_size(context);
+    if (hint_size > LFS_ATTR_MAX)
+        return -EINVAL;
+    alloc_hint_t *hint = malloc(hint_size);
+    if (hint == NULL)
+        return -ENOMEM;
+
+    int err = _scan_used_blocks(context);
+    if (err) {
+        free(hint);
+        return err;
+    }
+    lfs_block_t block_count = context->map_blocks;
+    lfs_block_t size = 8 * context->config.lookahead_size;
+    if (size > block_count)
+        size = block_count;
+
+    // Pick the word-aligned window with the most free blocks
+    lfs_block_t best_start = 0;
+    lfs_block_t best_free = 0;
+    for (lfs_block_t start = 0; start < block_count; start += 32) {
+        lfs_block_t free_blocks = _window_free_blocks(context, start, size);
+        if (free_blocks > best_free) {
+            best_start = start;
+            best_free = free_blocks;
+        }
+    }
+
+    hint->magic = ALLOC_HINT_MAGIC;
+    hint->block_count = block_count;
+    hint->start = best_start;
+    hint->size = size;
+    hint->clean = 1;
+    _fill_lookahead(context, hint);
+
+    // Writing the attribute may itself allocate blocks; repeat until the window is stable
+    err = -EAGAIN;
+    for (size_t retry = 0; retry < ALLOC_HINT_RETRY && err == -EAGAIN; retry++) {
+        err = _error_remap(lfs_setattr(&context->littlefs, "/", ALLOC_HINT_ATTR, hint, hint_size));
+        if (err)
+            break;
+        err = _scan_used_blocks(context);
+        if (err)
+            break;
+        for (lfs_block_t i = 0; i < size; i++) {
+            if (MAP_TEST(context->used_map, (best_start + i) % block_count)
+                && !(hint->lookahead[i / 8] & (1U << (i % 8))))
+            {
+                _fill_lookahead(context, hint);
+                err = -EAGAIN;
+                break;
+            }
+        }
+    }
+    if (err)
+        lfs_removeattr(&context->littlefs, "/", ALLOC_HINT_ATTR);
+    free(hint);
+    return err;
+}
+
+static void _load_alloc_hint(filesystem_littlefs_context_t *context) {
+    size_t hint_size = _alloc_hint_size(context);
+    if (hint_size > LFS_ATTR_MAX)
+        return;
+    alloc_hint_t *hint = malloc(hint_size);
+    if (hint == NULL)
+        return;
+
+    lfs_t *lfs = &context->littlefs;
+    lfs_ssize_t res = lfs_getattr(lfs, "/", ALLOC_HINT_ATTR, hint, hint_size);
+    if (res != (lfs_ssize_t)hint_size || hint->magic != ALLOC_HINT_MAGIC) {
+        free(hint);
+        return;
+    }
+    // The window must lie in the mounted file system, whose size comes from its superblock
+    bool valid = hint->clean
+        && hint->block_count == lfs->block_count
+        && hint->block_count == context->config.block_count
+        && hint->start < hint->block_count
+        && hint->size > 0
+        && hint->size <= 8 * context->config.lookahead_size
+        && hint->size <= hint->block_count;
+
+    // Invalidate the stored hint before anything else is written
+    uint32_t clean = hint->clean;
+    hint->clean = 0;
+    int err = lfs_setattr(lfs, "/", ALLOC_HINT_ATTR, hint, hint_size);
+    hint->clean = clean;
+
+    // Preload only if littlefs has not scanned on its own while writing the attribute
+    if (valid && !err && lfs->lookahead.size == 0) {
+        lfs->lookahead.start = hint->start;
+        lfs->lookahead.size = hint->size;
+        lfs->lookahead.next = 0;
+        lfs->lookahead.ckpoint = lfs->block_count;
+        memcpy(lfs->lookahead.buffer, hint->lookahead, context->config.lookahead_size);
+    }
+    free(hint);
+}
+#endif
+
 static int format(filesystem_t *fs, blockdevice_t *device) {
     filesystem_littlefs_context_t *context = fs->context;
-    mutex_enter_blocking(&context->_mutex);
+    _context_lock(&context->_mutex);
 
     int err = device->init(device);
     if (err) {
-        mutex_exit(&context->_mutex);
+        _context_unlock(&context->_mutex);
         return err;
     }
 
     // erase super block
     err = device->erase(device, 0, device->program_size);
     if (err) {
-        mutex_exit(&context->_mutex);
+        _context_unlock(&context->_mutex);
         return err;
     }
 
     _init_config(&context->config, device);
+    err = _init_buffers(context);
+    if (err) {
+        _context_unlock(&context->_mutex);
+        return err;
+    }
     err = lfs_format(&context->littlefs, &context->config);
     if (err) {
-        mutex_exit(&context->_mutex);
+        _context_unlock(&context->_mutex);
         return _error_remap(err);
     }
 
-    mutex_exit(&context->_mutex);
+    _context_unlock(&context->_mutex);
     return 0;
 }
 
 static int mount(filesystem_t *fs, blockdevice_t *device, bool pending) {
     (void)pending;
     filesystem_littlefs_context_t *context = fs->context;
-    mutex_enter_blocking(&context->_mutex);
+    _context_lock(&context->_mutex);
 
     int err = device->init(device);
     if (err) {
-        mutex_exit(&context->_mutex);
+        _context_unlock(&context->_mutex);
         return err;
     }
 
     _init_config(&context->config, device);
+    err = _init_buffers(context);
+    if (err) {
+        _context_unlock(&context->_mutex);
+        return err;
+    }
     err = lfs_mount(&context->littlefs, &context->config);
     if (err) {
-        mutex_exit(&context->_mutex);
+        _context_unlock(&context->_mutex);
         return _error_remap(err);
     }
-    mutex_exit(&context->_mutex);
+#if PICO_VFS_LITTLEFS_ALLOC_HINT && LFS_VERSION >= 0x00020009
+    _load_alloc_hint(context);
+#endif
+    context->mounted = true;
+    _context_unlock(&context->_mutex);
     return 0;
 }
 
 static int unmount(filesystem_t *fs) {
     filesystem_littlefs_context_t *context = fs->context;
-    mutex_enter_blocking(&context->_mutex);
+    _context_lock(&context->_mutex);
 
     int res = 0;
+#if PICO_VFS_LITTLEFS_ALLOC_HINT && LFS_VERSION >= 0x00020009
+    _save_alloc_hint(context);
+#endif
     int err = lfs_unmount(&context->littlefs);
     if (err && !res) {
         res = _error_remap(err);
     }
+    context->mounted = false;
 
-    mutex_exit(&context->_mutex);
+    _context_unlock(&context->_mutex);
     return res;
 }
 
 static int file_remove(filesystem_t *fs, const char *filename) {
     filesystem_littlefs_context_t *context = fs->context;
 
-    mutex_enter_blocking(&context->_mutex);
+    _context_lock(&context->_mutex);
     int err = lfs_remove(&context->littlefs, filename);
-    mutex_exit(&context->_mutex);
+    _context_unlock(&context->_mutex);
 
     return _error_remap(err);
 }
@@ -216,9 +591,9 @@ static int file_remove(filesystem_t *fs, const char *filename) {
 static int file_rename(filesystem_t *fs, const char *oldpath, const char *newpath) {
     filesystem_littlefs_context_t *context = fs->context;
 
-    mutex_enter_blocking(&context->_mutex);
+    _context_lock(&context->_mutex);
     int err = lfs_rename(&context->littlefs, oldpath, newpath);
-    mutex_exit(&context->_mutex);
+    _context_unlock(&context->_mutex);
 
     return _error_remap(err);
 }
@@ -227,9 +602,9 @@ static int file_mkdir(filesystem_t *fs, const char *path, mode_t mode) {
     (void)mode;
     filesystem_littlefs_context_t *context = fs->context;
 
-    mutex_enter_blocking(&context->_mutex);
+    _context_lock(&context->_mutex);
     int err = lfs_mkdir(&context->littlefs, path);
-    mutex_exit(&context->_mutex);
+    _context_unlock(&context->_mutex);
 
     return _error_remap(err);
 }
@@ -237,9 +612,9 @@ static int file_mkdir(filesystem_t *fs, const char *path, mode_t mode) {
 static int file_rmdir(filesystem_t *fs, const char *path) {
     filesystem_littlefs_context_t *context = fs->context;
 
-    mutex_enter_blocking(&context->_mutex);
+    _context_lock(&context->_mutex);
     int err = lfs_remove(&context->littlefs, path);
-    mutex_exit(&context->_mutex);
+    _context_unlock(&context->_mutex);
 
     return _error_remap(err);
 }
@@ -248,9 +623,9 @@ static int file_stat(filesystem_t *fs, const char *path, struct stat *st) {
     filesystem_littlefs_context_t *context = fs->context;
     struct lfs_info info = {0};
 
-    mutex_enter_blocking(&context->_mutex);
+    _context_lock(&context->_mutex);
     int err = lfs_stat(&context->littlefs, path, &info);
-    mutex_exit(&context->_mutex);
+    _context_unlock(&context->_mutex);
 
     st->st_size = info.size;
     st->st_mode = _mode_remap(info.type);
@@ -260,19 +635,23 @@ static int file_stat(filesystem_t *fs, const char *path, struct stat *st) {
 static int file_open(filesystem_t *fs, fs_file_t *file, const char *path, int flags) {
     filesystem_littlefs_context_t *context = fs->context;
 
-    littlefs_file_t *f = file->context = calloc(1, sizeof(littlefs_file_t));
+    _context_lock(&context->_mutex);
+    littlefs_file_t *f = fs_object_pool_acquire(&context->file_pool);
     if (f == NULL) {
+        _context_unlock(&context->_mutex);
         fprintf(stderr, "file_open: Out of memory\n");
         return -ENOMEM;
     }
-
-    mutex_enter_blocking(&context->_mutex);
-    int err = lfs_file_open(&context->littlefs, &f->file, path, _flags_remap(flags));
-    mutex_exit(&context->_mutex);
-
+    f->config.buffer = _acquire_file_cache(context, &f->cache);
+    int err = lfs_file_opencfg(&context->littlefs, &f->file, path, _flags_remap(flags), &f->config);
     if (err) {
-        free(f);
+        _release_file_cache(context, f->cache);
+        fs_object_pool_release(&context->file_pool, f);
+        f = NULL;
     }
+    _context_unlock(&context->_mutex);
+
+    file->context = f;
     return _error_remap(err);
 }
 
@@ -280,11 +659,12 @@ static int file_close(filesystem_t *fs, fs_file_t *file) {
     filesystem_littlefs_context_t *context = fs->context;
     littlefs_file_t *f = file->context;
 
-    mutex_enter_blocking(&context->_mutex);
+    _context_lock(&context->_mutex);
     int err = lfs_file_close(&context->littlefs, &f->file);
-    mutex_exit(&context->_mutex);
+    _release_file_cache(context, f->cache);
+    fs_object_pool_release(&context->file_pool, f);
+    _context_unlock(&context->_mutex);
 
-    free(f);
     file->context = NULL;
     return _error_remap(err);
 }
@@ -293,9 +673,9 @@ static ssize_t file_read(filesystem_t *fs, fs_file_t *file, void *buffer, size_t
     filesystem_littlefs_context_t *context = fs->context;
     lfs_file_t *f = file->context;
 
-    mutex_enter_blocking(&context->_mutex);
+    _context_lock(&context->_mutex);
     lfs_ssize_t res = lfs_file_read(&context->littlefs, f, buffer, len);
-    mutex_exit(&context->_mutex);
+    _context_unlock(&context->_mutex);
 
     return _error_remap(res);
 }
@@ -304,20 +684,88 @@ static ssize_t file_write(filesystem_t *fs, fs_file_t *file, const void *buffer,
     filesystem_littlefs_context_t *context = fs->context;
     lfs_file_t *f = file->context;
 
-    mutex_enter_blocking(&context->_mutex);
+    _context_lock(&context->_mutex);
     lfs_ssize_t res = lfs_file_write(&context->littlefs, f, buffer, len);
-    mutex_exit(&context->_mutex);
+    _context_unlock(&context->_mutex);
 
     return _error_remap(res);
 }
 
+static ssize_t _file_transfer(filesystem_t *fs, fs_file_t *file, const struct iovec *iov, int iovcnt,
+                              off_t offset, bool write)
+{
+    filesystem_littlefs_context_t *context = fs->context;
+    lfs_file_t *f = file->context;
+
+    _context_lock(&context->_mutex);
+    lfs_soff_t position = lfs_file_tell(&context->littlefs, f);
+    if (offset >= 0) {
+        lfs_soff_t res = lfs_file_seek(&context->littlefs, f, offset, LFS_SEEK_SET);
+        if (res < 0) {
+            _context_unlock(&context->_mutex);
+            return _error_remap(res);
+        }
+    }
+    ssize_t total = 0;
+    lfs_ssize_t res = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (write)
+            res = lfs_file_write(&context->littlefs, f, iov[i].iov_base, iov[i].iov_len);
+        else
+            res = lfs_file_read(&context->littlefs, f, iov[i].iov_base, iov[i].iov_len);
+        if (res < 0)
+            break;
+        total += res;
+        if ((size_t)res < iov[i].iov_len)
+            break;
+    }
+    if (offset >= 0)
+        lfs_file_seek(&context->littlefs, f, position, LFS_SEEK_SET);
+    _context_unlock(&context->_mutex);
+
+    if (res < 0 && total == 0)
+        return _error_remap(res);
+    return total;
+}
+
+static ssize_t file_preadv(filesystem_t *fs, fs_file_t *file, const struct iovec *iov, int iovcnt, off_t offset) {
+    return _file_transfer(fs, file, iov, iovcnt, offset, false);
+}
+
+static ssize_t file_pwritev(filesystem_t *fs, fs_file_t *file, const struct iovec *iov, int iovcnt, off_t offset) {
+    return _file_transfer(fs, file, iov, iovcnt, offset, true);
+}
+
 static int file_sync(filesystem_t *fs, fs_file_t *file) {
     filesystem_littlefs_context_t *context = fs->context;
     lfs_file_t *f = file->context;
 
-    mutex_enter_blocking(&context->_mutex);
+    _context_lock(&context->_mutex);
     int err = lfs_file_sync(&context->littlefs, f);
-    mutex_exit(&context->_mutex);
+    _context_unlock(&context->_mutex);
+
+    return _error_remap(err);
+}
+
+static int sync_files(filesystem_t *fs, fs_file_t *const *files, size_t count) {
+    filesystem_littlefs_context_t *context = fs->context;
+
+    _context_lock(&context->_mutex);
+    context->sync_deferred = true;
+    context->sync_needed = false;
+    int err = 0;
+    for (size_t i = 0; i < count; i++) {
+        int res = lfs_file_sync(&context->littlefs, files[i]->context);
+        if (res < 0 && err == 0)
+            err = res;
+    }
+    context->sync_deferred = false;
+    if (context->sync_needed) {
+        int res = littlefs_sync(&context->config);  // One device sync for all the commits above
+        if (res < 0 && err == 0)
+            err = res;
+    }
+    _context_unlock(&context->_mutex);
 
     return _error_remap(err);
 }
@@ -326,9 +774,9 @@ static off_t file_seek(filesystem_t *fs, fs_file_t *file, off_t offset, int when
     filesystem_littlefs_context_t *context = fs->context;
     lfs_file_t *f = file->context;
 
-    mutex_enter_blocking(&context->_mutex);
+    _context_lock(&context->_mutex);
     off_t res = lfs_file_seek(&context->littlefs, f, offset, _whence_remap(whence));
-    mutex_exit(&context->_mutex);
+    _context_unlock(&context->_mutex);
 
     return _error_remap(res);
 }
@@ -337,9 +785,9 @@ static off_t file_tell(filesystem_t *fs, fs_file_t *file) {
     filesystem_littlefs_context_t *context = fs->context;
     lfs_file_t *f = file->context;
 
-    mutex_enter_blocking(&context->_mutex);
+    _context_lock(&context->_mutex);
     off_t res = lfs_file_tell(&context->littlefs, f);
-    mutex_exit(&context->_mutex);
+    _context_unlock(&context->_mutex);
 
     return _error_remap(res);
 }
@@ -348,9 +796,9 @@ static off_t file_size(filesystem_t *fs, fs_file_t *file) {
     filesystem_littlefs_context_t *context = fs->context;
     lfs_file_t *f = file->context;
 
-    mutex_enter_blocking(&context->_mutex);
+    _context_lock(&context->_mutex);
     off_t res = lfs_file_size(&context->littlefs, f);
-    mutex_exit(&context->_mutex);
+    _context_unlock(&context->_mutex);
 
     return _error_remap(res);
 }
@@ -359,30 +807,32 @@ static int file_truncate(filesystem_t *fs, fs_file_t *file, off_t length) {
     filesystem_littlefs_context_t *context = fs->context;
     lfs_file_t *f = file->context;
 
-    mutex_enter_blocking(&context->_mutex);
+    _context_lock(&context->_mutex);
     off_t res = lfs_file_truncate(&context->littlefs, f, length);
-    mutex_exit(&context->_mutex);
+    _context_unlock(&context->_mutex);
 
     return _error_remap(res);
 }
 
 static int dir_open(filesystem_t *fs, fs_dir_t *dir, const char *path) {
     filesystem_littlefs_context_t *context = fs->context;
-    lfs_dir_t *d = calloc(1, sizeof(lfs_dir_t));
+
+    _context_lock(&context->_mutex);
+    lfs_dir_t *d = fs_object_pool_acquire(&context->dir_pool);
     if (d == NULL) {
+        _context_unlock(&context->_mutex);
         fprintf(stderr, "dir_open: Out of memory\n");
         return -ENOMEM;
     }
-
-    mutex_enter_blocking(&context->_mutex);
     int err = lfs_dir_open(&context->littlefs, d, path);
-    mutex_exit(&context->_mutex);
+    if (err) {
+        fs_object_pool_release(&context->dir_pool, d);
+    }
+    _context_unlock(&context->_mutex);
 
     if (!err) {
         dir->context = d;
         dir->fd = -1;
-    } else {
-        free(d);
     }
     return _error_remap(err);
 }
@@ -391,11 +841,11 @@ static int dir_close(filesystem_t *fs, fs_dir_t *dir) {
     filesystem_littlefs_context_t *context = fs->context;
     lfs_dir_t *d = dir->context;
 
-    mutex_enter_blocking(&context->_mutex);
+    _context_lock(&context->_mutex);
     int err = lfs_dir_close(&context->littlefs, d);
-    mutex_exit(&context->_mutex);
+    fs_object_pool_release(&context->dir_pool, d);
+    _context_unlock(&context->_mutex);
 
-    free(d);
     return _error_remap(err);
 }
 
@@ -404,9 +854,9 @@ static int dir_read(filesystem_t *fs, fs_dir_t *dir, struct dirent *ent) {
     lfs_dir_t *d = dir->context;
     struct lfs_info info;
 
-    mutex_enter_blocking(&context->_mutex);
+    _context_lock(&context->_mutex);
     int res = lfs_dir_read(&context->littlefs, d, &info);
-    mutex_exit(&context->_mutex);
+    _context_unlock(&context->_mutex);
 
     if (res == 1) {
         ent->d_type = _type_remap(info.type);
@@ -418,6 +868,74 @@ static int dir_read(filesystem_t *fs, fs_dir_t *dir, struct dirent *ent) {
     return _error_remap(res);
 }
 
+/*
+ * Compact metadata with lfs_fs_gc(), then erase free blocks starting from the next
+ * allocation position of littlefs. Pre-erased blocks are remembered in erased_map and
+ * the erase callback skips them, so the erase cost moves out of write and close.
+ *
+ * The traversal that finds the free blocks is kept while a pass is pending, so the next
+ * call resumes erasing at once. It is repeated only after littlefs programmed or erased a
+ * block, and not started unless its last duration fits the budget.
+ */
+static int gc(filesystem_t *fs, uint32_t budget_us) {
+    filesystem_littlefs_context_t *context = fs->context;
+    blockdevice_t *device = context->config.context;
+    uint64_t start = time_us_64();
+
+    _context_lock(&context->_mutex);
+    if (!context->mounted || !context->gc_dirty) {  // Called without the VFS lock
+        _context_unlock(&context->_mutex);
+        return 0;
+    }
+    int err;
+    if (context->used_stale || context->used_map == NULL) {
+        if (time_us_64() - start + context->scan_us > budget_us) {
+            _context_unlock(&context->_mutex);
+            return 1;
+        }
+#if LFS_VERSION >= 0x00020008
+        err = lfs_fs_gc(&context->littlefs);
+        if (err) {
+            _context_unlock(&context->_mutex);
+            return _error_remap(err);
+        }
+#endif
+        err = _scan_used_blocks(context);
+        if (err) {
+            _context_unlock(&context->_mutex);
+            return err;
+        }
+        context->used_stale = false;
+        context->scan_us = (uint32_t)(time_us_64() - start);
+    }
+    lfs_block_t block_count = context->map_blocks;
+
+    bool pending = false;
+    uint32_t erase_us = 0;
+    lfs_block_t block = _next_allocation(context);
+    for (lfs_block_t n = 0; n < block_count; n++, block = (block + 1) % block_count) {
+        if (MAP_TEST(context->used_map, block) || MAP_TEST(context->erased_map, block))
+            continue;
+        uint64_t now = time_us_64();
+        if (now - start + erase_us > budget_us) {
+            pending = true;
+            break;
+        }
+        err = device->erase(device, block * context->config.block_size, context->config.block_size);
+        if (err) {
+            _context_unlock(&context->_mutex);
+            return err;
+        }
+        MAP_SET(context->erased_map, block);
+        uint32_t elapsed = (uint32_t)(time_us_64() - now);
+        if (elapsed > erase_us)
+            erase_us = elapsed;
+    }
+    context->gc_dirty = pending;
+    _context_unlock(&context->_mutex);
+    return pending ? 1 : 0;
+}
+
 filesystem_t *filesystem_littlefs_create(uint32_t block_cycles,
                                          lfs_size_t lookahead_size)
 {
@@ -449,6 +967,10 @@ filesystem_t *filesystem_littlefs_create(uint32_t block_cycles,
     fs->dir_open = dir_open;
     fs->dir_close = dir_close;
     fs->dir_read = dir_read;
+    fs->gc = gc;
+    fs->file_preadv = file_preadv;
+    fs->file_pwritev = file_pwritev;
+    fs->sync = sync_files;
 
     filesystem_littlefs_context_t *context = calloc(1, sizeof(filesystem_littlefs_context_t));
     if (context == NULL) {
@@ -459,12 +981,19 @@ filesystem_t *filesystem_littlefs_create(uint32_t block_cycles,
     context->id = -1;
     context->config.block_cycles = block_cycles;
     context->config.lookahead_size = lookahead_size;
-    mutex_init(&context->_mutex);
+    _context_lock_init(&context->_mutex);
+    fs_object_pool_init(&context->file_pool, sizeof(littlefs_file_t), PICO_VFS_MAX_OPEN_FILES);
+    fs_object_pool_init(&context->dir_pool, sizeof(lfs_dir_t), PICO_VFS_MAX_OPEN_DIRS);
     fs->context = context;
     return fs;
 }
 
 void filesystem_littlefs_free(filesystem_t *fs) {
+    filesystem_littlefs_context_t *context = fs->context;
+    fs_object_pool_deinit(&context->file_pool);
+    fs_object_pool_deinit(&context->dir_pool);
+    _free_buffers(context);
+    _free_maps(context);
     free(fs->context);
     fs->context = NULL;
     free(fs);
@@ -0,0 +1,344 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pico/mutex.h>
+#include <pico/time.h>
+#include "filesystem/logfile.h"
+#include "filesystem/vfs.h"
+
+#define LOG_STATE_MAGIC    0x53474F4C  // "LOGS"
+
+/*
+ * Kept in `name.state`. A preallocated file has its full size on the media, so the length of
+ * the data in the current generation is recorded here whenever it is known to be durable.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t generation;  // Current generation
+    uint32_t length;      // Bytes of the current generation that were synced
+} log_state_t;
+
+struct fs_logfile {
+    struct fs_logfile *next;
+    mutex_t mutex;
+    char *name;
+    size_t max_size;
+    uint32_t max_age_ms;
+    unsigned generations;
+    unsigned long generation;  // Number of the current file
+    unsigned long oldest;      // Oldest generation that may still exist
+    int fd;
+    size_t written;
+    size_t synced;             // Bytes of the current file recorded in the state file
+    int state_fd;
+    uint64_t opened_us;
+    int next_fd;               // Prepared file of the next generation, -1 if none
+    int retired_fd;            // Rotated out file that is still to be truncated and closed
+    size_t retired_size;
+};
+
+auto_init_mutex(logfiles_mutex);
+static fs_logfile_t *logfiles = NULL;
+
+
+static void generation_path(fs_logfile_t *log, unsigned long generation, char *path) {
+    snprintf(path, PATH_MAX, "%s.%lu", log->name, generation);
+}
+
+static int save_state(fs_logfile_t *log, size_t length) {
+    log_state_t state = {.magic = LOG_STATE_MAGIC, .generation = log->generation, .length = length};
+    if (pwrite(log->state_fd, &state, sizeof(state), 0) != sizeof(state))
+        return -1;
+    if (fsync(log->state_fd) != 0)
+        return -1;
+    log->synced = length;
+    return 0;
+}
+
+static int find_generations(fs_logfile_t *log, unsigned long *newest) {
+    const char *slash = strrchr(log->name, '/');
+    char dir_path[PATH_MAX];
+    size_t dir_length = slash == log->name ? 1 : (size_t)(slash - log->name);
+    if (dir_length >= sizeof(dir_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(dir_path, log->name, dir_length);
+    dir_path[dir_length] = '\0';
+    const char *base = slash + 1;
+    size_t base_length = strlen(base);
+
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL)
+        return -1;
+    *newest = 0;
+    log->oldest = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strncmp(ent->d_name, base, base_length) != 0 || ent->d_name[base_length] != '.')
+            continue;
+        const char *digits = ent->d_name + base_length + 1;
+        char *end;
+        if (!isdigit((unsigned char)*digits))
+            continue;
+        unsigned long generation = strtoul(digits, &end, 10);
+        if (*end != '\0' || generation == 0)
+            continue;
+        if (log->oldest == 0 || generation < log->oldest)
+            log->oldest = generation;
+        if (generation > *newest)
+            *newest = generation;
+    }
+    closedir(dir);
+    return 0;
+}
+
+static int create_generation(fs_logfile_t *log, unsigned long generation) {
+    char path[PATH_MAX];
+    generation_path(log, generation, path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    // Best effort: without preallocation the file grows as it is written
+    if (log->max_size > 0)
+        (void)posix_fallocate(fd, 0, (off_t)log->max_size);
+    return fd;
+}
+
+// Drops the unused preallocated part of the file that was rotated out. From then on the state
+// file points at the current file.
+static int retire(fs_logfile_t *log) {
+    int err = ftruncate(log->retired_fd, (off_t)log->retired_size);
+    if (close(log->retired_fd) != 0)
+        err = -1;
+    log->retired_fd = -1;
+    if (err == 0)
+        err = save_state(log, log->synced);
+    return err;
+}
+
+/*
+ * After a power failure the current generation has its preallocated size, and the next one may
+ * have been created already. The current one is cut back to the length that was synced, and the
+ * generations after it are removed.
+ */
+static int recover(fs_logfile_t *log, unsigned long *newest) {
+    log_state_t state;
+    if (pread(log->state_fd, &state, sizeof(state), 0) != sizeof(state) || state.magic != LOG_STATE_MAGIC)
+        return 0;  // New log, or written before the state file existed
+
+    char path[PATH_MAX];
+    for (; *newest > state.generation; (*newest)--) {
+        generation_path(log, *newest, path);
+        if (unlink(path) != 0 && errno != ENOENT)
+            return -1;
+    }
+    generation_path(log, state.generation, path);
+    struct stat finfo;
+    if (stat(path, &finfo) != 0 || finfo.st_size <= (off_t)state.length)
+        return 0;
+    int fd = open(path, O_WRONLY);
+    if (fd < 0)
+        return -1;
+    int err = ftruncate(fd, (off_t)state.length);
+    if (close(fd) != 0)
+        err = -1;
+    return err;
+}
+
+static int remove_expired(fs_logfile_t *log) {
+    char path[PATH_MAX];
+    while (log->oldest + log->generations <= log->generation) {
+        generation_path(log, log->oldest, path);
+        if (unlink(path) != 0 && errno != ENOENT)
+            return -1;
+        log->oldest++;
+    }
+    return 0;
+}
+
+static int prepare(fs_logfile_t *log) {
+    int err = 0;
+    if (log->retired_fd >= 0 && retire(log) != 0)
+        err = -1;
+    if (remove_expired(log) != 0)
+        err = -1;
+    if (log->next_fd < 0) {
+        log->next_fd = create_generation(log, log->generation + 1);
+        if (log->next_fd < 0)
+            err = -1;
+    }
+    return err;
+}
+
+static int rotate(fs_logfile_t *log) {
+    // Done inline only if fs_logfile_prepare_all() has not caught up
+    if ((log->next_fd < 0 || log->retired_fd >= 0) && prepare(log) != 0 && log->next_fd < 0)
+        return -1;
+
+    log->retired_fd = log->fd;
+    log->retired_size = log->written;
+    log->fd = log->next_fd;
+    log->next_fd = -1;
+    log->generation++;
+    log->written = 0;
+    log->synced = 0;
+    log->opened_us = time_us_64();
+    return 0;
+}
+
+static bool needs_rotation(fs_logfile_t *log, size_t size) {
+    if (log->written == 0)
+        return false;
+    if (log->max_size > 0 && log->written + size > log->max_size)
+        return true;
+    return log->max_age_ms > 0 && time_us_64() - log->opened_us >= (uint64_t)log->max_age_ms * 1000;
+}
+
+fs_logfile_t *fs_logfile_open(const char *name, size_t max_size, uint32_t max_age_ms, unsigned generations) {
+    if (name == NULL || name[0] != '/' || generations == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    fs_logfile_t *log = calloc(1, sizeof(fs_logfile_t));
+    if (log == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    log->name = strdup(name);
+    if (log->name == NULL) {
+        free(log);
+        errno = ENOMEM;
+        return NULL;
+    }
+    mutex_init(&log->mutex);
+    log->max_size = max_size;
+    log->max_age_ms = max_age_ms;
+    log->generations = generations;
+    log->next_fd = -1;
+    log->retired_fd = -1;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.state", log->name);
+    log->state_fd = open(path, O_RDWR | O_CREAT, 0644);
+    log->fd = -1;
+    unsigned long newest;
+    if (log->state_fd >= 0 && find_generations(log, &newest) == 0 && recover(log, &newest) == 0) {
+        log->generation = newest + 1;
+        if (log->oldest == 0 || log->oldest > log->generation)
+            log->oldest = log->generation;
+        if (save_state(log, 0) == 0)
+            log->fd = create_generation(log, log->generation);
+    }
+    if (log->fd < 0) {
+        int saved = errno;
+        if (log->state_fd >= 0)
+            close(log->state_fd);
+        free(log->name);
+        free(log);
+        errno = saved;
+        return NULL;
+    }
+    log->opened_us = time_us_64();
+    (void)prepare(log);  // Apply the generation limit to the files found
+
+    mutex_enter_blocking(&logfiles_mutex);
+    log->next = logfiles;
+    logfiles = log;
+    mutex_exit(&logfiles_mutex);
+    (void)fs_gc_register_idle(fs_logfile_prepare_all);  // Otherwise the preparation is done inline
+    return log;
+}
+
+ssize_t fs_logfile_write(fs_logfile_t *log, const void *data, size_t size) {
+    mutex_enter_blocking(&log->mutex);
+    ssize_t result = -1;
+    if (!needs_rotation(log, size) || rotate(log) == 0) {
+        result = write(log->fd, data, size);
+        if (result > 0)
+            log->written += (size_t)result;
+    }
+    mutex_exit(&log->mutex);
+    return result;
+}
+
+int fs_logfile_rotate(fs_logfile_t *log) {
+    mutex_enter_blocking(&log->mutex);
+    int err = rotate(log);
+    mutex_exit(&log->mutex);
+    return err;
+}
+
+int fs_logfile_sync(fs_logfile_t *log) {
+    mutex_enter_blocking(&log->mutex);
+    // The state file may only point past a rotated out file once that file is trimmed
+    int err = log->retired_fd >= 0 ? retire(log) : 0;
+    if (err == 0)
+        err = fsync(log->fd);
+    if (err == 0)
+        err = save_state(log, log->written);
+    mutex_exit(&log->mutex);
+    return err;
+}
+
+int fs_logfile_close(fs_logfile_t *log) {
+    mutex_enter_blocking(&logfiles_mutex);
+    for (fs_logfile_t **p = &logfiles; *p != NULL; p = &(*p)->next) {
+        if (*p == log) {
+            *p = log->next;
+            break;
+        }
+    }
+    mutex_exit(&logfiles_mutex);
+
+    mutex_enter_blocking(&log->mutex);
+    int err = 0;
+    if (log->retired_fd >= 0 && retire(log) != 0)
+        err = -1;
+    if (remove_expired(log) != 0)
+        err = -1;
+    if (ftruncate(log->fd, (off_t)log->written) != 0)
+        err = -1;
+    if (close(log->fd) != 0)
+        err = -1;
+    if (log->next_fd >= 0) {
+        char path[PATH_MAX];
+        generation_path(log, log->generation + 1, path);
+        close(log->next_fd);
+        unlink(path);
+    }
+    if (err == 0)
+        err = save_state(log, log->written);
+    if (close(log->state_fd) != 0)
+        err = -1;
+    mutex_exit(&log->mutex);
+
+    free(log->name);
+    free(log);
+    return err;
+}
+
+void fs_logfile_prepare_all(void) {
+    if (!mutex_try_enter(&logfiles_mutex, NULL))
+        return;
+    for (fs_logfile_t *log = logfiles; log != NULL; log = log->next) {
+        if (!mutex_try_enter(&log->mutex, NULL))
+            continue;  // Being written, try again at the next call
+        (void)prepare(log);
+        mutex_exit(&log->mutex);
+    }
+    mutex_exit(&logfiles_mutex);
+}
@@ -0,0 +1,1161 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pico/mutex.h>
+#include "filesystem/overlay.h"
+
+/*
+ * The upper file system holds the modified files, the directories leading to them, and two
+ * kinds of markers:
+ *
+ *   dir/.wh.name        whiteout, hides dir/name of the lower file system
+ *   dir/.wh..wh..opq    opaque marker, hides the whole lower dir
+ *
+ * Every upper path, markers included, is counted in a hash set of path hashes. A path whose
+ * hash is not in the set does not exist in the upper file system. A hash in the set is
+ * confirmed with a stat of the upper file system.
+ */
+#define WHITEOUT_PREFIX       ".wh."
+#define WHITEOUT_PREFIX_LEN   (sizeof(WHITEOUT_PREFIX) - 1)
+#define OPAQUE_NAME           ".wh..wh..opq"
+#define COPY_BUFFER_SIZE      1024
+#define INITIAL_SLOTS         32
+
+typedef struct {
+    uint32_t hash;
+    uint32_t count;            // Upper paths with this hash, 0 for a removed slot
+    bool used;
+} upper_slot_t;
+
+typedef struct {
+    bool found;
+    bool is_dir;
+    bool upper;                // Exists in the upper file system
+    bool lower;                // Exists in the lower file system and is not whited out
+    bool merged;               // Directory whose lower content is visible
+    bool whiteout;             // A whiteout hides the lower entry
+    struct stat st;
+} overlay_entry_t;
+
+typedef struct {
+    filesystem_t *layer;
+    fs_file_t file;
+} overlay_file_t;
+
+typedef struct {
+    char path[PATH_MAX];
+    fs_dir_t upper;
+    fs_dir_t lower;
+    bool has_upper;
+    bool has_lower;
+    bool reading_lower;
+} overlay_dir_t;
+
+typedef struct {
+    mutex_t _mutex;
+    filesystem_t *lower;
+    blockdevice_t *lower_device;
+    filesystem_t *upper;
+    blockdevice_t *upper_device;
+    upper_slot_t *slots;
+    size_t slot_count;         // Power of two
+    size_t slot_used;          // Slots in use, removed slots included
+    bool overflow;             // The set could not grow, every lookup asks the upper file system
+    fs_object_pool_t file_pool;
+    fs_object_pool_t dir_pool;
+} filesystem_overlay_context_t;
+
+static const char FILESYSTEM_NAME[] = "overlay";
+
+
+static uint32_t hash_path(const char *path) {
+    uint32_t hash = 2166136261U;
+    for (const char *p = path; *p != '\0'; p++) {
+        hash ^= (uint8_t)*p;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static void set_clear(filesystem_overlay_context_t *context) {
+    free(context->slots);
+    context->slots = NULL;
+    context->slot_count = 0;
+    context->slot_used = 0;
+    context->overflow = false;
+}
+
+static bool set_grow(filesystem_overlay_context_t *context) {
+    size_t live = 0;
+    for (size_t i = 0; i < context->slot_count; i++) {
+        if (context->slots[i].count > 0)
+            live++;
+    }
+    size_t slot_count = INITIAL_SLOTS;
+    while ((live + 1) * 2 > slot_count)
+        slot_count *= 2;
+    upper_slot_t *slots = calloc(slot_count, sizeof(upper_slot_t));
+    if (slots == NULL)
+        return false;
+
+    // Removed slots are dropped
+    for (size_t i = 0; i < context->slot_count; i++) {
+        upper_slot_t *slot = &context->slots[i];
+        if (slot->count == 0)
+            continue;
+        size_t j = slot->hash & (slot_count - 1);
+        while (slots[j].used)
+            j = (j + 1) & (slot_count - 1);
+        slots[j] = *slot;
+    }
+    free(context->slots);
+    context->slots = slots;
+    context->slot_count = slot_count;
+    context->slot_used = live;
+    return true;
+}
+
+static void set_add(filesystem_overlay_context_t *context, const char *path) {
+    if (context->overflow)
+        return;
+    if ((context->slot_used + 1) * 4 > context->slot_count * 3 && !set_grow(context)) {
+        // Without the set every path may be in the upper file system
+        set_clear(context);
+        context->overflow = true;
+        return;
+    }
+
+    uint32_t hash = hash_path(path);
+    size_t mask = context->slot_count - 1;
+    upper_slot_t *removed = NULL;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        upper_slot_t *slot = &context->slots[i];
+        if (slot->used && slot->hash == hash) {
+            slot->count++;
+            return;
+        }
+        if (slot->used && slot->count == 0 && removed == NULL)
+            removed = slot;
+        if (!slot->used) {
+            if (removed != NULL) {
+                slot = removed;
+            } else {
+                slot->used = true;
+                context->slot_used++;
+            }
+            slot->hash = hash;
+            slot->count = 1;
+            return;
+        }
+    }
+}
+
+static upper_slot_t *set_find(filesystem_overlay_context_t *context, const char *path) {
+    if (context->slots == NULL)
+        return NULL;
+    uint32_t hash = hash_path(path);
+    size_t mask = context->slot_count - 1;
+    for (size_t i = hash & mask; context->slots[i].used; i = (i + 1) & mask) {
+        if (context->slots[i].hash == hash)
+            return &context->slots[i];
+    }
+    return NULL;
+}
+
+static void set_remove(filesystem_overlay_context_t *context, const char *path) {
+    upper_slot_t *slot = set_find(context, path);
+    if (slot != NULL && slot->count > 0)
+        slot->count--;
+}
+
+static bool set_contains(filesystem_overlay_context_t *context, const char *path) {
+    if (context->overflow)
+        return true;
+    upper_slot_t *slot = set_find(context, path);
+    return slot != NULL && slot->count > 0;
+}
+
+static int path_join(char *buffer, const char *dir, const char *name) {
+    size_t dir_length = strcmp(dir, "/") == 0 ? 0 : strlen(dir);
+    size_t name_length = strlen(name);
+    if (dir_length + 1 + name_length >= PATH_MAX)
+        return -ENAMETOOLONG;
+    memmove(buffer, dir, dir_length);
+    buffer[dir_length] = '/';
+    memcpy(buffer + dir_length + 1, name, name_length + 1);
+    return 0;
+}
+
+// Canonical form "/a/b" without ".", ".." or empty components. The root is "/".
+static int normalize(char *buffer, const char *path) {
+    size_t length = 0;
+    while (true) {
+        while (*path == '/')
+            path++;
+        const char *name = path;
+        while (*path != '\0' && *path != '/')
+            path++;
+        size_t n = (size_t)(path - name);
+        if (n == 0)
+            break;
+        if (n == 1 && name[0] == '.')
+            continue;
+        if (n == 2 && name[0] == '.' && name[1] == '.') {
+            while (length > 0 && buffer[length - 1] != '/')
+                length--;
+            if (length > 0)
+                length--;
+            continue;
+        }
+        if (length + 1 + n >= PATH_MAX)
+            return -ENAMETOOLONG;
+        buffer[length++] = '/';
+        memcpy(buffer + length, name, n);
+        length += n;
+    }
+    if (length == 0)
+        buffer[length++] = '/';
+    buffer[length] = '\0';
+    return 0;
+}
+
+static void parent_path(char *buffer, const char *path) {
+    const char *slash = strrchr(path, '/');
+    size_t length = (size_t)(slash - path);
+    if (length == 0)
+        length = 1;
+    memcpy(buffer, path, length);
+    buffer[length] = '\0';
+}
+
+static int whiteout_path(char *buffer, const char *path) {
+    const char *slash = strrchr(path, '/');
+    size_t dir_length = (size_t)(slash - path) + 1;
+    size_t name_length = strlen(slash + 1);
+    if (dir_length + WHITEOUT_PREFIX_LEN + name_length >= PATH_MAX)
+        return -ENAMETOOLONG;
+    memcpy(buffer, path, dir_length);
+    memcpy(buffer + dir_length, WHITEOUT_PREFIX, WHITEOUT_PREFIX_LEN);
+    memcpy(buffer + dir_length + WHITEOUT_PREFIX_LEN, slash + 1, name_length + 1);
+    return 0;
+}
+
+static bool is_marker(const char *name) {
+    return strncmp(name, WHITEOUT_PREFIX, WHITEOUT_PREFIX_LEN) == 0;
+}
+
+static bool is_dot(const char *name) {
+    return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+}
+
+static int upper_stat(filesystem_overlay_context_t *context, const char *path, struct stat *st) {
+    if (!set_contains(context, path))
+        return -ENOENT;
+    struct stat tmp;
+    int err = context->upper->stat(context->upper, path, st != NULL ? st : &tmp);
+    return err == -ENOTDIR ? -ENOENT : err;
+}
+
+static bool upper_exists(filesystem_overlay_context_t *context, const char *path) {
+    return upper_stat(context, path, NULL) == 0;
+}
+
+static bool has_whiteout(filesystem_overlay_context_t *context, const char *path) {
+    char whiteout[PATH_MAX];
+    if (whiteout_path(whiteout, path) != 0)
+        return false;
+    return upper_exists(context, whiteout);
+}
+
+static bool has_opaque(filesystem_overlay_context_t *context, const char *path) {
+    char opaque[PATH_MAX];
+    if (path_join(opaque, path, OPAQUE_NAME) != 0)
+        return false;
+    return upper_exists(context, opaque);
+}
+
+/*
+ * Resolve a canonical path in the merged tree. The entry is filled in also when the path does
+ * not exist, so that the caller knows about a whiteout at the path.
+ */
+static int lookup(filesystem_overlay_context_t *context, const char *path, overlay_entry_t *entry) {
+    memset(entry, 0, sizeof(*entry));
+    if (strcmp(path, "/") == 0) {
+        entry->found = entry->is_dir = entry->upper = entry->lower = entry->merged = true;
+        entry->st.st_mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO;
+        return 0;
+    }
+
+    char prefix[PATH_MAX];
+    bool lower_visible = true;  // The lower entry of the prefix can still show through
+    const char *p = path;
+    while (true) {
+        const char *end = strchr(p + 1, '/');
+        bool last = end == NULL;
+        size_t length = last ? strlen(path) : (size_t)(end - path);
+        memcpy(prefix, path, length);
+        prefix[length] = '\0';
+
+        struct stat st;
+        int err = upper_stat(context, prefix, &st);
+        if (err != 0 && err != -ENOENT)
+            return err;
+        bool in_upper = err == 0;
+        bool whiteout = !in_upper && lower_visible && has_whiteout(context, prefix);
+        if (whiteout)
+            lower_visible = false;
+
+        if (last) {
+            entry->whiteout = whiteout;
+            if (lower_visible) {
+                struct stat lower_st;
+                err = context->lower->stat(context->lower, prefix, &lower_st);
+                if (err == 0) {
+                    entry->lower = true;
+                    if (!in_upper)
+                        entry->st = lower_st;
+                    entry->merged = S_ISDIR(lower_st.st_mode) &&
+                                    (!in_upper || (S_ISDIR(st.st_mode) && !has_opaque(context, prefix)));
+                } else if (!in_upper && err == -ENOTDIR) {
+                    return -ENOTDIR;
+                } else if (err != -ENOENT && err != -ENOTDIR) {
+                    return err;
+                }
+            }
+            if (in_upper) {
+                entry->upper = true;
+                entry->st = st;
+            }
+            entry->found = entry->upper || entry->lower;
+            entry->is_dir = entry->found && S_ISDIR(entry->st.st_mode);
+            return entry->found ? 0 : -ENOENT;
+        }
+
+        if (in_upper) {
+            if (!S_ISDIR(st.st_mode))
+                return -ENOTDIR;
+            if (lower_visible && has_opaque(context, prefix))
+                lower_visible = false;
+        } else if (!lower_visible) {
+            return -ENOENT;
+        }
+        p = end;
+    }
+}
+
+// Create the directories of the merged tree leading to path in the upper file system
+static int copy_up_dirs(filesystem_overlay_context_t *context, const char *path) {
+    char prefix[PATH_MAX];
+    const char *p = path;
+    while (strcmp(path, "/") != 0) {
+        const char *end = strchr(p + 1, '/');
+        size_t length = end == NULL ? strlen(path) : (size_t)(end - path);
+        memcpy(prefix, path, length);
+        prefix[length] = '\0';
+        if (!upper_exists(context, prefix)) {
+            int err = context->upper->mkdir(context->upper, prefix, 0777);
+            if (err != 0 && err != -EEXIST)
+                return err;
+            if (err == 0)
+                set_add(context, prefix);
+        }
+        if (end == NULL)
+            break;
+        p = end;
+    }
+    return 0;
+}
+
+static int create_marker(filesystem_overlay_context_t *context, const char *path) {
+    fs_file_t file = {.fd = -1};
+    int err = context->upper->file_open(context->upper, &file, path, O_WRONLY|O_CREAT);
+    if (err)
+        return err;
+    err = context->upper->file_close(context->upper, &file);
+    if (err == 0)
+        set_add(context, path);
+    return err;
+}
+
+static int remove_marker(filesystem_overlay_context_t *context, const char *path) {
+    int err = context->upper->remove(context->upper, path);
+    if (err == 0)
+        set_remove(context, path);
+    return err == -ENOENT ? 0 : err;
+}
+
+static int create_whiteout(filesystem_overlay_context_t *context, const char *path) {
+    char buffer[PATH_MAX];
+    parent_path(buffer, path);
+    int err = copy_up_dirs(context, buffer);
+    if (err)
+        return err;
+    err = whiteout_path(buffer, path);
+    if (err)
+        return err;
+    return create_marker(context, buffer);
+}
+
+static int clear_whiteout(filesystem_overlay_context_t *context, const char *path) {
+    char whiteout[PATH_MAX];
+    int err = whiteout_path(whiteout, path);
+    if (err)
+        return err;
+    return remove_marker(context, whiteout);
+}
+
+// Copy a lower file to the upper file system, with its content unless the open truncates it
+static int copy_up_file(filesystem_overlay_context_t *context, const char *path, bool content) {
+    char parent[PATH_MAX];
+    parent_path(parent, path);
+    int err = copy_up_dirs(context, parent);
+    if (err)
+        return err;
+
+    filesystem_t *lower = context->lower;
+    filesystem_t *upper = context->upper;
+    fs_file_t in = {.fd = -1};
+    fs_file_t out = {.fd = -1};
+    uint8_t *buffer = NULL;
+    if (content) {
+        buffer = malloc(COPY_BUFFER_SIZE);
+        if (buffer == NULL)
+            return -ENOMEM;
+        err = lower->file_open(lower, &in, path, O_RDONLY);
+        if (err) {
+            free(buffer);
+            return err;
+        }
+    }
+    err = upper->file_open(upper, &out, path, O_WRONLY|O_CREAT|O_TRUNC);
+    if (err == 0) {
+        set_add(context, path);
+        while (content) {
+            ssize_t length = lower->file_read(lower, &in, buffer, COPY_BUFFER_SIZE);
+            if (length <= 0) {
+                err = (int)length;
+                break;
+            }
+            ssize_t written = upper->file_write(upper, &out, buffer, (size_t)length);
+            if (written != length) {
+                err = written < 0 ? (int)written : -ENOSPC;
+                break;
+            }
+        }
+        int close_err = upper->file_close(upper, &out);
+        if (err == 0)
+            err = close_err;
+        if (err) {
+            // No partial copy may hide the lower file
+            upper->remove(upper, path);
+            set_remove(context, path);
+        }
+    }
+    if (content) {
+        lower->file_close(lower, &in);
+        free(buffer);
+    }
+    return err;
+}
+
+static int merged_open(filesystem_overlay_context_t *context, overlay_dir_t *d, const char *path,
+                       const overlay_entry_t *entry)
+{
+    strcpy(d->path, path);
+    d->has_upper = false;
+    d->has_lower = false;
+    d->reading_lower = false;
+    d->upper.fd = d->lower.fd = -1;
+    if (entry->upper) {
+        int err = context->upper->dir_open(context->upper, &d->upper, path);
+        if (err)
+            return err;
+        d->has_upper = true;
+    }
+    if (entry->merged) {
+        int err = context->lower->dir_open(context->lower, &d->lower, path);
+        if (err) {
+            if (d->has_upper)
+                context->upper->dir_close(context->upper, &d->upper);
+            d->has_upper = false;
+            return err;
+        }
+        d->has_lower = true;
+    }
+    return 0;
+}
+
+static void merged_close(filesystem_overlay_context_t *context, overlay_dir_t *d) {
+    if (d->has_upper)
+        context->upper->dir_close(context->upper, &d->upper);
+    if (d->has_lower)
+        context->lower->dir_close(context->lower, &d->lower);
+    d->has_upper = d->has_lower = false;
+}
+
+// Upper entries first, then the lower entries that are neither in the upper dir nor whited out
+static int merged_read(filesystem_overlay_context_t *context, overlay_dir_t *d, struct dirent *ent) {
+    while (d->has_upper && !d->reading_lower) {
+        int err = context->upper->dir_read(context->upper, &d->upper, ent);
+        if (err == -ENOENT) {
+            d->reading_lower = true;
+            break;
+        }
+        if (err)
+            return err;
+        if (!is_dot(ent->d_name) && !is_marker(ent->d_name))
+            return 0;
+    }
+    while (d->has_lower) {
+        int err = context->lower->dir_read(context->lower, &d->lower, ent);
+        if (err)
+            return err;
+        if (is_dot(ent->d_name))
+            continue;
+        char child[PATH_MAX];
+        if (path_join(child, d->path, ent->d_name) != 0)
+            continue;
+        if (d->has_upper && (upper_exists(context, child) || has_whiteout(context, child)))
+            continue;
+        return 0;
+    }
+    return -ENOENT;
+}
+
+static int merged_empty(filesystem_overlay_context_t *context, const char *path, const overlay_entry_t *entry) {
+    overlay_dir_t *d = malloc(sizeof(overlay_dir_t));
+    if (d == NULL)
+        return -ENOMEM;
+    int err = merged_open(context, d, path, entry);
+    if (err == 0) {
+        struct dirent ent;
+        err = merged_read(context, d, &ent);
+        if (err == 0)
+            err = -ENOTEMPTY;
+        else if (err == -ENOENT)
+            err = 0;
+        merged_close(context, d);
+    }
+    free(d);
+    return err;
+}
+
+// Remove the markers of an upper dir, which then holds no visible entry
+static int purge_markers(filesystem_overlay_context_t *context, const char *path) {
+    filesystem_t *upper = context->upper;
+    fs_dir_t dir = {.fd = -1};
+    struct dirent ent;
+    while (true) {
+        int err = upper->dir_open(upper, &dir, path);
+        if (err)
+            return err;
+        char marker[PATH_MAX] = {0};
+        while ((err = upper->dir_read(upper, &dir, &ent)) == 0) {
+            if (is_marker(ent.d_name)) {
+                err = path_join(marker, path, ent.d_name);
+                break;
+            }
+        }
+        upper->dir_close(upper, &dir);
+        if (err == -ENOENT)
+            return 0;
+        if (err)
+            return err;
+        // Reopened after each removal, as not every file system reads on past a removed entry
+        err = remove_marker(context, marker);
+        if (err)
+            return err;
+    }
+}
+
+static int remove_entry(filesystem_overlay_context_t *context, const char *path, const overlay_entry_t *entry) {
+    int err;
+    if (entry->lower) {
+        err = create_whiteout(context, path);
+        if (err)
+            return err;
+    }
+    if (entry->upper) {
+        if (entry->is_dir) {
+            err = purge_markers(context, path);
+            if (err == 0)
+                err = context->upper->rmdir(context->upper, path);
+        } else {
+            err = context->upper->remove(context->upper, path);
+        }
+        if (err)
+            return err;
+        set_remove(context, path);
+    }
+    return 0;
+}
+
+static int build_set(filesystem_overlay_context_t *context, char *path) {
+    filesystem_t *upper = context->upper;
+    fs_dir_t dir = {.fd = -1};
+    struct dirent ent;
+    int err = upper->dir_open(upper, &dir, path);
+    if (err)
+        return err;
+    size_t length = strlen(path);
+    while ((err = upper->dir_read(upper, &dir, &ent)) == 0) {
+        if (is_dot(ent.d_name))
+            continue;
+        err = path_join(path, path, ent.d_name);
+        if (err)
+            break;
+        set_add(context, path);
+        if (ent.d_type == DT_DIR)
+            err = build_set(context, path);
+        path[length > 1 ? length : 1] = '\0';
+        if (err)
+            break;
+    }
+    upper->dir_close(upper, &dir);
+    return err == -ENOENT ? 0 : err;
+}
+
+static int rebuild_set(filesystem_overlay_context_t *context) {
+    set_clear(context);
+    char path[PATH_MAX] = "/";
+    return build_set(context, path);
+}
+
+static int init_device(blockdevice_t *device) {
+    if (device == NULL || device->is_initialized)
+        return 0;
+    return device->init(device);
+}
+
+static int format(filesystem_t *fs, blockdevice_t *device) {
+    (void)device;
+    filesystem_overlay_context_t *context = fs->context;
+    int err = init_device(context->upper_device);
+    if (err)
+        return err;
+
+    // Only the upper file system is formatted, the lower content shows through again
+    mutex_enter_blocking(&context->_mutex);
+    err = context->upper->format(context->upper, context->upper_device);
+    set_clear(context);
+    mutex_exit(&context->_mutex);
+    return err;
+}
+
+static int mount(filesystem_t *fs, blockdevice_t *device, bool pending) {
+    (void)device;
+    filesystem_overlay_context_t *context = fs->context;
+    int err = init_device(context->lower_device);
+    if (err == 0)
+        err = init_device(context->upper_device);
+    if (err)
+        return err;
+
+    mutex_enter_blocking(&context->_mutex);
+    err = context->lower->mount(context->lower, context->lower_device, pending);
+    if (err == 0) {
+        err = context->upper->mount(context->upper, context->upper_device, pending);
+        if (err == 0) {
+            err = rebuild_set(context);
+            if (err)
+                context->upper->unmount(context->upper);
+        }
+        if (err)
+            context->lower->unmount(context->lower);
+    }
+    mutex_exit(&context->_mutex);
+    return err;
+}
+
+static int unmount(filesystem_t *fs) {
+    filesystem_overlay_context_t *context = fs->context;
+    mutex_enter_blocking(&context->_mutex);
+    set_clear(context);
+    int err = context->upper->unmount(context->upper);
+    int lower_err = context->lower->unmount(context->lower);
+    mutex_exit(&context->_mutex);
+    return err != 0 ? err : lower_err;
+}
+
+static int remove_path(filesystem_t *fs, const char *path, bool dir_only) {
+    filesystem_overlay_context_t *context = fs->context;
+    char buffer[PATH_MAX];
+    int err = normalize(buffer, path);
+    if (err)
+        return err;
+    if (strcmp(buffer, "/") == 0)
+        return -EBUSY;
+
+    mutex_enter_blocking(&context->_mutex);
+    overlay_entry_t entry;
+    err = lookup(context, buffer, &entry);
+    if (err == 0 && dir_only && !entry.is_dir)
+        err = -ENOTDIR;
+    if (err == 0 && entry.is_dir)
+        err = merged_empty(context, buffer, &entry);
+    if (err == 0)
+        err = remove_entry(context, buffer, &entry);
+    mutex_exit(&context->_mutex);
+    return err;
+}
+
+static int file_remove(filesystem_t *fs, const char *path) {
+    return remove_path(fs, path, false);
+}
+
+static int file_rmdir(filesystem_t *fs, const char *path) {
+    return remove_path(fs, path, true);
+}
+
+static int parent_dir(filesystem_overlay_context_t *context, const char *path, char *parent) {
+    parent_path(parent, path);
+    overlay_entry_t entry;
+    int err = lookup(context, parent, &entry);
+    if (err)
+        return err;
+    return entry.is_dir ? 0 : -ENOTDIR;
+}
+
+static int file_mkdir(filesystem_t *fs, const char *path, mode_t mode) {
+    filesystem_overlay_context_t *context = fs->context;
+    char buffer[PATH_MAX];
+    int err = normalize(buffer, path);
+    if (err)
+        return err;
+
+    mutex_enter_blocking(&context->_mutex);
+    overlay_entry_t entry;
+    char parent[PATH_MAX];
+    err = lookup(context, buffer, &entry);
+    if (err == 0)
+        err = -EEXIST;
+    else if (err == -ENOENT)
+        err = parent_dir(context, buffer, parent);
+    if (err == 0)
+        err = copy_up_dirs(context, parent);
+    if (err == 0)
+        err = context->upper->mkdir(context->upper, buffer, mode);
+    if (err == 0) {
+        set_add(context, buffer);
+        if (entry.whiteout) {
+            // The new directory must not show the content of the removed lower one
+            char opaque[PATH_MAX];
+            err = path_join(opaque, buffer, OPAQUE_NAME);
+            if (err == 0)
+                err = create_marker(context, opaque);
+            if (err == 0)
+                err = clear_whiteout(context, buffer);
+        }
+    }
+    mutex_exit(&context->_mutex);
+    return err;
+}
+
+static bool is_descendant(const char *path, const char *dir) {
+    size_t length = strlen(dir);
+    return strncmp(path, dir, length) == 0 && path[length] == '/';
+}
+
+static int rename_entry(filesystem_overlay_context_t *context, const char *oldpath, const char *newpath) {
+    overlay_entry_t old_entry;
+    overlay_entry_t new_entry;
+    char parent[PATH_MAX];
+    int err = lookup(context, oldpath, &old_entry);
+    if (err)
+        return err;
+    if (strcmp(oldpath, newpath) == 0)
+        return 0;
+    if (strcmp(oldpath, "/") == 0 || is_descendant(newpath, oldpath))
+        return -EINVAL;
+    err = lookup(context, newpath, &new_entry);
+    if (err == -ENOENT)
+        err = parent_dir(context, newpath, parent);
+    else if (err == 0 && old_entry.is_dir && !new_entry.is_dir)
+        err = -ENOTDIR;
+    else if (err == 0 && !old_entry.is_dir && new_entry.is_dir)
+        err = -EISDIR;
+    else if (err == 0 && new_entry.is_dir)
+        err = merged_empty(context, newpath, &new_entry);
+    if (err)
+        return err;
+    // The lower part of a merged directory cannot be moved
+    if (old_entry.is_dir && old_entry.merged)
+        return -EXDEV;
+
+    if (!old_entry.upper) {
+        err = copy_up_file(context, oldpath, true);
+        if (err)
+            return err;
+    }
+    if (new_entry.found) {
+        err = remove_entry(context, newpath, &new_entry);
+        if (err)
+            return err;
+    }
+    parent_path(parent, newpath);
+    err = copy_up_dirs(context, parent);
+    if (err == 0)
+        err = context->upper->rename(context->upper, oldpath, newpath);
+    if (err)
+        return err;
+
+    if (has_whiteout(context, newpath)) {
+        if (old_entry.is_dir) {
+            char opaque[PATH_MAX];
+            err = path_join(opaque, newpath, OPAQUE_NAME);
+            if (err == 0)
+                err = create_marker(context, opaque);
+        }
+        if (err == 0)
+            err = clear_whiteout(context, newpath);
+    }
+    if (err == 0 && old_entry.lower)
+        err = create_whiteout(context, oldpath);
+
+    if (old_entry.is_dir) {
+        int rebuild_err = rebuild_set(context);
+        if (err == 0)
+            err = rebuild_err;
+    } else {
+        set_remove(context, oldpath);
+        set_add(context, newpath);
+    }
+    return err;
+}
+
+static int file_rename(filesystem_t *fs, const char *oldpath, const char *newpath) {
+    filesystem_overlay_context_t *context = fs->context;
+    char old_buffer[PATH_MAX];
+    char new_buffer[PATH_MAX];
+    int err = normalize(old_buffer, oldpath);
+    if (err == 0)
+        err = normalize(new_buffer, newpath);
+    if (err)
+        return err;
+
+    mutex_enter_blocking(&context->_mutex);
+    err = rename_entry(context, old_buffer, new_buffer);
+    mutex_exit(&context->_mutex);
+    return err;
+}
+
+static int file_stat(filesystem_t *fs, const char *path, struct stat *st) {
+    filesystem_overlay_context_t *context = fs->context;
+    char buffer[PATH_MAX];
+    int err = normalize(buffer, path);
+    if (err)
+        return err;
+
+    mutex_enter_blocking(&context->_mutex);
+    overlay_entry_t entry;
+    err = lookup(context, buffer, &entry);
+    mutex_exit(&context->_mutex);
+    if (err)
+        return err;
+    *st = entry.st;
+    return 0;
+}
+
+static int open_entry(filesystem_overlay_context_t *context, overlay_file_t *f, const char *path, int flags) {
+    overlay_entry_t entry;
+    char parent[PATH_MAX];
+    int err = lookup(context, path, &entry);
+    if (err == -ENOENT && (flags & O_CREAT)) {
+        // A new file always goes to the upper file system
+        err = parent_dir(context, path, parent);
+        if (err == 0)
+            err = copy_up_dirs(context, parent);
+        if (err == 0)
+            err = context->upper->file_open(context->upper, &f->file, path, flags);
+        if (err)
+            return err;
+        set_add(context, path);
+        f->layer = context->upper;
+        err = entry.whiteout ? clear_whiteout(context, path) : 0;
+        if (err)
+            context->upper->file_close(context->upper, &f->file);
+        return err;
+    }
+    if (err)
+        return err;
+    if ((flags & O_CREAT) && (flags & O_EXCL))
+        return -EEXIST;
+    if (entry.is_dir)
+        return -EISDIR;
+
+    bool writable = (flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC);
+    if (!entry.upper && !writable) {
+        f->layer = context->lower;
+        return context->lower->file_open(context->lower, &f->file, path, flags);
+    }
+    if (!entry.upper) {
+        err = copy_up_file(context, path, !(flags & O_TRUNC));
+        if (err)
+            return err;
+    }
+    f->layer = context->upper;
+    return context->upper->file_open(context->upper, &f->file, path, flags & ~(O_CREAT|O_EXCL));
+}
+
+static int file_open(filesystem_t *fs, fs_file_t *file, const char *path, int flags) {
+    filesystem_overlay_context_t *context = fs->context;
+    char buffer[PATH_MAX];
+    int err = normalize(buffer, path);
+    if (err)
+        return err;
+
+    mutex_enter_blocking(&context->_mutex);
+    overlay_file_t *f = fs_object_pool_acquire(&context->file_pool);
+    if (f == NULL) {
+        mutex_exit(&context->_mutex);
+        fprintf(stderr, "file_open: Out of memory\n");
+        return -ENOMEM;
+    }
+    f->file.fd = file->fd;
+    err = open_entry(context, f, buffer, flags);
+    if (err)
+        fs_object_pool_release(&context->file_pool, f);
+    mutex_exit(&context->_mutex);
+    if (err)
+        return err;
+    file->context = f;
+    return 0;
+}
+
+static int file_close(filesystem_t *fs, fs_file_t *file) {
+    filesystem_overlay_context_t *context = fs->context;
+    overlay_file_t *f = file->context;
+    int err = f->layer->file_close(f->layer, &f->file);
+    mutex_enter_blocking(&context->_mutex);
+    fs_object_pool_release(&context->file_pool, f);
+    mutex_exit(&context->_mutex);
+    file->context = NULL;
+    return err;
+}
+
+static ssize_t file_write(filesystem_t *fs, fs_file_t *file, const void *buffer, size_t size) {
+    (void)fs;
+    overlay_file_t *f = file->context;
+    return f->layer->file_write(f->layer, &f->file, buffer, size);
+}
+
+static ssize_t file_read(filesystem_t *fs, fs_file_t *file, void *buffer, size_t size) {
+    (void)fs;
+    overlay_file_t *f = file->context;
+    return f->layer->file_read(f->layer, &f->file, buffer, size);
+}
+
+// Vectored I/O on a layer without it, as seek, transfer and seek back
+static ssize_t transfer_iov(overlay_file_t *f, const struct iovec *iov, int iovcnt, off_t offset, bool write) {
+    filesystem_t *layer = f->layer;
+    off_t position = 0;
+    if (offset >= 0) {
+        position = layer->file_tell(layer, &f->file);
+        if (position < 0)
+            return (ssize_t)position;
+        off_t res = layer->file_seek(layer, &f->file, offset, SEEK_SET);
+        if (res < 0)
+            return (ssize_t)res;
+    }
+    ssize_t total = 0;
+    ssize_t res = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (write)
+            res = layer->file_write(layer, &f->file, iov[i].iov_base, iov[i].iov_len);
+        else
+            res = layer->file_read(layer, &f->file, iov[i].iov_base, iov[i].iov_len);
+        if (res <= 0)
+            break;
+        total += res;
+        if ((size_t)res < iov[i].iov_len)
+            break;
+    }
+    if (offset >= 0)
+        layer->file_seek(layer, &f->file, position, SEEK_SET);
+    if (res < 0 && total == 0)
+        return res;
+    return total;
+}
+
+static ssize_t file_preadv(filesystem_t *fs, fs_file_t *file, const struct iovec *iov, int iovcnt, off_t offset) {
+    (void)fs;
+    overlay_file_t *f = file->context;
+    if (f->layer->file_preadv != NULL)
+        return f->layer->file_preadv(f->layer, &f->file, iov, iovcnt, offset);
+    return transfer_iov(f, iov, iovcnt, offset, false);
+}
+
+static ssize_t file_pwritev(filesystem_t *fs, fs_file_t *file, const struct iovec *iov, int iovcnt, off_t offset) {
+    (void)fs;
+    overlay_file_t *f = file->context;
+    if (f->layer->file_pwritev != NULL)
+        return f->layer->file_pwritev(f->layer, &f->file, iov, iovcnt, offset);
+    return transfer_iov(f, iov, iovcnt, offset, true);
+}
+
+static int file_sync(filesystem_t *fs, fs_file_t *file) {
+    (void)fs;
+    overlay_file_t *f = file->context;
+    return f->layer->file_sync(f->layer, &f->file);
+}
+
+static off_t file_seek(filesystem_t *fs, fs_file_t *file, off_t offset, int whence) {
+    (void)fs;
+    overlay_file_t *f = file->context;
+    return f->layer->file_seek(f->layer, &f->file, offset, whence);
+}
+
+static off_t file_tell(filesystem_t *fs, fs_file_t *file) {
+    (void)fs;
+    overlay_file_t *f = file->context;
+    return f->layer->file_tell(f->layer, &f->file);
+}
+
+static off_t file_size(filesystem_t *fs, fs_file_t *file) {
+    (void)fs;
+    overlay_file_t *f = file->context;
+    return f->layer->file_size(f->layer, &f->file);
+}
+
+static int file_truncate(filesystem_t *fs, fs_file_t *file, off_t length) {
+    (void)fs;
+    overlay_file_t *f = file->context;
+    return f->layer->file_truncate(f->layer, &f->file, length);
+}
+
+static int file_allocate(filesystem_t *fs, fs_file_t *file, off_t offset, off_t length) {
+    (void)fs;
+    overlay_file_t *f = file->context;
+    if (f->layer->file_allocate == NULL)
+        return -EOPNOTSUPP;
+    return f->layer->file_allocate(f->layer, &f->file, offset, length);
+}
+
+static int dir_open(filesystem_t *fs, fs_dir_t *dir, const char *path) {
+    filesystem_overlay_context_t *context = fs->context;
+    char buffer[PATH_MAX];
+    int err = normalize(buffer, path);
+    if (err)
+        return err;
+
+    mutex_enter_blocking(&context->_mutex);
+    overlay_entry_t entry;
+    err = lookup(context, buffer, &entry);
+    if (err == 0 && !entry.is_dir)
+        err = -ENOTDIR;
+    overlay_dir_t *d = NULL;
+    if (err == 0) {
+        d = fs_object_pool_acquire(&context->dir_pool);
+        if (d == NULL) {
+            fprintf(stderr, "dir_open: Out of memory\n");
+            err = -ENOMEM;
+        }
+    }
+    if (err == 0) {
+        err = merged_open(context, d, buffer, &entry);
+        if (err)
+            fs_object_pool_release(&context->dir_pool, d);
+    }
+    mutex_exit(&context->_mutex);
+    if (err)
+        return err;
+    dir->context = d;
+    dir->fd = -1;
+    return 0;
+}
+
+static int dir_close(filesystem_t *fs, fs_dir_t *dir) {
+    filesystem_overlay_context_t *context = fs->context;
+    mutex_enter_blocking(&context->_mutex);
+    merged_close(context, dir->context);
+    fs_object_pool_release(&context->dir_pool, dir->context);
+    mutex_exit(&context->_mutex);
+    dir->context = NULL;
+    return 0;
+}
+
+static int dir_read(filesystem_t *fs, fs_dir_t *dir, struct dirent *ent) {
+    filesystem_overlay_context_t *context = fs->context;
+    mutex_enter_blocking(&context->_mutex);
+    int err = merged_read(context, dir->context, ent);
+    mutex_exit(&context->_mutex);
+    return err;
+}
+
+static int gc(filesystem_t *fs, uint32_t budget_us) {
+    filesystem_overlay_context_t *context = fs->context;
+    if (context->upper->gc == NULL)
+        return 0;
+    return context->upper->gc(context->upper, budget_us);
+}
+
+filesystem_t *filesystem_overlay_create(filesystem_t *lower, blockdevice_t *lower_device,
+                                        filesystem_t *upper, blockdevice_t *upper_device)
+{
+    filesystem_t *fs = calloc(1, sizeof(filesystem_t));
+    if (fs == NULL) {
+        fprintf(stderr, "filesystem_overlay_create: Out of memory\n");
+        return NULL;
+    }
+
+    fs->type = FILESYSTEM_TYPE_OVERLAY;
+    fs->name = FILESYSTEM_NAME;
+    fs->mount = mount;
+    fs->unmount = unmount;
+    fs->format = format;
+    fs->remove = file_remove;
+    fs->rename = file_rename;
+    fs->mkdir = file_mkdir;
+    fs->rmdir = file_rmdir;
+    fs->stat = file_stat;
+    fs->file_open = file_open;
+    fs->file_close = file_close;
+    fs->file_write = file_write;
+    fs->file_read = file_read;
+    fs->file_sync = file_sync;
+    fs->file_seek = file_seek;
+    fs->file_tell = file_tell;
+    fs->file_size = file_size;
+    fs->file_truncate = file_truncate;
+    fs->dir_open = dir_open;
+    fs->dir_close = dir_close;
+    fs->dir_read = dir_read;
+    fs->gc = gc;
+    fs->file_preadv = file_preadv;
+    fs->file_pwritev = file_pwritev;
+    fs->file_allocate = file_allocate;
+
+    filesystem_overlay_context_t *context = calloc(1, sizeof(filesystem_overlay_context_t));
+    if (context == NULL) {
+        fprintf(stderr, "filesystem_overlay_create: Out of memory\n");
+        free(fs);
+        return NULL;
+    }
+    mutex_init(&context->_mutex);
+    context->lower = lower;
+    context->lower_device = lower_device;
+    context->upper = upper;
+    context->upper_device = upper_device;
+    fs_object_pool_init(&context->file_pool, sizeof(overlay_file_t), PICO_VFS_MAX_OPEN_FILES);
+    fs_object_pool_init(&context->dir_pool, sizeof(overlay_dir_t), PICO_VFS_MAX_OPEN_DIRS);
+    fs->context = context;
+    return fs;
+}
+
+void filesystem_overlay_free(filesystem_t *fs) {
+    filesystem_overlay_context_t *context = fs->context;
+    set_clear(context);
+    fs_object_pool_deinit(&context->file_pool);
+    fs_object_pool_deinit(&context->dir_pool);
+    free(fs->context);
+    fs->context = NULL;
+    free(fs);
+}
@@ -0,0 +1,568 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pico/mutex.h>
+#include "filesystem/romfs.h"
+#include "storage/crc32.h"
+
+/*
+ * Image layout, little endian, as written by tools/mkromfs.py:
+ *
+ *   header | entries[entry_count] | names | file data
+ *
+ * Entry 0 is the root directory. The entries of a directory are consecutive and sorted by
+ * name in byte order. The data of each file is contiguous.
+ */
+#define ROMFS_MAGIC       0x53464d52  // "RMFS"
+#define ROMFS_VERSION     1
+#define ROMFS_TYPE_FILE   0
+#define ROMFS_TYPE_DIR    1
+#define ROMFS_NAME_MAX    255
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint32_t entry_count;
+    uint32_t names_size;
+    uint32_t image_size;
+    uint32_t crc;          // CRC-32 of the entries and the names
+} romfs_header_t;
+
+typedef struct {
+    uint32_t name;         // Offset in the names
+    uint16_t name_length;
+    uint16_t type;
+    uint32_t parent;
+    uint32_t offset;       // File: offset of the data in the image. Directory: first entry
+    uint32_t size;         // File: size in bytes. Directory: number of entries
+} romfs_entry_t;
+
+typedef struct {
+    uint32_t offset;
+    uint32_t size;
+    off_t position;
+} romfs_file_t;
+
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+    uint32_t position;
+} romfs_dir_t;
+
+typedef struct {
+    mutex_t _mutex;
+    blockdevice_t *device;
+    const uint8_t *image;      // The image in place on a memory mapped device, otherwise NULL
+    uint8_t *table;            // Entries and names loaded into RAM when not mapped
+    uint8_t *buffer;           // One read unit, for reads not aligned to the device
+    const romfs_entry_t *entries;
+    const char *names;
+    uint32_t entry_count;
+    fs_object_pool_t file_pool;
+    fs_object_pool_t dir_pool;
+} filesystem_romfs_context_t;
+
+static const char FILESYSTEM_NAME[] = "romfs";
+
+
+static int read_image(filesystem_romfs_context_t *context, uint32_t addr, void *buffer, size_t length) {
+    if (context->image != NULL) {
+        memcpy(buffer, context->image + addr, length);
+        return 0;
+    }
+
+    blockdevice_t *device = context->device;
+    size_t unit = device->read_size;
+    uint8_t *p = buffer;
+    while (length > 0) {
+        size_t skip = addr % unit;
+        size_t n;
+        if (skip == 0 && length >= unit) {
+            n = length - length % unit;
+            if (device->read(device, p, addr, n) != BD_ERROR_OK)
+                return -EIO;
+        } else {
+            if (device->read(device, context->buffer, addr - skip, unit) != BD_ERROR_OK)
+                return -EIO;
+            n = unit - skip < length ? unit - skip : length;
+            memcpy(p, context->buffer + skip, n);
+        }
+        p += n;
+        addr += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static int compare_name(filesystem_romfs_context_t *context, const romfs_entry_t *entry,
+                        const char *name, size_t length)
+{
+    size_t n = entry->name_length < length ? entry->name_length : length;
+    int res = memcmp(context->names + entry->name, name, n);
+    if (res != 0)
+        return res;
+    return (int)entry->name_length - (int)length;
+}
+
+static int lookup(filesystem_romfs_context_t *context, const char *path, const romfs_entry_t **result) {
+    const romfs_entry_t *entry = &context->entries[0];
+    while (true) {
+        while (*path == '/')
+            path++;
+        const char *name = path;
+        while (*path != '\0' && *path != '/')
+            path++;
+        size_t length = (size_t)(path - name);
+        if (length == 0)
+            break;
+        if (entry->type != ROMFS_TYPE_DIR)
+            return -ENOTDIR;
+        if (length == 1 && name[0] == '.')
+            continue;
+        if (length == 2 && name[0] == '.' && name[1] == '.') {
+            entry = &context->entries[entry->parent];
+            continue;
+        }
+
+        // The entries of a directory are sorted by name
+        uint32_t low = entry->offset;
+        uint32_t high = entry->offset + entry->size;
+        const romfs_entry_t *found = NULL;
+        while (low < high) {
+            uint32_t middle = low + (high - low) / 2;
+            int res = compare_name(context, &context->entries[middle], name, length);
+            if (res == 0) {
+                found = &context->entries[middle];
+                break;
+            }
+            if (res < 0)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        if (found == NULL)
+            return -ENOENT;
+        entry = found;
+    }
+    *result = entry;
+    return 0;
+}
+
+// Checks that every entry refers to data inside the image, so lookups need no bounds checks
+static bool valid_table(filesystem_romfs_context_t *context, const romfs_header_t *header) {
+    const romfs_entry_t *entries = context->entries;
+    if (entries[0].type != ROMFS_TYPE_DIR)
+        return false;
+    for (uint32_t i = 0; i < header->entry_count; i++) {
+        const romfs_entry_t *entry = &entries[i];
+        if ((uint64_t)entry->name + entry->name_length > header->names_size ||
+            entry->name_length > ROMFS_NAME_MAX || entry->parent >= header->entry_count)
+        {
+            return false;
+        }
+        uint64_t end = (uint64_t)entry->offset + entry->size;
+        if (entry->type == ROMFS_TYPE_DIR) {
+            if (end > header->entry_count || (entry->size > 0 && entry->offset <= i))
+                return false;
+        } else if (entry->type != ROMFS_TYPE_FILE || end > header->image_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int format(filesystem_t *fs, blockdevice_t *device) {
+    (void)fs;
+    (void)device;
+    return -EROFS;
+}
+
+static int unmount(filesystem_t *fs);
+
+static int mount(filesystem_t *fs, blockdevice_t *device, bool pending) {
+    (void)pending;
+    filesystem_romfs_context_t *context = fs->context;
+    if (context->device != NULL)
+        unmount(fs);
+
+    mutex_enter_blocking(&context->_mutex);
+    context->device = device;
+    bd_size_t device_size = device->size(device);
+    context->image = device->map != NULL ? device->map(device, 0, device_size) : NULL;
+    if (context->image == NULL) {
+        context->buffer = malloc(device->read_size);
+        if (context->buffer == NULL) {
+            context->device = NULL;
+            mutex_exit(&context->_mutex);
+            return -ENOMEM;
+        }
+    }
+
+    romfs_header_t header;
+    int err = read_image(context, 0, &header, sizeof(header));
+    if (err == 0 && (header.magic != ROMFS_MAGIC || header.version != ROMFS_VERSION ||
+                     header.header_size < sizeof(header) || header.entry_count == 0 ||
+                     header.image_size > device_size))
+    {
+        err = -EINVAL;
+    }
+    uint64_t table_size = (uint64_t)header.entry_count * sizeof(romfs_entry_t) + header.names_size;
+    if (err == 0 && header.header_size + table_size > header.image_size)
+        err = -EINVAL;
+
+    const uint8_t *table = NULL;
+    if (err == 0 && context->image != NULL) {
+        table = context->image + header.header_size;
+    } else if (err == 0) {
+        context->table = malloc((size_t)table_size);
+        if (context->table == NULL)
+            err = -ENOMEM;
+        else
+            err = read_image(context, header.header_size, context->table, (size_t)table_size);
+        table = context->table;
+    }
+    if (err == 0 && storage_crc32(0, table, (size_t)table_size) != header.crc)
+        err = -EILSEQ;
+    if (err == 0) {
+        context->entries = (const romfs_entry_t *)table;
+        context->names = (const char *)table + header.entry_count * sizeof(romfs_entry_t);
+        context->entry_count = header.entry_count;
+        if (!valid_table(context, &header))
+            err = -EILSEQ;
+    }
+    mutex_exit(&context->_mutex);
+
+    if (err)
+        unmount(fs);
+    return err;
+}
+
+static int unmount(filesystem_t *fs) {
+    filesystem_romfs_context_t *context = fs->context;
+    mutex_enter_blocking(&context->_mutex);
+    free(context->table);
+    free(context->buffer);
+    context->table = NULL;
+    context->buffer = NULL;
+    context->image = NULL;
+    context->entries = NULL;
+    context->names = NULL;
+    context->entry_count = 0;
+    context->device = NULL;
+    mutex_exit(&context->_mutex);
+    return 0;
+}
+
+static int file_remove(filesystem_t *fs, const char *path) {
+    (void)fs;
+    (void)path;
+    return -EROFS;
+}
+
+static int file_rename(filesystem_t *fs, const char *oldpath, const char *newpath) {
+    (void)fs;
+    (void)oldpath;
+    (void)newpath;
+    return -EROFS;
+}
+
+static int file_mkdir(filesystem_t *fs, const char *path, mode_t mode) {
+    (void)fs;
+    (void)path;
+    (void)mode;
+    return -EROFS;
+}
+
+static int file_rmdir(filesystem_t *fs, const char *path) {
+    (void)fs;
+    (void)path;
+    return -EROFS;
+}
+
+static int file_stat(filesystem_t *fs, const char *path, struct stat *st) {
+    filesystem_romfs_context_t *context = fs->context;
+    const romfs_entry_t *entry;
+    int err = lookup(context, path, &entry);
+    if (err)
+        return err;
+
+    if (entry->type == ROMFS_TYPE_DIR) {
+        st->st_size = 0;
+        st->st_mode = S_IFDIR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+    } else {
+        st->st_size = entry->size;
+        st->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+    }
+    return 0;
+}
+
+static int file_open(filesystem_t *fs, fs_file_t *file, const char *path, int flags) {
+    filesystem_romfs_context_t *context = fs->context;
+    const romfs_entry_t *entry;
+    int err = lookup(context, path, &entry);
+    if (err == -ENOENT && (flags & O_CREAT))
+        return -EROFS;
+    if (err)
+        return err;
+    if ((flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC))
+        return -EROFS;
+    if (entry->type == ROMFS_TYPE_DIR)
+        return -EISDIR;
+
+    mutex_enter_blocking(&context->_mutex);
+    romfs_file_t *f = fs_object_pool_acquire(&context->file_pool);
+    mutex_exit(&context->_mutex);
+    if (f == NULL) {
+        fprintf(stderr, "file_open: Out of memory\n");
+        return -ENOMEM;
+    }
+    f->offset = entry->offset;
+    f->size = entry->size;
+    f->position = 0;
+    file->context = f;
+    return 0;
+}
+
+static int file_close(filesystem_t *fs, fs_file_t *file) {
+    filesystem_romfs_context_t *context = fs->context;
+    mutex_enter_blocking(&context->_mutex);
+    fs_object_pool_release(&context->file_pool, file->context);
+    mutex_exit(&context->_mutex);
+    file->context = NULL;
+    return 0;
+}
+
+static ssize_t file_write(filesystem_t *fs, fs_file_t *file, const void *buffer, size_t size) {
+    (void)fs;
+    (void)file;
+    (void)buffer;
+    (void)size;
+    return -EBADF;
+}
+
+static ssize_t read_at(filesystem_romfs_context_t *context, romfs_file_t *f, off_t offset, void *buffer, size_t size) {
+    if (offset >= (off_t)f->size)
+        return 0;
+    if ((off_t)size > (off_t)f->size - offset)
+        size = (size_t)(f->size - offset);
+    int err = read_image(context, f->offset + (uint32_t)offset, buffer, size);
+    if (err)
+        return err;
+    return (ssize_t)size;
+}
+
+static ssize_t file_read(filesystem_t *fs, fs_file_t *file, void *buffer, size_t size) {
+    filesystem_romfs_context_t *context = fs->context;
+    romfs_file_t *f = file->context;
+
+    mutex_enter_blocking(&context->_mutex);
+    ssize_t res = read_at(context, f, f->position, buffer, size);
+    if (res > 0)
+        f->position += res;
+    mutex_exit(&context->_mutex);
+    return res;
+}
+
+static ssize_t file_preadv(filesystem_t *fs, fs_file_t *file, const struct iovec *iov, int iovcnt, off_t offset) {
+    filesystem_romfs_context_t *context = fs->context;
+    romfs_file_t *f = file->context;
+
+    mutex_enter_blocking(&context->_mutex);
+    off_t position = offset >= 0 ? offset : f->position;
+    ssize_t total = 0;
+    ssize_t res = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        res = read_at(context, f, position, iov[i].iov_base, iov[i].iov_len);
+        if (res <= 0)
+            break;
+        total += res;
+        position += res;
+    }
+    if (offset < 0)
+        f->position = position;
+    mutex_exit(&context->_mutex);
+
+    if (res < 0 && total == 0)
+        return res;
+    return total;
+}
+
+static ssize_t file_pwritev(filesystem_t *fs, fs_file_t *file, const struct iovec *iov, int iovcnt, off_t offset) {
+    (void)fs;
+    (void)file;
+    (void)iov;
+    (void)iovcnt;
+    (void)offset;
+    return -EBADF;
+}
+
+static int file_sync(filesystem_t *fs, fs_file_t *file) {
+    (void)fs;
+    (void)file;
+    return 0;
+}
+
+static off_t file_seek(filesystem_t *fs, fs_file_t *file, off_t offset, int whence) {
+    (void)fs;
+    romfs_file_t *f = file->context;
+    off_t position;
+    switch (whence) {
+    case SEEK_SET:
+        position = offset;
+        break;
+    case SEEK_CUR:
+        position = f->position + offset;
+        break;
+    case SEEK_END:
+        position = (off_t)f->size + offset;
+        break;
+    default:
+        return -EINVAL;
+    }
+    if (position < 0)
+        return -EINVAL;
+    f->position = position;
+    return position;
+}
+
+static off_t file_tell(filesystem_t *fs, fs_file_t *file) {
+    (void)fs;
+    romfs_file_t *f = file->context;
+    return f->position;
+}
+
+static off_t file_size(filesystem_t *fs, fs_file_t *file) {
+    (void)fs;
+    romfs_file_t *f = file->context;
+    return (off_t)f->size;
+}
+
+static int file_truncate(filesystem_t *fs, fs_file_t *file, off_t length) {
+    (void)fs;
+    (void)file;
+    (void)length;
+    return -EBADF;
+}
+
+static int file_extent(filesystem_t *fs, fs_file_t *file, off_t offset, size_t length, bd_size_t *addr) {
+    filesystem_romfs_context_t *context = fs->context;
+    romfs_file_t *f = file->context;
+    if (context->image == NULL)
+        return -ENOTSUP;
+    if (offset < 0 || (uint64_t)offset + length > f->size)
+        return -EINVAL;
+    *addr = (bd_size_t)f->offset + (bd_size_t)offset;
+    return 0;
+}
+
+static int dir_open(filesystem_t *fs, fs_dir_t *dir, const char *path) {
+    filesystem_romfs_context_t *context = fs->context;
+    const romfs_entry_t *entry;
+    int err = lookup(context, path, &entry);
+    if (err)
+        return err;
+    if (entry->type != ROMFS_TYPE_DIR)
+        return -ENOTDIR;
+
+    mutex_enter_blocking(&context->_mutex);
+    romfs_dir_t *d = fs_object_pool_acquire(&context->dir_pool);
+    mutex_exit(&context->_mutex);
+    if (d == NULL) {
+        fprintf(stderr, "dir_open: Out of memory\n");
+        return -ENOMEM;
+    }
+    d->first = entry->offset;
+    d->count = entry->size;
+    d->position = 0;
+    dir->context = d;
+    dir->fd = -1;
+    return 0;
+}
+
+static int dir_close(filesystem_t *fs, fs_dir_t *dir) {
+    filesystem_romfs_context_t *context = fs->context;
+    mutex_enter_blocking(&context->_mutex);
+    fs_object_pool_release(&context->dir_pool, dir->context);
+    mutex_exit(&context->_mutex);
+    dir->context = NULL;
+    return 0;
+}
+
+static int dir_read(filesystem_t *fs, fs_dir_t *dir, struct dirent *ent) {
+    filesystem_romfs_context_t *context = fs->context;
+    romfs_dir_t *d = dir->context;
+    if (d->position >= d->count)
+        return -ENOENT;
+
+    const romfs_entry_t *entry = &context->entries[d->first + d->position];
+    d->position++;
+    ent->d_type = entry->type == ROMFS_TYPE_DIR ? DT_DIR : DT_REG;
+    memcpy(ent->d_name, context->names + entry->name, entry->name_length);
+    ent->d_name[entry->name_length] = '\0';
+    return 0;
+}
+
+filesystem_t *filesystem_romfs_create(void) {
+    filesystem_t *fs = calloc(1, sizeof(filesystem_t));
+    if (fs == NULL) {
+        fprintf(stderr, "filesystem_romfs_create: Out of memory\n");
+        return NULL;
+    }
+
+    fs->type = FILESYSTEM_TYPE_ROMFS;
+    fs->name = FILESYSTEM_NAME;
+    fs->mount = mount;
+    fs->unmount = unmount;
+    fs->format = format;
+    fs->remove = file_remove;
+    fs->rename = file_rename;
+    fs->mkdir = file_mkdir;
+    fs->rmdir = file_rmdir;
+    fs->stat = file_stat;
+    fs->file_open = file_open;
+    fs->file_close = file_close;
+    fs->file_write = file_write;
+    fs->file_read = file_read;
+    fs->file_sync = file_sync;
+    fs->file_seek = file_seek;
+    fs->file_tell = file_tell;
+    fs->file_size = file_size;
+    fs->file_truncate = file_truncate;
+    fs->dir_open = dir_open;
+    fs->dir_close = dir_close;
+    fs->dir_read = dir_read;
+    fs->file_preadv = file_preadv;
+    fs->file_pwritev = file_pwritev;
+    fs->file_extent = file_extent;
+
+    filesystem_romfs_context_t *context = calloc(1, sizeof(filesystem_romfs_context_t));
+    if (context == NULL) {
+        fprintf(stderr, "filesystem_romfs_create: Out of memory\n");
+        free(fs);
+        return NULL;
+    }
+    mutex_init(&context->_mutex);
+    fs_object_pool_init(&context->file_pool, sizeof(romfs_file_t), PICO_VFS_MAX_OPEN_FILES);
+    fs_object_pool_init(&context->dir_pool, sizeof(romfs_dir_t), PICO_VFS_MAX_OPEN_DIRS);
+    fs->context = context;
+    return fs;
+}
+
+void filesystem_romfs_free(filesystem_t *fs) {
+    filesystem_romfs_context_t *context = fs->context;
+    unmount(fs);
+    fs_object_pool_deinit(&context->file_pool);
+    fs_object_pool_deinit(&context->dir_pool);
+    free(fs->context);
+    fs->context = NULL;
+    free(fs);
+}
@@ -0,0 +1,746 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pico/mutex.h>
+#include <pico/time.h>
+#include "filesystem/stage.h"
+#if LIB_FREERTOS_KERNEL
+#include <FreeRTOS.h>
+#include <task.h>
+#elif PICO_ON_DEVICE
+#include "filesystem/core1.h"
+#else
+#include <pthread.h>
+#endif
+
+#if !defined(PICO_VFS_STAGE_TASK_PRIORITY)
+#define PICO_VFS_STAGE_TASK_PRIORITY    (tskIDLE_PRIORITY + 1)
+#endif
+
+#define CHUNK_SIZE    PICO_VFS_STAGE_CHUNK_SIZE
+
+struct stage_file;
+
+typedef struct stage_chunk {
+    struct stage_chunk *next;  // Next in the destage queue, or in the free list
+    struct stage_file *file;
+    off_t offset;              // Position of the data in the file
+    size_t length;
+    size_t capacity;           // Up to the next chunk boundary of the file
+    bool sealed;               // Takes no more data
+    absolute_time_t staged_at;
+    uint8_t *data;
+} stage_chunk_t;
+
+typedef struct stage_file {
+    struct stage_file *next;
+    fs_file_t file;            // File of the backing file system
+    char *path;
+    int flags;
+    off_t position;
+    off_t size;                // Including the staged data
+    stage_chunk_t *tail;       // Chunk that takes the next sequential write
+    int error;                 // Destage failure not yet returned
+} stage_file_t;
+
+typedef struct filesystem_stage_context {
+    struct filesystem_stage_context *next;
+    mutex_t _mutex;            // Guards the chunks and the files
+    mutex_t io_mutex;          // Serializes the access to backing files, taken before _mutex
+    filesystem_t *backing;
+    uint8_t *buffer;
+    bool own_buffer;
+    stage_chunk_t *chunks;
+    stage_chunk_t *free_list;
+    stage_chunk_t *queue_head; // Staged chunks in the order they were started
+    stage_chunk_t *queue_tail;
+    stage_file_t *files;
+    fs_object_pool_t file_pool;
+} filesystem_stage_context_t;
+
+static const char FILESYSTEM_NAME[] = "stage";
+
+static filesystem_stage_context_t *stages = NULL;
+static bool destager_started = false;
+auto_init_mutex(_stage_mutex);
+
+static bool destage_pass(void);
+#if !PICO_ON_DEVICE || LIB_FREERTOS_KERNEL
+static void stage_destager(void);
+#endif
+
+/*
+ * Destager backends. destager_wait() returns on destager_notify() or after the age limit of
+ * a partly filled chunk. On bare metal the destager is a job of the shared loop on core1, which
+ * waits the same way.
+ */
+#if LIB_FREERTOS_KERNEL
+
+static TaskHandle_t destager_task = NULL;
+
+static void stage_task(void *params) {
+    (void)params;
+    stage_destager();
+}
+
+static bool destager_start(void) {
+    if (xTaskCreate(stage_task, "fs_stage", configMINIMAL_STACK_SIZE * 4, NULL,
+                    PICO_VFS_STAGE_TASK_PRIORITY, &destager_task) != pdPASS) {
+        errno = ENOMEM;
+        return false;
+    }
+    return true;
+}
+
+static void destager_notify(void) {
+    if (destager_task != NULL)
+        xTaskNotifyGive(destager_task);
+}
+
+static void destager_wait(void) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(PICO_VFS_STAGE_AGE_US / 1000) + 1);
+}
+
+#elif PICO_ON_DEVICE
+
+static bool destager_start(void) {
+    return fs_core1_add_job(destage_pass, PICO_VFS_STAGE_AGE_US) == 0;  // errno is set
+}
+
+static void destager_notify(void) {
+    fs_core1_notify();
+}
+
+#else
+
+static pthread_mutex_t destager_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t destager_cond = PTHREAD_COND_INITIALIZER;
+static unsigned destager_pending = 0;
+
+static void *stage_thread(void *params) {
+    (void)params;
+    stage_destager();
+    return NULL;
+}
+
+static bool destager_start(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, stage_thread, NULL) != 0) {
+        errno = ENOMEM;
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+static void destager_notify(void) {
+    pthread_mutex_lock(&destager_mutex);
+    destager_pending++;
+    pthread_cond_signal(&destager_cond);
+    pthread_mutex_unlock(&destager_mutex);
+}
+
+static void destager_wait(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += (long)PICO_VFS_STAGE_AGE_US * 1000;
+    ts.tv_sec += ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+    pthread_mutex_lock(&destager_mutex);
+    if (destager_pending == 0)
+        pthread_cond_timedwait(&destager_cond, &destager_mutex, &ts);
+    destager_pending = 0;
+    pthread_mutex_unlock(&destager_mutex);
+}
+#endif
+
+static void seal(stage_chunk_t *chunk) {
+    chunk->sealed = true;
+    if (chunk->file->tail == chunk)
+        chunk->file->tail = NULL;
+}
+
+/*
+ * Take the oldest chunk that is ready: a full chunk, one older than the age limit, or with
+ * force any chunk. With a file, only the chunks of that file are taken.
+ */
+static stage_chunk_t *take_chunk(filesystem_stage_context_t *context, stage_file_t *file, bool force) {
+    absolute_time_t now = get_absolute_time();
+    stage_chunk_t *prev = NULL;
+    for (stage_chunk_t *chunk = context->queue_head; chunk != NULL; prev = chunk, chunk = chunk->next) {
+        if (file != NULL && chunk->file != file)
+            continue;
+        if (!force && !chunk->sealed &&
+            absolute_time_diff_us(chunk->staged_at, now) < PICO_VFS_STAGE_AGE_US)
+        {
+            continue;
+        }
+        if (prev == NULL)
+            context->queue_head = chunk->next;
+        else
+            prev->next = chunk->next;
+        if (context->queue_tail == chunk)
+            context->queue_tail = prev;
+        chunk->next = NULL;
+        seal(chunk);
+        return chunk;
+    }
+    return NULL;
+}
+
+/*
+ * Write one chunk to the backing file system. The caller holds io_mutex, so no read sees the
+ * file while the chunk is neither staged nor written. Returns false if no chunk was ready.
+ */
+static bool destage_one(filesystem_stage_context_t *context, stage_file_t *file, bool force) {
+    mutex_enter_blocking(&context->_mutex);
+    stage_chunk_t *chunk = take_chunk(context, file, force);
+    mutex_exit(&context->_mutex);
+    if (chunk == NULL)
+        return false;
+
+    filesystem_t *backing = context->backing;
+    stage_file_t *f = chunk->file;
+    int err = 0;
+    off_t offset = backing->file_seek(backing, &f->file, chunk->offset, SEEK_SET);
+    if (offset < 0) {
+        err = (int)offset;
+    } else {
+        ssize_t written = backing->file_write(backing, &f->file, chunk->data, chunk->length);
+        if (written < 0)
+            err = (int)written;
+        else if ((size_t)written != chunk->length)
+            err = -ENOSPC;
+    }
+
+    mutex_enter_blocking(&context->_mutex);
+    if (err && f->error == 0)
+        f->error = err;
+    chunk->file = NULL;
+    chunk->next = context->free_list;
+    context->free_list = chunk;
+    mutex_exit(&context->_mutex);
+    return true;
+}
+
+static void destage_file(filesystem_stage_context_t *context, stage_file_t *file) {
+    while (destage_one(context, file, true))
+        ;
+}
+
+static int take_error(stage_file_t *f) {
+    int err = f->error;
+    f->error = 0;
+    return err;
+}
+
+// Destages one ready chunk of every staging file system
+static bool destage_pass(void) {
+    bool busy = false;
+    mutex_enter_blocking(&_stage_mutex);
+    for (filesystem_stage_context_t *context = stages; context != NULL; context = context->next) {
+        mutex_enter_blocking(&context->io_mutex);
+        if (destage_one(context, NULL, false))
+            busy = true;
+        mutex_exit(&context->io_mutex);
+    }
+    mutex_exit(&_stage_mutex);
+    return busy;
+}
+
+#if !PICO_ON_DEVICE || LIB_FREERTOS_KERNEL
+static void stage_destager(void) {
+    while (true) {
+        if (!destage_pass())
+            destager_wait();
+    }
+}
+#endif
+
+int fs_stage_start_destager(void) {
+    mutex_enter_blocking(&_stage_mutex);
+    if (destager_started) {
+        mutex_exit(&_stage_mutex);
+        errno = EBUSY;
+        return -1;
+    }
+    destager_started = destager_start();
+    mutex_exit(&_stage_mutex);
+    return destager_started ? 0 : -1;  // errno is set by the backend
+}
+
+static int format(filesystem_t *fs, blockdevice_t *device) {
+    filesystem_stage_context_t *context = fs->context;
+    return context->backing->format(context->backing, device);
+}
+
+static int mount(filesystem_t *fs, blockdevice_t *device, bool pending) {
+    filesystem_stage_context_t *context = fs->context;
+    return context->backing->mount(context->backing, device, pending);
+}
+
+static int unmount(filesystem_t *fs) {
+    filesystem_stage_context_t *context = fs->context;
+    mutex_enter_blocking(&context->io_mutex);
+    while (destage_one(context, NULL, true))
+        ;
+    int err = context->backing->unmount(context->backing);
+    mutex_exit(&context->io_mutex);
+    return err;
+}
+
+static int file_remove(filesystem_t *fs, const char *path) {
+    filesystem_stage_context_t *context = fs->context;
+    return context->backing->remove(context->backing, path);
+}
+
+static int file_rename(filesystem_t *fs, const char *oldpath, const char *newpath) {
+    filesystem_stage_context_t *context = fs->context;
+    int err = context->backing->rename(context->backing, oldpath, newpath);
+    if (err)
+        return err;
+
+    // Keeps stat() of the new name up to date with the staged size
+    mutex_enter_blocking(&context->_mutex);
+    for (stage_file_t *f = context->files; f != NULL; f = f->next) {
+        if (strcmp(f->path, oldpath) != 0)
+            continue;
+        char *path = strdup(newpath);
+        if (path != NULL) {
+            free(f->path);
+            f->path = path;
+        }
+    }
+    mutex_exit(&context->_mutex);
+    return 0;
+}
+
+static int file_mkdir(filesystem_t *fs, const char *path, mode_t mode) {
+    filesystem_stage_context_t *context = fs->context;
+    return context->backing->mkdir(context->backing, path, mode);
+}
+
+static int file_rmdir(filesystem_t *fs, const char *path) {
+    filesystem_stage_context_t *context = fs->context;
+    return context->backing->rmdir(context->backing, path);
+}
+
+static int file_stat(filesystem_t *fs, const char *path, struct stat *st) {
+    filesystem_stage_context_t *context = fs->context;
+    int err = context->backing->stat(context->backing, path, st);
+    if (err || !S_ISREG(st->st_mode))
+        return err;
+
+    mutex_enter_blocking(&context->_mutex);
+    for (stage_file_t *f = context->files; f != NULL; f = f->next) {
+        if (f->size > st->st_size && strcmp(f->path, path) == 0)
+            st->st_size = f->size;
+    }
+    mutex_exit(&context->_mutex);
+    return 0;
+}
+
+static int file_open(filesystem_t *fs, fs_file_t *file, const char *path, int flags) {
+    filesystem_stage_context_t *context = fs->context;
+    mutex_enter_blocking(&context->_mutex);
+    stage_file_t *f = fs_object_pool_acquire(&context->file_pool);
+    mutex_exit(&context->_mutex);
+    if (f == NULL) {
+        fprintf(stderr, "file_open: Out of memory\n");
+        return -ENOMEM;
+    }
+    f->path = strdup(path);
+    if (f->path == NULL) {
+        mutex_enter_blocking(&context->_mutex);
+        fs_object_pool_release(&context->file_pool, f);
+        mutex_exit(&context->_mutex);
+        fprintf(stderr, "file_open: Out of memory\n");
+        return -ENOMEM;
+    }
+
+    filesystem_t *backing = context->backing;
+    f->file.fd = file->fd;
+    // Appends are positioned here, each chunk is written at its own offset
+    int err = backing->file_open(backing, &f->file, path, flags & ~O_APPEND);
+    off_t size = 0;
+    if (err == 0) {
+        size = backing->file_size(backing, &f->file);
+        if (size < 0) {
+            backing->file_close(backing, &f->file);
+            err = (int)size;
+        }
+    }
+    mutex_enter_blocking(&context->_mutex);
+    if (err) {
+        free(f->path);
+        fs_object_pool_release(&context->file_pool, f);
+    } else {
+        f->flags = flags;
+        f->size = size;
+        f->next = context->files;
+        context->files = f;
+    }
+    mutex_exit(&context->_mutex);
+    if (err)
+        return err;
+    file->context = f;
+    return 0;
+}
+
+static int file_close(filesystem_t *fs, fs_file_t *file) {
+    filesystem_stage_context_t *context = fs->context;
+    stage_file_t *f = file->context;
+
+    mutex_enter_blocking(&context->io_mutex);
+    destage_file(context, f);
+    int err = context->backing->file_close(context->backing, &f->file);
+    mutex_exit(&context->io_mutex);
+
+    mutex_enter_blocking(&context->_mutex);
+    for (stage_file_t **p = &context->files; *p != NULL; p = &(*p)->next) {
+        if (*p == f) {
+            *p = f->next;
+            break;
+        }
+    }
+    int destage_err = take_error(f);
+    free(f->path);
+    fs_object_pool_release(&context->file_pool, f);
+    mutex_exit(&context->_mutex);
+    file->context = NULL;
+    return destage_err != 0 ? destage_err : err;
+}
+
+static ssize_t file_write(filesystem_t *fs, fs_file_t *file, const void *buffer, size_t size) {
+    filesystem_stage_context_t *context = fs->context;
+    stage_file_t *f = file->context;
+    if ((f->flags & O_ACCMODE) == O_RDONLY)
+        return -EBADF;
+
+    const uint8_t *p = buffer;
+    size_t remaining = size;
+    bool sealed = false;
+    mutex_enter_blocking(&context->_mutex);
+    int err = take_error(f);
+    if (err) {
+        mutex_exit(&context->_mutex);
+        return err;
+    }
+    if (f->flags & O_APPEND)
+        f->position = f->size;
+    while (remaining > 0) {
+        stage_chunk_t *chunk = f->tail;
+        if (chunk != NULL && chunk->offset + (off_t)chunk->length != f->position) {
+            seal(chunk);
+            sealed = true;
+            chunk = NULL;
+        }
+        if (chunk == NULL) {
+            chunk = context->free_list;
+            if (chunk == NULL) {
+                // Back-pressure, the writer makes room by writing out the oldest chunk
+                mutex_exit(&context->_mutex);
+                mutex_enter_blocking(&context->io_mutex);
+                destage_one(context, NULL, true);
+                mutex_exit(&context->io_mutex);
+                mutex_enter_blocking(&context->_mutex);
+                continue;
+            }
+            context->free_list = chunk->next;
+            chunk->next = NULL;
+            chunk->file = f;
+            chunk->offset = f->position;
+            chunk->length = 0;
+            chunk->capacity = CHUNK_SIZE - (size_t)(f->position % CHUNK_SIZE);
+            chunk->sealed = false;
+            chunk->staged_at = get_absolute_time();
+            if (context->queue_tail != NULL)
+                context->queue_tail->next = chunk;
+            else
+                context->queue_head = chunk;
+            context->queue_tail = chunk;
+            f->tail = chunk;
+        }
+
+        size_t length = chunk->capacity - chunk->length;
+        if (length > remaining)
+            length = remaining;
+        memcpy(chunk->data + chunk->length, p, length);
+        chunk->length += length;
+        p += length;
+        remaining -= length;
+        f->position += (off_t)length;
+        if (f->position > f->size)
+            f->size = f->position;
+        if (chunk->length == chunk->capacity) {
+            seal(chunk);
+            sealed = true;
+        }
+    }
+    mutex_exit(&context->_mutex);
+
+    if (sealed && destager_started)
+        destager_notify();
+    return (ssize_t)size;
+}
+
+static ssize_t file_read(filesystem_t *fs, fs_file_t *file, void *buffer, size_t size) {
+    filesystem_stage_context_t *context = fs->context;
+    filesystem_t *backing = context->backing;
+    stage_file_t *f = file->context;
+    if ((f->flags & O_ACCMODE) == O_WRONLY)
+        return -EBADF;
+
+    // No chunk is written out during the read
+    mutex_enter_blocking(&context->io_mutex);
+    mutex_enter_blocking(&context->_mutex);
+    off_t position = f->position;
+    if (position >= f->size)
+        size = 0;
+    else if ((off_t)size > f->size - position)
+        size = (size_t)(f->size - position);
+    mutex_exit(&context->_mutex);
+
+    // The backing data, then the staged chunks from the oldest to the newest
+    ssize_t length = 0;
+    off_t backing_size = backing->file_size(backing, &f->file);
+    if (backing_size < 0) {
+        length = (ssize_t)backing_size;
+    } else if (position < backing_size && size > 0) {
+        size_t n = (off_t)size < backing_size - position ? size : (size_t)(backing_size - position);
+        off_t offset = backing->file_seek(backing, &f->file, position, SEEK_SET);
+        length = offset < 0 ? (ssize_t)offset : backing->file_read(backing, &f->file, buffer, n);
+    }
+    if (length < 0) {
+        mutex_exit(&context->io_mutex);
+        return length;
+    }
+    memset((uint8_t *)buffer + length, 0, size - (size_t)length);
+
+    mutex_enter_blocking(&context->_mutex);
+    off_t end = position + (off_t)size;
+    for (stage_chunk_t *chunk = context->queue_head; chunk != NULL; chunk = chunk->next) {
+        off_t chunk_end = chunk->offset + (off_t)chunk->length;
+        if (chunk->file != f || chunk_end <= position || chunk->offset >= end)
+            continue;
+        off_t from = chunk->offset > position ? chunk->offset : position;
+        off_t to = chunk_end < end ? chunk_end : end;
+        memcpy((uint8_t *)buffer + (from - position), chunk->data + (from - chunk->offset), (size_t)(to - from));
+    }
+    f->position = position + (off_t)size;
+    mutex_exit(&context->_mutex);
+    mutex_exit(&context->io_mutex);
+    return (ssize_t)size;
+}
+
+static int file_sync(filesystem_t *fs, fs_file_t *file) {
+    filesystem_stage_context_t *context = fs->context;
+    stage_file_t *f = file->context;
+
+    mutex_enter_blocking(&context->io_mutex);
+    destage_file(context, f);
+    int err = context->backing->file_sync(context->backing, &f->file);
+    mutex_exit(&context->io_mutex);
+
+    mutex_enter_blocking(&context->_mutex);
+    int destage_err = take_error(f);
+    mutex_exit(&context->_mutex);
+    return destage_err != 0 ? destage_err : err;
+}
+
+static off_t file_seek(filesystem_t *fs, fs_file_t *file, off_t offset, int whence) {
+    filesystem_stage_context_t *context = fs->context;
+    stage_file_t *f = file->context;
+    mutex_enter_blocking(&context->_mutex);
+    off_t position;
+    switch (whence) {
+    case SEEK_SET:
+        position = offset;
+        break;
+    case SEEK_CUR:
+        position = f->position + offset;
+        break;
+    case SEEK_END:
+        position = f->size + offset;
+        break;
+    default:
+        position = -EINVAL;
+        break;
+    }
+    if (position < 0)
+        position = -EINVAL;
+    else
+        f->position = position;
+    mutex_exit(&context->_mutex);
+    return position;
+}
+
+static off_t file_tell(filesystem_t *fs, fs_file_t *file) {
+    filesystem_stage_context_t *context = fs->context;
+    stage_file_t *f = file->context;
+    mutex_enter_blocking(&context->_mutex);
+    off_t position = f->position;
+    mutex_exit(&context->_mutex);
+    return position;
+}
+
+static off_t file_size(filesystem_t *fs, fs_file_t *file) {
+    filesystem_stage_context_t *context = fs->context;
+    stage_file_t *f = file->context;
+    mutex_enter_blocking(&context->_mutex);
+    off_t size = f->size;
+    mutex_exit(&context->_mutex);
+    return size;
+}
+
+static int file_truncate(filesystem_t *fs, fs_file_t *file, off_t length) {
+    filesystem_stage_context_t *context = fs->context;
+    stage_file_t *f = file->context;
+
+    // The staged data is written out first, the backing file system truncates it
+    mutex_enter_blocking(&context->io_mutex);
+    destage_file(context, f);
+    int err = context->backing->file_truncate(context->backing, &f->file, length);
+    mutex_enter_blocking(&context->_mutex);
+    int destage_err = take_error(f);
+    if (err == 0)
+        f->size = length;
+    mutex_exit(&context->_mutex);
+    mutex_exit(&context->io_mutex);
+    return destage_err != 0 ? destage_err : err;
+}
+
+static int dir_open(filesystem_t *fs, fs_dir_t *dir, const char *path) {
+    filesystem_stage_context_t *context = fs->context;
+    return context->backing->dir_open(context->backing, dir, path);
+}
+
+static int dir_close(filesystem_t *fs, fs_dir_t *dir) {
+    filesystem_stage_context_t *context = fs->context;
+    return context->backing->dir_close(context->backing, dir);
+}
+
+static int dir_read(filesystem_t *fs, fs_dir_t *dir, struct dirent *ent) {
+    filesystem_stage_context_t *context = fs->context;
+    return context->backing->dir_read(context->backing, dir, ent);
+}
+
+// Destages the ready chunks, then runs the maintenance of the backing file system
+static int gc(filesystem_t *fs, uint32_t budget_us) {
+    filesystem_stage_context_t *context = fs->context;
+    absolute_time_t until = make_timeout_time_us(budget_us);
+    mutex_enter_blocking(&context->io_mutex);
+    bool more = false;
+    while (destage_one(context, NULL, false)) {
+        if (time_reached(until)) {
+            more = true;
+            break;
+        }
+    }
+    mutex_exit(&context->io_mutex);
+    if (more)
+        return 1;
+
+    filesystem_t *backing = context->backing;
+    if (backing->gc == NULL)
+        return 0;
+    int64_t remaining = absolute_time_diff_us(get_absolute_time(), until);
+    return backing->gc(backing, remaining > 0 ? (uint32_t)remaining : 0);
+}
+
+filesystem_t *filesystem_stage_create(filesystem_t *backing, void *buffer, size_t size) {
+    size_t count = size / CHUNK_SIZE;
+    if (backing == NULL || count == 0) {
+        fprintf(stderr, "filesystem_stage_create: Staging area smaller than a chunk\n");
+        return NULL;
+    }
+    filesystem_t *fs = calloc(1, sizeof(filesystem_t));
+    if (fs == NULL) {
+        fprintf(stderr, "filesystem_stage_create: Out of memory\n");
+        return NULL;
+    }
+
+    fs->type = backing->type;  // Same path semantics as the backing file system
+    fs->name = FILESYSTEM_NAME;
+    fs->mount = mount;
+    fs->unmount = unmount;
+    fs->format = format;
+    fs->remove = file_remove;
+    fs->rename = file_rename;
+    fs->mkdir = file_mkdir;
+    fs->rmdir = file_rmdir;
+    fs->stat = file_stat;
+    fs->file_open = file_open;
+    fs->file_close = file_close;
+    fs->file_write = file_write;
+    fs->file_read = file_read;
+    fs->file_sync = file_sync;
+    fs->file_seek = file_seek;
+    fs->file_tell = file_tell;
+    fs->file_size = file_size;
+    fs->file_truncate = file_truncate;
+    fs->dir_open = dir_open;
+    fs->dir_close = dir_close;
+    fs->dir_read = dir_read;
+    fs->gc = gc;
+
+    filesystem_stage_context_t *context = calloc(1, sizeof(filesystem_stage_context_t));
+    stage_chunk_t *chunks = calloc(count, sizeof(stage_chunk_t));
+    uint8_t *data = buffer != NULL ? buffer : malloc(count * CHUNK_SIZE);
+    if (context == NULL || chunks == NULL || data == NULL) {
+        fprintf(stderr, "filesystem_stage_create: Out of memory\n");
+        if (buffer == NULL)
+            free(data);
+        free(chunks);
+        free(context);
+        free(fs);
+        return NULL;
+    }
+    mutex_init(&context->_mutex);
+    mutex_init(&context->io_mutex);
+    context->backing = backing;
+    context->buffer = data;
+    context->own_buffer = buffer == NULL;
+    context->chunks = chunks;
+    for (size_t i = 0; i < count; i++) {
+        chunks[i].data = data + i * CHUNK_SIZE;
+        chunks[i].next = i + 1 < count ? &chunks[i + 1] : NULL;
+    }
+    context->free_list = &chunks[0];
+    fs_object_pool_init(&context->file_pool, sizeof(stage_file_t), PICO_VFS_MAX_OPEN_FILES);
+    fs->context = context;
+
+    mutex_enter_blocking(&_stage_mutex);
+    context->next = stages;
+    stages = context;
+    mutex_exit(&_stage_mutex);
+    return fs;
+}
+
+void filesystem_stage_free(filesystem_t *fs) {
+    filesystem_stage_context_t *context = fs->context;
+    mutex_enter_blocking(&_stage_mutex);
+    for (filesystem_stage_context_t **p = &stages; *p != NULL; p = &(*p)->next) {
+        if (*p == context) {
+            *p = context->next;
+            break;
+        }
+    }
+    mutex_exit(&_stage_mutex);
+
+    fs_object_pool_deinit(&context->file_pool);
+    if (context->own_buffer)
+        free(context->buffer);
+    free(context->chunks);
+    free(fs->context);
+    fs->context = NULL;
+    free(fs);
+}
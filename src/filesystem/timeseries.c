@@ -0,0 +1,613 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pico/mutex.h>
+#include "filesystem/timeseries.h"
+#include "filesystem/vfs.h"
+#include "storage/crc32.h"
+
+#define FILE_MAGIC     0x53544656  // "VFTS"
+#define CHUNK_MAGIC    0x4b4e4843  // "CHNK"
+#define INDEX_MAGIC    0x58444e49  // "INDX"
+#define VERSION        1
+#define NO_BLOCK       UINT32_MAX
+#define MAX_VARINT     10
+#define MAX_SAMPLE(n)  (MAX_VARINT + 5 * (n))  // Timestamp delta and 32-bit value deltas
+
+/*
+ * Block 0 is the file header. The following blocks are groups of `entries` chunks, each group
+ * followed by the index block of its chunks.
+ */
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t value_count;
+    uint32_t block_size;
+    uint32_t crc;
+} file_header_t;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t count;            // Samples in the chunk
+    uint16_t length;           // Size of the encoded samples after the header
+    uint64_t first_timestamp;
+    uint64_t last_timestamp;
+    uint32_t crc;              // Over the fields above and the encoded samples
+    uint32_t reserved;
+} chunk_header_t;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t count;
+    uint16_t reserved;
+    uint32_t crc;              // Over the fields above and the entries
+    uint32_t reserved2;
+} index_header_t;
+
+typedef struct {
+    uint64_t timestamp;        // First timestamp of the chunk
+    uint64_t offset;           // Position of the chunk in the file
+} index_entry_t;
+
+struct fs_timeseries {
+    mutex_t mutex;
+    int fd;
+    size_t block_size;
+    unsigned value_count;
+    uint32_t entries;          // Chunks per index block
+    uint32_t chunks;           // Chunks before the current one
+    uint8_t *chunk;            // Current chunk, filled by fs_timeseries_append()
+    uint32_t values[PICO_VFS_TIMESERIES_MAX_VALUES];  // Last sample of the current chunk
+    uint64_t last_timestamp;
+    uint8_t *index;            // Index block of the group of the current chunk
+    uint8_t *buffer;           // Block last read by a query
+    uint32_t buffer_block;
+};
+
+
+static size_t put_varint(uint8_t *p, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        p[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    p[n++] = (uint8_t)value;
+    return n;
+}
+
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint64_t *value) {
+    *value = 0;
+    for (unsigned shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = *p++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return p;
+    }
+    return NULL;
+}
+
+static inline uint32_t zigzag(int32_t n) {
+    return ((uint32_t)n << 1) ^ (uint32_t)(n >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t n) {
+    return (int32_t)(n >> 1) ^ -(int32_t)(n & 1);
+}
+
+static inline off_t block_offset(fs_timeseries_t *ts, uint32_t block) {
+    return (off_t)block * (off_t)ts->block_size;
+}
+
+static inline uint32_t chunk_block(fs_timeseries_t *ts, uint32_t chunk) {
+    return 1 + chunk + chunk / ts->entries;
+}
+
+static inline uint32_t index_block(fs_timeseries_t *ts, uint32_t group) {
+    return (group + 1) * (ts->entries + 1);
+}
+
+static uint32_t chunk_crc(const uint8_t *chunk) {
+    const chunk_header_t *header = (const chunk_header_t *)chunk;
+    uint32_t crc = storage_crc32(0, header, offsetof(chunk_header_t, crc));
+    return storage_crc32(crc, chunk + sizeof(chunk_header_t), header->length);
+}
+
+static uint32_t index_crc(const uint8_t *index) {
+    const index_header_t *header = (const index_header_t *)index;
+    uint32_t crc = storage_crc32(0, header, offsetof(index_header_t, crc));
+    return storage_crc32(crc, index + sizeof(index_header_t), header->count * sizeof(index_entry_t));
+}
+
+static bool chunk_is_valid(fs_timeseries_t *ts, const uint8_t *chunk) {
+    const chunk_header_t *header = (const chunk_header_t *)chunk;
+    return header->magic == CHUNK_MAGIC &&
+           sizeof(chunk_header_t) + header->length <= ts->block_size &&
+           header->crc == chunk_crc(chunk);
+}
+
+static bool index_is_valid(fs_timeseries_t *ts, const uint8_t *index) {
+    const index_header_t *header = (const index_header_t *)index;
+    return header->magic == INDEX_MAGIC && header->count == ts->entries && header->crc == index_crc(index);
+}
+
+static int read_block(fs_timeseries_t *ts, uint32_t block, uint8_t *buffer) {
+    if (lseek(ts->fd, block_offset(ts, block), SEEK_SET) < 0)
+        return -1;
+    ssize_t size = read(ts->fd, buffer, ts->block_size);
+    if (size < 0)
+        return -1;
+    if ((size_t)size != ts->block_size) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static int write_block(fs_timeseries_t *ts, uint32_t block, const uint8_t *buffer) {
+    if (lseek(ts->fd, block_offset(ts, block), SEEK_SET) < 0)
+        return -1;
+    ssize_t size = write(ts->fd, buffer, ts->block_size);
+    if (size < 0)
+        return -1;
+    if ((size_t)size != ts->block_size) {
+        errno = ENOSPC;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Decodes the sample at `*offset` of a chunk, on top of the previous sample in `timestamp` and
+ * `values`.
+ */
+static bool decode_sample(const uint8_t *chunk, unsigned value_count, uint16_t *offset,
+                          uint64_t *timestamp, uint32_t *values)
+{
+    const chunk_header_t *header = (const chunk_header_t *)chunk;
+    const uint8_t *payload = chunk + sizeof(chunk_header_t);
+    const uint8_t *end = payload + header->length;
+    const uint8_t *p = payload + *offset;
+    uint64_t delta;
+    if ((p = get_varint(p, end, &delta)) == NULL)
+        return false;
+    *timestamp += delta;
+    for (unsigned i = 0; i < value_count; i++) {
+        if ((p = get_varint(p, end, &delta)) == NULL)
+            return false;
+        values[i] += (uint32_t)unzigzag((uint32_t)delta);
+    }
+    *offset = (uint16_t)(p - payload);
+    return true;
+}
+
+static void reset_chunk(fs_timeseries_t *ts) {
+    memset(ts->chunk, 0, ts->block_size);
+    ((chunk_header_t *)ts->chunk)->magic = CHUNK_MAGIC;
+}
+
+static int write_chunk(fs_timeseries_t *ts) {
+    chunk_header_t *header = (chunk_header_t *)ts->chunk;
+    header->crc = chunk_crc(ts->chunk);
+    if (ts->buffer_block == chunk_block(ts, ts->chunks))
+        ts->buffer_block = NO_BLOCK;
+    return write_block(ts, chunk_block(ts, ts->chunks), ts->chunk);
+}
+
+static int write_index(fs_timeseries_t *ts, uint32_t group) {
+    index_header_t *header = (index_header_t *)ts->index;
+    header->magic = INDEX_MAGIC;
+    header->crc = index_crc(ts->index);
+    return write_block(ts, index_block(ts, group), ts->index);
+}
+
+/*
+ * Writes out the full current chunk and starts the next one. The index block follows the last
+ * chunk of a group.
+ */
+static int complete_chunk(fs_timeseries_t *ts) {
+    if (write_chunk(ts) != 0)
+        return -1;
+
+    index_header_t *index = (index_header_t *)ts->index;
+    index_entry_t *entries = (index_entry_t *)(ts->index + sizeof(index_header_t));
+    entries[index->count].timestamp = ((chunk_header_t *)ts->chunk)->first_timestamp;
+    entries[index->count].offset = (uint64_t)block_offset(ts, chunk_block(ts, ts->chunks));
+    index->count++;
+    ts->chunks++;
+    reset_chunk(ts);
+    if (index->count == ts->entries) {
+        if (write_index(ts, ts->chunks / ts->entries - 1) != 0)
+            return -1;
+        memset(ts->index, 0, ts->block_size);
+    }
+    return 0;
+}
+
+/*
+ * Rebuilds the index entries of a group from the headers of its first `count` chunks. Stops at
+ * the first chunk that is not valid and returns the number of valid ones.
+ */
+static ssize_t load_group(fs_timeseries_t *ts, uint32_t group, uint32_t count) {
+    memset(ts->index, 0, ts->block_size);
+    index_header_t *index = (index_header_t *)ts->index;
+    index_entry_t *entries = (index_entry_t *)(ts->index + sizeof(index_header_t));
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t block = chunk_block(ts, group * ts->entries + i);
+        if (read_block(ts, block, ts->buffer) != 0)
+            return -1;
+        if (!chunk_is_valid(ts, ts->buffer))
+            break;
+        entries[i].timestamp = ((chunk_header_t *)ts->buffer)->first_timestamp;
+        entries[i].offset = (uint64_t)block_offset(ts, block);
+        index->count++;
+    }
+    ts->buffer_block = NO_BLOCK;
+    return index->count;
+}
+
+/*
+ * Takes the timestamp to continue from out of the chunk before the current one, the last chunk
+ * of the previous group.
+ */
+static int load_last_timestamp(fs_timeseries_t *ts) {
+    if (read_block(ts, chunk_block(ts, ts->chunks - 1), ts->buffer) != 0)
+        return -1;
+    if (chunk_is_valid(ts, ts->buffer))
+        ts->last_timestamp = ((chunk_header_t *)ts->buffer)->last_timestamp;
+    ts->buffer_block = NO_BLOCK;
+    return 0;
+}
+
+/*
+ * Finds where appending continues in an existing file. The last chunk becomes the current one
+ * again. Chunks and index blocks that were torn by a power failure are rebuilt or overwritten.
+ */
+static int find_end(fs_timeseries_t *ts, off_t size) {
+    uint32_t blocks = (uint32_t)(size / (off_t)ts->block_size);
+    uint32_t body = blocks > 0 ? blocks - 1 : 0;
+    uint32_t groups = body / (ts->entries + 1);
+    uint32_t remainder = body % (ts->entries + 1);
+
+    if (remainder == 0 && groups > 0) {
+        if (read_block(ts, index_block(ts, groups - 1), ts->index) != 0)
+            return -1;
+        if (index_is_valid(ts, ts->index)) {
+            memset(ts->index, 0, ts->block_size);
+            ts->chunks = groups * ts->entries;
+            return load_last_timestamp(ts);
+        }
+        groups--;
+        remainder = ts->entries;
+    }
+
+    ssize_t count = load_group(ts, groups, remainder);
+    if (count < 0)
+        return -1;
+    ts->chunks = groups * ts->entries + (uint32_t)count;
+    if (count == 0)
+        return groups > 0 ? load_last_timestamp(ts) : 0;
+
+    // Continue filling the last chunk
+    ts->chunks--;
+    index_header_t *index = (index_header_t *)ts->index;
+    index->count--;
+    if (read_block(ts, chunk_block(ts, ts->chunks), ts->chunk) != 0)
+        return -1;
+    chunk_header_t *header = (chunk_header_t *)ts->chunk;
+    uint64_t timestamp = header->first_timestamp;
+    uint16_t offset = 0;
+    for (uint16_t i = 0; i < header->count; i++) {
+        if (!decode_sample(ts->chunk, ts->value_count, &offset, &timestamp, ts->values)) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    ts->last_timestamp = header->last_timestamp;
+    return 0;
+}
+
+static int recover(fs_timeseries_t *ts, off_t size) {
+    if (find_end(ts, size) != 0)
+        return -1;
+    // Blocks left after a torn chunk must not be read back as part of the series
+    uint32_t blocks = chunk_block(ts, ts->chunks) + (((chunk_header_t *)ts->chunk)->count > 0 ? 1 : 0);
+    if (size > block_offset(ts, blocks))
+        return ftruncate(ts->fd, block_offset(ts, blocks));
+    return 0;
+}
+
+static int create_header(fs_timeseries_t *ts) {
+    memset(ts->buffer, 0, ts->block_size);
+    file_header_t *header = (file_header_t *)ts->buffer;
+    header->magic = FILE_MAGIC;
+    header->version = VERSION;
+    header->value_count = (uint16_t)ts->value_count;
+    header->block_size = (uint32_t)ts->block_size;
+    header->crc = storage_crc32(0, header, offsetof(file_header_t, crc));
+    return write_block(ts, 0, ts->buffer);
+}
+
+static int read_header(fs_timeseries_t *ts, unsigned value_count) {
+    file_header_t header;
+    if (lseek(ts->fd, 0, SEEK_SET) < 0)
+        return -1;
+    ssize_t size = read(ts->fd, &header, sizeof(header));
+    if (size < 0)
+        return -1;
+    if ((size_t)size != sizeof(header) ||
+        header.magic != FILE_MAGIC ||
+        header.version != VERSION ||
+        header.crc != storage_crc32(0, &header, offsetof(file_header_t, crc)) ||
+        header.value_count == 0 || header.value_count > PICO_VFS_TIMESERIES_MAX_VALUES ||
+        header.block_size < sizeof(chunk_header_t) + MAX_SAMPLE(header.value_count) ||
+        header.block_size > UINT16_MAX)
+    {
+        errno = EILSEQ;
+        return -1;
+    }
+    if (value_count != 0 && value_count != header.value_count) {
+        errno = EINVAL;
+        return -1;
+    }
+    ts->value_count = header.value_count;
+    ts->block_size = header.block_size;
+    return 0;
+}
+
+static void release(fs_timeseries_t *ts) {
+    free(ts->chunk);
+    free(ts->index);
+    free(ts->buffer);
+    free(ts);
+}
+
+fs_timeseries_t *fs_timeseries_open(const char *path, unsigned value_count) {
+    if (value_count > PICO_VFS_TIMESERIES_MAX_VALUES) {
+        errno = EINVAL;
+        return NULL;
+    }
+    fs_timeseries_t *ts = calloc(1, sizeof(fs_timeseries_t));
+    if (ts == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    mutex_init(&ts->mutex);
+    ts->buffer_block = NO_BLOCK;
+    ts->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (ts->fd < 0) {
+        free(ts);
+        return NULL;
+    }
+
+    int err = 0;
+    off_t size = lseek(ts->fd, 0, SEEK_END);
+    if (size < 0) {
+        err = -1;
+    } else if (size == 0) {
+        if (value_count == 0) {
+            errno = EINVAL;
+            err = -1;
+        }
+        ts->value_count = value_count;
+        ts->block_size = PICO_VFS_TIMESERIES_BLOCK_SIZE;
+    } else {
+        err = read_header(ts, value_count);
+    }
+    if (err == 0) {
+        ts->entries = (uint32_t)((ts->block_size - sizeof(index_header_t)) / sizeof(index_entry_t));
+        ts->chunk = malloc(ts->block_size);
+        ts->index = calloc(1, ts->block_size);
+        ts->buffer = malloc(ts->block_size);
+        if (ts->chunk == NULL || ts->index == NULL || ts->buffer == NULL) {
+            errno = ENOMEM;
+            err = -1;
+        }
+    }
+    if (err == 0) {
+        reset_chunk(ts);
+        err = size == 0 ? create_header(ts) : recover(ts, size);
+    }
+    if (err != 0) {
+        int saved = errno;
+        close(ts->fd);
+        release(ts);
+        errno = saved;
+        return NULL;
+    }
+    return ts;
+}
+
+static int sync_chunk(fs_timeseries_t *ts) {
+    if (((chunk_header_t *)ts->chunk)->count == 0)
+        return 0;
+    return write_chunk(ts);
+}
+
+int fs_timeseries_close(fs_timeseries_t *ts) {
+    mutex_enter_blocking(&ts->mutex);
+    int err = sync_chunk(ts);
+    mutex_exit(&ts->mutex);
+    if (close(ts->fd) != 0)
+        err = -1;
+    int saved = errno;
+    release(ts);
+    errno = saved;
+    return err;
+}
+
+int fs_timeseries_sync(fs_timeseries_t *ts) {
+    mutex_enter_blocking(&ts->mutex);
+    int err = sync_chunk(ts);
+    if (err == 0)
+        err = fsync(ts->fd);
+    mutex_exit(&ts->mutex);
+    return err;
+}
+
+unsigned fs_timeseries_value_count(fs_timeseries_t *ts) {
+    return ts->value_count;
+}
+
+int fs_timeseries_append(fs_timeseries_t *ts, uint64_t timestamp, const float *values) {
+    mutex_enter_blocking(&ts->mutex);
+    if (timestamp < ts->last_timestamp) {
+        mutex_exit(&ts->mutex);
+        errno = EINVAL;
+        return -1;
+    }
+    chunk_header_t *header = (chunk_header_t *)ts->chunk;
+    if (sizeof(chunk_header_t) + header->length + MAX_SAMPLE(ts->value_count) > ts->block_size) {
+        if (complete_chunk(ts) != 0) {
+            mutex_exit(&ts->mutex);
+            return -1;
+        }
+    }
+    if (header->count == 0) {
+        header->first_timestamp = timestamp;
+        header->last_timestamp = timestamp;
+        memset(ts->values, 0, sizeof(ts->values));
+    }
+
+    uint8_t *p = ts->chunk + sizeof(chunk_header_t) + header->length;
+    size_t length = put_varint(p, timestamp - header->last_timestamp);
+    for (unsigned i = 0; i < ts->value_count; i++) {
+        uint32_t bits;
+        memcpy(&bits, &values[i], sizeof(bits));
+        length += put_varint(p + length, zigzag((int32_t)(bits - ts->values[i])));
+        ts->values[i] = bits;
+    }
+    header->length += (uint16_t)length;
+    header->count++;
+    header->last_timestamp = timestamp;
+    ts->last_timestamp = timestamp;
+    mutex_exit(&ts->mutex);
+    return 0;
+}
+
+/*
+ * Returns the chunk from the current one, or reads it into the query buffer.
+ */
+static const uint8_t *load_chunk(fs_timeseries_t *ts, uint32_t chunk) {
+    if (chunk == ts->chunks)
+        return ts->chunk;
+    uint32_t block = chunk_block(ts, chunk);
+    if (ts->buffer_block != block) {
+        ts->buffer_block = NO_BLOCK;
+        if (read_block(ts, block, ts->buffer) != 0)
+            return NULL;
+        if (!chunk_is_valid(ts, ts->buffer)) {
+            errno = EIO;
+            return NULL;
+        }
+        ts->buffer_block = block;
+    }
+    return ts->buffer;
+}
+
+static int first_timestamp(fs_timeseries_t *ts, uint32_t chunk, uint64_t *timestamp) {
+    uint32_t group = chunk / ts->entries;
+    const uint8_t *index = ts->index;
+    if (chunk == ts->chunks) {
+        *timestamp = ((chunk_header_t *)ts->chunk)->first_timestamp;
+        return 0;
+    }
+    if (group != ts->chunks / ts->entries) {
+        uint32_t block = index_block(ts, group);
+        if (ts->buffer_block != block) {
+            ts->buffer_block = NO_BLOCK;
+            if (read_block(ts, block, ts->buffer) != 0)
+                return -1;
+            if (!index_is_valid(ts, ts->buffer)) {
+                errno = EIO;
+                return -1;
+            }
+            ts->buffer_block = block;
+        }
+        index = ts->buffer;
+    }
+    const index_entry_t *entries = (const index_entry_t *)(index + sizeof(index_header_t));
+    *timestamp = entries[chunk % ts->entries].timestamp;
+    return 0;
+}
+
+int fs_timeseries_query(fs_timeseries_t *ts, fs_timeseries_iter_t *iter, uint64_t from, uint64_t to) {
+    mutex_enter_blocking(&ts->mutex);
+    uint32_t total = ts->chunks + (((chunk_header_t *)ts->chunk)->count > 0 ? 1 : 0);
+
+    // Last chunk that starts before `from`. Equal timestamps may continue from the chunk before.
+    uint32_t low = 0;
+    uint32_t high = total;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        uint64_t timestamp;
+        if (first_timestamp(ts, middle, &timestamp) != 0) {
+            mutex_exit(&ts->mutex);
+            return -1;
+        }
+        if (timestamp < from)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    mutex_exit(&ts->mutex);
+
+    memset(iter, 0, sizeof(*iter));
+    iter->ts = ts;
+    iter->from = from;
+    iter->to = to;
+    iter->chunk = low > 0 ? low - 1 : 0;
+    return 0;
+}
+
+int fs_timeseries_next(fs_timeseries_iter_t *iter, uint64_t *timestamp, float *values) {
+    fs_timeseries_t *ts = iter->ts;
+    mutex_enter_blocking(&ts->mutex);
+    int result = 0;
+    while (iter->chunk <= ts->chunks) {
+        const uint8_t *chunk = load_chunk(ts, iter->chunk);
+        if (chunk == NULL) {
+            result = -1;
+            break;
+        }
+        const chunk_header_t *header = (const chunk_header_t *)chunk;
+        if (iter->sample >= header->count) {
+            if (iter->chunk == ts->chunks)
+                break;  // Samples appended later are read by the next call
+            iter->chunk++;
+            iter->sample = 0;
+            iter->offset = 0;
+            continue;
+        }
+        if (iter->sample == 0) {
+            iter->timestamp = header->first_timestamp;
+            memset(iter->values, 0, sizeof(iter->values));
+        }
+        if (!decode_sample(chunk, ts->value_count, &iter->offset, &iter->timestamp, iter->values)) {
+            errno = EIO;
+            result = -1;
+            break;
+        }
+        iter->sample++;
+        if (iter->timestamp < iter->from)
+            continue;
+        if (iter->timestamp > iter->to) {
+            iter->chunk = UINT32_MAX;
+            break;
+        }
+        *timestamp = iter->timestamp;
+        memcpy(values, iter->values, ts->value_count * sizeof(float));
+        result = 1;
+        break;
+    }
+    mutex_exit(&ts->mutex);
+    return result;
+}
@@ -0,0 +1,921 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pico/mutex.h>
+#include "filesystem/tmpfs.h"
+
+#define CHUNK_SIZE            PICO_VFS_TMPFS_CHUNK_SIZE
+#define INITIAL_BUCKETS       8
+#define NAME_MAX              255
+
+typedef struct chunk {
+    struct chunk *next;
+    uint8_t data[CHUNK_SIZE];
+} chunk_t;
+
+typedef struct node {
+    struct node *next;         // Next entry in the same bucket of the parent directory
+    struct node *parent;       // NULL for the root and for removed nodes
+    uint32_t hash;
+    bool is_dir;
+    bool removed;
+    unsigned opened;           // Open files and directories that refer to the node
+    char *name;
+    union {
+        struct {
+            chunk_t *head;
+            chunk_t *tail;
+            size_t chunks;
+            off_t size;
+            uint32_t generation;  // Changed when chunks are freed, which invalidates cursors
+        } file;
+        struct {
+            struct node **buckets;
+            size_t bucket_count;
+            size_t count;
+        } dir;
+    };
+} node_t;
+
+typedef struct {
+    node_t *node;
+    int flags;
+    off_t position;
+    chunk_t *chunk;            // Cursor of sequential access, chunk number `index` of the file
+    size_t index;
+    uint32_t generation;
+} tmpfs_file_t;
+
+typedef struct {
+    node_t *node;
+    size_t bucket;
+    size_t position;           // Entries of the bucket already returned
+} tmpfs_dir_t;
+
+typedef struct {
+    mutex_t _mutex;
+    node_t root;
+    size_t max_bytes;
+    size_t used_bytes;
+    unsigned opened;
+    fs_object_pool_t file_pool;
+    fs_object_pool_t dir_pool;
+} filesystem_tmpfs_context_t;
+
+static const char FILESYSTEM_NAME[] = "tmpfs";
+
+
+static bool reserve(filesystem_tmpfs_context_t *context, size_t size) {
+    if (context->max_bytes > 0 && context->used_bytes + size > context->max_bytes)
+        return false;
+    context->used_bytes += size;
+    return true;
+}
+
+static void unreserve(filesystem_tmpfs_context_t *context, size_t size) {
+    context->used_bytes -= size;
+}
+
+static uint32_t hash_name(const char *name, size_t length) {
+    uint32_t hash = 2166136261u;  // FNV-1a
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static node_t *dir_find(node_t *dir, const char *name, size_t length, uint32_t hash) {
+    if (dir->dir.bucket_count == 0)
+        return NULL;
+    node_t *node = dir->dir.buckets[hash % dir->dir.bucket_count];
+    for (; node != NULL; node = node->next) {
+        if (node->hash == hash && strncmp(node->name, name, length) == 0 && node->name[length] == '\0')
+            return node;
+    }
+    return NULL;
+}
+
+static void dir_link(node_t *dir, node_t *node) {
+    node_t **bucket = &dir->dir.buckets[node->hash % dir->dir.bucket_count];
+    node->next = *bucket;
+    *bucket = node;
+}
+
+/*
+ * Doubles the bucket table when the entries outnumber the buckets. A failed allocation keeps
+ * the current table, which only makes the chains longer.
+ */
+static int dir_grow(filesystem_tmpfs_context_t *context, node_t *dir) {
+    if (dir->dir.count < dir->dir.bucket_count)
+        return 0;
+    size_t count = dir->dir.bucket_count == 0 ? INITIAL_BUCKETS : dir->dir.bucket_count * 2;
+    if (!reserve(context, count * sizeof(node_t *)))
+        return dir->dir.bucket_count == 0 ? -ENOSPC : 0;
+    node_t **buckets = calloc(count, sizeof(node_t *));
+    if (buckets == NULL) {
+        unreserve(context, count * sizeof(node_t *));
+        return dir->dir.bucket_count == 0 ? -ENOMEM : 0;
+    }
+
+    node_t **old = dir->dir.buckets;
+    size_t old_count = dir->dir.bucket_count;
+    dir->dir.buckets = buckets;
+    dir->dir.bucket_count = count;
+    for (size_t i = 0; i < old_count; i++) {
+        node_t *node = old[i];
+        while (node != NULL) {
+            node_t *next = node->next;
+            dir_link(dir, node);
+            node = next;
+        }
+    }
+    free(old);
+    unreserve(context, old_count * sizeof(node_t *));
+    return 0;
+}
+
+static void dir_insert(node_t *dir, node_t *node) {
+    dir_link(dir, node);
+    node->parent = dir;
+    dir->dir.count++;
+}
+
+static void dir_remove(node_t *dir, node_t *node) {
+    node_t **link = &dir->dir.buckets[node->hash % dir->dir.bucket_count];
+    while (*link != node)
+        link = &(*link)->next;
+    *link = node->next;
+    node->next = NULL;
+    node->parent = NULL;
+    dir->dir.count--;
+}
+
+static void free_chunks(filesystem_tmpfs_context_t *context, node_t *node, size_t keep) {
+    chunk_t *chunk = node->file.head;
+    chunk_t *last = NULL;
+    for (size_t i = 0; i < keep; i++) {
+        last = chunk;
+        chunk = chunk->next;
+    }
+    while (chunk != NULL) {
+        chunk_t *next = chunk->next;
+        free(chunk);
+        unreserve(context, sizeof(chunk_t));
+        chunk = next;
+    }
+    if (last != NULL)
+        last->next = NULL;
+    else
+        node->file.head = NULL;
+    node->file.tail = last;
+    node->file.chunks = keep;
+    node->file.generation++;
+}
+
+static void free_node(filesystem_tmpfs_context_t *context, node_t *node) {
+    if (node->is_dir) {
+        free(node->dir.buckets);
+        unreserve(context, node->dir.bucket_count * sizeof(node_t *));
+        node->dir.buckets = NULL;
+        node->dir.bucket_count = 0;
+    } else {
+        free_chunks(context, node, 0);
+    }
+    if (node == &context->root)
+        return;
+    unreserve(context, sizeof(node_t) + strlen(node->name) + 1);
+    free(node->name);
+    free(node);
+}
+
+static void free_tree(filesystem_tmpfs_context_t *context, node_t *dir) {
+    for (size_t i = 0; i < dir->dir.bucket_count; i++) {
+        node_t *node = dir->dir.buckets[i];
+        while (node != NULL) {
+            node_t *next = node->next;
+            if (node->is_dir)
+                free_tree(context, node);
+            free_node(context, node);
+            node = next;
+        }
+    }
+    dir->dir.count = 0;
+}
+
+// Detaches a node from its directory. The memory is released once nothing has it open.
+static void remove_node(filesystem_tmpfs_context_t *context, node_t *node) {
+    dir_remove(node->parent, node);
+    node->removed = true;
+    if (node->opened == 0)
+        free_node(context, node);
+}
+
+static void release_node(filesystem_tmpfs_context_t *context, node_t *node) {
+    node->opened--;
+    context->opened--;
+    if (node->removed && node->opened == 0)
+        free_node(context, node);
+}
+
+static node_t *create_node(filesystem_tmpfs_context_t *context, const char *name, size_t length, bool is_dir) {
+    if (!reserve(context, sizeof(node_t) + length + 1))
+        return NULL;
+    node_t *node = calloc(1, sizeof(node_t));
+    char *copy = malloc(length + 1);
+    if (node == NULL || copy == NULL) {
+        free(node);
+        free(copy);
+        unreserve(context, sizeof(node_t) + length + 1);
+        return NULL;
+    }
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    node->name = copy;
+    node->hash = hash_name(name, length);
+    node->is_dir = is_dir;
+    return node;
+}
+
+// Returns the next path component before `end`, skipping slashes, or 0 at the end
+static size_t next_component(const char **path, const char *end, const char **name) {
+    while (*path < end && **path == '/')
+        (*path)++;
+    *name = *path;
+    while (*path < end && **path != '/')
+        (*path)++;
+    return (size_t)(*path - *name);
+}
+
+static int lookup(filesystem_tmpfs_context_t *context, const char *path, size_t path_length, node_t **result) {
+    const char *end = path + path_length;
+    node_t *node = &context->root;
+    const char *name;
+    size_t length;
+    while ((length = next_component(&path, end, &name)) > 0) {
+        if (!node->is_dir)
+            return -ENOTDIR;
+        if (length == 1 && name[0] == '.')
+            continue;
+        if (length == 2 && name[0] == '.' && name[1] == '.') {
+            if (node->parent != NULL)
+                node = node->parent;
+            continue;
+        }
+        node = dir_find(node, name, length, hash_name(name, length));
+        if (node == NULL)
+            return -ENOENT;
+    }
+    *result = node;
+    return 0;
+}
+
+// Resolves the directory that holds the last component of `path`
+static int lookup_parent(filesystem_tmpfs_context_t *context, const char *path, node_t **parent,
+                         const char **name, size_t *length)
+{
+    size_t end = strlen(path);
+    while (end > 0 && path[end - 1] == '/')
+        end--;
+    size_t start = end;
+    while (start > 0 && path[start - 1] != '/')
+        start--;
+    *name = path + start;
+    *length = end - start;
+    if (*length == 0 || (*length == 1 && path[start] == '.') ||
+        (*length == 2 && path[start] == '.' && path[start + 1] == '.'))
+    {
+        return -EINVAL;
+    }
+    if (*length > NAME_MAX)
+        return -ENAMETOOLONG;
+
+    int err = lookup(context, path, start, parent);
+    if (err)
+        return err;
+    if (!(*parent)->is_dir)
+        return -ENOTDIR;
+    return 0;
+}
+
+static int format(filesystem_t *fs, blockdevice_t *device) {
+    (void)device;
+    filesystem_tmpfs_context_t *context = fs->context;
+    mutex_enter_blocking(&context->_mutex);
+    if (context->opened > 0) {
+        mutex_exit(&context->_mutex);
+        return -EBUSY;
+    }
+    free_tree(context, &context->root);
+    free_node(context, &context->root);
+    mutex_exit(&context->_mutex);
+    return 0;
+}
+
+static int mount(filesystem_t *fs, blockdevice_t *device, bool pending) {
+    (void)fs;
+    (void)device;
+    (void)pending;
+    return 0;  // The content lives as long as the file system object
+}
+
+static int unmount(filesystem_t *fs) {
+    (void)fs;
+    return 0;
+}
+
+static int file_remove(filesystem_t *fs, const char *path) {
+    filesystem_tmpfs_context_t *context = fs->context;
+    mutex_enter_blocking(&context->_mutex);
+    node_t *parent;
+    const char *name;
+    size_t length;
+    int err = lookup_parent(context, path, &parent, &name, &length);
+    if (err == 0) {
+        node_t *node = dir_find(parent, name, length, hash_name(name, length));
+        if (node == NULL)
+            err = -ENOENT;
+        else if (node->is_dir && node->dir.count > 0)
+            err = -ENOTEMPTY;
+        else
+            remove_node(context, node);
+    }
+    mutex_exit(&context->_mutex);
+    return err;
+}
+
+static int file_rmdir(filesystem_t *fs, const char *path) {
+    filesystem_tmpfs_context_t *context = fs->context;
+    mutex_enter_blocking(&context->_mutex);
+    node_t *parent;
+    const char *name;
+    size_t length;
+    int err = lookup_parent(context, path, &parent, &name, &length);
+    if (err == 0) {
+        node_t *node = dir_find(parent, name, length, hash_name(name, length));
+        if (node == NULL)
+            err = -ENOENT;
+        else if (!node->is_dir)
+            err = -ENOTDIR;
+        else if (node->dir.count > 0)
+            err = -ENOTEMPTY;
+        else
+            remove_node(context, node);
+    }
+    mutex_exit(&context->_mutex);
+    return err;
+}
+
+static int file_rename(filesystem_t *fs, const char *oldpath, const char *newpath) {
+    filesystem_tmpfs_context_t *context = fs->context;
+    mutex_enter_blocking(&context->_mutex);
+    node_t *old_parent, *new_parent;
+    const char *old_name, *new_name;
+    size_t old_length, new_length;
+    int err = lookup_parent(context, oldpath, &old_parent, &old_name, &old_length);
+    if (err == 0)
+        err = lookup_parent(context, newpath, &new_parent, &new_name, &new_length);
+    node_t *node = NULL;
+    if (err == 0) {
+        node = dir_find(old_parent, old_name, old_length, hash_name(old_name, old_length));
+        if (node == NULL)
+            err = -ENOENT;
+    }
+    if (err == 0 && node->is_dir) {
+        // A directory cannot move below itself
+        for (node_t *p = new_parent; p != NULL; p = p->parent) {
+            if (p == node) {
+                err = -EINVAL;
+                break;
+            }
+        }
+    }
+    node_t *target = NULL;
+    if (err == 0) {
+        target = dir_find(new_parent, new_name, new_length, hash_name(new_name, new_length));
+        if (target == node) {
+            mutex_exit(&context->_mutex);
+            return 0;
+        }
+        if (target != NULL && target->is_dir && !node->is_dir)
+            err = -EISDIR;
+        else if (target != NULL && !target->is_dir && node->is_dir)
+            err = -ENOTDIR;
+        else if (target != NULL && target->is_dir && target->dir.count > 0)
+            err = -ENOTEMPTY;
+    }
+    char *name = NULL;
+    if (err == 0) {
+        if (!reserve(context, new_length + 1)) {
+            err = -ENOSPC;
+        } else {
+            name = malloc(new_length + 1);
+            if (name == NULL) {
+                unreserve(context, new_length + 1);
+                err = -ENOMEM;
+            }
+        }
+    }
+    if (err == 0 && target == NULL && new_parent != old_parent)
+        err = dir_grow(context, new_parent);
+    if (err != 0) {
+        if (name != NULL) {
+            free(name);
+            unreserve(context, new_length + 1);
+        }
+        mutex_exit(&context->_mutex);
+        return err;
+    }
+
+    if (target != NULL)
+        remove_node(context, target);
+    memcpy(name, new_name, new_length);
+    name[new_length] = '\0';
+    unreserve(context, strlen(node->name) + 1);
+    dir_remove(old_parent, node);
+    free(node->name);
+    node->name = name;
+    node->hash = hash_name(new_name, new_length);
+    dir_insert(new_parent, node);
+    mutex_exit(&context->_mutex);
+    return 0;
+}
+
+static int file_mkdir(filesystem_t *fs, const char *path, mode_t mode) {
+    (void)mode;
+    filesystem_tmpfs_context_t *context = fs->context;
+    mutex_enter_blocking(&context->_mutex);
+    node_t *parent;
+    const char *name;
+    size_t length;
+    int err = lookup_parent(context, path, &parent, &name, &length);
+    if (err == 0 && dir_find(parent, name, length, hash_name(name, length)) != NULL)
+        err = -EEXIST;
+    if (err == 0)
+        err = dir_grow(context, parent);
+    if (err == 0) {
+        node_t *node = create_node(context, name, length, true);
+        if (node == NULL)
+            err = -ENOSPC;
+        else
+            dir_insert(parent, node);
+    }
+    mutex_exit(&context->_mutex);
+    return err;
+}
+
+static int file_stat(filesystem_t *fs, const char *path, struct stat *st) {
+    filesystem_tmpfs_context_t *context = fs->context;
+    mutex_enter_blocking(&context->_mutex);
+    node_t *node;
+    int err = lookup(context, path, strlen(path), &node);
+    if (err == 0) {
+        st->st_size = node->is_dir ? 0 : node->file.size;
+        st->st_mode = (node->is_dir ? S_IFDIR : S_IFREG) | S_IRWXU | S_IRWXG | S_IRWXO;
+    }
+    mutex_exit(&context->_mutex);
+    return err;
+}
+
+static bool append_chunk(filesystem_tmpfs_context_t *context, node_t *node) {
+    if (!reserve(context, sizeof(chunk_t)))
+        return false;
+    chunk_t *chunk = malloc(sizeof(chunk_t));
+    if (chunk == NULL) {
+        unreserve(context, sizeof(chunk_t));
+        return false;
+    }
+    chunk->next = NULL;
+    if (node->file.tail != NULL)
+        node->file.tail->next = chunk;
+    else
+        node->file.head = chunk;
+    node->file.tail = chunk;
+    node->file.chunks++;
+    return true;
+}
+
+// Allocates the chunks up to `end` and returns the end of the allocated data
+static off_t allocate(filesystem_tmpfs_context_t *context, node_t *node, off_t end) {
+    size_t needed = (size_t)((end + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    while (node->file.chunks < needed && append_chunk(context, node))
+        ;
+    off_t capacity = (off_t)node->file.chunks * CHUNK_SIZE;
+    return capacity < end ? capacity : end;
+}
+
+static chunk_t *seek_chunk(tmpfs_file_t *f, size_t index) {
+    node_t *node = f->node;
+    if (index + 1 == node->file.chunks) {
+        f->chunk = node->file.tail;  // Appends do not walk the list
+        f->index = index;
+    } else if (f->chunk == NULL || f->generation != node->file.generation || f->index > index) {
+        f->chunk = node->file.head;
+        f->index = 0;
+    }
+    f->generation = node->file.generation;
+    while (f->index < index) {
+        f->chunk = f->chunk->next;
+        f->index++;
+    }
+    return f->chunk;
+}
+
+/*
+ * Copies file data at `offset` to `out`, or from `in` to the file. With neither, the range
+ * is filled with zeros. The chunks of the range must be allocated.
+ */
+static void transfer(tmpfs_file_t *f, off_t offset, uint8_t *out, const uint8_t *in, size_t length) {
+    size_t at = (size_t)(offset % CHUNK_SIZE);
+    chunk_t *chunk = seek_chunk(f, (size_t)(offset / CHUNK_SIZE));
+    while (length > 0) {
+        size_t n = CHUNK_SIZE - at < length ? CHUNK_SIZE - at : length;
+        if (out != NULL) {
+            memcpy(out, chunk->data + at, n);
+            out += n;
+        } else if (in != NULL) {
+            memcpy(chunk->data + at, in, n);
+            in += n;
+        } else {
+            memset(chunk->data + at, 0, n);
+        }
+        length -= n;
+        at = 0;
+        if (length > 0) {
+            chunk = chunk->next;
+            f->chunk = chunk;
+            f->index++;
+        }
+    }
+}
+
+static ssize_t read_at(tmpfs_file_t *f, off_t offset, void *buffer, size_t length) {
+    off_t size = f->node->file.size;
+    if (offset >= size || length == 0)
+        return 0;
+    if ((off_t)length > size - offset)
+        length = (size_t)(size - offset);
+    transfer(f, offset, buffer, NULL, length);
+    return (ssize_t)length;
+}
+
+static ssize_t write_at(filesystem_tmpfs_context_t *context, tmpfs_file_t *f, off_t offset,
+                        const void *buffer, size_t length)
+{
+    if (length == 0)
+        return 0;
+    node_t *node = f->node;
+    off_t end = allocate(context, node, offset + (off_t)length);
+    if (end <= offset)
+        return -ENOSPC;
+    if (offset > node->file.size)
+        transfer(f, node->file.size, NULL, NULL, (size_t)(offset - node->file.size));
+    transfer(f, offset, NULL, buffer, (size_t)(end - offset));
+    if (end > node->file.size)
+        node->file.size = end;
+    return (ssize_t)(end - offset);
+}
+
+static int file_open(filesystem_t *fs, fs_file_t *file, const char *path, int flags) {
+    filesystem_tmpfs_context_t *context = fs->context;
+    mutex_enter_blocking(&context->_mutex);
+    node_t *parent;
+    const char *name;
+    size_t length;
+    int err = lookup_parent(context, path, &parent, &name, &length);
+    if (err) {
+        mutex_exit(&context->_mutex);
+        return err == -EINVAL ? -EISDIR : err;
+    }
+    node_t *node = dir_find(parent, name, length, hash_name(name, length));
+    if (node == NULL && !(flags & O_CREAT))
+        err = -ENOENT;
+    else if (node != NULL && (flags & O_CREAT) && (flags & O_EXCL))
+        err = -EEXIST;
+    else if (node != NULL && node->is_dir)
+        err = -EISDIR;
+    tmpfs_file_t *f = NULL;
+    if (err == 0) {
+        f = fs_object_pool_acquire(&context->file_pool);
+        if (f == NULL)
+            err = -ENOMEM;
+    }
+    if (err == 0 && node == NULL) {
+        err = dir_grow(context, parent);
+        if (err == 0) {
+            node = create_node(context, name, length, false);
+            if (node == NULL)
+                err = -ENOSPC;
+            else
+                dir_insert(parent, node);
+        }
+    }
+    if (err) {
+        fs_object_pool_release(&context->file_pool, f);
+        mutex_exit(&context->_mutex);
+        return err;
+    }
+
+    if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY) {
+        free_chunks(context, node, 0);
+        node->file.size = 0;
+    }
+    f->node = node;
+    f->flags = flags;
+    node->opened++;
+    context->opened++;
+    mutex_exit(&context->_mutex);
+
+    file->context = f;
+    return 0;
+}
+
+static int file_close(filesystem_t *fs, fs_file_t *file) {
+    filesystem_tmpfs_context_t *context = fs->context;
+    tmpfs_file_t *f = file->context;
+
+    mutex_enter_blocking(&context->_mutex);
+    release_node(context, f->node);
+    fs_object_pool_release(&context->file_pool, f);
+    mutex_exit(&context->_mutex);
+
+    file->context = NULL;
+    return 0;
+}
+
+static ssize_t file_read(filesystem_t *fs, fs_file_t *file, void *buffer, size_t size) {
+    filesystem_tmpfs_context_t *context = fs->context;
+    tmpfs_file_t *f = file->context;
+    if ((f->flags & O_ACCMODE) == O_WRONLY)
+        return -EBADF;
+
+    mutex_enter_blocking(&context->_mutex);
+    ssize_t res = read_at(f, f->position, buffer, size);
+    if (res > 0)
+        f->position += res;
+    mutex_exit(&context->_mutex);
+    return res;
+}
+
+static ssize_t file_write(filesystem_t *fs, fs_file_t *file, const void *buffer, size_t size) {
+    filesystem_tmpfs_context_t *context = fs->context;
+    tmpfs_file_t *f = file->context;
+    if ((f->flags & O_ACCMODE) == O_RDONLY)
+        return -EBADF;
+
+    mutex_enter_blocking(&context->_mutex);
+    if (f->flags & O_APPEND)
+        f->position = f->node->file.size;
+    ssize_t res = write_at(context, f, f->position, buffer, size);
+    if (res > 0)
+        f->position += res;
+    mutex_exit(&context->_mutex);
+    return res;
+}
+
+static ssize_t _file_transfer(filesystem_t *fs, fs_file_t *file, const struct iovec *iov, int iovcnt,
+                              off_t offset, bool write)
+{
+    filesystem_tmpfs_context_t *context = fs->context;
+    tmpfs_file_t *f = file->context;
+    if ((f->flags & O_ACCMODE) == (write ? O_RDONLY : O_WRONLY))
+        return -EBADF;
+
+    mutex_enter_blocking(&context->_mutex);
+    off_t position = offset >= 0 ? offset : f->position;
+    ssize_t total = 0;
+    ssize_t res = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (write)
+            res = write_at(context, f, position, iov[i].iov_base, iov[i].iov_len);
+        else
+            res = read_at(f, position, iov[i].iov_base, iov[i].iov_len);
+        if (res < 0)
+            break;
+        total += res;
+        position += res;
+        if ((size_t)res < iov[i].iov_len)
+            break;
+    }
+    if (offset < 0)
+        f->position = position;
+    mutex_exit(&context->_mutex);
+
+    if (res < 0 && total == 0)
+        return res;
+    return total;
+}
+
+static ssize_t file_preadv(filesystem_t *fs, fs_file_t *file, const struct iovec *iov, int iovcnt, off_t offset) {
+    return _file_transfer(fs, file, iov, iovcnt, offset, false);
+}
+
+static ssize_t file_pwritev(filesystem_t *fs, fs_file_t *file, const struct iovec *iov, int iovcnt, off_t offset) {
+    return _file_transfer(fs, file, iov, iovcnt, offset, true);
+}
+
+static int file_sync(filesystem_t *fs, fs_file_t *file) {
+    (void)fs;
+    (void)file;
+    return 0;
+}
+
+static off_t file_seek(filesystem_t *fs, fs_file_t *file, off_t offset, int whence) {
+    filesystem_tmpfs_context_t *context = fs->context;
+    tmpfs_file_t *f = file->context;
+
+    mutex_enter_blocking(&context->_mutex);
+    off_t position;
+    switch (whence) {
+    case SEEK_SET:
+        position = offset;
+        break;
+    case SEEK_CUR:
+        position = f->position + offset;
+        break;
+    case SEEK_END:
+        position = f->node->file.size + offset;
+        break;
+    default:
+        position = -1;
+        break;
+    }
+    if (position < 0) {
+        mutex_exit(&context->_mutex);
+        return -EINVAL;
+    }
+    f->position = position;
+    mutex_exit(&context->_mutex);
+    return position;
+}
+
+static off_t file_tell(filesystem_t *fs, fs_file_t *file) {
+    (void)fs;
+    tmpfs_file_t *f = file->context;
+    return f->position;
+}
+
+static off_t file_size(filesystem_t *fs, fs_file_t *file) {
+    filesystem_tmpfs_context_t *context = fs->context;
+    tmpfs_file_t *f = file->context;
+
+    mutex_enter_blocking(&context->_mutex);
+    off_t size = f->node->file.size;
+    mutex_exit(&context->_mutex);
+    return size;
+}
+
+static int file_truncate(filesystem_t *fs, fs_file_t *file, off_t length) {
+    filesystem_tmpfs_context_t *context = fs->context;
+    tmpfs_file_t *f = file->context;
+    if ((f->flags & O_ACCMODE) == O_RDONLY)
+        return -EBADF;
+    if (length < 0)
+        return -EINVAL;
+
+    mutex_enter_blocking(&context->_mutex);
+    node_t *node = f->node;
+    int err = 0;
+    if (length < node->file.size) {
+        free_chunks(context, node, (size_t)((length + CHUNK_SIZE - 1) / CHUNK_SIZE));
+        node->file.size = length;
+    } else if (length > node->file.size) {
+        if (allocate(context, node, length) < length) {
+            err = -ENOSPC;
+        } else {
+            transfer(f, node->file.size, NULL, NULL, (size_t)(length - node->file.size));
+            node->file.size = length;
+        }
+    }
+    mutex_exit(&context->_mutex);
+    return err;
+}
+
+static int dir_open(filesystem_t *fs, fs_dir_t *dir, const char *path) {
+    filesystem_tmpfs_context_t *context = fs->context;
+    mutex_enter_blocking(&context->_mutex);
+    node_t *node;
+    int err = lookup(context, path, strlen(path), &node);
+    if (err == 0 && !node->is_dir)
+        err = -ENOTDIR;
+    tmpfs_dir_t *d = NULL;
+    if (err == 0) {
+        d = fs_object_pool_acquire(&context->dir_pool);
+        if (d == NULL) {
+            fprintf(stderr, "dir_open: Out of memory\n");
+            err = -ENOMEM;
+        }
+    }
+    if (err == 0) {
+        d->node = node;
+        node->opened++;
+        context->opened++;
+        dir->context = d;
+        dir->fd = -1;
+    }
+    mutex_exit(&context->_mutex);
+    return err;
+}
+
+static int dir_close(filesystem_t *fs, fs_dir_t *dir) {
+    filesystem_tmpfs_context_t *context = fs->context;
+    tmpfs_dir_t *d = dir->context;
+
+    mutex_enter_blocking(&context->_mutex);
+    release_node(context, d->node);
+    fs_object_pool_release(&context->dir_pool, d);
+    mutex_exit(&context->_mutex);
+    return 0;
+}
+
+static int dir_read(filesystem_t *fs, fs_dir_t *dir, struct dirent *ent) {
+    filesystem_tmpfs_context_t *context = fs->context;
+    tmpfs_dir_t *d = dir->context;
+
+    mutex_enter_blocking(&context->_mutex);
+    node_t *node = NULL;
+    while (d->bucket < d->node->dir.bucket_count) {
+        node = d->node->dir.buckets[d->bucket];
+        for (size_t i = 0; i < d->position && node != NULL; i++)
+            node = node->next;
+        if (node != NULL)
+            break;
+        d->bucket++;
+        d->position = 0;
+    }
+    if (node == NULL) {
+        mutex_exit(&context->_mutex);
+        return -ENOENT;
+    }
+    d->position++;
+    ent->d_type = node->is_dir ? DT_DIR : DT_REG;
+    strcpy(ent->d_name, node->name);
+    mutex_exit(&context->_mutex);
+    return 0;
+}
+
+filesystem_t *filesystem_tmpfs_create(size_t max_bytes) {
+    filesystem_t *fs = calloc(1, sizeof(filesystem_t));
+    if (fs == NULL) {
+        fprintf(stderr, "filesystem_tmpfs_create: Out of memory\n");
+        return NULL;
+    }
+
+    fs->type = FILESYSTEM_TYPE_TMPFS;
+    fs->name = FILESYSTEM_NAME;
+    fs->mount = mount;
+    fs->unmount = unmount;
+    fs->format = format;
+    fs->remove = file_remove;
+    fs->rename = file_rename;
+    fs->mkdir = file_mkdir;
+    fs->rmdir = file_rmdir;
+    fs->stat = file_stat;
+    fs->file_open = file_open;
+    fs->file_close = file_close;
+    fs->file_write = file_write;
+    fs->file_read = file_read;
+    fs->file_sync = file_sync;
+    fs->file_seek = file_seek;
+    fs->file_tell = file_tell;
+    fs->file_size = file_size;
+    fs->file_truncate = file_truncate;
+    fs->dir_open = dir_open;
+    fs->dir_close = dir_close;
+    fs->dir_read = dir_read;
+    fs->file_preadv = file_preadv;
+    fs->file_pwritev = file_pwritev;
+
+    filesystem_tmpfs_context_t *context = calloc(1, sizeof(filesystem_tmpfs_context_t));
+    if (context == NULL) {
+        fprintf(stderr, "filesystem_tmpfs_create: Out of memory\n");
+        free(fs);
+        return NULL;
+    }
+    mutex_init(&context->_mutex);
+    context->root.is_dir = true;
+    context->max_bytes = max_bytes;
+    fs_object_pool_init(&context->file_pool, sizeof(tmpfs_file_t), PICO_VFS_MAX_OPEN_FILES);
+    fs_object_pool_init(&context->dir_pool, sizeof(tmpfs_dir_t), PICO_VFS_MAX_OPEN_DIRS);
+    fs->context = context;
+    return fs;
+}
+
+void filesystem_tmpfs_free(filesystem_t *fs) {
+    filesystem_tmpfs_context_t *context = fs->context;
+    free_tree(context, &context->root);
+    free_node(context, &context->root);
+    fs_object_pool_deinit(&context->file_pool);
+    fs_object_pool_deinit(&context->dir_pool);
+    free(fs->context);
+    fs->context = NULL;
+    free(fs);
+}
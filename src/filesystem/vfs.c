@@ -3,29 +3,66 @@
  *
  * SPDX-License-Identifier: BSD-3-Clause
  */
+#include <ctype.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <sys/errno.h>
 #include <sys/dirent.h>
 #include <sys/unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <pico/mutex.h>
+#include <pico/sem.h>
+#include <pico/time.h>
 #include "filesystem/vfs.h"
+#if LIB_FREERTOS_KERNEL
+#include <FreeRTOS.h>
+#include <semphr.h>
+#include <task.h>
+#define VFS_FREERTOS_MUTEX    (configUSE_RECURSIVE_MUTEXES && configSUPPORT_STATIC_ALLOCATION)
+#else
+#define VFS_FREERTOS_MUTEX    0
+#endif
+
+#if !defined(IOV_MAX)
+#define IOV_MAX    64
+#endif
 
 
 typedef struct {
     const char *dir;
     void *filesystem;
     void *device;
+    bool sync_gathering;   // An fsync() leader is collecting requests for a group commit
 } mountpoint_t;
 
 typedef struct {
-    fs_file_t *file;
+    fs_file_t file;
     filesystem_t *filesystem;
-    char path[PATH_MAX + 1];
+    mountpoint_t *mountpoint;
+    uint32_t path_hash;    // Dentry cache key of the opened path, DENTRY_ANY if not canonical
+    off_t size;            // File size as seen through this descriptor
+    mode_t mode;
+    blksize_t blksize;
+    volatile bool sync_requested;  // Waiting to be flushed by the next group commit
+    int sync_result;
+    uint8_t sync_waiters;  // fsync() callers waiting for the leader of the group commit
+    semaphore_t sync_done; // Released once per waiter when the group commit is done
+    uint8_t *buffer;       // O_RDBUF/O_WRBUF buffer, NULL if the descriptor is unbuffered
+    int buffer_flags;      // O_RDBUF and O_WRBUF given to open()
+    size_t buffer_size;
+    size_t buffer_length;  // Bytes read ahead, or bytes waiting to be written if buffer_dirty
+    size_t buffer_offset;  // Bytes of the read-ahead data already returned to the caller
+    bool buffer_dirty;
+    off_t buffer_position; // File position of the first byte waiting to be written
+    uint64_t buffer_since; // Time the oldest byte waiting to be written was buffered
+    int buffer_error;      // Error of a background flush, reported by the next write, fsync or close
 } file_descriptor_t;
 
 typedef struct {
-    fs_dir_t *dir;
+    fs_dir_t dir;
     filesystem_t *filesystem;
 } dir_descriptor_t;
 
@@ -33,16 +70,121 @@ typedef struct {
 #define PICO_VFS_MAX_MOUNTPOINT        10
 #endif
 #define FS_MAX_MOUNTPOINT              PICO_VFS_MAX_MOUNTPOINT
+#define FS_MAX_OPEN_FILES              PICO_VFS_MAX_OPEN_FILES
+#define FS_MAX_OPEN_DIRS               PICO_VFS_MAX_OPEN_DIRS
+#if !defined(PICO_VFS_DENTRY_CACHE_SIZE)
+#define PICO_VFS_DENTRY_CACHE_SIZE     16
+#endif
+#define DENTRY_CACHE_SIZE              PICO_VFS_DENTRY_CACHE_SIZE
+#define DENTRY_PATH_MAX                64
+#if !defined(PICO_VFS_MAX_MAPPINGS)
+#define PICO_VFS_MAX_MAPPINGS          8
+#endif
+#if !defined(PICO_VFS_COPY_BUFFER_SIZE)
+#define PICO_VFS_COPY_BUFFER_SIZE      4096
+#endif
+#if !defined(PICO_VFS_GROUP_COMMIT_WINDOW_US)
+#define PICO_VFS_GROUP_COMMIT_WINDOW_US    0
+#endif
+#if !defined(PICO_VFS_FILE_BUFFER_SIZE)
+#define PICO_VFS_FILE_BUFFER_SIZE      512
+#endif
+#if !defined(PICO_VFS_WRITE_BUFFER_AGE_US)
+#define PICO_VFS_WRITE_BUFFER_AGE_US   100000
+#endif
+#if !defined(PICO_VFS_MAX_IDLE_HANDLERS)
+#define PICO_VFS_MAX_IDLE_HANDLERS     4
+#endif
 #define STDIO_FILNO_MAX                STDERR_FILENO
 #define FILENO_VALUE(fd)               (fd + STDIO_FILNO_MAX + 1)  // Conversion to file descriptors for publication
 #define FILENO_INDEX(fd)               (fd - STDIO_FILNO_MAX - 1)  // Conversion to file descriptors for internal use
+#define BITMAP_WORDS(n)                (((n) + 31) / 32)
 
-static mountpoint_t mountpoints[FS_MAX_MOUNTPOINT] = {0};  // Mount points and file system map
-static size_t max_file_descriptor = 0;                     // File descriptor current maximum value
-static file_descriptor_t *file_descriptor = NULL;          // File descriptor and file system map
-static size_t max_dir_descriptor = 0;                      // Dir descriptor current maximum value
-static dir_descriptor_t *dir_descriptor = NULL;            // Dir descriptor and file system map
-static recursive_mutex_t __attribute__((unused)) _mutex;   // Recursive mutexes are used because recursive calls occur, e.g. on loopback devices
+static mountpoint_t mountpoints[FS_MAX_MOUNTPOINT] = {0};              // Mount points and file system map
+static file_descriptor_t file_descriptor[FS_MAX_OPEN_FILES] = {0};     // File descriptor and file system map
+static uint32_t file_descriptor_used[BITMAP_WORDS(FS_MAX_OPEN_FILES)]; // In-use bitmap of file_descriptor
+static dir_descriptor_t dir_descriptor[FS_MAX_OPEN_DIRS] = {0};        // Dir descriptor and file system map
+static uint32_t dir_descriptor_used[BITMAP_WORDS(FS_MAX_OPEN_DIRS)];   // In-use bitmap of dir_descriptor
+/*
+ * Dentry cache
+ *
+ * Caches the result of stat() per mount point and path, including negative results, so
+ * that repeated lookups of the same paths do not walk FAT directory clusters or littlefs
+ * metadata pairs. Entries are dropped by every VFS operation that can change them.
+ */
+enum {
+    DENTRY_UNUSED = 0,
+    DENTRY_NEGATIVE,
+    DENTRY_POSITIVE,
+};
+
+#define DENTRY_ANY  0  // Key of a path that is not cached
+
+typedef struct {
+    uint8_t state;
+    mountpoint_t *mountpoint;
+    uint32_t hash;
+    off_t size;
+    mode_t mode;
+    char path[DENTRY_PATH_MAX];
+} dentry_t;
+
+#if DENTRY_CACHE_SIZE > 0
+static dentry_t dentry_cache[DENTRY_CACHE_SIZE];
+static size_t dentry_victim = 0;
+#endif
+static volatile uint64_t last_activity_us = 0;  // Time of the most recent request, used to detect idle periods
+static void (*idle_handlers[PICO_VFS_MAX_IDLE_HANDLERS])(void);  // Called by fs_gc_idle_poll()
+
+/*
+ * VFS lock. Under FreeRTOS a recursive FreeRTOS mutex is used, so that a high-priority task
+ * waiting for the lock raises the priority of the holder instead of spinning behind it.
+ */
+#if VFS_FREERTOS_MUTEX
+static StaticSemaphore_t _mutex_buffer;
+static SemaphoreHandle_t _mutex = NULL;
+
+static SemaphoreHandle_t vfs_mutex(void) {
+    if (_mutex == NULL) {
+        taskENTER_CRITICAL();
+        if (_mutex == NULL)
+            _mutex = xSemaphoreCreateRecursiveMutexStatic(&_mutex_buffer);
+        taskEXIT_CRITICAL();
+    }
+    return _mutex;
+}
+
+static void vfs_lock(void) {
+    xSemaphoreTakeRecursive(vfs_mutex(), portMAX_DELAY);
+}
+
+static bool vfs_try_lock(void) {
+    return xSemaphoreTakeRecursive(vfs_mutex(), 0) == pdTRUE;
+}
+
+static void vfs_exit(void) {
+    xSemaphoreGiveRecursive(_mutex);
+}
+#else
+auto_init_recursive_mutex(_mutex);  // Recursive mutexes are used because recursive calls occur, e.g. on loopback devices
+
+static void vfs_lock(void) {
+    recursive_mutex_enter_blocking(&_mutex);
+}
+
+static bool vfs_try_lock(void) {
+    return recursive_mutex_try_enter(&_mutex, NULL);
+}
+
+static void vfs_exit(void) {
+    recursive_mutex_exit(&_mutex);
+}
+#endif
+
+static void vfs_enter(void) {
+    vfs_lock();
+    last_activity_us = time_us_64();
+}
 
 static int _error_remap(int err) {
     if (err >= 0) {
@@ -69,6 +211,8 @@ static mountpoint_t *find_mountpoint(const char *path) {
     size_t longest_length = 0;
 
     for (size_t i = 0; i < FS_MAX_MOUNTPOINT; i++) {
+        if (mountpoints[i].filesystem == NULL)
+            continue;
         size_t prefix_length = strlen(mountpoints[i].dir);
         if (prefix_length > longest_length && strncmp(path, mountpoints[i].dir, prefix_length) == 0) {
             longest_match = &mountpoints[i];
@@ -78,99 +222,504 @@ static mountpoint_t *find_mountpoint(const char *path) {
     return longest_match;
 }
 
+/*
+ * Only canonical paths are cached: a path with empty, "." or ".." components, or a FAT
+ * short name alias, could name the same entry under a different key. Paths in the root
+ * mount point have no leading slash.
+ */
+static bool dentry_cacheable(mountpoint_t *mp, const char *path) {
+    size_t length = strlen(path);
+    if (length == 0 || length >= DENTRY_PATH_MAX || path[0] == '.')
+        return false;
+    if (length > 1 && path[length - 1] == '/')
+        return false;
+    if (strstr(path, "//") != NULL || strstr(path, "/.") != NULL)
+        return false;
+    if (((filesystem_t *)mp->filesystem)->type == FILESYSTEM_TYPE_FAT) {
+        for (const char *p = path; *p != '\0'; p++) {
+            if (*p == '~' || (unsigned char)*p >= 0x80)
+                return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Dentry cache key of a path. A path that is not cacheable may name any cached entry, so its
+ * key is DENTRY_ANY, which invalidates the whole mount point.
+ */
+static uint32_t dentry_hash(mountpoint_t *mp, const char *path) {
+    if (!dentry_cacheable(mp, path))
+        return DENTRY_ANY;
+    bool fold = ((filesystem_t *)mp->filesystem)->type == FILESYSTEM_TYPE_FAT;  // FAT names are case insensitive
+    uint32_t hash = 2166136261U;
+    for (const char *p = path; *p != '\0'; p++) {
+        hash ^= (uint8_t)(fold ? tolower((unsigned char)*p) : *p);
+        hash *= 16777619U;
+    }
+    return hash != DENTRY_ANY ? hash : hash + 1;
+}
+
+#if DENTRY_CACHE_SIZE > 0
+static dentry_t *dentry_find(mountpoint_t *mp, const char *path, uint32_t hash) {
+    bool fold = ((filesystem_t *)mp->filesystem)->type == FILESYSTEM_TYPE_FAT;
+    for (size_t i = 0; i < DENTRY_CACHE_SIZE; i++) {
+        dentry_t *entry = &dentry_cache[i];
+        if (entry->state == DENTRY_UNUSED || entry->hash != hash || entry->mountpoint != mp)
+            continue;
+        if ((fold ? strcasecmp(entry->path, path) : strcmp(entry->path, path)) == 0)
+            return entry;
+    }
+    return NULL;
+}
+#endif
+
+static int dentry_lookup(mountpoint_t *mp, const char *path, struct stat *st) {
+#if DENTRY_CACHE_SIZE > 0
+    if (!dentry_cacheable(mp, path))
+        return 1;
+    dentry_t *entry = dentry_find(mp, path, dentry_hash(mp, path));
+    if (entry == NULL)
+        return 1;
+    if (entry->state == DENTRY_NEGATIVE)
+        return -ENOENT;
+    if (st != NULL) {
+        st->st_size = entry->size;
+        st->st_mode = entry->mode;
+    }
+    return 0;
+#else
+    (void)mp;
+    (void)path;
+    (void)st;
+    return 1;
+#endif
+}
+
+static void dentry_store(mountpoint_t *mp, const char *path, const struct stat *st) {
+#if DENTRY_CACHE_SIZE > 0
+    if (!dentry_cacheable(mp, path))
+        return;
+    uint32_t hash = dentry_hash(mp, path);
+    dentry_t *entry = dentry_find(mp, path, hash);
+    for (size_t i = 0; entry == NULL && i < DENTRY_CACHE_SIZE; i++) {
+        if (dentry_cache[i].state == DENTRY_UNUSED)
+            entry = &dentry_cache[i];
+    }
+    if (entry == NULL) {
+        entry = &dentry_cache[dentry_victim];
+        dentry_victim = (dentry_victim + 1) % DENTRY_CACHE_SIZE;
+    }
+    entry->state = st != NULL ? DENTRY_POSITIVE : DENTRY_NEGATIVE;
+    entry->mountpoint = mp;
+    entry->hash = hash;
+    entry->size = st != NULL ? st->st_size : 0;
+    entry->mode = st != NULL ? st->st_mode : 0;
+    strcpy(entry->path, path);
+#else
+    (void)mp;
+    (void)path;
+    (void)st;
+#endif
+}
+
+static void dentry_invalidate_hash(mountpoint_t *mp, uint32_t hash) {
+#if DENTRY_CACHE_SIZE > 0
+    for (size_t i = 0; i < DENTRY_CACHE_SIZE; i++) {
+        if ((hash == DENTRY_ANY || dentry_cache[i].hash == hash) && dentry_cache[i].mountpoint == mp)
+            dentry_cache[i].state = DENTRY_UNUSED;
+    }
+#else
+    (void)mp;
+    (void)hash;
+#endif
+}
+
+static void dentry_invalidate(mountpoint_t *mp, const char *path) {
+    dentry_invalidate_hash(mp, dentry_hash(mp, path));
+}
+
+/*
+ * Drop every entry of a mount point, or of all mount points if mp is NULL
+ */
+static void dentry_invalidate_all(mountpoint_t *mp) {
+#if DENTRY_CACHE_SIZE > 0
+    for (size_t i = 0; i < DENTRY_CACHE_SIZE; i++) {
+        if (mp == NULL || dentry_cache[i].mountpoint == mp)
+            dentry_cache[i].state = DENTRY_UNUSED;
+    }
+#else
+    (void)mp;
+#endif
+}
+
+/*
+ * Descriptor slots are managed with an in-use bitmap: allocation picks the lowest free
+ * slot with a count-trailing-zeros per word, so open() keeps the POSIX lowest-numbered
+ * descriptor semantics without scanning the table or touching the heap.
+ */
+static int bitmap_acquire(uint32_t *bitmap, size_t capacity) {
+    for (size_t i = 0; i < BITMAP_WORDS(capacity); i++) {
+        uint32_t available = ~bitmap[i];
+        if (available == 0)
+            continue;
+        size_t index = i * 32 + __builtin_ctz(available);
+        if (index >= capacity)
+            break;
+        bitmap[i] |= 1U << (index % 32);
+        return (int)index;
+    }
+    return -1;
+}
+
+static void bitmap_release(uint32_t *bitmap, size_t index) {
+    bitmap[index / 32] &= ~(1U << (index % 32));
+}
+
+static bool bitmap_test(const uint32_t *bitmap, size_t index) {
+    return (bitmap[index / 32] & (1U << (index % 32))) != 0;
+}
+
 static bool is_valid_file_descriptor(int fildes) {
-    if (fildes <= STDIO_FILNO_MAX || (int)max_file_descriptor <= FILENO_INDEX(fildes))
+    if (fildes <= STDIO_FILNO_MAX || FS_MAX_OPEN_FILES <= FILENO_INDEX(fildes))
+        return false;
+    else
+        return bitmap_test(file_descriptor_used, FILENO_INDEX(fildes));
+}
+
+static bool is_valid_dir_descriptor(const DIR *dir) {
+    if (dir == NULL || dir->fd < 0 || FS_MAX_OPEN_DIRS <= dir->fd)
         return false;
     else
-        return true;
+        return bitmap_test(dir_descriptor_used, dir->fd);
+}
+
+/*
+ * Descriptor buffer. The buffer holds either data read ahead or data waiting to be written.
+ * The file system position is at the end of the data read ahead, or at the start of the data
+ * waiting to be written, so operations that use or change the position drain the buffer
+ * first. Called with the VFS lock held.
+ */
+static size_t buffer_size_for(const blockdevice_t *device) {
+    if (device == NULL)
+        return PICO_VFS_FILE_BUFFER_SIZE;  // In-memory file system
+    size_t size = device->erase_size;  // One erase block, the unit the device prefers
+    if (size > PICO_VFS_FILE_BUFFER_SIZE)
+        size = PICO_VFS_FILE_BUFFER_SIZE;
+    if (size < device->read_size)
+        size = device->read_size;
+    return size;
+}
+
+// Drop the read-ahead data and return the number of bytes that were not consumed
+static size_t buffer_discard(file_descriptor_t *descriptor) {
+    size_t unread = descriptor->buffer_length - descriptor->buffer_offset;
+    descriptor->buffer_length = 0;
+    descriptor->buffer_offset = 0;
+    return unread;
+}
+
+// Write out the data waiting in the buffer. On failure the data not yet written stays in the
+// buffer, so that a later flush can retry it.
+static int buffer_flush(file_descriptor_t *descriptor) {
+    if (!descriptor->buffer_dirty)
+        return 0;
+    filesystem_t *fs = descriptor->filesystem;
+    size_t done = 0;
+    int err = 0;
+    while (done < descriptor->buffer_length) {
+        ssize_t size = fs->file_write(fs, &descriptor->file, descriptor->buffer + done,
+                                      descriptor->buffer_length - done);
+        if (size <= 0) {
+            err = size < 0 ? size : -ENOSPC;
+            break;
+        }
+        done += size;
+    }
+    if (done > 0)
+        dentry_invalidate_hash(descriptor->mountpoint, descriptor->path_hash);
+    if (err < 0) {
+        memmove(descriptor->buffer, descriptor->buffer + done, descriptor->buffer_length - done);
+        descriptor->buffer_length -= done;
+        descriptor->buffer_position += done;
+        return err;
+    }
+    descriptor->buffer_dirty = false;
+    descriptor->buffer_length = 0;
+    descriptor->buffer_offset = 0;
+    return 0;
+}
+
+// Take the error of a background flush, so that it is reported only once
+static int buffer_take_error(file_descriptor_t *descriptor) {
+    int err = descriptor->buffer_error;
+    descriptor->buffer_error = 0;
+    return err;
+}
+
+// Write out the buffers of the descriptors open on a path, so that the file system sees their
+// data. A path that is not canonical matches every descriptor of the mount point.
+static void buffer_flush_path(mountpoint_t *mp, uint32_t path_hash) {
+    for (size_t i = 0; i < FS_MAX_OPEN_FILES; i++) {
+        file_descriptor_t *descriptor = &file_descriptor[i];
+        if (!bitmap_test(file_descriptor_used, i) || !descriptor->buffer_dirty || descriptor->mountpoint != mp)
+            continue;
+        if (path_hash != DENTRY_ANY && descriptor->path_hash != DENTRY_ANY && descriptor->path_hash != path_hash)
+            continue;
+        int err = buffer_flush(descriptor);
+        if (err < 0)
+            descriptor->buffer_error = err;
+    }
+}
+
+// Difference between the position seen by the caller and the file system position
+static off_t buffer_delta(const file_descriptor_t *descriptor) {
+    if (descriptor->buffer_dirty)
+        return descriptor->buffer_length;
+    return -(off_t)(descriptor->buffer_length - descriptor->buffer_offset);
+}
+
+// Bring the file system position to the position seen by the caller
+static int buffer_drain(file_descriptor_t *descriptor) {
+    if (descriptor->buffer_dirty)
+        return buffer_flush(descriptor);
+    size_t unread = buffer_discard(descriptor);
+    if (unread == 0)
+        return 0;
+    filesystem_t *fs = descriptor->filesystem;
+    off_t pos = fs->file_seek(fs, &descriptor->file, -(off_t)unread, SEEK_CUR);
+    return pos < 0 ? pos : 0;
+}
+
+static ssize_t buffered_read(file_descriptor_t *descriptor, void *buf, size_t nbyte) {
+    filesystem_t *fs = descriptor->filesystem;
+    uint8_t *out = buf;
+    size_t total = 0;
+    while (total < nbyte) {
+        size_t available = descriptor->buffer_length - descriptor->buffer_offset;
+        if (available == 0) {
+            ssize_t size;
+            if (nbyte - total >= descriptor->buffer_size) {
+                // Large reads go straight to the file system
+                size = fs->file_read(fs, &descriptor->file, out + total, nbyte - total);
+                if (size < 0)
+                    return total > 0 ? (ssize_t)total : size;
+                return total + size;
+            }
+            size = fs->file_read(fs, &descriptor->file, descriptor->buffer, descriptor->buffer_size);
+            if (size < 0)
+                return total > 0 ? (ssize_t)total : size;
+            descriptor->buffer_length = size;
+            descriptor->buffer_offset = 0;
+            if (size == 0)
+                break;
+            available = size;
+        }
+        size_t n = nbyte - total < available ? nbyte - total : available;
+        memcpy(out + total, descriptor->buffer + descriptor->buffer_offset, n);
+        descriptor->buffer_offset += n;
+        total += n;
+    }
+    return total;
+}
+
+static ssize_t buffered_write(file_descriptor_t *descriptor, const void *buf, size_t nbyte) {
+    if (descriptor->buffer_dirty && descriptor->buffer_length + nbyte > descriptor->buffer_size) {
+        int err = buffer_flush(descriptor);
+        if (err < 0)
+            return err;
+    }
+    if (!descriptor->buffer_dirty) {
+        int err = buffer_drain(descriptor);  // Drop the read-ahead data
+        if (err < 0)
+            return err;
+        filesystem_t *fs = descriptor->filesystem;
+        off_t position = fs->file_tell(fs, &descriptor->file);
+        if (position < 0)
+            return position;
+        descriptor->buffer_position = position;
+        descriptor->buffer_since = time_us_64();
+        descriptor->buffer_dirty = true;
+    }
+    memcpy(descriptor->buffer + descriptor->buffer_length, buf, nbyte);
+    descriptor->buffer_length += nbyte;
+    off_t end = descriptor->buffer_position + descriptor->buffer_length;
+    if (descriptor->size < end)
+        descriptor->size = end;
+
+    if (descriptor->buffer_length == descriptor->buffer_size) {
+        int err = buffer_flush(descriptor);
+        if (err < 0)
+            return err;
+    }
+    return nbyte;
+}
+
+static int flush_aged_buffers(uint32_t age_us) {
+    uint64_t now = time_us_64();
+    int err = 0;
+    for (size_t i = 0; i < FS_MAX_OPEN_FILES; i++) {
+        file_descriptor_t *descriptor = &file_descriptor[i];
+        if (!bitmap_test(file_descriptor_used, i) || !descriptor->buffer_dirty)
+            continue;
+        if (now - descriptor->buffer_since < age_us)
+            continue;
+        int res = buffer_flush(descriptor);
+        if (res < 0) {
+            descriptor->buffer_error = res;  // The owner of the descriptor learns of it as well
+            if (err == 0)
+                err = res;
+        }
+    }
+    return err;
+}
+
+// Overridden by the filesystem_io_service library to forward the file system calls to the I/O core.
+// -ENOTSUP means that the file system keeps running on the calling core.
+int __attribute__((weak)) fs_io_service_attach(filesystem_t *fs, blockdevice_t *device) {
+    (void)fs;
+    (void)device;
+    return 0;
+}
+
+void __attribute__((weak)) fs_io_service_detach(filesystem_t *fs) {
+    (void)fs;
+}
+
+// Attach the file systems that were mounted before the I/O service started
+int vfs_io_service_attach_mounted(void) {
+    int err = 0;
+    vfs_enter();
+    for (size_t i = 0; i < FS_MAX_MOUNTPOINT; i++) {
+        if (mountpoints[i].filesystem == NULL)
+            continue;
+        int res = fs_io_service_attach(mountpoints[i].filesystem, mountpoints[i].device);
+        if (res < 0 && res != -ENOTSUP && err == 0)
+            err = res;
+    }
+    vfs_exit();
+    return err;
+}
+
+static bool is_mounted(const filesystem_t *fs) {
+    for (size_t i = 0; i < FS_MAX_MOUNTPOINT; i++) {
+        if (mountpoints[i].filesystem == fs)
+            return true;
+    }
+    return false;
 }
 
 int fs_format(filesystem_t *fs, blockdevice_t *device) {
-    if (!device->is_initialized) {
+    if (device != NULL && !device->is_initialized) {
         int err = device->init(device);
         if (err != BD_ERROR_OK) {
             return _error_remap(err);
         }
     }
-    return fs->format(fs, device);
+    vfs_enter();
+    dentry_invalidate_all(NULL);
+    vfs_exit();
+    int err = fs_io_service_attach(fs, device);
+    if (err && err != -ENOTSUP)
+        return _error_remap(err);
+    err = fs->format(fs, device);
+
+    // The attachment lasts while the file system is mounted
+    vfs_enter();
+    if (!is_mounted(fs))
+        fs_io_service_detach(fs);
+    vfs_exit();
+    return _error_remap(err);
 }
 
 int fs_mount(const char *dir, filesystem_t *fs, blockdevice_t *device) {
-    if (!device->is_initialized) {
+    if (device != NULL && !device->is_initialized) {
         int err = device->init(device);
         if (err)
             return _error_remap(err);
     }
 
-    int err = fs->mount(fs, device, false);
+    int err = fs_io_service_attach(fs, device);
+    if (err && err != -ENOTSUP)
+        return _error_remap(err);
+    err = fs->mount(fs, device, false);
     if (err) {
+        vfs_enter();
+        if (!is_mounted(fs))
+            fs_io_service_detach(fs);
+        vfs_exit();
         return _error_remap(err);
     }
 
-    auto_init_recursive_mutex(_mutex);
-    recursive_mutex_enter_blocking(&_mutex);
+    vfs_enter();
     for (size_t i = 0; i < FS_MAX_MOUNTPOINT; i++) {
         if (mountpoints[i].filesystem == NULL) {
             mountpoints[i].filesystem = fs;
             mountpoints[i].device = device;
             mountpoints[i].dir = strdup(dir);
-            recursive_mutex_exit(&_mutex);
+            dentry_invalidate_all(&mountpoints[i]);
+            vfs_exit();
             return _error_remap(0);
         }
     }
-    recursive_mutex_exit(&_mutex);
+    if (!is_mounted(fs))
+        fs_io_service_detach(fs);
+    vfs_exit();
     return _error_remap(-EFAULT);
 }
 
 int fs_unmount(const char *path) {
-    auto_init_recursive_mutex(_mutex);
-    recursive_mutex_enter_blocking(&_mutex);
+    vfs_enter();
 
     mountpoint_t *mp = find_mountpoint(path);
     if (mp == NULL) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-ENOENT);
     }
     filesystem_t *fs = mp->filesystem;
     int err = fs->unmount(fs);
     if (err) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(err);
     }
 
+    dentry_invalidate_all(mp);
     mp->filesystem = NULL;
     mp->device = NULL;
     free((char *)mp->dir);
+    mp->dir = NULL;
+    if (!is_mounted(fs))
+        fs_io_service_detach(fs);
 
-    recursive_mutex_exit(&_mutex);
+    vfs_exit();
     return _error_remap(0);
 }
 
 int fs_reformat(const char *path) {
-    auto_init_recursive_mutex(_mutex);
-    recursive_mutex_enter_blocking(&_mutex);
+    vfs_enter();
 
     mountpoint_t *mp = find_mountpoint(path);
     if (mp == NULL) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-ENOENT);
     }
     filesystem_t *fs = mp->filesystem;
     blockdevice_t *device = mp->device;
+    dentry_invalidate_all(mp);
 
     int err = fs->unmount(fs);
     if (err) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(err);
     }
     err = fs->format(fs, device);
     if (err) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(err);
     }
     err = fs->mount(fs, device, false);
 
-    recursive_mutex_exit(&_mutex);
+    vfs_exit();
     return _error_remap(err);
 }
 
@@ -178,44 +727,48 @@ int fs_info(const char *path, filesystem_t **fs, blockdevice_t **device) {
     (void)fs;
     (void)device;
 
-    auto_init_recursive_mutex(_mutex);
-    recursive_mutex_enter_blocking(&_mutex);
+    vfs_enter();
 
     mountpoint_t *mp = find_mountpoint(path);
     if (mp == NULL) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-ENOENT);
     }
     *fs = mp->filesystem;
     *device = mp->device;
 
-    recursive_mutex_exit(&_mutex);
+    vfs_exit();
     return _error_remap(0);
 }
 
 int _unlink(const char *path) {
-    auto_init_recursive_mutex(_mutex);
-    recursive_mutex_enter_blocking(&_mutex);
+    vfs_enter();
 
     mountpoint_t *mp = find_mountpoint(path);
     if (mp == NULL) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-ENOENT);
     }
     const char *entity_path = remove_prefix(path, mp->dir);
+    if (dentry_lookup(mp, entity_path, NULL) == -ENOENT) {
+        vfs_exit();
+        return _error_remap(-ENOENT);
+    }
     filesystem_t *fs = mp->filesystem;
     int err = fs->remove(fs, entity_path);
-    recursive_mutex_exit(&_mutex);
+    dentry_invalidate(mp, entity_path);
+    if (err == 0)
+        dentry_store(mp, entity_path, NULL);
+    vfs_exit();
     return _error_remap(err);
 }
 
 int rename(const char *old, const char *new) {
     // TODO: Check if old and new are the same filesystem
-    auto_init_recursive_mutex(_mutex);
-    recursive_mutex_enter_blocking(&_mutex);
+    vfs_enter();
     mountpoint_t *mp = find_mountpoint(old);
     if (mp == NULL) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-ENOENT);
     }
     const char *old_entity_path = remove_prefix(old, mp->dir);
@@ -223,246 +776,224 @@ int rename(const char *old, const char *new) {
 
     filesystem_t *fs = mp->filesystem;
     int err = fs->rename(fs, old_entity_path, new_entity_path);
-    recursive_mutex_exit(&_mutex);
+    dentry_invalidate_all(mp);  // Renaming a directory moves everything below it
+    vfs_exit();
     return _error_remap(err);
 }
 
 int mkdir(const char *path, mode_t mode) {
-    auto_init_recursive_mutex(_mutex);
-    recursive_mutex_enter_blocking(&_mutex);
+    vfs_enter();
     mountpoint_t *mp = find_mountpoint(path);
     if (mp == NULL) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-ENOENT);
     }
     const char *entity_path = remove_prefix(path, mp->dir);
+    if (dentry_lookup(mp, entity_path, NULL) == 0) {
+        vfs_exit();
+        return _error_remap(-EEXIST);
+    }
     filesystem_t *fs = mp->filesystem;
     int err = fs->mkdir(fs, entity_path, mode);
-    recursive_mutex_exit(&_mutex);
+    dentry_invalidate(mp, entity_path);
+    vfs_exit();
     return _error_remap(err);
 }
 
 int rmdir(const char *path) {
-    auto_init_recursive_mutex(_mutex);
-    recursive_mutex_enter_blocking(&_mutex);
+    vfs_enter();
     mountpoint_t *mp = find_mountpoint(path);
     if (mp == NULL) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-ENOENT);
     }
     const char *entity_path = remove_prefix(path, mp->dir);
+    if (dentry_lookup(mp, entity_path, NULL) == -ENOENT) {
+        vfs_exit();
+        return _error_remap(-ENOENT);
+    }
     filesystem_t *fs = mp->filesystem;
     int err = fs->rmdir(fs, entity_path);
-    recursive_mutex_exit(&_mutex);
+    dentry_invalidate(mp, entity_path);
+    if (err == 0)
+        dentry_store(mp, entity_path, NULL);
+    vfs_exit();
     return _error_remap(err);
 }
 
 int _stat(const char *path, struct stat *st) {
-    auto_init_recursive_mutex(_mutex);
-    recursive_mutex_enter_blocking(&_mutex);
+    vfs_enter();
     mountpoint_t *mp = find_mountpoint(path);
     if (mp == NULL) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-ENOENT);
     }
     const char *entity_path = remove_prefix(path, mp->dir);
+    buffer_flush_path(mp, dentry_hash(mp, entity_path));
+    int err = dentry_lookup(mp, entity_path, st);
+    if (err <= 0) {
+        vfs_exit();
+        return _error_remap(err);
+    }
     filesystem_t *fs = mp->filesystem;
-    int err = fs->stat(fs, entity_path, st);
-    recursive_mutex_exit(&_mutex);
+    err = fs->stat(fs, entity_path, st);
+    if (err == 0)
+        dentry_store(mp, entity_path, st);
+    else if (err == -ENOENT)
+        dentry_store(mp, entity_path, NULL);
+    vfs_exit();
     return _error_remap(err);
 }
 
 int _fstat(int fildes, struct stat *st) {
-    auto_init_recursive_mutex(_mutex);
-    recursive_mutex_enter_blocking(&_mutex);
+    vfs_enter();
 
     if (fildes == STDIN_FILENO || fildes == STDOUT_FILENO || fildes == STDERR_FILENO) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         st->st_size = 0;
         st->st_mode = S_IFCHR;
         return _error_remap(0);
     }
     if (!is_valid_file_descriptor(fildes)) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-EBADF);
     }
 
-    fs_file_t *file = file_descriptor[FILENO_INDEX(fildes)].file;
-    filesystem_t *fs = file_descriptor[FILENO_INDEX(fildes)].filesystem;
-    if (fs == NULL) {
-        recursive_mutex_exit(&_mutex);
-        return _error_remap(-EBADF);
-    }
-
-    off_t size = 0;
-    if (fs->type != FILESYSTEM_TYPE_FAT) {
-        off_t current = fs->file_tell(fs, file);
-        size = fs->file_seek(fs, file, 0, SEEK_END);
-        off_t err = fs->file_seek(fs, file, current, SEEK_SET);
-        if (current != err) {
-            recursive_mutex_exit(&_mutex);
-            return _error_remap(err);
-        }
-    } else {
-        /* NOTE: Support for different behaviour of FatFs from POSIX
-         *
-         * FatFs has a problem where f_size() reports a larger than actual file size when
-         * moved to a position beyond the f_lseek() file size; POSIX reports the actual size
-         * written to the file, not the seek position.
-         */
-        const char *path = file_descriptor[FILENO_INDEX(fildes)].path;
-        mountpoint_t *mp = find_mountpoint(path);
-        if (mp == NULL) {
-            recursive_mutex_exit(&_mutex);
-            return _error_remap(-ENOENT);
-        }
-        const char *entity_path = remove_prefix(path, mp->dir);
-        filesystem_t *fs = mp->filesystem;
-
-        struct stat finfo = {0};
-        int err = fs->stat(fs, entity_path, &finfo);
-        if (err != 0) {
-            recursive_mutex_exit(&_mutex);
-            return _error_remap(err);
+    /* NOTE: The size comes from the open file of the file system where it is correct
+     *
+     * It includes changes made through other descriptors. FatFs reports a larger size in
+     * f_size() after f_lseek() beyond the end of the file, while POSIX reports the size
+     * actually written, so on FAT the size kept by the descriptor is used. It is taken at
+     * open and updated on write and ftruncate.
+     */
+    file_descriptor_t *descriptor = &file_descriptor[FILENO_INDEX(fildes)];
+    filesystem_t *fs = descriptor->filesystem;
+    if (fs->file_size != NULL && fs->type != FILESYSTEM_TYPE_FAT) {
+        off_t size = fs->file_size(fs, &descriptor->file);
+        if (size >= 0) {
+            // Data waiting in the descriptor buffer is not in the file system yet
+            off_t end = descriptor->buffer_position + (off_t)descriptor->buffer_length;
+            if (descriptor->buffer_dirty && size < end)
+                size = end;
+            descriptor->size = size;
         }
-        size = finfo.st_size;
     }
-    recursive_mutex_exit(&_mutex);
-
-    st->st_size = size;
-    st->st_mode = S_IFREG;
+    st->st_size = descriptor->size;
+    st->st_mode = descriptor->mode;
+    st->st_blksize = descriptor->blksize;
+    st->st_blocks = (descriptor->size + 511) / 512;
+    vfs_exit();
     return _error_remap(0);
 }
 
-static int _assign_file_descriptor() {
-    int fd = -1;
-    if (max_file_descriptor == 0) {
-        max_file_descriptor = 2;
-        file_descriptor = calloc(max_file_descriptor, sizeof(file_descriptor_t));
-        if (file_descriptor == NULL) {
-            printf("_open: Out of memory\n");
-            return -1;
-        }
-    }
-    for (size_t i = 0; i < max_file_descriptor; i++) {
-        if (file_descriptor[i].filesystem == NULL) {
-            fd = i;
-            break;
-        }
-    }
-    if (fd == -1) {
-        // Extend the management array
-        size_t last_max = max_file_descriptor;
-        max_file_descriptor *= 2;
-        file_descriptor = realloc(file_descriptor, sizeof(file_descriptor_t) * max_file_descriptor);
-        if (file_descriptor == NULL) {
-            printf("_open: Out of memory\n");
-            return -1;
-        }
-        for (size_t i = last_max; i < max_file_descriptor; i++) {
-            file_descriptor[i].filesystem = NULL;
-            file_descriptor[i].file = NULL;
-        }
-        fd = last_max;
-    }
-    return FILENO_VALUE(fd);
-}
-
-static int _assign_dir_descriptor(void) {
-    int fd = -1;
-    if (max_dir_descriptor == 0) {
-        max_dir_descriptor = 2;
-        dir_descriptor = calloc(max_dir_descriptor, sizeof(dir_descriptor_t));
-        if (dir_descriptor == NULL) {
-            printf("_opendir: Out of memory\n");
-            return -1;
-        }
-    }
-    for (size_t i = 0; i < max_dir_descriptor; i++) {
-        if (dir_descriptor[i].filesystem == NULL) {
-            fd = i;
-            break;
-        }
-    }
-    if (fd == -1) {
-        // Extend the management array
-        size_t last_max = max_dir_descriptor;
-        max_dir_descriptor *= 2;
-        dir_descriptor = realloc(dir_descriptor, sizeof(dir_descriptor_t) * max_dir_descriptor);
-        if (dir_descriptor == NULL) {
-            printf("_opendir: Out of memory\n");
-            return -1;
-        }
-        for (size_t i = last_max; i < max_dir_descriptor; i++) {
-            dir_descriptor[i].filesystem = NULL;
-            dir_descriptor[i].dir = NULL;
-        }
-        fd = (int)last_max;
-    }
-    return fd;
-}
-
 int _open(const char *path, int oflags, ...) {
-    auto_init_recursive_mutex(_mutex);
-    recursive_mutex_enter_blocking(&_mutex);
+    vfs_enter();
 
     mountpoint_t *mp = find_mountpoint(path);
     if (mp == NULL) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-ENOENT);
     }
     const char *entity_path = remove_prefix(path, mp->dir);
+    uint32_t path_hash = dentry_hash(mp, entity_path);
+    if ((oflags & O_ACCMODE) != O_WRONLY)
+        buffer_flush_path(mp, path_hash);  // The new descriptor reads what was written
+    if (!(oflags & O_CREAT) && dentry_lookup(mp, entity_path, NULL) == -ENOENT) {
+        vfs_exit();
+        return _error_remap(-ENOENT);
+    }
     // find file descriptor
-    int fd = _assign_file_descriptor();
-    if (fd == -1) {
-        recursive_mutex_exit(&_mutex);
+    int index = bitmap_acquire(file_descriptor_used, FS_MAX_OPEN_FILES);
+    if (index == -1) {
+        vfs_exit();
         return _error_remap(-ENFILE);
     }
+    int fd = FILENO_VALUE(index);
 
     filesystem_t *fs = mp->filesystem;
-    fs_file_t *file = file_descriptor[FILENO_INDEX(fd)].file = calloc(1, sizeof(fs_file_t));
-    if (file == NULL) {
-        recursive_mutex_exit(&_mutex);
-        return _error_remap(-ENOMEM);
+    fs_file_t *file = &file_descriptor[FILENO_INDEX(fd)].file;
+    memset(file, 0, sizeof(fs_file_t));
+
+    uint8_t *buffer = NULL;
+    if (oflags & (O_RDBUF|O_WRBUF)) {
+        buffer = malloc(buffer_size_for(mp->device));
+        if (buffer == NULL) {
+            bitmap_release(file_descriptor_used, FILENO_INDEX(fd));
+            vfs_exit();
+            return _error_remap(-ENOMEM);
+        }
     }
 
-    int err = fs->file_open(fs, file, entity_path, oflags);
+    int err = fs->file_open(fs, file, entity_path, oflags & ~(O_RDBUF|O_WRBUF));
+    if (oflags & (O_CREAT|O_TRUNC))
+        dentry_invalidate_hash(mp, path_hash);
     if (err < 0) {
-        free(file);
-        file_descriptor[FILENO_INDEX(fd)].file = NULL;
-        recursive_mutex_exit(&_mutex);
+        free(buffer);
+        bitmap_release(file_descriptor_used, FILENO_INDEX(fd));
+        vfs_exit();
         return _error_remap(err);
     }
+    file->fd = fd;
     file_descriptor[FILENO_INDEX(fd)].filesystem = fs;
-    strncpy(file_descriptor[FILENO_INDEX(fd)].path, path, PATH_MAX);
-
-    recursive_mutex_exit(&_mutex);
+    file_descriptor[FILENO_INDEX(fd)].mountpoint = mp;
+    file_descriptor[FILENO_INDEX(fd)].path_hash = path_hash;
+    off_t size = fs->file_size(fs, file);
+    file_descriptor[FILENO_INDEX(fd)].size = size > 0 ? size : 0;
+    file_descriptor[FILENO_INDEX(fd)].mode = S_IFREG | S_IRWXU | S_IRWXG | S_IRWXO;
+    file_descriptor[FILENO_INDEX(fd)].blksize = mp->device != NULL ? ((blockdevice_t *)mp->device)->erase_size
+                                                                   : PICO_VFS_FILE_BUFFER_SIZE;
+    file_descriptor[FILENO_INDEX(fd)].sync_requested = false;
+    file_descriptor[FILENO_INDEX(fd)].buffer = buffer;
+    file_descriptor[FILENO_INDEX(fd)].buffer_flags = oflags & (O_RDBUF|O_WRBUF);
+    file_descriptor[FILENO_INDEX(fd)].buffer_dirty = false;
+    file_descriptor[FILENO_INDEX(fd)].buffer_size = buffer != NULL ? buffer_size_for(mp->device) : 0;
+    file_descriptor[FILENO_INDEX(fd)].buffer_length = 0;
+    file_descriptor[FILENO_INDEX(fd)].buffer_offset = 0;
+    file_descriptor[FILENO_INDEX(fd)].buffer_error = 0;
+
+    vfs_exit();
 
     return _error_remap(fd);
 }
 
+// Hand the result of a group commit to the descriptor and release the fsync() callers waiting for it
+static void sync_complete(file_descriptor_t *descriptor, int result) {
+    descriptor->sync_result = result;
+    descriptor->sync_requested = false;
+    for (; descriptor->sync_waiters > 0; descriptor->sync_waiters--)
+        sem_release(&descriptor->sync_done);
+}
+
 int _close(int fildes) {
-    auto_init_recursive_mutex(_mutex);
-    recursive_mutex_enter_blocking(&_mutex);
+    vfs_enter();
 
     if (!is_valid_file_descriptor(fildes)) {
         printf("_close error fildes=%d\n", fildes);
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-EBADF);
     }
-    fs_file_t *file = file_descriptor[FILENO_INDEX(fildes)].file;
+    fs_file_t *file = &file_descriptor[FILENO_INDEX(fildes)].file;
     filesystem_t *fs = file_descriptor[FILENO_INDEX(fildes)].filesystem;
     if (fs == NULL) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-EBADF);
     }
+    int flush_err = buffer_flush(&file_descriptor[FILENO_INDEX(fildes)]);
+    if (flush_err == 0)
+        flush_err = buffer_take_error(&file_descriptor[FILENO_INDEX(fildes)]);
     int err = fs->file_close(fs, file);
-    free(file);
+    if (err == 0)
+        err = flush_err;
+    // littlefs commits the size of a written file at close
+    dentry_invalidate_hash(file_descriptor[FILENO_INDEX(fildes)].mountpoint,
+                           file_descriptor[FILENO_INDEX(fildes)].path_hash);
     file_descriptor[FILENO_INDEX(fildes)].filesystem = NULL;
-    file_descriptor[FILENO_INDEX(fildes)].file = NULL;
-    file_descriptor[FILENO_INDEX(fildes)].path[0] = '\0';
+    free(file_descriptor[FILENO_INDEX(fildes)].buffer);
+    file_descriptor[FILENO_INDEX(fildes)].buffer = NULL;
+    sync_complete(&file_descriptor[FILENO_INDEX(fildes)], err);  // A pending group commit is served by the close
+    bitmap_release(file_descriptor_used, FILENO_INDEX(fildes));
 
-    recursive_mutex_exit(&_mutex);
+    vfs_exit();
     return _error_remap(err);
 }
 
@@ -490,51 +1021,84 @@ static size_t pico_stdio_fallback_read(void *buf, size_t nbyte) {
 }
 
 ssize_t _write(int fildes, const void *buf, size_t nbyte) {
-    auto_init_recursive_mutex(_mutex);
-    recursive_mutex_enter_blocking(&_mutex);
+    vfs_enter();
 
     if (fildes == STDOUT_FILENO || fildes == STDERR_FILENO) {
         pico_stdio_fallback_write(buf, nbyte);
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return (ssize_t)nbyte;
     }
     if (!is_valid_file_descriptor(fildes)) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-EBADF);
     }
-    fs_file_t *file = file_descriptor[FILENO_INDEX(fildes)].file;
+    fs_file_t *file = &file_descriptor[FILENO_INDEX(fildes)].file;
     filesystem_t *fs = file_descriptor[FILENO_INDEX(fildes)].filesystem;
     if (fs == NULL) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-EBADF);
     }
-    recursive_mutex_exit(&_mutex);
+    mountpoint_t *mp = file_descriptor[FILENO_INDEX(fildes)].mountpoint;
+    uint32_t path_hash = file_descriptor[FILENO_INDEX(fildes)].path_hash;
+    file_descriptor_t *descriptor = &file_descriptor[FILENO_INDEX(fildes)];
+    int flush_err = buffer_take_error(descriptor);
+    if (flush_err < 0) {
+        vfs_exit();
+        return _error_remap(flush_err);
+    }
+    if ((descriptor->buffer_flags & O_WRBUF) && nbyte < descriptor->buffer_size) {
+        ssize_t size = buffered_write(descriptor, buf, nbyte);
+        vfs_exit();
+        return _error_remap(size);
+    }
+    int err = buffer_drain(descriptor);
+    vfs_exit();
+    if (err < 0)
+        return _error_remap(err);
 
     ssize_t size = fs->file_write(fs, file, buf, nbyte);
+    if (size > 0) {
+        off_t position = fs->file_tell(fs, file);
+        vfs_lock();
+        if (file_descriptor[FILENO_INDEX(fildes)].size < position)
+            file_descriptor[FILENO_INDEX(fildes)].size = position;
+        dentry_invalidate_hash(mp, path_hash);
+        vfs_exit();
+    }
 
     return _error_remap(size);
 }
 
 ssize_t _read(int fildes, void *buf, size_t nbyte) {
-    auto_init_recursive_mutex(_mutex);
-    recursive_mutex_enter_blocking(&_mutex);
+    vfs_enter();
 
     if (fildes == STDIN_FILENO) {
         size_t read_bytes = pico_stdio_fallback_read(buf, nbyte);
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return read_bytes;
     }
     if (!is_valid_file_descriptor(fildes)) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-EBADF);
     }
-    fs_file_t *file = file_descriptor[FILENO_INDEX(fildes)].file;
+    fs_file_t *file = &file_descriptor[FILENO_INDEX(fildes)].file;
     filesystem_t *fs = file_descriptor[FILENO_INDEX(fildes)].filesystem;
     if (fs == NULL) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-EBADF);
     }
-    recursive_mutex_exit(&_mutex);
+    file_descriptor_t *descriptor = &file_descriptor[FILENO_INDEX(fildes)];
+    int err = buffer_flush(descriptor);  // Reads see the data written through this descriptor
+    if (err < 0) {
+        vfs_exit();
+        return _error_remap(err);
+    }
+    if (descriptor->buffer_flags & O_RDBUF) {
+        ssize_t size = buffered_read(descriptor, buf, nbyte);
+        vfs_exit();
+        return _error_remap(size);
+    }
+    vfs_exit();
 
     ssize_t size = fs->file_read(fs, file, buf, nbyte);
 
@@ -542,22 +1106,36 @@ ssize_t _read(int fildes, void *buf, size_t nbyte) {
 }
 
 off_t _lseek(int fildes, off_t offset, int whence) {
-    auto_init_recursive_mutex(_mutex);
-    recursive_mutex_enter_blocking(&_mutex);
+    vfs_enter();
 
     if (!is_valid_file_descriptor(fildes)) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-EBADF);
     }
-    fs_file_t *file = file_descriptor[FILENO_INDEX(fildes)].file;
+    fs_file_t *file = &file_descriptor[FILENO_INDEX(fildes)].file;
     filesystem_t *fs = file_descriptor[FILENO_INDEX(fildes)].filesystem;
     if (fs == NULL) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-EBADF);
     }
 
-    off_t pos = fs->file_seek(fs, file, offset, whence);
-    recursive_mutex_exit(&_mutex);
+    file_descriptor_t *descriptor = &file_descriptor[FILENO_INDEX(fildes)];
+    off_t pos;
+    if (whence == SEEK_CUR && offset == 0) {
+        // ftell() keeps the buffer
+        pos = fs->file_tell(fs, file);
+        if (pos >= 0)
+            pos += buffer_delta(descriptor);
+    } else {
+        pos = buffer_flush(descriptor);
+        if (pos == 0) {
+            size_t unread = buffer_discard(descriptor);
+            if (whence == SEEK_CUR)
+                offset -= unread;
+            pos = fs->file_seek(fs, file, offset, whence);
+        }
+    }
+    vfs_exit();
 
     return _error_remap(pos);
 }
@@ -565,132 +1143,699 @@ off_t _lseek(int fildes, off_t offset, int whence) {
 off_t _ftello_r(struct _reent *ptr, register FILE *fp) {
     (void)ptr;
     int fildes = fp->_file;
-    auto_init_recursive_mutex(_mutex);
-    recursive_mutex_enter_blocking(&_mutex);
+    vfs_enter();
 
     if (!is_valid_file_descriptor(fildes)) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-EBADF);
     }
-    fs_file_t *file = file_descriptor[FILENO_INDEX(fildes)].file;
+    fs_file_t *file = &file_descriptor[FILENO_INDEX(fildes)].file;
     filesystem_t *fs = file_descriptor[FILENO_INDEX(fildes)].filesystem;
     if (fs == NULL) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-EBADF);
     }
 
+    file_descriptor_t *descriptor = &file_descriptor[FILENO_INDEX(fildes)];
     off_t pos = fs->file_tell(fs, file);
-    recursive_mutex_exit(&_mutex);
+    if (pos >= 0)
+        pos += buffer_delta(descriptor);
+    vfs_exit();
 
     return _error_remap(pos);
 }
 
+/*
+ * Group commit. The open files of a mount point are flushed with one call to the file system's
+ * sync operation, which commits them together and syncs the block device once. Every file of
+ * the group gets the first error. Called with the VFS lock held.
+ */
+static int flush_mountpoint(mountpoint_t *mp, bool requested_only) {
+    filesystem_t *fs = mp->filesystem;
+    fs_file_t *files[FS_MAX_OPEN_FILES];
+    size_t index[FS_MAX_OPEN_FILES];
+    size_t count = 0;
+    int flush_err = 0;
+    for (size_t i = 0; i < FS_MAX_OPEN_FILES; i++) {
+        if (!bitmap_test(file_descriptor_used, i) || file_descriptor[i].mountpoint != mp)
+            continue;
+        if (requested_only && !file_descriptor[i].sync_requested)
+            continue;
+        int res = buffer_flush(&file_descriptor[i]);
+        if (res < 0 && flush_err == 0)
+            flush_err = res;
+        files[count] = &file_descriptor[i].file;
+        index[count++] = i;
+    }
+
+    int err = 0;
+    if (fs->sync != NULL) {
+        err = fs->sync(fs, files, count);
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            int res = fs->file_sync(fs, files[i]);
+            if (res < 0 && err == 0)
+                err = res;
+        }
+    }
+    if (flush_err < 0)
+        err = flush_err;  // Data that did not reach the file system is not durable either
+    for (size_t i = 0; i < count; i++)
+        sync_complete(&file_descriptor[index[i]], err);
+    return err;
+}
+
+#if PICO_VFS_GROUP_COMMIT_WINDOW_US > 0
+/*
+ * The first fsync() on a mount point waits for the window and then flushes every file whose
+ * fsync() arrived in the meantime. Those callers block on the semaphore of their descriptor
+ * until the leader, or a close() of the descriptor, releases them with the result.
+ */
+static bool sync_done_initialized = false;
+
+static int group_commit(int fildes) {
+    vfs_lock();
+    if (!is_valid_file_descriptor(fildes)) {
+        vfs_exit();
+        return -EBADF;
+    }
+    if (!sync_done_initialized) {
+        // Initialized once, so that a reopened descriptor keeps the permits of its waiters
+        for (size_t i = 0; i < FS_MAX_OPEN_FILES; i++)
+            sem_init(&file_descriptor[i].sync_done, 0, UINT8_MAX);
+        sync_done_initialized = true;
+    }
+    file_descriptor_t *descriptor = &file_descriptor[FILENO_INDEX(fildes)];
+    mountpoint_t *mp = descriptor->mountpoint;
+    descriptor->sync_requested = true;
+    if (mp->sync_gathering) {
+        descriptor->sync_waiters++;
+        vfs_exit();
+        sem_acquire_blocking(&descriptor->sync_done);
+        vfs_lock();
+        int err = descriptor->sync_result;
+        vfs_exit();
+        return err;
+    }
+    mp->sync_gathering = true;
+    vfs_exit();
+
+    sleep_us(PICO_VFS_GROUP_COMMIT_WINDOW_US);
+
+    vfs_lock();
+    mp->sync_gathering = false;
+    flush_mountpoint(mp, true);
+    int err = descriptor->sync_result;
+    vfs_exit();
+    return err;
+}
+#endif
+
+// fsync() returning a negative error code. Also used by the aio worker, see vfs_aio_fsync().
+static int sync_descriptor(int fildes) {
+    vfs_enter();
+
+    if (fildes == STDOUT_FILENO || fildes == STDERR_FILENO) {
+        stdio_flush();
+        vfs_exit();
+        return 0;
+    }
+    if (!is_valid_file_descriptor(fildes)) {
+        vfs_exit();
+        return -EBADF;
+    }
+    fs_file_t *file = &file_descriptor[FILENO_INDEX(fildes)].file;
+    filesystem_t *fs = file_descriptor[FILENO_INDEX(fildes)].filesystem;
+    if (fs == NULL) {
+        vfs_exit();
+        return -EBADF;
+    }
+    int flush_err = buffer_flush(&file_descriptor[FILENO_INDEX(fildes)]);
+    if (flush_err == 0)
+        flush_err = buffer_take_error(&file_descriptor[FILENO_INDEX(fildes)]);
+    vfs_exit();
+    if (flush_err < 0)
+        return flush_err;
+
+#if PICO_VFS_GROUP_COMMIT_WINDOW_US > 0
+    (void)file;
+    return group_commit(fildes);
+#else
+    return fs->file_sync(fs, file);
+#endif
+}
+
+int fsync(int fildes) {
+    return _error_remap(sync_descriptor(fildes));
+}
+
+int syncfs(int fildes) {
+    vfs_enter();
+
+    if (!is_valid_file_descriptor(fildes)) {
+        vfs_exit();
+        return _error_remap(-EBADF);
+    }
+    int err = flush_mountpoint(file_descriptor[FILENO_INDEX(fildes)].mountpoint, false);
+    vfs_exit();
+    return _error_remap(err);
+}
+
+int fs_sync_all(void) {
+    vfs_enter();
+
+    int err = 0;
+    for (size_t i = 0; i < FS_MAX_MOUNTPOINT; i++) {
+        if (mountpoints[i].filesystem == NULL)
+            continue;
+        int res = flush_mountpoint(&mountpoints[i], false);
+        if (res < 0 && err == 0)
+            err = res;
+    }
+    vfs_exit();
+    return _error_remap(err);
+}
+
 int ftruncate(int fildes, off_t length) {
-    auto_init_recursive_mutex(_mutex);
-    recursive_mutex_enter_blocking(&_mutex);
+    vfs_enter();
 
     if (!is_valid_file_descriptor(fildes)) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-EBADF);
     }
-    fs_file_t *file = file_descriptor[FILENO_INDEX(fildes)].file;
+    fs_file_t *file = &file_descriptor[FILENO_INDEX(fildes)].file;
     filesystem_t *fs = file_descriptor[FILENO_INDEX(fildes)].filesystem;
     if (fs == NULL) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return _error_remap(-EBADF);
     }
 
-    int err = fs->file_truncate(fs, file, length);
-    recursive_mutex_exit(&_mutex);
+    int err = buffer_drain(&file_descriptor[FILENO_INDEX(fildes)]);
+    if (err == 0)
+        err = fs->file_truncate(fs, file, length);
+    if (err == 0)
+        file_descriptor[FILENO_INDEX(fildes)].size = length;
+    dentry_invalidate_hash(file_descriptor[FILENO_INDEX(fildes)].mountpoint,
+                           file_descriptor[FILENO_INDEX(fildes)].path_hash);
+    vfs_exit();
 
     return _error_remap(err);
 }
 
+int posix_fallocate(int fildes, off_t offset, off_t len) {
+    if (offset < 0 || len <= 0)
+        return EINVAL;
+    vfs_enter();
+
+    if (!is_valid_file_descriptor(fildes)) {
+        vfs_exit();
+        return EBADF;
+    }
+    file_descriptor_t *descriptor = &file_descriptor[FILENO_INDEX(fildes)];
+    filesystem_t *fs = descriptor->filesystem;
+    if (fs == NULL) {
+        vfs_exit();
+        return EBADF;
+    }
+    if (fs->file_allocate == NULL) {
+        vfs_exit();
+        return EOPNOTSUPP;
+    }
+
+    int err = buffer_drain(descriptor);
+    if (err == 0)
+        err = fs->file_allocate(fs, &descriptor->file, offset, len);
+    if (err == 0 && offset + len > descriptor->size)
+        descriptor->size = offset + len;
+    dentry_invalidate_hash(descriptor->mountpoint, descriptor->path_hash);
+    vfs_exit();
+
+    return -err;  // posix_fallocate() returns the error number instead of setting errno
+}
+
+// read/write body of vfs_transfer() for file descriptors, returning a negative error code
+static ssize_t file_transfer(int fildes, const struct iovec *iov, int iovcnt, off_t offset, bool write) {
+    vfs_enter();
+    if (!is_valid_file_descriptor(fildes)) {
+        vfs_exit();
+        return -EBADF;
+    }
+    fs_file_t *file = &file_descriptor[FILENO_INDEX(fildes)].file;
+    filesystem_t *fs = file_descriptor[FILENO_INDEX(fildes)].filesystem;
+    if (fs == NULL) {
+        vfs_exit();
+        return -EBADF;
+    }
+    mountpoint_t *mp = file_descriptor[FILENO_INDEX(fildes)].mountpoint;
+    uint32_t path_hash = file_descriptor[FILENO_INDEX(fildes)].path_hash;
+    int err = buffer_drain(&file_descriptor[FILENO_INDEX(fildes)]);
+    if (err < 0) {
+        vfs_exit();
+        return err;
+    }
+
+    ssize_t total = 0;
+    ssize_t size = 0;
+    if (write ? fs->file_pwritev != NULL : fs->file_preadv != NULL) {
+        vfs_exit();
+        if (write)
+            total = fs->file_pwritev(fs, file, iov, iovcnt, offset);
+        else
+            total = fs->file_preadv(fs, file, iov, iovcnt, offset);
+        size = total;
+    } else {
+        // Fall back to one call per vector, holding the vfs lock so that the sequence is atomic
+        off_t position = fs->file_tell(fs, file);
+        if (offset >= 0) {
+            off_t res = fs->file_seek(fs, file, offset, SEEK_SET);
+            if (res < 0) {
+                vfs_exit();
+                return res;
+            }
+        }
+        for (int i = 0; i < iovcnt; i++) {
+            if (write)
+                size = fs->file_write(fs, file, iov[i].iov_base, iov[i].iov_len);
+            else
+                size = fs->file_read(fs, file, iov[i].iov_base, iov[i].iov_len);
+            if (size < 0)
+                break;
+            total += size;
+            if ((size_t)size < iov[i].iov_len)
+                break;
+        }
+        if (offset >= 0)
+            fs->file_seek(fs, file, position, SEEK_SET);
+        vfs_exit();
+    }
+    if (size < 0 && total <= 0)
+        return size;
+
+    if (write && total > 0) {
+        off_t end = offset >= 0 ? offset + total : fs->file_tell(fs, file);
+        vfs_lock();
+        if (file_descriptor[FILENO_INDEX(fildes)].size < end)
+            file_descriptor[FILENO_INDEX(fildes)].size = end;
+        dentry_invalidate_hash(mp, path_hash);
+        vfs_exit();
+    }
+    return total;
+}
+
+// Shared implementation of readv/writev (offset -1) and the positional variants
+static ssize_t vfs_transfer(int fildes, const struct iovec *iov, int iovcnt, off_t offset, bool write) {
+    if (iovcnt <= 0 || iovcnt > IOV_MAX)
+        return _error_remap(-EINVAL);
+    if (offset < -1)
+        return _error_remap(-EINVAL);
+
+    if ((write && (fildes == STDOUT_FILENO || fildes == STDERR_FILENO)) ||
+        (!write && fildes == STDIN_FILENO))
+    {
+        if (offset >= 0)
+            return _error_remap(-ESPIPE);
+        ssize_t total = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            ssize_t size = write ? _write(fildes, iov[i].iov_base, iov[i].iov_len)
+                                 : _read(fildes, iov[i].iov_base, iov[i].iov_len);
+            if (size < 0)
+                return total > 0 ? total : size;
+            total += size;
+            if ((size_t)size < iov[i].iov_len)
+                break;
+        }
+        return total;
+    }
+    return _error_remap(file_transfer(fildes, iov, iovcnt, offset, write));
+}
+
+/*
+ * Positional read and write for the aio worker. Errors are returned as negative codes, not
+ * through errno, which the cores share on bare metal.
+ */
+ssize_t vfs_aio_transfer(int fildes, void *buf, size_t nbyte, off_t offset, bool write) {
+    if (offset < 0)
+        return -EINVAL;
+    if ((write && (fildes == STDOUT_FILENO || fildes == STDERR_FILENO)) ||
+        (!write && fildes == STDIN_FILENO))
+    {
+        return -ESPIPE;
+    }
+    struct iovec iov = {.iov_base = buf, .iov_len = nbyte};
+    return file_transfer(fildes, &iov, 1, offset, write);
+}
+
+int vfs_aio_fsync(int fildes) {
+    return sync_descriptor(fildes);
+}
+
+ssize_t pread(int fildes, void *buf, size_t nbyte, off_t offset) {
+    if (offset < 0)
+        return _error_remap(-EINVAL);
+    struct iovec iov = {.iov_base = buf, .iov_len = nbyte};
+    return vfs_transfer(fildes, &iov, 1, offset, false);
+}
+
+ssize_t pwrite(int fildes, const void *buf, size_t nbyte, off_t offset) {
+    if (offset < 0)
+        return _error_remap(-EINVAL);
+    struct iovec iov = {.iov_base = (void *)buf, .iov_len = nbyte};
+    return vfs_transfer(fildes, &iov, 1, offset, true);
+}
+
+ssize_t readv(int fildes, const struct iovec *iov, int iovcnt) {
+    return vfs_transfer(fildes, iov, iovcnt, -1, false);
+}
+
+ssize_t writev(int fildes, const struct iovec *iov, int iovcnt) {
+    return vfs_transfer(fildes, iov, iovcnt, -1, true);
+}
+
+ssize_t preadv(int fildes, const struct iovec *iov, int iovcnt, off_t offset) {
+    if (offset < 0)
+        return _error_remap(-EINVAL);
+    return vfs_transfer(fildes, iov, iovcnt, offset, false);
+}
+
+ssize_t pwritev(int fildes, const struct iovec *iov, int iovcnt, off_t offset) {
+    if (offset < 0)
+        return _error_remap(-EINVAL);
+    return vfs_transfer(fildes, iov, iovcnt, offset, true);
+}
+
+static uint8_t *copy_buffer = NULL;  // Allocated on first use and kept for later copies
+auto_init_mutex(_copy_mutex);
+
+// Largest transfer that fits the copy buffer and is a multiple of both optimal I/O sizes
+static size_t copy_chunk_size(blksize_t in_blksize, blksize_t out_blksize) {
+    size_t unit = in_blksize > out_blksize ? in_blksize : out_blksize;
+    if (unit == 0 || unit > PICO_VFS_COPY_BUFFER_SIZE)
+        return PICO_VFS_COPY_BUFFER_SIZE;
+    return PICO_VFS_COPY_BUFFER_SIZE - PICO_VFS_COPY_BUFFER_SIZE % unit;
+}
+
+ssize_t fs_copy_file_range(int fd_in, int fd_out, size_t len) {
+    if (fd_in == fd_out)
+        return _error_remap(-EINVAL);
+
+    vfs_enter();
+    blksize_t in_blksize = 0;
+    blksize_t out_blksize = 0;
+    filesystem_t *fs = NULL;
+    if (is_valid_file_descriptor(fd_in) && is_valid_file_descriptor(fd_out)) {
+        in_blksize = file_descriptor[FILENO_INDEX(fd_in)].blksize;
+        out_blksize = file_descriptor[FILENO_INDEX(fd_out)].blksize;
+        int err = buffer_drain(&file_descriptor[FILENO_INDEX(fd_in)]);
+        if (err == 0)
+            err = buffer_drain(&file_descriptor[FILENO_INDEX(fd_out)]);
+        if (err < 0) {
+            vfs_exit();
+            return _error_remap(err);
+        }
+        if (file_descriptor[FILENO_INDEX(fd_in)].filesystem == file_descriptor[FILENO_INDEX(fd_out)].filesystem)
+            fs = file_descriptor[FILENO_INDEX(fd_in)].filesystem;
+    }
+    vfs_exit();
+
+    mutex_enter_blocking(&_copy_mutex);
+    if (copy_buffer == NULL) {
+        copy_buffer = malloc(PICO_VFS_COPY_BUFFER_SIZE);
+        if (copy_buffer == NULL) {
+            mutex_exit(&_copy_mutex);
+            return _error_remap(-ENOMEM);
+        }
+    }
+
+    if (fs != NULL && fs->file_copy != NULL) {
+        fs_file_t *in = &file_descriptor[FILENO_INDEX(fd_in)].file;
+        fs_file_t *out = &file_descriptor[FILENO_INDEX(fd_out)].file;
+        ssize_t size = fs->file_copy(fs, in, out, len, copy_buffer, PICO_VFS_COPY_BUFFER_SIZE);
+        if (size != -ENOTSUP) {
+            mutex_exit(&_copy_mutex);
+            if (size > 0) {
+                off_t position = fs->file_tell(fs, out);
+                vfs_lock();
+                if (file_descriptor[FILENO_INDEX(fd_out)].size < position)
+                    file_descriptor[FILENO_INDEX(fd_out)].size = position;
+                dentry_invalidate_hash(file_descriptor[FILENO_INDEX(fd_out)].mountpoint,
+                                       file_descriptor[FILENO_INDEX(fd_out)].path_hash);
+                vfs_exit();
+            }
+            return _error_remap(size);
+        }
+    }
+
+    size_t chunk = copy_chunk_size(in_blksize, out_blksize);
+    ssize_t total = 0;
+    while ((size_t)total < len) {
+        size_t request = len - total < chunk ? len - total : chunk;
+        ssize_t read_size = _read(fd_in, copy_buffer, request);
+        if (read_size <= 0) {
+            if (read_size < 0 && total == 0)
+                total = -1;
+            break;
+        }
+        ssize_t write_size = _write(fd_out, copy_buffer, read_size);
+        if (write_size < 0) {
+            if (total == 0)
+                total = -1;
+            break;
+        }
+        total += write_size;
+        if (write_size < read_size) {
+            _lseek(fd_in, write_size - read_size, SEEK_CUR);  // leave the unwritten part unread
+            break;
+        }
+    }
+    mutex_exit(&_copy_mutex);
+    if (total >= 0)
+        errno = 0;
+    return total;
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    if (offset == NULL)
+        return fs_copy_file_range(in_fd, out_fd, count);
+
+    off_t position = _lseek(in_fd, 0, SEEK_CUR);
+    if (position < 0)
+        return -1;
+    if (_lseek(in_fd, *offset, SEEK_SET) < 0)
+        return -1;
+    ssize_t size = fs_copy_file_range(in_fd, out_fd, count);
+    int err = errno;
+    if (size > 0)
+        *offset += size;
+    _lseek(in_fd, position, SEEK_SET);
+    errno = err;
+    return size;
+}
+
+typedef struct {
+    void *addr;
+    size_t length;
+    bool copy;  // Heap copy of the file data, released by munmap
+} mapping_t;
+
+static mapping_t mappings[PICO_VFS_MAX_MAPPINGS] = {0};
+
+void *mmap(void *addr, size_t len, int prot, int flags, int fildes, off_t off) {
+    (void)addr;
+    if (len == 0 || off < 0) {
+        _error_remap(-EINVAL);
+        return MAP_FAILED;
+    }
+    if ((prot & PROT_WRITE) || (flags & MAP_FIXED)) {
+        _error_remap(-ENOTSUP);  // Only read-only mappings are supported
+        return MAP_FAILED;
+    }
+
+    vfs_enter();
+    if (!is_valid_file_descriptor(fildes)) {
+        vfs_exit();
+        _error_remap(-EBADF);
+        return MAP_FAILED;
+    }
+    fs_file_t *file = &file_descriptor[FILENO_INDEX(fildes)].file;
+    filesystem_t *fs = file_descriptor[FILENO_INDEX(fildes)].filesystem;
+    mountpoint_t *mp = file_descriptor[FILENO_INDEX(fildes)].mountpoint;
+    if (fs == NULL) {
+        vfs_exit();
+        _error_remap(-EBADF);
+        return MAP_FAILED;
+    }
+    mapping_t *mapping = NULL;
+    for (size_t i = 0; i < PICO_VFS_MAX_MAPPINGS; i++) {
+        if (mappings[i].addr == NULL) {
+            mapping = &mappings[i];
+            break;
+        }
+    }
+    if (mapping == NULL) {
+        vfs_exit();
+        _error_remap(-ENOMEM);
+        return MAP_FAILED;
+    }
+
+    int err = buffer_drain(&file_descriptor[FILENO_INDEX(fildes)]);
+    if (err < 0) {
+        vfs_exit();
+        _error_remap(err);
+        return MAP_FAILED;
+    }
+
+    // Use the data in place if the range is contiguous on a memory mapped device
+    blockdevice_t *device = mp->device;
+    const void *data = NULL;
+    bd_size_t device_addr;
+    if (device != NULL && device->map != NULL && fs->file_extent != NULL &&
+        fs->file_extent(fs, file, off, len, &device_addr) == 0)
+    {
+        data = device->map(device, device_addr, len);
+    }
+    if (data != NULL) {
+        mapping->addr = (void *)data;
+        mapping->length = len;
+        mapping->copy = false;
+        vfs_exit();
+        errno = 0;
+        return mapping->addr;
+    }
+
+    void *buffer = calloc(1, len);  // The part beyond the end of the file reads as zero
+    if (buffer == NULL) {
+        vfs_exit();
+        _error_remap(-ENOMEM);
+        return MAP_FAILED;
+    }
+    mapping->addr = buffer;
+    mapping->length = len;
+    mapping->copy = true;
+    vfs_exit();
+
+    if (pread(fildes, buffer, len, off) < 0) {
+        err = errno;
+        munmap(buffer, len);
+        errno = err;
+        return MAP_FAILED;
+    }
+    errno = 0;
+    return buffer;
+}
+
+int munmap(void *addr, size_t len) {
+    (void)len;
+    vfs_enter();
+    for (size_t i = 0; i < PICO_VFS_MAX_MAPPINGS; i++) {
+        if (addr != NULL && mappings[i].addr == addr) {
+            if (mappings[i].copy)
+                free(mappings[i].addr);
+            mappings[i].addr = NULL;
+            vfs_exit();
+            return _error_remap(0);
+        }
+    }
+    vfs_exit();
+    return _error_remap(-EINVAL);
+}
+
+int msync(void *addr, size_t len, int flags) {
+    (void)flags;
+    vfs_enter();
+    for (size_t i = 0; i < PICO_VFS_MAX_MAPPINGS; i++) {
+        uint8_t *start = mappings[i].addr;
+        if (start != NULL && (uint8_t *)addr >= start &&
+            (uint8_t *)addr + len <= start + mappings[i].length)
+        {
+            vfs_exit();
+            return _error_remap(0);  // Read-only mappings have nothing to write back
+        }
+    }
+    vfs_exit();
+    return _error_remap(-ENOMEM);
+}
+
 DIR *opendir(const char *path) {
-    auto_init_recursive_mutex(_mutex);
-    recursive_mutex_enter_blocking(&_mutex);
+    vfs_enter();
 
     mountpoint_t *mp = find_mountpoint(path);
     if (mp == NULL) {
         _error_remap(-ENOENT);
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return NULL;
     }
     const char *entity_path = remove_prefix(path, mp->dir);
     // find dir descriptor
-    int fd = _assign_dir_descriptor();
+    int fd = bitmap_acquire(dir_descriptor_used, FS_MAX_OPEN_DIRS);
     if (fd == -1) {
         _error_remap(-ENFILE);
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return NULL;
     }
 
-    fs_dir_t *dir = dir_descriptor[fd].dir = calloc(1, sizeof(fs_dir_t));
-    if (dir == NULL) {
-        _error_remap(-ENOMEM);
-        recursive_mutex_exit(&_mutex);
-        return NULL;
-    }
+    fs_dir_t *dir = &dir_descriptor[fd].dir;
+    memset(dir, 0, sizeof(fs_dir_t));
     filesystem_t *fs = mp->filesystem;
     int err = fs->dir_open(fs, dir, entity_path);
     if (err != 0) {
-        free(dir);
-        dir_descriptor[fd].dir = NULL;
+        bitmap_release(dir_descriptor_used, fd);
         _error_remap(err);
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return NULL;
     }
     dir_descriptor[fd].filesystem = fs;
     dir->fd = fd;
-    recursive_mutex_exit(&_mutex);
+    vfs_exit();
 
     return dir;
 }
 
 int closedir(DIR *dir) {
-    auto_init_recursive_mutex(_mutex);
-    recursive_mutex_enter_blocking(&_mutex);
+    vfs_enter();
 
-    int fd = dir->fd;
-    fs_dir_t *_dir = dir_descriptor[dir->fd].dir;
-    filesystem_t *fs = dir_descriptor[dir->fd].filesystem;
-    if (fs == NULL) {
-        recursive_mutex_exit(&_mutex);
+    if (!is_valid_dir_descriptor(dir)) {
+        vfs_exit();
         return _error_remap(-EBADF);
     }
+    int fd = dir->fd;
+    fs_dir_t *_dir = &dir_descriptor[fd].dir;
+    filesystem_t *fs = dir_descriptor[fd].filesystem;
     int err = fs->dir_close(fs, _dir);
     dir_descriptor[fd].filesystem = NULL;
-    free(dir_descriptor[fd].dir);
-    dir_descriptor[fd].dir = NULL;
-    recursive_mutex_exit(&_mutex);
+    bitmap_release(dir_descriptor_used, fd);
+    vfs_exit();
     return _error_remap(err);
 }
 
 struct dirent *readdir(DIR *dir) {
-    auto_init_recursive_mutex(_mutex);
-    recursive_mutex_enter_blocking(&_mutex);
+    vfs_enter();
 
-    fs_dir_t *_dir = dir_descriptor[dir->fd].dir;
+    if (!is_valid_dir_descriptor(dir)) {
+        _error_remap(-EBADF);
+        vfs_exit();
+        return NULL;
+    }
+    fs_dir_t *_dir = &dir_descriptor[dir->fd].dir;
     filesystem_t *fs = dir_descriptor[dir->fd].filesystem;
     if (fs == NULL) {
         _error_remap(-EBADF);
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return NULL;
     }
     memset(&_dir->current, 0, sizeof(_dir->current));
     int err = fs->dir_read(fs, _dir, &_dir->current);
     if (err == 0) {
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return &_dir->current;
     } else if (err == -ENOENT) {
         memset(&_dir->current, 0, sizeof(_dir->current));
         _error_remap(0);
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return NULL;
     } else {
         memset(&_dir->current, 0, sizeof(_dir->current));
         _error_remap(err);
-        recursive_mutex_exit(&_mutex);
+        vfs_exit();
         return NULL;
     }
 }
@@ -764,3 +1909,82 @@ void __attribute__((constructor)) pre_main(void) {
     fs_init();
 }
 #endif
+
+int fs_gc(const char *path, uint32_t budget_us) {
+    vfs_lock();
+
+    mountpoint_t *mp = find_mountpoint(path);
+    if (mp == NULL) {
+        vfs_exit();
+        return _error_remap(-ENOENT);
+    }
+    filesystem_t *fs = mp->filesystem;
+    int err = fs->gc != NULL ? fs->gc(fs, budget_us) : 0;
+
+    vfs_exit();
+    return _error_remap(err);
+}
+
+bool fs_gc_idle_poll(uint32_t idle_us, uint32_t budget_us) {
+    if (!vfs_try_lock())
+        return false;
+    (void)flush_aged_buffers(PICO_VFS_WRITE_BUFFER_AGE_US);  // A failure is reported by the descriptor
+    uint64_t start = time_us_64();
+    if (start - last_activity_us < idle_us) {
+        vfs_exit();
+        return false;
+    }
+
+    filesystem_t *filesystems[FS_MAX_MOUNTPOINT];
+    for (size_t i = 0; i < FS_MAX_MOUNTPOINT; i++)
+        filesystems[i] = mountpoints[i].filesystem;
+    void (*handlers[PICO_VFS_MAX_IDLE_HANDLERS])(void);
+    memcpy(handlers, idle_handlers, sizeof(handlers));
+    vfs_exit();
+
+    // The maintenance takes the file system's own lock, so requests to other file systems
+    // are not held up. A file system that is unmounted meanwhile has no work left.
+    bool pending = false;
+    for (size_t i = 0; i < FS_MAX_MOUNTPOINT; i++) {
+        filesystem_t *fs = filesystems[i];
+        if (fs == NULL || fs->gc == NULL)
+            continue;
+        uint64_t elapsed = time_us_64() - start;
+        if (elapsed >= budget_us) {
+            pending = true;
+            break;
+        }
+        if (fs->gc(fs, budget_us - (uint32_t)elapsed) > 0)
+            pending = true;
+    }
+
+    // Their file and device operations take the VFS lock one at a time
+    for (size_t i = 0; i < PICO_VFS_MAX_IDLE_HANDLERS && handlers[i] != NULL; i++)
+        handlers[i]();
+    return pending;
+}
+
+int fs_gc_register_idle(void (*fn)(void)) {
+    vfs_lock();
+    for (size_t i = 0; i < PICO_VFS_MAX_IDLE_HANDLERS; i++) {
+        if (idle_handlers[i] == fn) {
+            vfs_exit();
+            return 0;
+        }
+        if (idle_handlers[i] == NULL) {
+            idle_handlers[i] = fn;
+            vfs_exit();
+            return 0;
+        }
+    }
+    vfs_exit();
+    errno = ENOSPC;
+    return -1;
+}
+
+int fs_flush_buffers(uint32_t age_us) {
+    vfs_lock();
+    int err = flush_aged_buffers(age_us);
+    vfs_exit();
+    return _error_remap(err);
+}
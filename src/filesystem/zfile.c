@@ -0,0 +1,840 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pico/mutex.h>
+#include "filesystem/vfs.h"
+#include "filesystem/zfile.h"
+#include "storage/crc32.h"
+
+#define FILE_MAGIC      0x465a4656  // "VFZF"
+#define FRAME_MAGIC     0x4d52465a  // "ZFRM"
+#define INDEX_MAGIC     0x5844495a  // "ZIDX"
+#define FOOTER_MAGIC    0x444e455a  // "ZEND"
+#define VERSION         1
+#define FRAME_STORED    0x80000000  // The frame data is not compressed
+#define INDEX_ENTRIES   64
+#define MAX_FRAME_SIZE  65536       // Match offsets of the LZ4 block format are 16-bit
+#define MIN_FRAME_SIZE  64
+#define BOUND(n)        ((n) + (n) / 255 + 16)  // Compressed size of incompressible data
+#define NO_RECORD       UINT32_MAX
+
+#define HASH_BITS       10
+#define MIN_MATCH       4
+#define LAST_LITERALS   5           // The LZ4 block format ends with literals
+#define MF_LIMIT        12          // No match starts in the last bytes of a block
+
+/*
+ * The file header is followed by frames. After every INDEX_ENTRIES frames, and after the last
+ * frame when the file is closed, an index record of the frames since the previous record is
+ * appended. The footer at the end of a closed file points to the last index record, and the
+ * index records are linked backwards.
+ */
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t frame_size;
+    uint32_t crc;
+} file_header_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t length;           // Uncompressed size of the frame
+    uint32_t packed;           // Size of the data after the header, FRAME_STORED if not compressed
+    uint32_t crc;              // Over the uncompressed data
+} frame_header_t;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t count;
+    uint16_t reserved;
+    uint32_t previous;         // Position of the previous index record, 0 for the first one
+    uint32_t crc;              // Over the fields above and the entries
+} index_header_t;
+
+typedef struct {
+    uint64_t position;         // Uncompressed position of the first byte of the frame
+    uint64_t offset;           // Position of the frame in the file
+} index_entry_t;
+
+typedef struct {
+    uint32_t index;            // Position of the last index record
+    uint32_t magic;
+} footer_t;
+
+struct fs_zfile {
+    mutex_t mutex;
+    int fd;
+    bool writer;
+    uint32_t frame_size;
+    uint8_t *frame;            // Writer: data of the current frame. Reader: last frame read.
+    uint32_t length;           // Bytes in `frame`
+    off_t loaded;              // Reader: position of the frame in `frame` in the file, or -1
+    uint8_t *packed;           // Frame header and compressed data
+    uint16_t *table;           // Writer: match finder of the compressor
+    uint8_t *index;            // Index record of the frames after the last record in the file
+    off_t last_record;         // Position of the last index record in the file, 0 if none
+    index_entry_t *records;    // Reader: first position and file position of each index record
+    uint32_t record_count;
+    uint32_t record_capacity;
+    uint8_t *block;            // Reader: index record last read
+    uint32_t block_record;
+    off_t end;                 // End of the last frame or index record in the file
+    off_t size;                // Uncompressed size of the frames in the file
+    off_t position;            // Reader: read position
+};
+
+#define RECORD_SIZE  (sizeof(index_header_t) + INDEX_ENTRIES * sizeof(index_entry_t))
+
+_Static_assert(PICO_VFS_ZFILE_FRAME_SIZE >= MIN_FRAME_SIZE &&
+               PICO_VFS_ZFILE_FRAME_SIZE <= MAX_FRAME_SIZE,
+               "PICO_VFS_ZFILE_FRAME_SIZE out of range");
+
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash32(uint32_t value) {
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static uint8_t *put_length(uint8_t *p, size_t length) {
+    while (length >= 255) {
+        *p++ = 255;
+        length -= 255;
+    }
+    *p++ = (uint8_t)length;
+    return p;
+}
+
+/*
+ * Appends an LZ4 sequence of literals followed by a match. A `match` of 0 ends the block.
+ */
+static uint8_t *put_sequence(uint8_t *p, const uint8_t *literals, size_t count,
+                             uint16_t offset, size_t match)
+{
+    uint8_t *token = p++;
+    *token = (uint8_t)((count >= 15 ? 15 : count) << 4);
+    if (count >= 15)
+        p = put_length(p, count - 15);
+    memcpy(p, literals, count);
+    p += count;
+    if (match == 0)
+        return p;
+
+    *p++ = (uint8_t)offset;
+    *p++ = (uint8_t)(offset >> 8);
+    match -= MIN_MATCH;
+    *token |= (uint8_t)(match >= 15 ? 15 : match);
+    if (match >= 15)
+        p = put_length(p, match - 15);
+    return p;
+}
+
+/*
+ * Compresses `size` bytes into an LZ4 block of at most BOUND(size) bytes. A greedy match
+ * finder with one candidate per hash, as in the LZ4 fast mode.
+ */
+static size_t lz4_compress(const uint8_t *src, size_t size, uint8_t *dst, uint16_t *table) {
+    uint8_t *p = dst;
+    size_t anchor = 0;
+    if (size > MF_LIMIT) {
+        memset(table, 0, sizeof(uint16_t) << HASH_BITS);
+        size_t limit = size - MF_LIMIT;
+        size_t i = 0;
+        while (i < limit) {
+            uint32_t sequence = read32(src + i);
+            uint32_t h = hash32(sequence);
+            size_t candidate = table[h];
+            table[h] = (uint16_t)i;
+            if (candidate >= i || read32(src + candidate) != sequence) {
+                i++;
+                continue;
+            }
+            while (i > anchor && candidate > 0 && src[i - 1] == src[candidate - 1]) {
+                i--;
+                candidate--;
+            }
+            size_t match = MIN_MATCH;
+            while (i + match < size - LAST_LITERALS && src[candidate + match] == src[i + match])
+                match++;
+            p = put_sequence(p, src + anchor, i - anchor, (uint16_t)(i - candidate), match);
+            i += match;
+            anchor = i;
+        }
+    }
+    p = put_sequence(p, src + anchor, size - anchor, 0, 0);
+    return (size_t)(p - dst);
+}
+
+static bool get_length(const uint8_t **p, const uint8_t *end, size_t *length) {
+    uint8_t byte;
+    do {
+        if (*p >= end)
+            return false;
+        byte = *(*p)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+/*
+ * Decompresses an LZ4 block. Returns the decompressed size, or -1 if the block does not
+ * decode into `capacity` bytes.
+ */
+static ssize_t lz4_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity) {
+    const uint8_t *p = src;
+    const uint8_t *end = src + size;
+    size_t n = 0;
+    while (p < end) {
+        uint8_t token = *p++;
+        size_t count = token >> 4;
+        if (count == 15 && !get_length(&p, end, &count))
+            return -1;
+        if (count > (size_t)(end - p) || count > capacity - n)
+            return -1;
+        memcpy(dst + n, p, count);
+        p += count;
+        n += count;
+        if (p == end)
+            break;
+
+        if (end - p < 2)
+            return -1;
+        size_t offset = p[0] | (p[1] << 8);
+        p += 2;
+        if (offset == 0 || offset > n)
+            return -1;
+        size_t match = token & 15;
+        if (match == 15 && !get_length(&p, end, &match))
+            return -1;
+        match += MIN_MATCH;
+        if (match > capacity - n)
+            return -1;
+        // The match may overlap the bytes it produces
+        for (size_t i = 0; i < match; i++, n++)
+            dst[n] = dst[n - offset];
+    }
+    return (ssize_t)n;
+}
+
+static inline index_header_t *record_header(uint8_t *record) {
+    return (index_header_t *)record;
+}
+
+static inline index_entry_t *record_entries(uint8_t *record) {
+    return (index_entry_t *)(record + sizeof(index_header_t));
+}
+
+static uint32_t record_crc(const uint8_t *record) {
+    const index_header_t *header = (const index_header_t *)record;
+    uint32_t crc = storage_crc32(0, header, offsetof(index_header_t, crc));
+    return storage_crc32(crc, record + sizeof(index_header_t), header->count * sizeof(index_entry_t));
+}
+
+static inline size_t record_size(const uint8_t *record) {
+    return sizeof(index_header_t) + ((const index_header_t *)record)->count * sizeof(index_entry_t);
+}
+
+static int read_at(fs_zfile_t *zf, off_t offset, void *buffer, size_t size) {
+    if (lseek(zf->fd, offset, SEEK_SET) < 0)
+        return -1;
+    ssize_t length = read(zf->fd, buffer, size);
+    if (length < 0)
+        return -1;
+    if ((size_t)length != size) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Appends at the end of the frames. A failed write is cut off again, so that the file stays
+ * readable.
+ */
+static int write_end(fs_zfile_t *zf, const void *buffer, size_t size) {
+    ssize_t length = -1;
+    if (lseek(zf->fd, zf->end, SEEK_SET) >= 0)
+        length = write(zf->fd, buffer, size);
+    if (length >= 0 && (size_t)length == size) {
+        zf->end += (off_t)size;
+        return 0;
+    }
+    int saved = length < 0 ? errno : ENOSPC;
+    ftruncate(zf->fd, zf->end);
+    errno = saved;
+    return -1;
+}
+
+static bool frame_header_is_valid(fs_zfile_t *zf, const frame_header_t *header) {
+    if (header->magic != FRAME_MAGIC || header->length == 0 || header->length > zf->frame_size)
+        return false;
+    if (header->packed & FRAME_STORED)
+        return (header->packed & ~FRAME_STORED) == header->length;
+    return header->packed > 0 && header->packed <= BOUND(zf->frame_size);
+}
+
+static inline size_t frame_packed_size(const frame_header_t *header) {
+    return header->packed & ~FRAME_STORED;
+}
+
+/*
+ * Reads the frame at `offset` of the file into the frame buffer.
+ */
+static int load_frame(fs_zfile_t *zf, off_t offset) {
+    if (zf->loaded == offset)
+        return 0;
+    zf->loaded = -1;
+    frame_header_t header;
+    if (read_at(zf, offset, &header, sizeof(header)) != 0)
+        return -1;
+    if (!frame_header_is_valid(zf, &header)) {
+        errno = EIO;
+        return -1;
+    }
+    if (header.packed & FRAME_STORED) {
+        if (read(zf->fd, zf->frame, header.length) != (ssize_t)header.length) {
+            errno = EIO;
+            return -1;
+        }
+    } else {
+        if (read(zf->fd, zf->packed, header.packed) != (ssize_t)header.packed) {
+            errno = EIO;
+            return -1;
+        }
+        if (lz4_decompress(zf->packed, header.packed, zf->frame, zf->frame_size) != (ssize_t)header.length) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    if (storage_crc32(0, zf->frame, header.length) != header.crc) {
+        errno = EIO;
+        return -1;
+    }
+    zf->length = header.length;
+    zf->loaded = offset;
+    return 0;
+}
+
+/*
+ * Reads the index record at `offset` into `record`. Returns 1 if it is valid, 0 if it is not
+ * an index record.
+ */
+static int read_record(fs_zfile_t *zf, off_t offset, off_t file_size, uint8_t *record) {
+    index_header_t *header = record_header(record);
+    if (offset + (off_t)sizeof(index_header_t) > file_size)
+        return 0;
+    if (read_at(zf, offset, header, sizeof(index_header_t)) != 0)
+        return -1;
+    if (header->magic != INDEX_MAGIC || header->count == 0 || header->count > INDEX_ENTRIES ||
+        header->previous >= offset || offset + (off_t)record_size(record) > file_size)
+    {
+        return 0;
+    }
+    if (read(zf->fd, record_entries(record), header->count * sizeof(index_entry_t)) !=
+        (ssize_t)(header->count * sizeof(index_entry_t)))
+    {
+        errno = EIO;
+        return -1;
+    }
+    return header->crc == record_crc(record) ? 1 : 0;
+}
+
+static int add_record(fs_zfile_t *zf, uint64_t position, off_t offset) {
+    if (zf->record_count == zf->record_capacity) {
+        uint32_t capacity = zf->record_capacity > 0 ? zf->record_capacity * 2 : 8;
+        index_entry_t *records = realloc(zf->records, capacity * sizeof(index_entry_t));
+        if (records == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        zf->records = records;
+        zf->record_capacity = capacity;
+    }
+    zf->records[zf->record_count].position = position;
+    zf->records[zf->record_count].offset = (uint64_t)offset;
+    zf->record_count++;
+    return 0;
+}
+
+static int write_record(fs_zfile_t *zf) {
+    index_header_t *header = record_header(zf->index);
+    header->magic = INDEX_MAGIC;
+    header->previous = (uint32_t)zf->last_record;
+    header->crc = record_crc(zf->index);
+    off_t offset = zf->end;
+    if (write_end(zf, zf->index, record_size(zf->index)) != 0)
+        return -1;
+    zf->last_record = offset;
+    header->count = 0;
+    return 0;
+}
+
+/*
+ * Compresses and writes out the current frame. A full index record is written before the
+ * frame, so that a failure leaves the data of the frame in the buffer.
+ */
+static int write_frame(fs_zfile_t *zf) {
+    index_header_t *index = record_header(zf->index);
+    if (index->count == INDEX_ENTRIES && write_record(zf) != 0)
+        return -1;
+
+    frame_header_t *header = (frame_header_t *)zf->packed;
+    uint8_t *data = zf->packed + sizeof(frame_header_t);
+    size_t packed = lz4_compress(zf->frame, zf->length, data, zf->table);
+    header->magic = FRAME_MAGIC;
+    header->length = zf->length;
+    header->packed = (uint32_t)packed;
+    header->crc = storage_crc32(0, zf->frame, zf->length);
+    if (packed >= zf->length) {
+        memcpy(data, zf->frame, zf->length);
+        packed = zf->length;
+        header->packed = (uint32_t)packed | FRAME_STORED;
+    }
+    off_t offset = zf->end;
+    if (write_end(zf, zf->packed, sizeof(frame_header_t) + packed) != 0)
+        return -1;
+
+    index_entry_t *entry = &record_entries(zf->index)[index->count++];
+    entry->position = (uint64_t)zf->size;
+    entry->offset = (uint64_t)offset;
+    zf->size += zf->length;
+    zf->length = 0;
+    return 0;
+}
+
+static int flush(fs_zfile_t *zf) {
+    if (zf->length > 0 && write_frame(zf) != 0)
+        return -1;
+    if (record_header(zf->index)->count == INDEX_ENTRIES)
+        return write_record(zf);
+    return 0;
+}
+
+static int close_writer(fs_zfile_t *zf) {
+    if (flush(zf) != 0)
+        return -1;
+    if (record_header(zf->index)->count > 0 && write_record(zf) != 0)
+        return -1;
+    if (zf->last_record == 0)
+        return 0;
+    footer_t footer = {.index = (uint32_t)zf->last_record, .magic = FOOTER_MAGIC};
+    return write_end(zf, &footer, sizeof(footer));
+}
+
+/*
+ * Size of the frames up to the end of the last frame of an index record.
+ */
+static int size_from_record(fs_zfile_t *zf, uint8_t *record) {
+    const index_entry_t *last = &record_entries(record)[record_header(record)->count - 1];
+    frame_header_t header;
+    if (read_at(zf, (off_t)last->offset, &header, sizeof(header)) != 0)
+        return -1;
+    if (!frame_header_is_valid(zf, &header)) {
+        errno = EIO;
+        return -1;
+    }
+    zf->size = (off_t)(last->position + header.length);
+    return 0;
+}
+
+/*
+ * Finds the frames of a closed file from the index records, following them backwards from
+ * the footer. Returns 1 if the footer is valid.
+ */
+static int load_from_footer(fs_zfile_t *zf, off_t file_size) {
+    if (file_size < (off_t)(sizeof(file_header_t) + sizeof(footer_t)))
+        return 0;
+    footer_t footer;
+    off_t end = file_size - (off_t)sizeof(footer);
+    if (read_at(zf, end, &footer, sizeof(footer)) != 0)
+        return -1;
+    if (footer.magic != FOOTER_MAGIC || footer.index < sizeof(file_header_t))
+        return 0;
+    int valid = read_record(zf, footer.index, end, zf->block);
+    if (valid <= 0)
+        return valid;
+    if (footer.index + (off_t)record_size(zf->block) != end)
+        return 0;
+    if (size_from_record(zf, zf->block) != 0)
+        return -1;
+    zf->end = end;
+    zf->last_record = footer.index;
+    if (zf->writer)
+        return 1;
+
+    // The index records from the last one to the first one, then reversed
+    off_t offset = footer.index;
+    index_header_t header;
+    index_entry_t first;
+    while (true) {
+        if (read_at(zf, offset, &header, sizeof(header)) != 0 ||
+            read(zf->fd, &first, sizeof(first)) != sizeof(first))
+        {
+            errno = EIO;
+            return -1;
+        }
+        if (header.magic != INDEX_MAGIC || header.previous >= offset) {
+            errno = EIO;
+            return -1;
+        }
+        if (add_record(zf, first.position, offset) != 0)
+            return -1;
+        if (header.previous == 0)
+            break;
+        offset = header.previous;
+    }
+    for (uint32_t i = 0; i < zf->record_count / 2; i++) {
+        index_entry_t swap = zf->records[i];
+        zf->records[i] = zf->records[zf->record_count - 1 - i];
+        zf->records[zf->record_count - 1 - i] = swap;
+    }
+    return 1;
+}
+
+/*
+ * Finds the frames of a file that was not closed by walking the frame headers. The frames
+ * after the last index record go into the current index record. A frame torn by a power
+ * failure, and anything after it, is ignored.
+ */
+static int load_by_scan(fs_zfile_t *zf, off_t file_size) {
+    index_header_t *index = record_header(zf->index);
+    off_t offset = sizeof(file_header_t);
+    while (offset + (off_t)sizeof(frame_header_t) <= file_size) {
+        frame_header_t header;
+        if (read_at(zf, offset, &header, sizeof(header)) != 0)
+            return -1;
+        if (header.magic == INDEX_MAGIC) {
+            int valid = read_record(zf, offset, file_size, zf->block);
+            if (valid < 0)
+                return -1;
+            if (valid == 0 || record_header(zf->block)->count != index->count ||
+                memcmp(record_entries(zf->block), record_entries(zf->index),
+                       index->count * sizeof(index_entry_t)) != 0)
+            {
+                break;
+            }
+            if (!zf->writer && add_record(zf, record_entries(zf->index)[0].position, offset) != 0)
+                return -1;
+            zf->last_record = offset;
+            index->count = 0;
+            offset += (off_t)record_size(zf->block);
+            continue;
+        }
+        if (!frame_header_is_valid(zf, &header) || index->count == INDEX_ENTRIES)
+            break;
+        off_t next = offset + (off_t)sizeof(frame_header_t) + (off_t)frame_packed_size(&header);
+        if (next > file_size)
+            break;
+        index_entry_t *entry = &record_entries(zf->index)[index->count++];
+        entry->position = (uint64_t)zf->size;
+        entry->offset = (uint64_t)offset;
+        zf->size += header.length;
+        offset = next;
+    }
+    zf->end = offset;
+
+    // The last frame may have been written only in part
+    if (index->count > 0) {
+        index_entry_t *last = &record_entries(zf->index)[index->count - 1];
+        if (load_frame(zf, (off_t)last->offset) != 0) {
+            if (errno != EIO)
+                return -1;
+            zf->end = (off_t)last->offset;
+            zf->size = (off_t)last->position;
+            index->count--;
+        }
+    }
+    zf->block_record = NO_RECORD;
+    return 0;
+}
+
+static int create_header(fs_zfile_t *zf) {
+    file_header_t header = {
+        .magic = FILE_MAGIC,
+        .version = VERSION,
+        .frame_size = zf->frame_size,
+    };
+    header.crc = storage_crc32(0, &header, offsetof(file_header_t, crc));
+    zf->end = 0;
+    return write_end(zf, &header, sizeof(header));
+}
+
+static int read_header(fs_zfile_t *zf) {
+    file_header_t header;
+    if (lseek(zf->fd, 0, SEEK_SET) < 0)
+        return -1;
+    ssize_t size = read(zf->fd, &header, sizeof(header));
+    if (size < 0)
+        return -1;
+    if ((size_t)size != sizeof(header) ||
+        header.magic != FILE_MAGIC ||
+        header.version != VERSION ||
+        header.crc != storage_crc32(0, &header, offsetof(file_header_t, crc)) ||
+        header.frame_size < MIN_FRAME_SIZE || header.frame_size > MAX_FRAME_SIZE)
+    {
+        errno = EILSEQ;
+        return -1;
+    }
+    zf->frame_size = header.frame_size;
+    return 0;
+}
+
+static int allocate(fs_zfile_t *zf) {
+    zf->frame = malloc(zf->frame_size);
+    zf->packed = malloc(sizeof(frame_header_t) + BOUND(zf->frame_size));
+    zf->index = calloc(1, RECORD_SIZE);
+    zf->block = malloc(RECORD_SIZE);
+    if (zf->writer)
+        zf->table = malloc(sizeof(uint16_t) << HASH_BITS);
+    if (zf->frame == NULL || zf->packed == NULL || zf->index == NULL || zf->block == NULL ||
+        (zf->writer && zf->table == NULL))
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+static void release(fs_zfile_t *zf) {
+    free(zf->frame);
+    free(zf->packed);
+    free(zf->table);
+    free(zf->index);
+    free(zf->records);
+    free(zf->block);
+    free(zf);
+}
+
+fs_zfile_t *fs_zfile_open(const char *path, int flags) {
+    int mode = flags & O_ACCMODE;
+    if (mode != O_RDONLY && mode != O_WRONLY) {
+        errno = EINVAL;
+        return NULL;
+    }
+    fs_zfile_t *zf = calloc(1, sizeof(fs_zfile_t));
+    if (zf == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    mutex_init(&zf->mutex);
+    zf->writer = mode == O_WRONLY;
+    zf->loaded = -1;
+    zf->block_record = NO_RECORD;
+    if (zf->writer)
+        zf->fd = open(path, O_RDWR | (flags & (O_CREAT | O_EXCL | O_TRUNC)), 0644);
+    else
+        zf->fd = open(path, O_RDONLY);
+    if (zf->fd < 0) {
+        free(zf);
+        return NULL;
+    }
+
+    int err = 0;
+    off_t size = lseek(zf->fd, 0, SEEK_END);
+    if (size < 0) {
+        err = -1;
+    } else if (size == 0 && zf->writer) {
+        zf->frame_size = PICO_VFS_ZFILE_FRAME_SIZE;
+    } else {
+        err = read_header(zf);
+    }
+    if (err == 0)
+        err = allocate(zf);
+    if (err == 0) {
+        if (size == 0) {
+            err = create_header(zf);
+        } else {
+            int found = load_from_footer(zf, size);
+            if (found < 0)
+                err = -1;
+            else if (found == 0)
+                err = load_by_scan(zf, size);
+        }
+    }
+    // A writer continues after the last frame, over the footer or a torn frame
+    if (err == 0 && zf->writer && zf->end < size)
+        err = ftruncate(zf->fd, zf->end);
+    if (err != 0) {
+        int saved = errno;
+        close(zf->fd);
+        release(zf);
+        errno = saved;
+        return NULL;
+    }
+    zf->loaded = -1;
+    zf->length = 0;
+    return zf;
+}
+
+ssize_t fs_zfile_write(fs_zfile_t *zf, const void *buffer, size_t size) {
+    if (!zf->writer) {
+        errno = EBADF;
+        return -1;
+    }
+    mutex_enter_blocking(&zf->mutex);
+    const uint8_t *data = buffer;
+    size_t written = 0;
+    while (written < size) {
+        if (zf->length == zf->frame_size && write_frame(zf) != 0) {
+            mutex_exit(&zf->mutex);
+            return written > 0 ? (ssize_t)written : -1;
+        }
+        size_t n = zf->frame_size - zf->length;
+        if (n > size - written)
+            n = size - written;
+        memcpy(zf->frame + zf->length, data + written, n);
+        zf->length += n;
+        written += n;
+    }
+    mutex_exit(&zf->mutex);
+    return (ssize_t)written;
+}
+
+/*
+ * Finds the frame that holds `position`.
+ */
+static const index_entry_t *find_frame(fs_zfile_t *zf, off_t position) {
+    const index_entry_t *entries = record_entries(zf->index);
+    uint16_t count = record_header(zf->index)->count;
+    if (count == 0 || (uint64_t)position < entries[0].position) {
+        // Last index record that starts at or before the position
+        uint32_t low = 1;
+        uint32_t high = zf->record_count;
+        while (low < high) {
+            uint32_t middle = low + (high - low) / 2;
+            if (zf->records[middle].position <= (uint64_t)position)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        uint32_t record = low - 1;
+        if (zf->block_record != record) {
+            zf->block_record = NO_RECORD;
+            int valid = read_record(zf, (off_t)zf->records[record].offset, zf->end, zf->block);
+            if (valid <= 0) {
+                if (valid == 0)
+                    errno = EIO;
+                return NULL;
+            }
+            zf->block_record = record;
+        }
+        entries = record_entries(zf->block);
+        count = record_header(zf->block)->count;
+    }
+
+    uint16_t low = 1;
+    uint16_t high = count;
+    while (low < high) {
+        uint16_t middle = low + (high - low) / 2;
+        if (entries[middle].position <= (uint64_t)position)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return &entries[low - 1];
+}
+
+ssize_t fs_zfile_read(fs_zfile_t *zf, void *buffer, size_t size) {
+    if (zf->writer) {
+        errno = EBADF;
+        return -1;
+    }
+    mutex_enter_blocking(&zf->mutex);
+    uint8_t *data = buffer;
+    size_t total = 0;
+    while (total < size && zf->position < zf->size) {
+        const index_entry_t *entry = find_frame(zf, zf->position);
+        if (entry == NULL || load_frame(zf, (off_t)entry->offset) != 0) {
+            mutex_exit(&zf->mutex);
+            return total > 0 ? (ssize_t)total : -1;
+        }
+        size_t skip = (size_t)((uint64_t)zf->position - entry->position);
+        if (skip >= zf->length) {
+            mutex_exit(&zf->mutex);
+            errno = EIO;
+            return total > 0 ? (ssize_t)total : -1;
+        }
+        size_t n = zf->length - skip;
+        if (n > size - total)
+            n = size - total;
+        memcpy(data + total, zf->frame + skip, n);
+        total += n;
+        zf->position += (off_t)n;
+    }
+    mutex_exit(&zf->mutex);
+    return (ssize_t)total;
+}
+
+off_t fs_zfile_seek(fs_zfile_t *zf, off_t offset, int whence) {
+    if (zf->writer) {
+        errno = EBADF;
+        return -1;
+    }
+    mutex_enter_blocking(&zf->mutex);
+    off_t base;
+    switch (whence) {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = zf->position;
+        break;
+    case SEEK_END:
+        base = zf->size;
+        break;
+    default:
+        mutex_exit(&zf->mutex);
+        errno = EINVAL;
+        return -1;
+    }
+    if (base + offset < 0) {
+        mutex_exit(&zf->mutex);
+        errno = EINVAL;
+        return -1;
+    }
+    zf->position = base + offset;
+    mutex_exit(&zf->mutex);
+    return zf->position;
+}
+
+off_t fs_zfile_size(fs_zfile_t *zf) {
+    mutex_enter_blocking(&zf->mutex);
+    off_t size = zf->size + (zf->writer ? (off_t)zf->length : 0);
+    mutex_exit(&zf->mutex);
+    return size;
+}
+
+int fs_zfile_sync(fs_zfile_t *zf) {
+    mutex_enter_blocking(&zf->mutex);
+    int err = zf->writer ? flush(zf) : 0;
+    if (err == 0)
+        err = fsync(zf->fd);
+    mutex_exit(&zf->mutex);
+    return err;
+}
+
+int fs_zfile_close(fs_zfile_t *zf) {
+    mutex_enter_blocking(&zf->mutex);
+    int err = zf->writer ? close_writer(zf) : 0;
+    mutex_exit(&zf->mutex);
+    if (close(zf->fd) != 0)
+        err = -1;
+    int saved = errno;
+    release(zf);
+    errno = saved;
+    return err;
+}
@@ -0,0 +1,945 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <errno.h>
+#include <pico/mutex.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "storage/crc32.h"
+#include "storage/kv.h"
+
+#define SECTOR_MAGIC    0x5653564b  // "KVSV"
+#define ENTRY_MAGIC     0x564b
+#define ERASE_VALUE     0xFF
+#define MIN_SECTORS     3
+#define MAX_KEY_LENGTH  UINT8_MAX
+#define INDEX_CAPACITY  32
+
+#define ENTRY_DELETE    0x01  // Removes the key
+#define ENTRY_COLLECTED 0x02  // The live entries of the oldest sector were copied before it
+
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;           // Covers sequence
+    uint32_t sequence;      // Incremented for every sector that is started
+    uint32_t reserved;
+} sector_header_t;
+
+typedef struct {
+    uint16_t magic;
+    uint8_t key_length;
+    uint8_t flags;
+    uint16_t value_length;
+    uint16_t reserved;
+    uint32_t crc;           // Covers the sector sequence, the fields above, the key and the value
+} entry_header_t;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t addr;          // Device address of the newest entry of the key, 0 if empty
+} slot_t;
+
+struct kv {
+    struct kv *next;          // Open stores, compacted by kv_gc_all()
+    blockdevice_t *device;
+    mutex_t mutex;
+    size_t sector_size;
+    size_t sector_count;
+    size_t page_size;         // Program size of the device
+    size_t unit;              // Read unit, a multiple of the program and read sizes
+    uint8_t *page;            // Page being filled, ERASE_VALUE beyond `fill`
+    uint8_t *scratch;         // Bounce buffer of one read unit
+    size_t fill;
+    bd_size_t page_addr;      // Device address of `page`
+    size_t head;              // Sector being written
+    size_t tail;              // Oldest sector
+    uint32_t head_sequence;
+    uint32_t *live;           // Bytes of live entries in each sector
+    size_t live_total;
+    slot_t *slots;            // Open addressing hash index with linear probing
+    size_t capacity;          // Number of slots, a power of two
+    size_t count;             // Number of keys
+};
+
+auto_init_mutex(stores_mutex);
+static kv_t *stores = NULL;
+
+// Provided by the VFS when it is linked, which then calls kv_gc_all() from fs_gc_idle_poll()
+extern int fs_gc_register_idle(void (*fn)(void)) __attribute__((weak));
+
+
+static inline bd_size_t sector_addr(kv_t *kv, size_t sector) {
+    return (bd_size_t)sector * kv->sector_size;
+}
+
+static inline size_t sector_of(kv_t *kv, bd_size_t addr) {
+    return (size_t)(addr / kv->sector_size);
+}
+
+static inline size_t next_sector(kv_t *kv, size_t sector) {
+    return (sector + 1) % kv->sector_count;
+}
+
+static inline size_t prev_sector(kv_t *kv, size_t sector) {
+    return (sector + kv->sector_count - 1) % kv->sector_count;
+}
+
+static inline size_t free_sectors(kv_t *kv) {
+    return kv->sector_count - (kv->head + kv->sector_count - kv->tail) % kv->sector_count - 1;
+}
+
+static inline bd_size_t head_position(kv_t *kv) {
+    return kv->page_addr + kv->fill;
+}
+
+static inline size_t entry_size(const entry_header_t *header) {
+    return sizeof(entry_header_t) + header->key_length + header->value_length;
+}
+
+static int log_read(kv_t *kv, void *buffer, bd_size_t addr, size_t size) {
+    blockdevice_t *device = kv->device;
+    uint8_t *out = buffer;
+    while (size > 0) {
+        bd_size_t block = addr - addr % kv->unit;
+        size_t offset = (size_t)(addr - block);
+        size_t length = kv->unit - offset < size ? kv->unit - offset : size;
+
+        bool buffered = kv->fill > 0 && kv->page_addr >= block && kv->page_addr < block + kv->unit;
+        if (!buffered || kv->unit != kv->page_size) {
+            int err = device->read(device, kv->scratch, block, kv->unit);
+            if (err != BD_ERROR_OK)
+                return err;
+        }
+        if (buffered)  // The page being filled is newer than the device
+            memcpy(kv->scratch + (size_t)(kv->page_addr - block), kv->page, kv->page_size);
+        memcpy(out, kv->scratch + offset, length);
+
+        out += length;
+        addr += length;
+        size -= length;
+    }
+    return BD_ERROR_OK;
+}
+
+static uint32_t sector_crc(const sector_header_t *header) {
+    return storage_crc32(0, &header->sequence, sizeof(header->sequence));
+}
+
+static uint32_t entry_crc(uint32_t sequence, const entry_header_t *header) {
+    uint32_t crc = storage_crc32(0, &sequence, sizeof(sequence));
+    return storage_crc32(crc, header, offsetof(entry_header_t, crc));
+}
+
+/*
+ * Returns 1 if the sector has a valid header, 0 if not.
+ */
+static int read_sector_header(kv_t *kv, size_t sector, sector_header_t *header) {
+    int err = log_read(kv, header, sector_addr(kv, sector), sizeof(sector_header_t));
+    if (err != BD_ERROR_OK)
+        return err;
+    return header->magic == SECTOR_MAGIC && header->crc == sector_crc(header);
+}
+
+/*
+ * Verifies the entry at `offset` of a sector started with `sequence`, and copies its
+ * NUL-terminated key to `key`. Returns -ENOENT if there is no valid entry.
+ */
+static int check_entry(kv_t *kv, size_t sector, size_t offset, uint32_t sequence,
+                       entry_header_t *header, char *key)
+{
+    if (offset + sizeof(entry_header_t) > kv->sector_size)
+        return -ENOENT;
+
+    bd_size_t addr = sector_addr(kv, sector) + offset;
+    int err = log_read(kv, header, addr, sizeof(entry_header_t));
+    if (err != BD_ERROR_OK)
+        return err;
+    if (header->magic != ENTRY_MAGIC || offset + entry_size(header) > kv->sector_size)
+        return -ENOENT;
+    if (header->key_length == 0 && header->flags != ENTRY_COLLECTED)
+        return -ENOENT;
+
+    uint32_t crc = entry_crc(sequence, header);
+    addr += sizeof(entry_header_t);
+    err = log_read(kv, key, addr, header->key_length);
+    if (err != BD_ERROR_OK)
+        return err;
+    key[header->key_length] = '\0';
+    crc = storage_crc32(crc, key, header->key_length);
+    addr += header->key_length;
+
+    uint8_t chunk[64];
+    for (size_t done = 0; done < header->value_length; ) {
+        size_t length = header->value_length - done < sizeof(chunk) ? header->value_length - done : sizeof(chunk);
+        err = log_read(kv, chunk, addr + done, length);
+        if (err != BD_ERROR_OK)
+            return err;
+        crc = storage_crc32(crc, chunk, length);
+        done += length;
+    }
+    return crc == header->crc ? BD_ERROR_OK : -ENOENT;
+}
+
+static int read_entry(kv_t *kv, size_t sector, size_t *offset, uint32_t sequence,
+                      entry_header_t *header, char *key)
+{
+    int err = check_entry(kv, sector, *offset, sequence, header, key);
+    if (err != -ENOENT || *offset % kv->page_size == 0)
+        return err;
+
+    // kv_sync() pads the page, the following entry starts on the next page
+    *offset += kv->page_size - *offset % kv->page_size;
+    return check_entry(kv, sector, *offset, sequence, header, key);
+}
+
+static int program_page(kv_t *kv) {
+    blockdevice_t *device = kv->device;
+    int err = device->program(device, kv->page, kv->page_addr, kv->page_size);
+    if (err != BD_ERROR_OK)
+        return err;
+    kv->page_addr += kv->page_size;
+    kv->fill = 0;
+    memset(kv->page, ERASE_VALUE, kv->page_size);
+    return BD_ERROR_OK;
+}
+
+static int emit(kv_t *kv, const void *data, size_t size) {
+    const uint8_t *p = data;
+    while (size > 0) {
+        size_t length = kv->page_size - kv->fill < size ? kv->page_size - kv->fill : size;
+        memcpy(kv->page + kv->fill, p, length);
+        kv->fill += length;
+        p += length;
+        size -= length;
+        if (kv->fill == kv->page_size) {
+            int err = program_page(kv);
+            if (err != BD_ERROR_OK)
+                return err;
+        }
+    }
+    return BD_ERROR_OK;
+}
+
+static int flush_page(kv_t *kv) {
+    if (kv->fill == 0)
+        return BD_ERROR_OK;
+    return program_page(kv);
+}
+
+static bool is_erased(kv_t *kv, bd_size_t addr, size_t size) {
+    uint8_t chunk[64];
+    for (size_t done = 0; done < size; done += sizeof(chunk)) {
+        size_t length = size - done < sizeof(chunk) ? size - done : sizeof(chunk);
+        if (log_read(kv, chunk, addr + done, length) != BD_ERROR_OK)
+            return false;
+        for (size_t i = 0; i < length; i++) {
+            if (chunk[i] != ERASE_VALUE)
+                return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Erases a sector. Devices without a real erase, such as SD cards and files, keep the old
+ * contents, so the sector is filled with the erase value instead.
+ */
+static int free_sector(kv_t *kv, size_t sector) {
+    blockdevice_t *device = kv->device;
+    int err = device->erase(device, sector_addr(kv, sector), kv->sector_size);
+    if (err != BD_ERROR_OK)
+        return err;
+    kv->live_total -= kv->live[sector];
+    kv->live[sector] = 0;
+    if (is_erased(kv, sector_addr(kv, sector), kv->page_size))
+        return BD_ERROR_OK;
+
+    memset(kv->scratch, ERASE_VALUE, kv->page_size);
+    for (size_t offset = 0; offset < kv->sector_size; offset += kv->page_size) {
+        err = device->program(device, kv->scratch, sector_addr(kv, sector) + offset, kv->page_size);
+        if (err != BD_ERROR_OK)
+            return err;
+    }
+    return BD_ERROR_OK;
+}
+
+static int start_sector(kv_t *kv, size_t sector, uint32_t sequence) {
+    kv->head = sector;
+    kv->head_sequence = sequence;
+    kv->page_addr = sector_addr(kv, sector);
+    kv->fill = 0;
+    sector_header_t header = {
+        .magic = SECTOR_MAGIC,
+        .sequence = sequence,
+    };
+    header.crc = sector_crc(&header);
+    return emit(kv, &header, sizeof(header));
+}
+
+static uint32_t key_hash(const char *key, size_t length) {
+    uint32_t hash = 2166136261u;  // FNV-1a
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Looks up a key. Returns 1 with the slot and the header of the newest entry if the key
+ * exists, 0 with the empty slot to insert it at if not.
+ */
+static int find_slot(kv_t *kv, const char *key, size_t length, uint32_t hash, size_t *slot,
+                     entry_header_t *header)
+{
+    size_t mask = kv->capacity - 1;
+    size_t i;
+    for (i = hash & mask; kv->slots[i].addr != 0; i = (i + 1) & mask) {
+        if (kv->slots[i].hash != hash)
+            continue;
+        struct {
+            entry_header_t header;
+            char key[MAX_KEY_LENGTH];
+        } entry;
+        int err = log_read(kv, &entry, kv->slots[i].addr, sizeof(entry_header_t) + length);
+        if (err != BD_ERROR_OK)
+            return err;
+        if (entry.header.key_length == length && memcmp(entry.key, key, length) == 0) {
+            *slot = i;
+            *header = entry.header;
+            return 1;
+        }
+    }
+    *slot = i;
+    return 0;
+}
+
+static size_t empty_slot(kv_t *kv, uint32_t hash) {
+    size_t mask = kv->capacity - 1;
+    size_t i = hash & mask;
+    while (kv->slots[i].addr != 0)
+        i = (i + 1) & mask;
+    return i;
+}
+
+static int grow_index(kv_t *kv) {
+    slot_t *old = kv->slots;
+    size_t old_capacity = kv->capacity;
+    slot_t *slots = calloc(old_capacity * 2, sizeof(slot_t));
+    if (slots == NULL)
+        return -ENOMEM;
+    kv->slots = slots;
+    kv->capacity = old_capacity * 2;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].addr != 0)
+            kv->slots[empty_slot(kv, old[i].hash)] = old[i];
+    }
+    free(old);
+    return BD_ERROR_OK;
+}
+
+// Backward shift deletion keeps the probe sequences intact without tombstones
+static void remove_slot(kv_t *kv, size_t slot) {
+    size_t mask = kv->capacity - 1;
+    size_t hole = slot;
+    for (size_t i = (slot + 1) & mask; kv->slots[i].addr != 0; i = (i + 1) & mask) {
+        size_t home = kv->slots[i].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            kv->slots[hole] = kv->slots[i];
+            hole = i;
+        }
+    }
+    kv->slots[hole].addr = 0;
+}
+
+static void account(kv_t *kv, bd_size_t addr, const entry_header_t *header, bool add) {
+    size_t size = entry_size(header);
+    if (add) {
+        kv->live[sector_of(kv, addr)] += size;
+        kv->live_total += size;
+    } else {
+        kv->live[sector_of(kv, addr)] -= size;
+        kv->live_total -= size;
+    }
+}
+
+/*
+ * Looks up the key of `entry` like find_slot(). A new key also gets its slot, so that the
+ * following index_apply() cannot fail.
+ */
+static int index_reserve(kv_t *kv, const char *key, uint32_t hash, const entry_header_t *entry,
+                         size_t *slot, entry_header_t *old)
+{
+    int found = find_slot(kv, key, entry->key_length, hash, slot, old);
+    if (found != 0 || (entry->flags & ENTRY_DELETE))
+        return found;
+    if ((kv->count + 1) * 4 > kv->capacity * 3) {
+        int err = grow_index(kv);
+        if (err != BD_ERROR_OK)
+            return err;
+        *slot = empty_slot(kv, hash);
+    }
+    return 0;
+}
+
+/*
+ * Points the slot reserved by index_reserve() at the entry written at `addr`. Sector switches
+ * in between may move the old entry, but not the slot.
+ */
+static void index_apply(kv_t *kv, size_t slot, bool found, const entry_header_t *old, uint32_t hash,
+                        bd_size_t addr, const entry_header_t *entry)
+{
+    if (found) {
+        account(kv, kv->slots[slot].addr, old, false);
+        if (entry->flags & ENTRY_DELETE) {
+            remove_slot(kv, slot);
+            kv->count--;
+            return;
+        }
+        kv->slots[slot].addr = (uint32_t)addr;
+    } else {
+        if (entry->flags & ENTRY_DELETE)
+            return;
+        kv->slots[slot].hash = hash;
+        kv->slots[slot].addr = (uint32_t)addr;
+        kv->count++;
+    }
+    account(kv, addr, entry, true);
+}
+
+/*
+ * Points the index at the entry written at `addr`.
+ */
+static int index_update(kv_t *kv, const char *key, bd_size_t addr, const entry_header_t *entry) {
+    uint32_t hash = key_hash(key, entry->key_length);
+    size_t slot;
+    entry_header_t old;
+    int found = index_reserve(kv, key, hash, entry, &slot, &old);
+    if (found < 0)
+        return found;
+    index_apply(kv, slot, found, &old, hash, addr, entry);
+    return BD_ERROR_OK;
+}
+
+/*
+ * Copies the entry at `addr` to the head. The CRC changes with the sector sequence.
+ */
+static int copy_entry(kv_t *kv, bd_size_t addr, const entry_header_t *header, const char *key) {
+    entry_header_t copy = *header;
+    bd_size_t value_addr = addr + sizeof(entry_header_t) + header->key_length;
+    uint8_t chunk[64];
+
+    uint32_t crc = storage_crc32(entry_crc(kv->head_sequence, &copy), key, header->key_length);
+    for (size_t done = 0; done < header->value_length; ) {
+        size_t length = header->value_length - done < sizeof(chunk) ? header->value_length - done : sizeof(chunk);
+        int err = log_read(kv, chunk, value_addr + done, length);
+        if (err != BD_ERROR_OK)
+            return err;
+        crc = storage_crc32(crc, chunk, length);
+        done += length;
+    }
+    copy.crc = crc;
+
+    int err = emit(kv, &copy, sizeof(copy));
+    if (err == BD_ERROR_OK)
+        err = emit(kv, key, header->key_length);
+    for (size_t done = 0; err == BD_ERROR_OK && done < header->value_length; ) {
+        size_t length = header->value_length - done < sizeof(chunk) ? header->value_length - done : sizeof(chunk);
+        err = log_read(kv, chunk, value_addr + done, length);
+        if (err == BD_ERROR_OK)
+            err = emit(kv, chunk, length);
+        done += length;
+    }
+    return err;
+}
+
+/*
+ * Copies the live entries of the oldest sector to the head, which has just been started, and
+ * frees the oldest sector. Delete entries are dropped, as no older entry remains.
+ */
+static int collect_tail(kv_t *kv) {
+    size_t sector = kv->tail;
+    sector_header_t sector_header;
+    int valid = read_sector_header(kv, sector, &sector_header);
+    if (valid < 0)
+        return valid;
+
+    size_t offset = sizeof(sector_header_t);
+    while (valid) {
+        entry_header_t header;
+        char key[MAX_KEY_LENGTH + 1];
+        int err = read_entry(kv, sector, &offset, sector_header.sequence, &header, key);
+        if (err == -ENOENT)
+            break;
+        if (err != BD_ERROR_OK)
+            return err;
+        bd_size_t addr = sector_addr(kv, sector) + offset;
+        offset += entry_size(&header);
+        if (header.key_length == 0 || (header.flags & ENTRY_DELETE))
+            continue;
+
+        size_t slot;
+        entry_header_t newest;
+        int found = find_slot(kv, key, header.key_length, key_hash(key, header.key_length), &slot, &newest);
+        if (found < 0)
+            return found;
+        if (!found || kv->slots[slot].addr != addr)
+            continue;  // Superseded
+        bd_size_t copy_addr = head_position(kv);
+        err = copy_entry(kv, addr, &header, key);
+        if (err != BD_ERROR_OK)
+            return err;
+        account(kv, addr, &header, false);
+        account(kv, copy_addr, &header, true);
+        kv->slots[slot].addr = (uint32_t)copy_addr;
+    }
+
+    // The copies must be durable before the originals are erased
+    entry_header_t marker = {
+        .magic = ENTRY_MAGIC,
+        .flags = ENTRY_COLLECTED,
+    };
+    marker.crc = entry_crc(kv->head_sequence, &marker);
+    int err = emit(kv, &marker, sizeof(marker));
+    if (err == BD_ERROR_OK)
+        err = flush_page(kv);
+    if (err == BD_ERROR_OK)
+        err = kv->device->sync(kv->device);
+    if (err == BD_ERROR_OK)
+        err = free_sector(kv, sector);
+    if (err == BD_ERROR_OK)
+        kv->tail = next_sector(kv, sector);
+    return err;
+}
+
+/*
+ * Moves on to the next sector. If it is the last free one, the oldest sector is compacted
+ * into it.
+ */
+static int switch_sector(kv_t *kv) {
+    size_t sector = next_sector(kv, kv->head);
+    bool collect = next_sector(kv, sector) == kv->tail;
+    if (collect && kv->live[kv->tail] + sizeof(entry_header_t) > kv->sector_size - sizeof(sector_header_t))
+        return -ENOSPC;
+
+    int err = flush_page(kv);
+    if (err == BD_ERROR_OK)
+        err = start_sector(kv, sector, kv->head_sequence + 1);
+    if (err == BD_ERROR_OK && collect)
+        err = collect_tail(kv);
+    return err;
+}
+
+/*
+ * Makes room at the head for an entry of `size` bytes that supersedes `replaced` live bytes.
+ */
+static int ensure_room(kv_t *kv, size_t size, size_t replaced) {
+    size_t capacity = kv->sector_size - sizeof(sector_header_t) - sizeof(entry_header_t);
+    if (kv->live_total - replaced + size > (kv->sector_count - 2) * capacity)
+        return -ENOSPC;
+
+    // Every switch may compact one sector; a full turn without room means nothing is reclaimable
+    for (size_t i = 0; i <= kv->sector_count; i++) {
+        if (head_position(kv) + size <= sector_addr(kv, kv->head) + kv->sector_size)
+            return BD_ERROR_OK;
+        int err = switch_sector(kv);
+        if (err != BD_ERROR_OK)
+            return err;
+    }
+    return -ENOSPC;
+}
+
+static int append(kv_t *kv, const char *key, size_t key_length, uint8_t flags, const void *value,
+                  size_t size)
+{
+    entry_header_t header = {
+        .magic = ENTRY_MAGIC,
+        .key_length = (uint8_t)key_length,
+        .flags = flags,
+        .value_length = (uint16_t)size,
+    };
+    // Indexing the entry must not fail once it is in the log
+    uint32_t hash = key_hash(key, key_length);
+    size_t slot;
+    entry_header_t old;
+    int found = index_reserve(kv, key, hash, &header, &slot, &old);
+    if (found < 0)
+        return found;
+    int err = ensure_room(kv, entry_size(&header), found ? entry_size(&old) : 0);
+    if (err != BD_ERROR_OK)
+        return err;
+
+    header.crc = storage_crc32(entry_crc(kv->head_sequence, &header), key, key_length);
+    header.crc = storage_crc32(header.crc, value, size);
+    bd_size_t addr = head_position(kv);
+    err = emit(kv, &header, sizeof(header));
+    if (err == BD_ERROR_OK)
+        err = emit(kv, key, key_length);
+    if (err == BD_ERROR_OK)
+        err = emit(kv, value, size);
+    if (err == BD_ERROR_OK)
+        index_apply(kv, slot, found, &old, hash, addr, &header);
+    return err;
+}
+
+/*
+ * Scans the sector for entries and returns the offset after the last one.
+ */
+static int scan_sector(kv_t *kv, size_t sector, bool update, bool *collected, size_t *end) {
+    sector_header_t sector_header;
+    int valid = read_sector_header(kv, sector, &sector_header);
+    if (valid < 0)
+        return valid;
+    size_t offset = sizeof(sector_header_t);
+    *end = offset;
+    while (valid) {
+        entry_header_t header;
+        char key[MAX_KEY_LENGTH + 1];
+        int err = read_entry(kv, sector, &offset, sector_header.sequence, &header, key);
+        if (err == -ENOENT)
+            break;
+        if (err != BD_ERROR_OK)
+            return err;
+        if (header.key_length == 0)
+            *collected = true;
+        else if (update && (err = index_update(kv, key, sector_addr(kv, sector) + offset, &header)) != BD_ERROR_OK)
+            return err;
+        offset += entry_size(&header);
+        *end = offset;
+    }
+    return BD_ERROR_OK;
+}
+
+static int recover(kv_t *kv) {
+    size_t count = kv->sector_count;
+
+    // The sectors in use have consecutive sequence numbers from the tail to the head
+    sector_header_t header, following;
+    bool found = false;
+    for (size_t sector = 0; sector < count && !found; sector++) {
+        int valid = read_sector_header(kv, sector, &header);
+        if (valid < 0)
+            return valid;
+        if (!valid)
+            continue;
+        valid = read_sector_header(kv, next_sector(kv, sector), &following);
+        if (valid < 0)
+            return valid;
+        if (!valid || following.sequence != header.sequence + 1) {
+            kv->head = sector;
+            kv->head_sequence = header.sequence;
+            found = true;
+        }
+    }
+    if (!found)
+        return -EINVAL;
+    kv->tail = kv->head;
+    for (size_t i = 1; i < count; i++) {
+        size_t sector = prev_sector(kv, kv->tail);
+        int valid = read_sector_header(kv, sector, &header);
+        if (valid < 0)
+            return valid;
+        if (!valid || header.sequence != kv->head_sequence - i)
+            break;
+        kv->tail = sector;
+    }
+
+    // No free sector is left while a compaction is in progress. Either the copies are complete
+    // and only the oldest sector remains to be erased, or the copies are dropped.
+    size_t end;
+    int err;
+    if (free_sectors(kv) == 0) {
+        bool collected = false;
+        err = scan_sector(kv, kv->head, false, &collected, &end);
+        if (err != BD_ERROR_OK)
+            return err;
+        if (collected) {
+            err = free_sector(kv, kv->tail);
+            kv->tail = next_sector(kv, kv->tail);
+        } else {
+            err = free_sector(kv, kv->head);
+            kv->head = prev_sector(kv, kv->head);
+            kv->head_sequence--;
+        }
+        if (err != BD_ERROR_OK)
+            return err;
+    }
+
+    for (size_t sector = kv->tail; ; sector = next_sector(kv, sector)) {
+        bool collected = false;
+        err = scan_sector(kv, sector, true, &collected, &end);
+        if (err != BD_ERROR_OK)
+            return err;
+        if (sector == kv->head)
+            break;
+    }
+
+    // An entry torn by power failure may have left programmed bytes behind the last entry.
+    // Entries written over them could complete it, so the next entry goes to a new sector.
+    size_t next = end;
+    if (next % kv->page_size)
+        next += kv->page_size - next % kv->page_size;
+    if (next < kv->sector_size)
+        next += kv->page_size;
+    if (!is_erased(kv, sector_addr(kv, kv->head) + end, next - end))
+        end = kv->sector_size;
+    else if (end % kv->page_size)
+        end += kv->page_size - end % kv->page_size;
+    kv->page_addr = sector_addr(kv, kv->head) + end;
+    return BD_ERROR_OK;
+}
+
+static int create(blockdevice_t *device, kv_t **result) {
+    if (!device->is_initialized) {
+        int err = device->init(device);
+        if (err != BD_ERROR_OK)
+            return err;
+    }
+
+    size_t page_size = (size_t)device->program_size;
+    size_t read_size = (size_t)device->read_size;
+    size_t unit = page_size > read_size ? page_size : read_size;
+    if (unit % page_size != 0 || unit % read_size != 0)
+        return -EINVAL;
+    size_t sector_size = (size_t)device->erase_size;
+    while (sector_size < PICO_VFS_KV_SECTOR_SIZE)
+        sector_size += (size_t)device->erase_size;
+    if (sector_size % unit != 0)
+        return -EINVAL;
+    // Index entries hold 32-bit device addresses
+    bd_size_t size = device->size(device);
+    if (size > UINT32_MAX)
+        size = UINT32_MAX;
+    size_t sector_count = (size_t)(size / sector_size);
+    if (sector_count < MIN_SECTORS)
+        return -ENOSPC;
+
+    kv_t *kv = calloc(1, sizeof(kv_t));
+    if (kv == NULL)
+        return -ENOMEM;
+    kv->page = malloc(page_size);
+    kv->scratch = malloc(unit);
+    kv->live = calloc(sector_count, sizeof(uint32_t));
+    kv->slots = calloc(INDEX_CAPACITY, sizeof(slot_t));
+    if (kv->page == NULL || kv->scratch == NULL || kv->live == NULL || kv->slots == NULL) {
+        free(kv->page);
+        free(kv->scratch);
+        free(kv->live);
+        free(kv->slots);
+        free(kv);
+        return -ENOMEM;
+    }
+    kv->device = device;
+    mutex_init(&kv->mutex);
+    kv->sector_size = sector_size;
+    kv->sector_count = sector_count;
+    kv->page_size = page_size;
+    kv->unit = unit;
+    kv->capacity = INDEX_CAPACITY;
+    memset(kv->page, ERASE_VALUE, page_size);
+
+    *result = kv;
+    return BD_ERROR_OK;
+}
+
+static void destroy(kv_t *kv) {
+    free(kv->page);
+    free(kv->scratch);
+    free(kv->live);
+    free(kv->slots);
+    free(kv);
+}
+
+static int check_key(const char *key) {
+    size_t length = key != NULL ? strlen(key) : 0;
+    if (length == 0 || length > MAX_KEY_LENGTH)
+        return -EINVAL;
+    return (int)length;
+}
+
+int kv_format(blockdevice_t *device) {
+    kv_t *kv;
+    int err = create(device, &kv);
+    if (err != BD_ERROR_OK)
+        return err;
+
+    for (size_t sector = 0; sector < kv->sector_count && err == BD_ERROR_OK; sector++)
+        err = free_sector(kv, sector);
+    if (err == BD_ERROR_OK)
+        err = start_sector(kv, 0, 0);
+    if (err == BD_ERROR_OK)
+        err = flush_page(kv);
+    if (err == BD_ERROR_OK)
+        err = device->sync(device);
+
+    destroy(kv);
+    return err;
+}
+
+kv_t *kv_open(blockdevice_t *device) {
+    kv_t *kv;
+    int err = create(device, &kv);
+    if (err != BD_ERROR_OK) {
+        errno = -err;
+        return NULL;
+    }
+    err = recover(kv);
+    if (err != BD_ERROR_OK) {
+        destroy(kv);
+        errno = -err;
+        return NULL;
+    }
+
+    mutex_enter_blocking(&stores_mutex);
+    kv->next = stores;
+    stores = kv;
+    mutex_exit(&stores_mutex);
+    if (fs_gc_register_idle != NULL)
+        (void)fs_gc_register_idle(kv_gc_all);  // Otherwise compaction is left to kv_gc()
+    return kv;
+}
+
+int kv_sync(kv_t *kv) {
+    mutex_enter_blocking(&kv->mutex);
+    int err = flush_page(kv);
+    if (err == BD_ERROR_OK)
+        err = kv->device->sync(kv->device);
+    mutex_exit(&kv->mutex);
+    return err;
+}
+
+int kv_close(kv_t *kv) {
+    mutex_enter_blocking(&stores_mutex);
+    for (kv_t **p = &stores; *p != NULL; p = &(*p)->next) {
+        if (*p == kv) {
+            *p = kv->next;
+            break;
+        }
+    }
+    mutex_exit(&stores_mutex);
+
+    int err = kv_sync(kv);
+    destroy(kv);
+    return err;
+}
+
+ssize_t kv_get(kv_t *kv, const char *key, void *value, size_t size) {
+    int length = check_key(key);
+    if (length < 0)
+        return length;
+
+    mutex_enter_blocking(&kv->mutex);
+    size_t slot;
+    entry_header_t header;
+    ssize_t result = find_slot(kv, key, (size_t)length, key_hash(key, (size_t)length), &slot, &header);
+    if (result == 0) {
+        result = -ENOENT;
+    } else if (result > 0) {
+        result = header.value_length;
+        if (value != NULL && size < header.value_length) {
+            result = -EMSGSIZE;
+        } else if (value != NULL) {
+            bd_size_t addr = kv->slots[slot].addr + sizeof(entry_header_t) + (size_t)length;
+            int err = log_read(kv, value, addr, header.value_length);
+            if (err != BD_ERROR_OK)
+                result = err;
+        }
+    }
+    mutex_exit(&kv->mutex);
+    return result;
+}
+
+int kv_set(kv_t *kv, const char *key, const void *value, size_t size) {
+    int length = check_key(key);
+    if (length < 0)
+        return length;
+    // An entry and the compaction marker fit in a sector
+    size_t limit = kv->sector_size - sizeof(sector_header_t) - 2 * sizeof(entry_header_t) - (size_t)length;
+    if (size > limit || size > UINT16_MAX)
+        return -EMSGSIZE;
+
+    mutex_enter_blocking(&kv->mutex);
+    int err = append(kv, key, (size_t)length, 0, value, size);
+    mutex_exit(&kv->mutex);
+    return err;
+}
+
+int kv_delete(kv_t *kv, const char *key) {
+    int length = check_key(key);
+    if (length < 0)
+        return length;
+
+    mutex_enter_blocking(&kv->mutex);
+    size_t slot;
+    entry_header_t header;
+    int err = find_slot(kv, key, (size_t)length, key_hash(key, (size_t)length), &slot, &header);
+    if (err == 0)
+        err = -ENOENT;
+    else if (err > 0)
+        err = append(kv, key, (size_t)length, ENTRY_DELETE, NULL, 0);
+    mutex_exit(&kv->mutex);
+    return err;
+}
+
+// Called with the store locked
+static int gc(kv_t *kv) {
+    size_t used = (size_t)(head_position(kv) - sector_addr(kv, kv->head));
+    size_t capacity = kv->sector_size - sizeof(sector_header_t);
+    if (free_sectors(kv) == 1 && used >= kv->sector_size / 2 && kv->live[kv->tail] <= capacity / 2) {
+        int err = switch_sector(kv);
+        return err != BD_ERROR_OK ? err : 1;
+    }
+    return 0;
+}
+
+int kv_gc(kv_t *kv) {
+    mutex_enter_blocking(&kv->mutex);
+    int result = gc(kv);
+    mutex_exit(&kv->mutex);
+    return result;
+}
+
+void kv_gc_all(void) {
+    if (!mutex_try_enter(&stores_mutex, NULL))
+        return;
+    for (kv_t *kv = stores; kv != NULL; kv = kv->next) {
+        if (!mutex_try_enter(&kv->mutex, NULL))
+            continue;  // Being written, try again at the next call
+        (void)gc(kv);
+        mutex_exit(&kv->mutex);
+    }
+    mutex_exit(&stores_mutex);
+}
+
+void kv_iter_init(kv_t *kv, kv_iter_t *iter) {
+    iter->kv = kv;
+    iter->slot = 0;
+}
+
+ssize_t kv_iter_next(kv_iter_t *iter, char *key, size_t size) {
+    kv_t *kv = iter->kv;
+    mutex_enter_blocking(&kv->mutex);
+    while (iter->slot < kv->capacity && kv->slots[iter->slot].addr == 0)
+        iter->slot++;
+    ssize_t result = 0;
+    if (iter->slot < kv->capacity) {
+        entry_header_t header;
+        bd_size_t addr = kv->slots[iter->slot].addr;
+        result = log_read(kv, &header, addr, sizeof(header));
+        if (result == BD_ERROR_OK && size <= header.key_length) {
+            result = -EMSGSIZE;
+        } else if (result == BD_ERROR_OK) {
+            result = log_read(kv, key, addr + sizeof(header), header.key_length);
+            if (result == BD_ERROR_OK) {
+                key[header.key_length] = '\0';
+                result = header.key_length;
+                iter->slot++;
+            }
+        }
+    }
+    mutex_exit(&kv->mutex);
+    return result;
+}
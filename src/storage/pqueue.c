@@ -0,0 +1,242 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <errno.h>
+#include <pico/mutex.h>
+#include <stdlib.h>
+#include <string.h>
+#include "storage/pqueue.h"
+#include "storage/ringlog.h"
+
+#define RECORD_MESSAGE  'M'
+#define RECORD_COMMIT   'C'  // Followed by the sequence number of the oldest record that remains
+#define COMMIT_SIZE     (1 + sizeof(uint64_t))
+
+struct pq {
+    ringlog_t *log;
+    mutex_t mutex;
+    ringlog_iter_t head;    // At the oldest message, or at commit records before it
+    uint8_t *record;        // Record type followed by the message
+    size_t record_size;
+    size_t commit_room;     // Left by every push for the commit record of a later pop
+};
+
+
+/*
+ * Reads the next message into `pq->record`, skipping commit records, and returns its size.
+ * `at` is set to the position of the message. Messages that the log dropped when it wrapped
+ * around are skipped.
+ */
+static ssize_t read_message(pq_t *pq, ringlog_iter_t *iter, ringlog_iter_t *at) {
+    while (true) {
+        *at = *iter;
+        ssize_t length = ringlog_iter_next(iter, pq->record, pq->record_size, NULL);
+        if (length == -EOVERFLOW) {
+            int err = ringlog_iter_init(pq->log, iter, 0);
+            if (err != BD_ERROR_OK)
+                return err;
+            continue;
+        }
+        if (length <= 0)
+            return length;
+        if (pq->record[0] == RECORD_MESSAGE)
+            return length - 1;
+    }
+}
+
+/*
+ * Moves `iter` past commit records to the next message, or to the end of the log. Returns 1 if
+ * `first`, the oldest record that the log would keep, is after it, 0 if not, or a negative
+ * error code.
+ */
+static int is_dropped(pq_t *pq, ringlog_iter_t *iter, int64_t first) {
+    if (first < 0)
+        return (int)first;
+    if ((uint64_t)first <= iter->sequence)
+        return 0;
+    ringlog_iter_t at;
+    ssize_t length = read_message(pq, iter, &at);
+    if (length < 0)
+        return (int)length;
+    *iter = at;
+    return (uint64_t)first > iter->sequence;
+}
+
+/*
+ * The newest commit holds the position of the oldest message that remains.
+ */
+static int find_head(pq_t *pq) {
+    uint64_t head = ringlog_first_sequence(pq->log);
+    ringlog_iter_t iter;
+    int err = ringlog_iter_init(pq->log, &iter, 0);
+    if (err != BD_ERROR_OK)
+        return err;
+    ssize_t length;
+    while ((length = ringlog_iter_next(&iter, pq->record, pq->record_size, NULL)) > 0) {
+        if (pq->record[0] != RECORD_COMMIT || (size_t)length != COMMIT_SIZE)
+            continue;
+        uint64_t sequence;
+        memcpy(&sequence, pq->record + 1, sizeof(sequence));
+        if (sequence > head)
+            head = sequence;
+    }
+    if (length < 0)
+        return (int)length;
+    return ringlog_iter_init(pq->log, &pq->head, head);
+}
+
+int pq_format(blockdevice_t *device) {
+    return ringlog_format(device);
+}
+
+pq_t *pq_open(blockdevice_t *device) {
+    ringlog_t *log = ringlog_open(device);
+    if (log == NULL)
+        return NULL;
+
+    pq_t *pq = calloc(1, sizeof(pq_t));
+    size_t record_size = ringlog_max_record_size(log);
+    uint8_t *record = malloc(record_size);
+    if (pq == NULL || record == NULL) {
+        free(pq);
+        free(record);
+        ringlog_close(log);
+        errno = ENOMEM;
+        return NULL;
+    }
+    pq->log = log;
+    mutex_init(&pq->mutex);
+    pq->record = record;
+    pq->record_size = record_size;
+    // A sync pads the log to the next page, so the commit may start one page later
+    pq->commit_room = RINGLOG_RECORD_OVERHEAD + COMMIT_SIZE + device->program_size;
+
+    int err = find_head(pq);
+    if (err != BD_ERROR_OK) {
+        free(pq->record);
+        free(pq);
+        ringlog_close(log);
+        errno = -err;
+        return NULL;
+    }
+    return pq;
+}
+
+int pq_close(pq_t *pq) {
+    int err = ringlog_close(pq->log);
+    free(pq->record);
+    free(pq);
+    return err;
+}
+
+size_t pq_max_message_size(pq_t *pq) {
+    return pq->record_size - 1 - pq->commit_room;
+}
+
+int pq_push(pq_t *pq, const void *message, size_t size) {
+    if (size == 0)
+        return -EINVAL;
+    if (size > pq_max_message_size(pq))
+        return -EMSGSIZE;
+
+    mutex_enter_blocking(&pq->mutex);
+    // Neither the message nor the commit record of a later pop may drop messages not yet removed
+    int64_t first = ringlog_first_sequence_after(pq->log, size + 1 + pq->commit_room);
+    int dropped = is_dropped(pq, &pq->head, first);
+    if (dropped != 0) {
+        mutex_exit(&pq->mutex);
+        return dropped < 0 ? dropped : -ENOSPC;
+    }
+    pq->record[0] = RECORD_MESSAGE;
+    memcpy(pq->record + 1, message, size);
+    int64_t sequence = ringlog_append(pq->log, pq->record, size + 1);
+    mutex_exit(&pq->mutex);
+    return sequence < 0 ? (int)sequence : 0;
+}
+
+int pq_sync(pq_t *pq) {
+    return ringlog_sync(pq->log);
+}
+
+ssize_t pq_peek(pq_t *pq, void *buffer, size_t size) {
+    mutex_enter_blocking(&pq->mutex);
+    ringlog_iter_t iter = pq->head;
+    ringlog_iter_t at;
+    ssize_t length = read_message(pq, &iter, &at);
+    if (length > 0) {
+        pq->head = at;  // Commit records before the message are not read again
+        if (size < (size_t)length)
+            length = -EMSGSIZE;
+        else
+            memcpy(buffer, pq->record + 1, (size_t)length);
+    }
+    mutex_exit(&pq->mutex);
+    return length;
+}
+
+ssize_t pq_peek_batch(pq_t *pq, pq_message_t *messages, size_t count, void *buffer, size_t size) {
+    mutex_enter_blocking(&pq->mutex);
+    ringlog_iter_t iter = pq->head;
+    ringlog_iter_t at;
+    uint8_t *out = buffer;
+    size_t used = 0;
+    ssize_t result = 0;
+    while ((size_t)result < count) {
+        ssize_t length = read_message(pq, &iter, &at);
+        if (length <= 0) {
+            if (result == 0)
+                result = length;
+            break;
+        }
+        if (result == 0)
+            pq->head = at;
+        if (used + (size_t)length > size) {
+            if (result == 0)
+                result = -EMSGSIZE;
+            break;
+        }
+        memcpy(out + used, pq->record + 1, (size_t)length);
+        messages[result].data = out + used;
+        messages[result].size = (size_t)length;
+        used += (size_t)length;
+        result++;
+    }
+    mutex_exit(&pq->mutex);
+    return result;
+}
+
+ssize_t pq_pop_commit(pq_t *pq, size_t count) {
+    mutex_enter_blocking(&pq->mutex);
+    ringlog_iter_t iter = pq->head;
+    ringlog_iter_t at;
+    ssize_t removed = 0;
+    int err = BD_ERROR_OK;
+    while ((size_t)removed < count) {
+        ssize_t length = read_message(pq, &iter, &at);
+        if (length < 0)
+            err = (int)length;
+        if (length <= 0)
+            break;
+        removed++;
+    }
+
+    if (err == BD_ERROR_OK && removed > 0) {
+        // The commit record must not drop the messages that remain
+        ringlog_iter_t next = iter;
+        int dropped = is_dropped(pq, &next, ringlog_first_sequence_after(pq->log, COMMIT_SIZE));
+        if (dropped != 0)
+            err = dropped < 0 ? dropped : -ENOSPC;
+    }
+    if (err == BD_ERROR_OK && removed > 0) {
+        pq->record[0] = RECORD_COMMIT;
+        memcpy(pq->record + 1, &iter.sequence, sizeof(iter.sequence));
+        int64_t sequence = ringlog_append(pq->log, pq->record, COMMIT_SIZE);
+        err = sequence < 0 ? (int)sequence : ringlog_sync(pq->log);
+        if (err == BD_ERROR_OK)
+            pq->head = iter;
+    }
+    mutex_exit(&pq->mutex);
+    return err != BD_ERROR_OK ? err : removed;
+}
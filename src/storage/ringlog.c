@@ -0,0 +1,624 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <errno.h>
+#include <pico/mutex.h>
+#include <stdlib.h>
+#include <string.h>
+#include "storage/crc32.h"
+#include "storage/ringlog.h"
+
+#define SECTOR_MAGIC    0x474c4752  // "RGLG"
+#define RECORD_MAGIC    0x5243
+#define ERASE_VALUE     0xFF
+#define MIN_SECTORS     4
+
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;           // Covers sequence and first_record
+    uint64_t sequence;      // Incremented for every sector that is started
+    uint64_t first_record;  // Sequence number of the first record in the sector
+} sector_header_t;
+
+typedef struct {
+    uint16_t magic;
+    uint16_t length;
+    uint32_t crc;           // Covers sequence, length and the record data
+    uint64_t sequence;
+} record_header_t;
+
+_Static_assert(sizeof(record_header_t) == RINGLOG_RECORD_OVERHEAD, "RINGLOG_RECORD_OVERHEAD is the record header");
+
+struct ringlog {
+    blockdevice_t *device;
+    mutex_t mutex;
+    size_t sector_size;
+    size_t sector_count;
+    size_t page_size;         // Program size of the device
+    size_t unit;              // Read unit, a multiple of the program and read sizes
+    uint8_t *page;            // Page being filled, ERASE_VALUE beyond `fill`
+    uint8_t *scratch;         // Bounce buffer of one read unit
+    size_t fill;
+    bd_size_t page_addr;      // Device address of `page`
+    size_t head;              // Sector being written
+    size_t tail;              // Oldest sector
+    uint64_t head_sequence;
+    uint64_t first_sequence;
+    uint64_t next_sequence;
+};
+
+
+static inline bd_size_t sector_addr(ringlog_t *log, size_t sector) {
+    return (bd_size_t)sector * log->sector_size;
+}
+
+static inline size_t next_sector(ringlog_t *log, size_t sector) {
+    return (sector + 1) % log->sector_count;
+}
+
+static int log_read(ringlog_t *log, void *buffer, bd_size_t addr, size_t size) {
+    blockdevice_t *device = log->device;
+    uint8_t *out = buffer;
+    while (size > 0) {
+        bd_size_t block = addr - addr % log->unit;
+        size_t offset = (size_t)(addr - block);
+        size_t length = log->unit - offset < size ? log->unit - offset : size;
+
+        bool buffered = log->fill > 0 && log->page_addr >= block && log->page_addr < block + log->unit;
+        if (!buffered || log->unit != log->page_size) {
+            int err = device->read(device, log->scratch, block, log->unit);
+            if (err != BD_ERROR_OK)
+                return err;
+        }
+        if (buffered)  // The page being filled is newer than the device
+            memcpy(log->scratch + (size_t)(log->page_addr - block), log->page, log->page_size);
+        memcpy(out, log->scratch + offset, length);
+
+        out += length;
+        addr += length;
+        size -= length;
+    }
+    return BD_ERROR_OK;
+}
+
+static uint32_t sector_crc(const sector_header_t *header) {
+    uint32_t crc = storage_crc32(0, &header->sequence, sizeof(header->sequence));
+    return storage_crc32(crc, &header->first_record, sizeof(header->first_record));
+}
+
+static uint32_t record_crc(const record_header_t *header) {
+    uint32_t crc = storage_crc32(0, &header->sequence, sizeof(header->sequence));
+    return storage_crc32(crc, &header->length, sizeof(header->length));
+}
+
+/*
+ * Returns 1 if the sector has a valid header, 0 if not.
+ */
+static int read_sector_header(ringlog_t *log, size_t sector, sector_header_t *header) {
+    int err = log_read(log, header, sector_addr(log, sector), sizeof(sector_header_t));
+    if (err != BD_ERROR_OK)
+        return err;
+    return header->magic == SECTOR_MAGIC && header->crc == sector_crc(header);
+}
+
+/*
+ * Verifies the record `sequence` at `offset` of the sector and returns its length. The data is
+ * copied to `buffer` if it fits. Returns -ENOENT if there is no such record.
+ */
+static ssize_t check_record(ringlog_t *log, size_t sector, size_t offset, uint64_t sequence,
+                            void *buffer, size_t size)
+{
+    if (offset + sizeof(record_header_t) > log->sector_size)
+        return -ENOENT;
+
+    record_header_t header;
+    bd_size_t addr = sector_addr(log, sector) + offset;
+    int err = log_read(log, &header, addr, sizeof(header));
+    if (err != BD_ERROR_OK)
+        return err;
+    if (header.magic != RECORD_MAGIC || header.sequence != sequence || header.length == 0 ||
+        offset + sizeof(header) + header.length > log->sector_size)
+    {
+        return -ENOENT;
+    }
+
+    uint32_t crc = record_crc(&header);
+    addr += sizeof(header);
+    if (buffer != NULL && size >= header.length) {
+        err = log_read(log, buffer, addr, header.length);
+        if (err != BD_ERROR_OK)
+            return err;
+        crc = storage_crc32(crc, buffer, header.length);
+    } else {
+        uint8_t chunk[64];
+        for (size_t done = 0; done < header.length; ) {
+            size_t length = header.length - done < sizeof(chunk) ? header.length - done : sizeof(chunk);
+            err = log_read(log, chunk, addr + done, length);
+            if (err != BD_ERROR_OK)
+                return err;
+            crc = storage_crc32(crc, chunk, length);
+            done += length;
+        }
+    }
+    if (crc != header.crc)
+        return -ENOENT;
+    return header.length;
+}
+
+static ssize_t read_record(ringlog_t *log, size_t sector, size_t *offset, uint64_t sequence,
+                           void *buffer, size_t size)
+{
+    ssize_t length = check_record(log, sector, *offset, sequence, buffer, size);
+    if (length != -ENOENT || *offset % log->page_size == 0)
+        return length;
+
+    // ringlog_sync() pads the page, the following record starts on the next page
+    *offset += log->page_size - *offset % log->page_size;
+    return check_record(log, sector, *offset, sequence, buffer, size);
+}
+
+static int program_page(ringlog_t *log) {
+    blockdevice_t *device = log->device;
+    int err = device->program(device, log->page, log->page_addr, log->page_size);
+    if (err != BD_ERROR_OK)
+        return err;
+    log->page_addr += log->page_size;
+    log->fill = 0;
+    memset(log->page, ERASE_VALUE, log->page_size);
+    return BD_ERROR_OK;
+}
+
+static int emit(ringlog_t *log, const void *data, size_t size) {
+    const uint8_t *p = data;
+    while (size > 0) {
+        size_t length = log->page_size - log->fill < size ? log->page_size - log->fill : size;
+        memcpy(log->page + log->fill, p, length);
+        log->fill += length;
+        p += length;
+        size -= length;
+        if (log->fill == log->page_size) {
+            int err = program_page(log);
+            if (err != BD_ERROR_OK)
+                return err;
+        }
+    }
+    return BD_ERROR_OK;
+}
+
+static int flush_page(ringlog_t *log) {
+    if (log->fill == 0)
+        return BD_ERROR_OK;
+    return program_page(log);
+}
+
+/*
+ * Finds the oldest sector and the oldest record that remain when `sector` is started with
+ * `sequence`, which erases the sector after it.
+ */
+static int reclaim(ringlog_t *log, size_t sector, uint64_t sequence, size_t *tail, uint64_t *first) {
+    size_t ahead = next_sector(log, sector);
+    *tail = log->tail;
+    *first = log->first_sequence;
+    if (*tail == sector && sector != log->head)
+        *tail = ahead;
+    if (*tail == ahead) {
+        *tail = next_sector(log, ahead);
+        sector_header_t header;
+        int valid = read_sector_header(log, *tail, &header);
+        if (valid < 0)
+            return valid;
+        if (valid && header.sequence < sequence) {
+            *first = header.first_record;
+        } else {
+            *tail = sector;
+            *first = log->next_sequence;
+        }
+    }
+    return BD_ERROR_OK;
+}
+
+static bool fits(ringlog_t *log, size_t size) {
+    bd_size_t end = sector_addr(log, log->head) + log->sector_size;
+    return log->page_addr + log->fill + sizeof(record_header_t) + size <= end;
+}
+
+/*
+ * Starts writing at an erased sector, and erases the one after it ahead of time. The oldest
+ * records are dropped if they are in either sector.
+ */
+static int start_sector(ringlog_t *log, size_t sector, uint64_t sequence) {
+    blockdevice_t *device = log->device;
+    size_t ahead = next_sector(log, sector);
+
+    int err = reclaim(log, sector, sequence, &log->tail, &log->first_sequence);
+    if (err != BD_ERROR_OK)
+        return err;
+
+    err = device->erase(device, sector_addr(log, ahead), log->sector_size);
+    if (err != BD_ERROR_OK)
+        return err;
+
+    log->head = sector;
+    log->head_sequence = sequence;
+    log->page_addr = sector_addr(log, sector);
+    log->fill = 0;
+    sector_header_t header = {
+        .magic = SECTOR_MAGIC,
+        .sequence = sequence,
+        .first_record = log->next_sequence,
+    };
+    header.crc = sector_crc(&header);
+    return emit(log, &header, sizeof(header));
+}
+
+static bool is_erased(ringlog_t *log, bd_size_t addr, size_t size) {
+    uint8_t chunk[64];
+    for (size_t done = 0; done < size; done += sizeof(chunk)) {
+        size_t length = size - done < sizeof(chunk) ? size - done : sizeof(chunk);
+        if (log_read(log, chunk, addr + done, length) != BD_ERROR_OK)
+            return false;
+        for (size_t i = 0; i < length; i++) {
+            if (chunk[i] != ERASE_VALUE)
+                return false;
+        }
+    }
+    return true;
+}
+
+static int recover(ringlog_t *log) {
+    size_t count = log->sector_count;
+
+    // At most two adjacent sectors are invalid after an interrupted sector switch
+    sector_header_t reference;
+    size_t first;
+    int valid = 0;
+    for (first = 0; first < 3; first++) {
+        valid = read_sector_header(log, first, &reference);
+        if (valid < 0)
+            return valid;
+        if (valid)
+            break;
+    }
+    if (!valid)
+        return -EINVAL;
+
+    // Sector sequence numbers increase by one from `first` up to the head, and are smaller
+    // or invalid after it
+    sector_header_t header;
+    size_t lo = 0;
+    size_t hi = count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        valid = read_sector_header(log, (first + mid) % count, &header);
+        if (valid < 0)
+            return valid;
+        if (valid && header.sequence == reference.sequence + mid)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    log->head = (first + lo) % count;
+    log->head_sequence = reference.sequence + lo;
+
+    // Sector 0 keeps sequence 0 until the log wraps around, then the oldest sector is the
+    // first valid one after the head
+    log->tail = log->head;
+    valid = read_sector_header(log, 0, &header);
+    if (valid < 0)
+        return valid;
+    if (valid && header.sequence == 0) {
+        log->tail = 0;
+    } else {
+        for (size_t sector = next_sector(log, log->head); sector != log->head; sector = next_sector(log, sector)) {
+            valid = read_sector_header(log, sector, &header);
+            if (valid < 0)
+                return valid;
+            if (valid && header.sequence < log->head_sequence) {
+                log->tail = sector;
+                break;
+            }
+        }
+    }
+    valid = read_sector_header(log, log->tail, &header);
+    if (valid < 0)
+        return valid;
+    log->first_sequence = header.first_record;
+
+    // Only the head sector is scanned
+    valid = read_sector_header(log, log->head, &header);
+    if (valid < 0)
+        return valid;
+    uint64_t sequence = header.first_record;
+    size_t offset = sizeof(sector_header_t);
+    size_t end = offset;
+    while (true) {
+        ssize_t length = read_record(log, log->head, &offset, sequence, NULL, 0);
+        if (length == -ENOENT)
+            break;
+        if (length < 0)
+            return (int)length;
+        offset += sizeof(record_header_t) + (size_t)length;
+        end = offset;
+        sequence++;
+    }
+    log->next_sequence = sequence;
+
+    // A record torn by power failure may have left programmed bytes behind the last record.
+    // Records written over them could complete it, and readers only skip the padding of one
+    // page, so the next record goes to a new sector.
+    size_t next = end;
+    if (next % log->page_size)
+        next += log->page_size - next % log->page_size;
+    if (next < log->sector_size)
+        next += log->page_size;
+    if (!is_erased(log, sector_addr(log, log->head) + end, next - end))
+        end = log->sector_size;
+    else if (end % log->page_size)
+        end += log->page_size - end % log->page_size;
+    log->page_addr = sector_addr(log, log->head) + end;
+    return BD_ERROR_OK;
+}
+
+static int create(blockdevice_t *device, ringlog_t **result) {
+    if (!device->is_initialized) {
+        int err = device->init(device);
+        if (err != BD_ERROR_OK)
+            return err;
+    }
+
+    size_t page_size = (size_t)device->program_size;
+    size_t read_size = (size_t)device->read_size;
+    size_t unit = page_size > read_size ? page_size : read_size;
+    if (unit % page_size != 0 || unit % read_size != 0)
+        return -EINVAL;
+    size_t sector_size = (size_t)device->erase_size;
+    while (sector_size < PICO_VFS_RINGLOG_SECTOR_SIZE)
+        sector_size += (size_t)device->erase_size;
+    if (sector_size % unit != 0)
+        return -EINVAL;
+    size_t sector_count = (size_t)(device->size(device) / sector_size);
+    if (sector_count < MIN_SECTORS)
+        return -ENOSPC;
+
+    ringlog_t *log = calloc(1, sizeof(ringlog_t));
+    if (log == NULL)
+        return -ENOMEM;
+    log->page = malloc(page_size);
+    log->scratch = malloc(unit);
+    if (log->page == NULL || log->scratch == NULL) {
+        free(log->page);
+        free(log->scratch);
+        free(log);
+        return -ENOMEM;
+    }
+    log->device = device;
+    mutex_init(&log->mutex);
+    log->sector_size = sector_size;
+    log->sector_count = sector_count;
+    log->page_size = page_size;
+    log->unit = unit;
+    memset(log->page, ERASE_VALUE, page_size);
+
+    *result = log;
+    return BD_ERROR_OK;
+}
+
+static void destroy(ringlog_t *log) {
+    free(log->page);
+    free(log->scratch);
+    free(log);
+}
+
+int ringlog_format(blockdevice_t *device) {
+    ringlog_t *log;
+    int err = create(device, &log);
+    if (err != BD_ERROR_OK)
+        return err;
+
+    // Devices without a real erase, such as SD cards, keep the old headers
+    memset(log->page, 0, log->page_size);
+    for (size_t sector = 0; sector < log->sector_count && err == BD_ERROR_OK; sector++) {
+        err = device->erase(device, sector_addr(log, sector), log->sector_size);
+        if (err == BD_ERROR_OK)
+            err = device->program(device, log->page, sector_addr(log, sector), log->page_size);
+    }
+    memset(log->page, ERASE_VALUE, log->page_size);
+    if (err == BD_ERROR_OK)
+        err = device->erase(device, sector_addr(log, 0), log->sector_size);
+    if (err == BD_ERROR_OK)
+        err = start_sector(log, 0, 0);
+    if (err == BD_ERROR_OK)
+        err = flush_page(log);
+    if (err == BD_ERROR_OK)
+        err = device->sync(device);
+
+    destroy(log);
+    return err;
+}
+
+ringlog_t *ringlog_open(blockdevice_t *device) {
+    ringlog_t *log;
+    int err = create(device, &log);
+    if (err != BD_ERROR_OK) {
+        errno = -err;
+        return NULL;
+    }
+    err = recover(log);
+    if (err != BD_ERROR_OK) {
+        destroy(log);
+        errno = -err;
+        return NULL;
+    }
+    return log;
+}
+
+int ringlog_sync(ringlog_t *log) {
+    mutex_enter_blocking(&log->mutex);
+    int err = flush_page(log);
+    if (err == BD_ERROR_OK)
+        err = log->device->sync(log->device);
+    mutex_exit(&log->mutex);
+    return err;
+}
+
+int ringlog_close(ringlog_t *log) {
+    int err = ringlog_sync(log);
+    destroy(log);
+    return err;
+}
+
+size_t ringlog_max_record_size(ringlog_t *log) {
+    size_t size = log->sector_size - sizeof(sector_header_t) - sizeof(record_header_t);
+    return size < UINT16_MAX ? size : UINT16_MAX;
+}
+
+uint64_t ringlog_first_sequence(ringlog_t *log) {
+    mutex_enter_blocking(&log->mutex);
+    uint64_t sequence = log->first_sequence;
+    mutex_exit(&log->mutex);
+    return sequence;
+}
+
+uint64_t ringlog_next_sequence(ringlog_t *log) {
+    mutex_enter_blocking(&log->mutex);
+    uint64_t sequence = log->next_sequence;
+    mutex_exit(&log->mutex);
+    return sequence;
+}
+
+int64_t ringlog_append(ringlog_t *log, const void *record, size_t size) {
+    if (size == 0)
+        return -EINVAL;
+    if (size > ringlog_max_record_size(log))
+        return -EMSGSIZE;
+
+    mutex_enter_blocking(&log->mutex);
+    int err = BD_ERROR_OK;
+    if (!fits(log, size)) {
+        err = flush_page(log);
+        if (err == BD_ERROR_OK)
+            err = start_sector(log, next_sector(log, log->head), log->head_sequence + 1);
+    }
+    if (err == BD_ERROR_OK) {
+        record_header_t header = {
+            .magic = RECORD_MAGIC,
+            .length = (uint16_t)size,
+            .sequence = log->next_sequence,
+        };
+        header.crc = storage_crc32(record_crc(&header), record, size);
+        err = emit(log, &header, sizeof(header));
+        if (err == BD_ERROR_OK)
+            err = emit(log, record, size);
+    }
+    int64_t result = err != BD_ERROR_OK ? err : (int64_t)log->next_sequence++;
+    mutex_exit(&log->mutex);
+    return result;
+}
+
+int64_t ringlog_first_sequence_after(ringlog_t *log, size_t size) {
+    if (size == 0 || size > ringlog_max_record_size(log))
+        return -EINVAL;
+
+    mutex_enter_blocking(&log->mutex);
+    int64_t result = (int64_t)log->first_sequence;
+    if (!fits(log, size)) {
+        size_t tail;
+        uint64_t first;
+        int err = reclaim(log, next_sector(log, log->head), log->head_sequence + 1, &tail, &first);
+        result = err != BD_ERROR_OK ? err : (int64_t)first;
+    }
+    mutex_exit(&log->mutex);
+    return result;
+}
+
+int ringlog_iter_init(ringlog_t *log, ringlog_iter_t *iter, uint64_t sequence) {
+    mutex_enter_blocking(&log->mutex);
+    if (sequence < log->first_sequence)
+        sequence = log->first_sequence;
+    if (sequence > log->next_sequence)
+        sequence = log->next_sequence;
+
+    // Last sector from the tail whose first record is not after `sequence`
+    size_t count = (log->head + log->sector_count - log->tail) % log->sector_count + 1;
+    size_t lo = 0;
+    size_t hi = count;
+    sector_header_t header;
+    int err = BD_ERROR_OK;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        int valid = read_sector_header(log, (log->tail + mid) % log->sector_count, &header);
+        if (valid < 0) {
+            err = valid;
+            break;
+        }
+        if (valid && header.first_record <= sequence)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    size_t sector = (log->tail + lo) % log->sector_count;
+    size_t offset = sizeof(sector_header_t);
+    uint64_t current = sequence;
+    if (err == BD_ERROR_OK) {
+        int valid = read_sector_header(log, sector, &header);
+        err = valid < 0 ? valid : (valid ? BD_ERROR_OK : -EIO);
+        current = header.first_record;
+    }
+    while (err == BD_ERROR_OK && current < sequence) {
+        ssize_t length = read_record(log, sector, &offset, current, NULL, 0);
+        if (length < 0) {
+            err = length == -ENOENT ? -EIO : (int)length;
+            break;
+        }
+        offset += sizeof(record_header_t) + (size_t)length;
+        current++;
+    }
+    mutex_exit(&log->mutex);
+    if (err != BD_ERROR_OK)
+        return err;
+
+    iter->log = log;
+    iter->sector = sector;
+    iter->offset = offset;
+    iter->sequence = sequence;
+    return BD_ERROR_OK;
+}
+
+ssize_t ringlog_iter_next(ringlog_iter_t *iter, void *buffer, size_t size, uint64_t *sequence) {
+    ringlog_t *log = iter->log;
+    mutex_enter_blocking(&log->mutex);
+    if (iter->sequence >= log->next_sequence) {
+        mutex_exit(&log->mutex);
+        return 0;
+    }
+    if (iter->sequence < log->first_sequence) {
+        mutex_exit(&log->mutex);
+        return -EOVERFLOW;
+    }
+
+    size_t sector = iter->sector;
+    size_t offset = iter->offset;
+    ssize_t length = read_record(log, sector, &offset, iter->sequence, buffer, size);
+    // The record starts the next sector. Sectors started after a power failure may be empty.
+    while (length == -ENOENT && sector != log->head) {
+        sector = next_sector(log, sector);
+        offset = sizeof(sector_header_t);
+        length = read_record(log, sector, &offset, iter->sequence, buffer, size);
+    }
+    if (length == -ENOENT) {
+        length = -EIO;
+    } else if (length > 0 && (size_t)length > size) {
+        length = -EMSGSIZE;
+    } else if (length > 0) {
+        if (sequence != NULL)
+            *sequence = iter->sequence;
+        iter->sector = sector;
+        iter->offset = offset + sizeof(record_header_t) + (size_t)length;
+        iter->sequence++;
+    }
+    mutex_exit(&log->mutex);
+    return length;
+}
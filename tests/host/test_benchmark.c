@@ -1,7 +1,9 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <pico/time.h>
 #include "blockdevice/heap.h"
 #include "filesystem/fat.h"
 #include "filesystem/littlefs.h"
@@ -10,6 +12,8 @@
 #define HEAP_STORAGE_SIZE        (128 * 1024)
 #define LITTLEFS_BLOCK_CYCLE     500
 #define LITTLEFS_LOOKAHEAD_SIZE  16
+#define SIMULATED_ERASE_US       2000
+#define LATENCY_SAMPLES          (40 * 16)
 
 static void test_printf(const char *format, ...) {
     va_list args;
@@ -101,6 +105,137 @@ static void test_api_read(filesystem_t *fs) {
     printf(COLOR_GREEN("ok\n"));
 }
 
+static int (*heap_erase)(blockdevice_t *device, bd_size_t addr, bd_size_t size);
+
+static int slow_erase(blockdevice_t *device, bd_size_t addr, bd_size_t size) {
+    busy_wait_us(SIMULATED_ERASE_US * (size / device->erase_size));
+    return heap_erase(device, addr, size);
+}
+
+static int compare_latency(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t measure_write_latency_p99(filesystem_t *fs, bool use_gc) {
+    static uint32_t latency[LATENCY_SAMPLES];
+    uint8_t buffer[128];
+    memset(buffer, 0x55, sizeof(buffer));
+
+    size_t n = 0;
+    while (n < LATENCY_SAMPLES) {
+        fs_file_t file;
+        int err = fs->file_open(fs, &file, "/log", O_WRONLY|O_CREAT|O_APPEND);
+        assert(err == 0);
+        for (size_t i = 0; i < 16; i++) {
+            uint64_t start = time_us_64();
+            ssize_t write_length = fs->file_write(fs, &file, buffer, sizeof(buffer));
+            assert(write_length == sizeof(buffer));
+            err = fs->file_sync(fs, &file);
+            assert(err == 0);
+            latency[n++] = (uint32_t)(time_us_64() - start);
+        }
+        err = fs->file_close(fs, &file);
+        assert(err == 0);
+        if (use_gc) {  // idle period between bursts
+            while ((err = fs->gc(fs, 100 * 1000)) > 0)
+                ;
+            assert(err == 0);
+        }
+    }
+    int err = fs->remove(fs, "/log");
+    assert(err == 0);
+
+    qsort(latency, LATENCY_SAMPLES, sizeof(latency[0]), compare_latency);
+    return latency[LATENCY_SAMPLES * 99 / 100];
+}
+
+static void test_write_latency(void) {
+    printf("littlefs write latency on slow erase device:\n");
+
+    blockdevice_t *heap = blockdevice_heap_create(HEAP_STORAGE_SIZE);
+    assert(heap != NULL);
+    heap_erase = heap->erase;
+    heap->erase = slow_erase;
+    filesystem_t *lfs = filesystem_littlefs_create(LITTLEFS_BLOCK_CYCLE,
+                                                   LITTLEFS_LOOKAHEAD_SIZE);
+    assert(lfs != NULL);
+    int err = lfs->format(lfs, heap);
+    assert(err == 0);
+    err = lfs->mount(lfs, heap, false);
+    assert(err == 0);
+
+    uint32_t inline_p99 = measure_write_latency_p99(lfs, false);
+    test_printf("p99 without gc");
+    printf("%lu us\n", (unsigned long)inline_p99);
+    uint32_t gc_p99 = measure_write_latency_p99(lfs, true);
+    test_printf("p99 with idle gc");
+    printf("%lu us\n", (unsigned long)gc_p99);
+    assert(gc_p99 < inline_p99);  // The erases moved out of the writes
+
+    err = lfs->unmount(lfs);
+    assert(err == 0);
+    filesystem_littlefs_free(lfs);
+    heap->erase = heap_erase;
+    blockdevice_heap_free(heap);
+}
+
+static void test_mount_time(void) {
+    printf("littlefs mount time:\n");
+
+    blockdevice_t *heap = blockdevice_heap_create(HEAP_STORAGE_SIZE);
+    assert(heap != NULL);
+    filesystem_t *lfs = filesystem_littlefs_create(LITTLEFS_BLOCK_CYCLE,
+                                                   LITTLEFS_LOOKAHEAD_SIZE);
+    assert(lfs != NULL);
+    int err = lfs->format(lfs, heap);
+    assert(err == 0);
+    err = lfs->mount(lfs, heap, false);
+    assert(err == 0);
+    uint8_t buffer[256];
+    memset(buffer, 0xAA, sizeof(buffer));
+    for (size_t i = 0; i < 64; i++) {
+        char path[16];
+        snprintf(path, sizeof(path), "/file%u", (unsigned)i);
+        fs_file_t file;
+        err = lfs->file_open(lfs, &file, path, O_WRONLY|O_CREAT);
+        assert(err == 0);
+        ssize_t write_length = lfs->file_write(lfs, &file, buffer, sizeof(buffer));
+        assert(write_length == sizeof(buffer));
+        err = lfs->file_close(lfs, &file);
+        assert(err == 0);
+    }
+
+    for (size_t i = 0; i < 2; i++) {
+        err = lfs->unmount(lfs);
+        assert(err == 0);
+
+        uint64_t start = time_us_64();
+        err = lfs->mount(lfs, heap, false);
+        assert(err == 0);
+        uint64_t mounted = time_us_64();
+        fs_file_t file;
+        err = lfs->file_open(lfs, &file, "/log", O_WRONLY|O_CREAT|O_APPEND);
+        assert(err == 0);
+        ssize_t write_length = lfs->file_write(lfs, &file, buffer, sizeof(buffer));
+        assert(write_length == sizeof(buffer));
+        err = lfs->file_close(lfs, &file);
+        assert(err == 0);
+        uint64_t written = time_us_64();
+
+        test_printf("mount");
+        printf("%lu us\n", (unsigned long)(mounted - start));
+        test_printf("mount to first write");
+        printf("%lu us\n", (unsigned long)(written - start));
+    }
+
+    err = lfs->unmount(lfs);
+    assert(err == 0);
+    filesystem_littlefs_free(lfs);
+    blockdevice_heap_free(heap);
+}
+
 void test_benchmark(void) {
     printf("FAT write/read:\n");
 
@@ -145,4 +280,7 @@ void test_benchmark(void) {
     cleanup(heap);
     filesystem_littlefs_free(lfs);
     blockdevice_heap_free(heap);
+
+    test_write_latency();
+    test_mount_time();
 }
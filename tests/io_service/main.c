@@ -0,0 +1,29 @@
+#include <assert.h>
+#include <stdio.h>
+#include <pico/stdlib.h>
+#include "filesystem/vfs.h"
+
+#define COLOR_GREEN(format)  ("\e[32m" format "\e[0m")
+
+extern void test_vfs(void);
+extern void test_standard(void);
+extern void test_copy_between_different_filesystems(void);
+
+int main(void) {
+    stdio_init_all();
+
+    printf("Start all tests on the core1 I/O service\n");
+
+    // Every file system mounted by the tests is attached to the service, except the FAT image
+    // on a loopback device, which runs on core0
+    int err = fs_io_service_start_core1();
+    assert(err == 0);
+
+    test_vfs();
+    test_standard();
+    test_copy_between_different_filesystems();
+
+    printf(COLOR_GREEN("All tests are ok\n"));
+    while (1)
+        tight_loop_contents();
+}
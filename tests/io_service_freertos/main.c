@@ -0,0 +1,145 @@
+/*
+ * Copyright 2024, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <FreeRTOS.h>
+#include <assert.h>
+#include <pico/stdlib.h>
+#include <semphr.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <task.h>
+#include "blockdevice/heap.h"
+#include "filesystem/fat.h"
+#include "filesystem/vfs.h"
+
+#define COLOR_GREEN(format)  ("\e[32m" format "\e[0m")
+#define HEAP_STORAGE_SIZE    (64 * 1024)
+
+#define SERVICE_PRIORITY     (tskIDLE_PRIORITY + 1)
+#define CLIENT_PRIORITY      (tskIDLE_PRIORITY + 2)
+#define GATE_PRIORITY        (tskIDLE_PRIORITY + 3)
+#define TEST_PRIORITY        (tskIDLE_PRIORITY + 4)
+#define RAISED_PRIORITY      (tskIDLE_PRIORITY + 5)
+
+/*
+ * The stat operation of the FAT file system is replaced before the file system is attached, so
+ * that the I/O task runs it. "/gate" holds the I/O task until the test opens the gate; any
+ * other path records the order in which the I/O task served it and the priority it ran at.
+ */
+static int (*fat_stat)(filesystem_t *fs, const char *path, struct stat *st);
+static SemaphoreHandle_t gate;
+static SemaphoreHandle_t done;
+static char served[4];
+static size_t served_count = 0;
+static UBaseType_t served_priority[4];
+
+static filesystem_t *fat;
+
+static void test_printf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+
+    printf(" ");
+    for (size_t i = 0; i < 50 - (size_t)n; i++)
+        printf(".");
+}
+
+static int gated_stat(filesystem_t *fs, const char *path, struct stat *st) {
+    if (strcmp(path, "/gate") == 0) {
+        xSemaphoreTake(gate, portMAX_DELAY);
+    } else if (served_count < sizeof(served)) {
+        served_priority[served_count] = uxTaskPriorityGet(NULL);
+        served[served_count++] = path[1];
+    }
+    return fat_stat(fs, path, st);
+}
+
+static void client_task(void *params) {
+    const char *path = params;
+    switch (path[1]) {
+    case 'r':
+        fs_io_service_set_class(FS_IO_CLASS_REALTIME);
+        break;
+    case 'b':
+        fs_io_service_set_class(FS_IO_CLASS_BULK);
+        break;
+    default:
+        fs_io_service_set_class(FS_IO_CLASS_NORMAL);
+        break;
+    }
+    struct stat st;
+    fat->stat(fat, path, &st);  // Straight to the I/O task, without the VFS lock
+    xSemaphoreGive(done);
+    vTaskDelete(NULL);
+}
+
+static void test_class_order(void) {
+    test_printf("class order, lent priority");
+
+    served_count = 0;
+    xTaskCreate(client_task, "gate", 1024, "/gate", GATE_PRIORITY, NULL);
+    vTaskDelay(pdMS_TO_TICKS(10));  // The I/O task now waits for the gate
+
+    // Queued in the reverse order of their classes
+    TaskHandle_t realtime;
+    xTaskCreate(client_task, "bulk", 1024, "/b", CLIENT_PRIORITY, NULL);
+    vTaskDelay(pdMS_TO_TICKS(10));
+    xTaskCreate(client_task, "normal", 1024, "/n", CLIENT_PRIORITY, NULL);
+    vTaskDelay(pdMS_TO_TICKS(10));
+    xTaskCreate(client_task, "realtime", 1024, "/r", CLIENT_PRIORITY, &realtime);
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    // A waiter raised after it submitted its request is seen by the I/O task
+    vTaskPrioritySet(realtime, RAISED_PRIORITY);
+    xSemaphoreGive(gate);
+    for (size_t i = 0; i < 4; i++)
+        xSemaphoreTake(done, portMAX_DELAY);
+
+    assert(served_count == 3);
+    assert(memcmp(served, "rnb", 3) == 0);
+    assert(served_priority[0] == RAISED_PRIORITY);
+    assert(served_priority[1] == CLIENT_PRIORITY);
+    assert(served_priority[2] == CLIENT_PRIORITY);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_task(void *params) {
+    (void)params;
+    printf("Start all tests on the FreeRTOS I/O service\n");
+
+    gate = xSemaphoreCreateBinary();
+    done = xSemaphoreCreateCounting(4, 0);
+    blockdevice_t *heap = blockdevice_heap_create(HEAP_STORAGE_SIZE);
+    fat = filesystem_fat_create();
+    assert(gate != NULL && done != NULL && heap != NULL && fat != NULL);
+    fat_stat = fat->stat;
+    fat->stat = gated_stat;
+
+    int err = fs_format(fat, heap);
+    assert(err == 0);
+    err = fs_mount("/", fat, heap);
+    assert(err == 0);
+    err = fs_io_service_start_freertos(SERVICE_PRIORITY);
+    assert(err == 0);
+
+    test_class_order();
+
+    printf(COLOR_GREEN("All tests are ok\n"));
+    while (1)
+        vTaskDelay(portMAX_DELAY);
+}
+
+int main(void) {
+    stdio_init_all();
+
+    xTaskCreate(test_task, "test", 1024 * 4, NULL, TEST_PRIORITY, NULL);
+    vTaskStartScheduler();
+    while (1)
+        tight_loop_contents();
+}
@@ -8,6 +8,16 @@ extern void test_filesystem(void);
 extern void test_vfs(void);
 extern void test_standard(void);
 extern void test_copy_between_different_filesystems(void);
+extern void test_aio(void);
+extern void test_ringlog(void);
+extern void test_kv(void);
+extern void test_pqueue(void);
+extern void test_logfile(void);
+extern void test_timeseries(void);
+extern void test_romfs(void);
+extern void test_overlay(void);
+extern void test_stage(void);
+extern void test_zfile(void);
 
 int main(void) {
     stdio_init_all();
@@ -19,6 +29,16 @@ int main(void) {
     test_vfs();
     test_standard();
     test_copy_between_different_filesystems();
+    test_aio();
+    test_ringlog();
+    test_kv();
+    test_pqueue();
+    test_logfile();
+    test_timeseries();
+    test_romfs();
+    test_overlay();
+    test_stage();
+    test_zfile();
 
     printf(COLOR_GREEN("All tests are ok\n"));
     while (1)
@@ -0,0 +1,134 @@
+#include <aio.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "blockdevice/heap.h"
+#include "filesystem/fat.h"
+#include "filesystem/littlefs.h"
+#include "filesystem/vfs.h"
+
+#define COLOR_GREEN(format)      ("\e[32m" format "\e[0m")
+#define HEAP_STORAGE_SIZE        (128 * 1024)
+#define LITTLEFS_BLOCK_CYCLE     500
+#define LITTLEFS_LOOKAHEAD_SIZE  16
+#define AIO_BUFFER_SIZE          (16 * 1024)
+
+static uint8_t write_buffer[AIO_BUFFER_SIZE];
+static uint8_t read_buffer[AIO_BUFFER_SIZE];
+
+static void test_printf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+
+    printf(" ");
+    for (size_t i = 0; i < 50 - (size_t)n; i++)
+        printf(".");
+}
+
+static void wait_for(struct aiocb *aiocbp) {
+    const struct aiocb *list[] = {aiocbp};
+    while (aio_error(aiocbp) == EINPROGRESS) {
+        int err = aio_suspend(list, 1, NULL);
+        assert(err == 0);
+    }
+}
+
+static void test_aio_write_read(void) {
+    test_printf("aio_write,aio_read,aio_fsync");
+
+    for (size_t i = 0; i < sizeof(write_buffer); i++)
+        write_buffer[i] = i & 0xFF;
+    int fd = open("/aio", O_RDWR|O_CREAT|O_TRUNC);
+    assert(fd != -1);
+
+    struct aiocb write_cb = {
+        .aio_fildes = fd, .aio_offset = 0, .aio_buf = write_buffer, .aio_nbytes = sizeof(write_buffer),
+    };
+    int err = aio_write(&write_cb);
+    assert(err == 0);
+    struct aiocb sync_cb = {.aio_fildes = fd};
+    err = aio_fsync(O_SYNC, &sync_cb);  // runs after the write
+    assert(err == 0);
+    wait_for(&sync_cb);
+    assert(aio_error(&write_cb) == 0);
+    assert(aio_return(&write_cb) == sizeof(write_buffer));
+    assert(aio_error(&sync_cb) == 0);
+    assert(aio_return(&sync_cb) == 0);
+
+    struct aiocb read_cb = {
+        .aio_fildes = fd, .aio_offset = 1000, .aio_buf = read_buffer, .aio_nbytes = sizeof(read_buffer),
+    };
+    err = aio_read(&read_cb);
+    assert(err == 0);
+    wait_for(&read_cb);
+    assert(aio_error(&read_cb) == 0);
+    assert(aio_return(&read_cb) == sizeof(read_buffer) - 1000);
+    assert(memcmp(read_buffer, &write_buffer[1000], sizeof(read_buffer) - 1000) == 0);
+    assert(lseek(fd, 0, SEEK_CUR) == 0);  // the file offset is not used
+
+    err = close(fd);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_aio_error(void) {
+    test_printf("aio_error,aio_suspend");
+
+    struct aiocb read_cb = {
+        .aio_fildes = 100, .aio_offset = 0, .aio_buf = read_buffer, .aio_nbytes = sizeof(read_buffer),
+    };
+    int err = aio_read(&read_cb);
+    assert(err == 0);
+    wait_for(&read_cb);
+    assert(aio_error(&read_cb) == EBADF);
+    assert(aio_return(&read_cb) == -1);
+
+    const struct aiocb *list[] = {NULL};
+    struct timespec timeout = {.tv_sec = 0, .tv_nsec = 1000000};
+    err = aio_suspend(list, 1, &timeout);
+    assert(err == -1);
+    assert(errno == EAGAIN);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+void test_aio(void) {
+    printf("Asynchronous I/O(littlefs):\n");
+
+    blockdevice_t *heap = blockdevice_heap_create(HEAP_STORAGE_SIZE);
+    filesystem_t *lfs = filesystem_littlefs_create(LITTLEFS_BLOCK_CYCLE, LITTLEFS_LOOKAHEAD_SIZE);
+    int err = fs_format(lfs, heap);
+    assert(err == 0);
+    err = fs_mount("/", lfs, heap);
+    assert(err == 0);
+
+    test_aio_write_read();
+    test_aio_error();
+
+    err = fs_unmount("/");
+    assert(err == 0);
+    filesystem_littlefs_free(lfs);
+    blockdevice_heap_free(heap);
+
+    printf("Asynchronous I/O(FAT):\n");
+
+    heap = blockdevice_heap_create(HEAP_STORAGE_SIZE);
+    filesystem_t *fat = filesystem_fat_create();
+    err = fs_format(fat, heap);
+    assert(err == 0);
+    err = fs_mount("/", fat, heap);
+    assert(err == 0);
+
+    test_aio_write_read();
+
+    err = fs_unmount("/");
+    assert(err == 0);
+    filesystem_fat_free(fat);
+    blockdevice_heap_free(heap);
+}
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/sendfile.h>
 #include "blockdevice/heap.h"
 #include "filesystem/littlefs.h"
 #include "filesystem/fat.h"
@@ -43,7 +44,7 @@ static void init_filesystem_combination(void) {
     };
 }
 
-#define TEST_FILE_SIZE  16 * 1024;
+#define TEST_FILE_SIZE  (16 * 1024)
 
 static void test_printf(const char *format, ...) {
     va_list args;
@@ -98,6 +99,50 @@ static void test_copy(const char *source, const char *dist) {
     assert(err == 0);
 }
 
+static void test_copy_file_range(const char *source, const char *dist) {
+    int fd_src = open(source, O_RDONLY);
+    assert(fd_src >= 0);
+    int fd_dist = open(dist, O_WRONLY|O_CREAT|O_TRUNC);
+    assert(fd_dist >= 0);
+
+    size_t total = 0;
+    while (true) {
+        ssize_t size = fs_copy_file_range(fd_src, fd_dist, 5000);  // not a multiple of any block size
+        assert(size >= 0);
+        if (size == 0)
+            break;
+        total += size;
+    }
+    assert(total == TEST_FILE_SIZE);
+
+    int err = close(fd_src);
+    assert(err == 0);
+    err = close(fd_dist);
+    assert(err == 0);
+}
+
+static void test_sendfile(const char *source, const char *dist) {
+    int fd_src = open(source, O_RDONLY);
+    assert(fd_src >= 0);
+    int fd_dist = open(dist, O_WRONLY|O_CREAT|O_TRUNC);
+    assert(fd_dist >= 0);
+
+    off_t offset = 0;
+    size_t remind = TEST_FILE_SIZE;
+    while (remind > 0) {
+        ssize_t size = sendfile(fd_dist, fd_src, &offset, remind);
+        assert(size > 0);
+        remind -= size;
+    }
+    assert(offset == TEST_FILE_SIZE);
+    assert(lseek(fd_src, 0, SEEK_CUR) == 0);  // the input position is left alone
+
+    int err = close(fd_src);
+    assert(err == 0);
+    err = close(fd_dist);
+    assert(err == 0);
+}
+
 static void test_read(const char *path) {
 
     int fd = open(path, O_RDONLY);
@@ -152,6 +197,21 @@ void test_copy_between_different_filesystems(void) {
         test_copy("/a/source", "/b/dist");
         srand(i);
         test_read("/b/dist");
+        test_copy_file_range("/a/source", "/b/range");
+        srand(i);
+        test_read("/b/range");
+        err = unlink("/b/range");
+        assert(err == 0);
+        test_copy_file_range("/a/source", "/a/range");  // same volume
+        srand(i);
+        test_read("/a/range");
+        err = unlink("/a/range");
+        assert(err == 0);
+        test_sendfile("/a/source", "/b/sendfile");
+        srand(i);
+        test_read("/b/sendfile");
+        err = unlink("/b/sendfile");
+        assert(err == 0);
         printf(COLOR_GREEN("ok\n"));
 
         test_printf("from %s(%s) to %s(%s)",
@@ -5,6 +5,7 @@
 #include "blockdevice/heap.h"
 #include "filesystem/fat.h"
 #include "filesystem/littlefs.h"
+#include "filesystem/tmpfs.h"
 
 #define COLOR_GREEN(format)      ("\e[32m" format "\e[0m")
 #define HEAP_STORAGE_SIZE        (128 * 1024)
@@ -250,7 +251,7 @@ static void test_api_dir_read(filesystem_t *fs) {
 
     struct dirent ent;
 
-    if (fs->type != FILESYSTEM_TYPE_FAT) {  // FAT does not return dot entries
+    if (fs->type == FILESYSTEM_TYPE_LITTLEFS) {  // FAT and tmpfs do not return dot entries
         err = fs->dir_read(fs, &dir, &ent);
         assert(err == 0);
         assert(ent.d_type == DT_DIR);
@@ -412,4 +413,27 @@ void test_filesystem(void) {
     cleanup(heap);
     filesystem_littlefs_free(lfs);
     blockdevice_heap_free(heap);
+
+
+    printf("File system tmpfs:\n");
+    filesystem_t *tmpfs = filesystem_tmpfs_create(HEAP_STORAGE_SIZE);
+    assert(tmpfs != NULL);
+
+    test_api_format(tmpfs, NULL);
+    test_api_mount(tmpfs, NULL);
+    test_api_file_open_close(tmpfs);
+    test_api_file_write_read(tmpfs);
+    test_api_file_seek(tmpfs);
+    test_api_file_tell(tmpfs);
+    test_api_file_size(tmpfs);
+    test_api_file_truncate(tmpfs);
+    test_api_dir_open(tmpfs);
+    test_api_dir_read(tmpfs);
+    test_api_remove(tmpfs);
+    test_api_rename(tmpfs);
+    test_api_stat(tmpfs);
+
+    test_api_unmount(tmpfs);
+
+    filesystem_tmpfs_free(tmpfs);
 }
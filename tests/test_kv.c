@@ -0,0 +1,304 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "blockdevice/heap.h"
+#include "storage/kv.h"
+
+#define COLOR_GREEN(format)  ("\e[32m" format "\e[0m")
+#define HEAP_STORAGE_SIZE    (32 * 1024)
+#define KEY_COUNT            40
+#define VALUE_SIZE           48
+
+static void test_printf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+
+    printf(" ");
+    for (size_t i = 0; i < 50 - (size_t)n; i++)
+        printf(".");
+}
+
+static void make_key(char *key, int n) {
+    sprintf(key, "config/key%02d", n);
+}
+
+static size_t make_value(uint8_t *value, int n, int version) {
+    size_t size = 1 + (size_t)(n + version) % VALUE_SIZE;
+    for (size_t i = 0; i < size; i++)
+        value[i] = (uint8_t)(n * 7 + version + i);
+    return size;
+}
+
+static void set_all(kv_t *kv, int version) {
+    uint8_t value[VALUE_SIZE];
+    char key[32];
+    for (int n = 0; n < KEY_COUNT; n++) {
+        make_key(key, n);
+        size_t size = make_value(value, n, version);
+        int err = kv_set(kv, key, value, size);
+        assert(err == 0);
+    }
+}
+
+static void verify_all(kv_t *kv, int version) {
+    uint8_t value[VALUE_SIZE];
+    uint8_t expected[VALUE_SIZE];
+    char key[32];
+    for (int n = 0; n < KEY_COUNT; n++) {
+        make_key(key, n);
+        size_t size = make_value(expected, n, version);
+        ssize_t length = kv_get(kv, key, value, sizeof(value));
+        assert(length == (ssize_t)size);
+        assert(memcmp(value, expected, size) == 0);
+    }
+}
+
+static void test_api_format(blockdevice_t *device) {
+    test_printf("kv_format");
+
+    int err = kv_format(device);
+    assert(err == 0);
+    kv_t *kv = kv_open(device);
+    assert(kv != NULL);
+    kv_iter_t iter;
+    kv_iter_init(kv, &iter);
+    char key[32];
+    assert(kv_iter_next(&iter, key, sizeof(key)) == 0);
+    err = kv_close(kv);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_set_get(blockdevice_t *device) {
+    test_printf("kv_set, kv_get");
+
+    kv_t *kv = kv_open(device);
+    assert(kv != NULL);
+    int err = kv_set(kv, "hostname", "pico", 4);
+    assert(err == 0);
+    err = kv_set(kv, "hostname", "pico-w", 6);
+    assert(err == 0);
+    err = kv_set(kv, "empty", NULL, 0);
+    assert(err == 0);
+
+    char value[16];
+    ssize_t length = kv_get(kv, "hostname", value, sizeof(value));
+    assert(length == 6);
+    assert(memcmp(value, "pico-w", 6) == 0);
+    length = kv_get(kv, "hostname", NULL, 0);
+    assert(length == 6);
+    length = kv_get(kv, "hostname", value, 2);
+    assert(length == -EMSGSIZE);
+    length = kv_get(kv, "empty", value, sizeof(value));
+    assert(length == 0);
+    length = kv_get(kv, "missing", value, sizeof(value));
+    assert(length == -ENOENT);
+    err = kv_set(kv, "", "x", 1);
+    assert(err == -EINVAL);
+    static uint8_t large[PICO_VFS_KV_SECTOR_SIZE];
+    err = kv_set(kv, "large", large, sizeof(large));
+    assert(err == -EMSGSIZE);
+
+    err = kv_close(kv);
+    assert(err == 0);
+    kv = kv_open(device);
+    assert(kv != NULL);
+    length = kv_get(kv, "hostname", value, sizeof(value));
+    assert(length == 6);
+    assert(memcmp(value, "pico-w", 6) == 0);
+    err = kv_close(kv);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_delete(blockdevice_t *device) {
+    test_printf("kv_delete");
+
+    kv_t *kv = kv_open(device);
+    assert(kv != NULL);
+    int err = kv_delete(kv, "hostname");
+    assert(err == 0);
+    err = kv_delete(kv, "hostname");
+    assert(err == -ENOENT);
+    ssize_t length = kv_get(kv, "hostname", NULL, 0);
+    assert(length == -ENOENT);
+    err = kv_close(kv);
+    assert(err == 0);
+
+    kv = kv_open(device);
+    assert(kv != NULL);
+    length = kv_get(kv, "hostname", NULL, 0);
+    assert(length == -ENOENT);
+    err = kv_delete(kv, "empty");
+    assert(err == 0);
+    err = kv_close(kv);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_iter(blockdevice_t *device) {
+    test_printf("kv_iter_next");
+
+    kv_t *kv = kv_open(device);
+    assert(kv != NULL);
+    set_all(kv, 0);
+
+    bool seen[KEY_COUNT] = {0};
+    kv_iter_t iter;
+    kv_iter_init(kv, &iter);
+    char key[32];
+    ssize_t length;
+    size_t count = 0;
+    while ((length = kv_iter_next(&iter, key, sizeof(key))) > 0) {
+        int n;
+        assert(sscanf(key, "config/key%02d", &n) == 1);
+        assert(!seen[n]);
+        seen[n] = true;
+        count++;
+    }
+    assert(length == 0);
+    assert(count == KEY_COUNT);
+
+    kv_iter_init(kv, &iter);
+    length = kv_iter_next(&iter, key, 4);
+    assert(length == -EMSGSIZE);
+    int err = kv_close(kv);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_compaction(blockdevice_t *device) {
+    test_printf("kv compaction");
+
+    // Rewrites the device many times over
+    kv_t *kv = kv_open(device);
+    assert(kv != NULL);
+    for (int version = 1; version <= 100; version++) {
+        set_all(kv, version);
+        if (version % 10 == 0) {
+            int err = kv_sync(kv);
+            assert(err == 0);
+        }
+        assert(kv_gc(kv) >= 0);
+    }
+    verify_all(kv, 100);
+    int err = kv_close(kv);
+    assert(err == 0);
+
+    kv = kv_open(device);
+    assert(kv != NULL);
+    verify_all(kv, 100);
+    err = kv_close(kv);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_full(blockdevice_t *device) {
+    test_printf("kv full");
+
+    kv_t *kv = kv_open(device);
+    assert(kv != NULL);
+    uint8_t value[1000] = {0};
+    char key[32];
+    int err = 0;
+    int n;
+    for (n = 0; n < 100 && err == 0; n++) {
+        sprintf(key, "bulk%d", n);
+        err = kv_set(kv, key, value, sizeof(value));
+    }
+    assert(err == -ENOSPC);
+    verify_all(kv, 100);
+
+    // Deleting makes room again
+    for (int i = 0; i < n - 1; i++) {
+        sprintf(key, "bulk%d", i);
+        err = kv_delete(kv, key);
+        assert(err == 0);
+    }
+    err = kv_set(kv, "bulk", value, sizeof(value));
+    assert(err == 0);
+    err = kv_close(kv);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_power_loss(blockdevice_t *device) {
+    test_printf("kv recovery");
+
+    kv_t *kv = kv_open(device);
+    assert(kv != NULL);
+    set_all(kv, 200);
+    int err = kv_sync(kv);
+    assert(err == 0);
+    err = kv_set(kv, "unsynced", "x", 1);  // Stays in the page buffer
+    assert(err == 0);
+
+    // The device as left by a power failure at this point
+    kv_t *recovered = kv_open(device);
+    assert(recovered != NULL);
+    verify_all(recovered, 200);
+    assert(kv_get(recovered, "unsynced", NULL, 0) == -ENOENT);
+    err = kv_close(recovered);
+    assert(err == 0);
+    err = kv_close(kv);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_overwrite_full(blockdevice_t *device) {
+    test_printf("kv overwrite when full");
+
+    int err = kv_format(device);
+    assert(err == 0);
+    kv_t *kv = kv_open(device);
+    assert(kv != NULL);
+    uint8_t value[VALUE_SIZE] = {0};
+    char key[32];
+    int n;
+    for (n = 0; n < 1000 && err == 0; n++) {
+        sprintf(key, "small%03d", n);
+        err = kv_set(kv, key, value, sizeof(value));
+    }
+    assert(err == -ENOSPC);
+
+    // An update needs no more live space than the value it replaces
+    value[0] = 1;
+    err = kv_set(kv, "small000", value, sizeof(value));
+    assert(err == 0);
+    uint8_t buffer[VALUE_SIZE];
+    ssize_t size = kv_get(kv, "small000", buffer, sizeof(buffer));
+    assert(size == VALUE_SIZE);
+    assert(buffer[0] == 1);
+    err = kv_close(kv);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+void test_kv(void) {
+    printf("Key-value store:\n");
+
+    blockdevice_t *heap = blockdevice_heap_create(HEAP_STORAGE_SIZE);
+
+    test_api_format(heap);
+    test_api_set_get(heap);
+    test_api_delete(heap);
+    test_api_iter(heap);
+    test_api_compaction(heap);
+    test_api_full(heap);
+    test_api_power_loss(heap);
+    test_api_overwrite_full(heap);
+
+    blockdevice_heap_free(heap);
+}
@@ -0,0 +1,213 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "blockdevice/heap.h"
+#include "filesystem/fat.h"
+#include "filesystem/logfile.h"
+#include "filesystem/vfs.h"
+
+#define COLOR_GREEN(format)  ("\e[32m" format "\e[0m")
+#define HEAP_STORAGE_SIZE    (128 * 1024)
+#define RECORD_SIZE          32
+#define LOGFILE_SIZE         (8 * RECORD_SIZE)
+
+static void test_printf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+
+    printf(" ");
+    for (size_t i = 0; i < 50 - (size_t)n; i++)
+        printf(".");
+}
+
+static void make_record(char *record, int n) {
+    memset(record, ' ', RECORD_SIZE);
+    snprintf(record, RECORD_SIZE, "record %04d", n);
+    record[RECORD_SIZE - 1] = '\n';
+}
+
+static void write_records(fs_logfile_t *log, int from, int count, bool prepare) {
+    char record[RECORD_SIZE];
+    for (int i = from; i < from + count; i++) {
+        make_record(record, i);
+        ssize_t size = fs_logfile_write(log, record, sizeof(record));
+        assert(size == RECORD_SIZE);
+        if (prepare)
+            fs_logfile_prepare_all();  // What the background maintenance task does
+    }
+}
+
+static void verify_file(const char *path, int first, int count) {
+    struct stat finfo;
+    int err = stat(path, &finfo);
+    assert(err == 0);
+    assert(finfo.st_size == count * RECORD_SIZE);
+
+    int fd = open(path, O_RDONLY);
+    assert(fd >= 0);
+    char record[RECORD_SIZE];
+    char expected[RECORD_SIZE];
+    for (int i = first; i < first + count; i++) {
+        ssize_t size = read(fd, record, sizeof(record));
+        assert(size == RECORD_SIZE);
+        make_record(expected, i);
+        assert(memcmp(record, expected, RECORD_SIZE) == 0);
+    }
+    close(fd);
+}
+
+static bool file_exists(const char *path) {
+    struct stat finfo;
+    return stat(path, &finfo) == 0;
+}
+
+static void test_api_posix_fallocate(void) {
+    test_printf("posix_fallocate");
+
+    int fd = open("/preallocated", O_RDWR | O_CREAT);
+    assert(fd >= 0);
+    int err = posix_fallocate(fd, 0, 4096);
+    assert(err == 0);
+    struct stat finfo;
+    err = fstat(fd, &finfo);
+    assert(err == 0);
+    assert(finfo.st_size == 4096);
+    err = posix_fallocate(fd, 4096, 4096);  // Extends a file with data
+    assert(err == 0);
+    off_t position = lseek(fd, 0, SEEK_CUR);
+    assert(position == 0);
+    err = fstat(fd, &finfo);
+    assert(err == 0);
+    assert(finfo.st_size == 8192);
+    err = posix_fallocate(fd, 0, 0);
+    assert(err == EINVAL);
+    close(fd);
+    unlink("/preallocated");
+
+    err = posix_fallocate(fd, 0, 4096);
+    assert(err == EBADF);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_rotation(void) {
+    test_printf("fs_logfile_write");
+
+    fs_logfile_t *log = fs_logfile_open("/app", LOGFILE_SIZE, 0, 3);
+    assert(log != NULL);
+    write_records(log, 0, 20, true);
+    write_records(log, 20, 10, false);  // Rotation without background preparation
+    int err = fs_logfile_close(log);
+    assert(err == 0);
+
+    // Generations 2 to 4 are kept and truncated to the records written
+    assert(!file_exists("/app.1"));
+    verify_file("/app.2", 8, 8);
+    verify_file("/app.3", 16, 8);
+    verify_file("/app.4", 24, 6);
+    assert(!file_exists("/app.5"));
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_reopen(void) {
+    test_printf("fs_logfile_open existing");
+
+    fs_logfile_t *log = fs_logfile_open("/app", LOGFILE_SIZE, 0, 3);
+    assert(log != NULL);
+    write_records(log, 100, 1, false);
+    int err = fs_logfile_rotate(log);
+    assert(err == 0);
+    write_records(log, 101, 2, false);
+    err = fs_logfile_sync(log);
+    assert(err == 0);
+    err = fs_logfile_close(log);
+    assert(err == 0);
+
+    assert(!file_exists("/app.2"));
+    assert(!file_exists("/app.3"));
+    verify_file("/app.4", 24, 6);
+    verify_file("/app.5", 100, 1);
+    verify_file("/app.6", 101, 2);
+    assert(!file_exists("/app.7"));
+
+    unlink("/app.4");
+    unlink("/app.5");
+    unlink("/app.6");
+    unlink("/app.state");
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_power_failure(filesystem_t *fs, blockdevice_t *device) {
+    test_printf("fs_logfile_open after power failure");
+
+    fs_logfile_t *log = fs_logfile_open("/crash", LOGFILE_SIZE, 0, 3);
+    assert(log != NULL);
+    write_records(log, 0, 3, false);
+    int err = fs_logfile_sync(log);
+    assert(err == 0);
+    fs_logfile_prepare_all();  // The next file is created and preallocated
+
+    // The media as it is when the power fails now
+    uint8_t *image = malloc(HEAP_STORAGE_SIZE);
+    assert(image != NULL);
+    err = device->read(device, image, 0, HEAP_STORAGE_SIZE);
+    assert(err == 0);
+    write_records(log, 3, 2, false);  // Not synced, lost with the power
+    err = fs_logfile_close(log);
+    assert(err == 0);
+    err = fs_unmount("/");
+    assert(err == 0);
+    err = device->erase(device, 0, HEAP_STORAGE_SIZE);
+    assert(err == 0);
+    err = device->program(device, image, 0, HEAP_STORAGE_SIZE);
+    assert(err == 0);
+    free(image);
+    err = fs_mount("/", fs, device);
+    assert(err == 0);
+
+    // The synced records are kept, without the rest of the preallocated area
+    log = fs_logfile_open("/crash", LOGFILE_SIZE, 0, 3);
+    assert(log != NULL);
+    verify_file("/crash.1", 0, 3);
+    write_records(log, 10, 1, false);
+    err = fs_logfile_close(log);
+    assert(err == 0);
+    verify_file("/crash.2", 10, 1);  // The leftover next file was removed and its number reused
+    assert(!file_exists("/crash.3"));
+
+    unlink("/crash.1");
+    unlink("/crash.2");
+    unlink("/crash.state");
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+void test_logfile(void) {
+    printf("Rotating log file(FAT):\n");
+
+    blockdevice_t *heap = blockdevice_heap_create(HEAP_STORAGE_SIZE);
+    filesystem_t *fat = filesystem_fat_create();
+    int err = fs_format(fat, heap);
+    assert(err == 0);
+    err = fs_mount("/", fat, heap);
+    assert(err == 0);
+
+    test_api_posix_fallocate();
+    test_api_rotation();
+    test_api_reopen();
+    test_api_power_failure(fat, heap);
+
+    err = fs_unmount("/");
+    assert(err == 0);
+    filesystem_fat_free(fat);
+    blockdevice_heap_free(heap);
+}
@@ -0,0 +1,344 @@
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <hardware/regs/addressmap.h>
+#include "blockdevice/flash.h"
+#include "blockdevice/heap.h"
+#include "filesystem/fat.h"
+#include "filesystem/overlay.h"
+#include "filesystem/romfs.h"
+#include "filesystem/tmpfs.h"
+#include "filesystem/vfs.h"
+
+#define COLOR_GREEN(format)  ("\e[32m" format "\e[0m")
+#define HEAP_STORAGE_SIZE    (128 * 1024)
+
+// Built from tests/romfs by pico_add_romfs_image()
+extern const uint8_t romfs_test_image[];
+extern const size_t romfs_test_image_size;
+
+static const char INDEX_HTML[] = "<!DOCTYPE html>\n<html><body><h1>pico-vfs</h1></body></html>\n";
+
+static void test_printf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+
+    printf(" ");
+    for (size_t i = 0; i < 50 - (size_t)n; i++)
+        printf(".");
+}
+
+static size_t read_file(const char *path, char *buffer, size_t size) {
+    int fd = open(path, O_RDONLY);
+    assert(fd >= 0);
+    ssize_t length = read(fd, buffer, size - 1);
+    assert(length >= 0);
+    buffer[length] = '\0';
+    int err = close(fd);
+    assert(err == 0);
+    return (size_t)length;
+}
+
+static void write_file(const char *path, int flags, const char *text) {
+    int fd = open(path, O_WRONLY|flags, 0644);
+    assert(fd >= 0);
+    ssize_t length = write(fd, text, strlen(text));
+    assert(length == (ssize_t)strlen(text));
+    int err = close(fd);
+    assert(err == 0);
+}
+
+// Names of a directory joined by spaces, in readdir order
+static void list_dir(const char *path, char *buffer, size_t size) {
+    DIR *dir = opendir(path);
+    assert(dir != NULL);
+    buffer[0] = '\0';
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        assert(strlen(buffer) + strlen(ent->d_name) + 2 < size);
+        if (buffer[0] != '\0')
+            strcat(buffer, " ");
+        strcat(buffer, ent->d_name);
+    }
+    int err = closedir(dir);
+    assert(err == 0);
+}
+
+static bool dir_contains(const char *list, const char *name) {
+    size_t length = strlen(name);
+    for (const char *p = list; (p = strstr(p, name)) != NULL; p += length) {
+        if ((p == list || p[-1] == ' ') && (p[length] == ' ' || p[length] == '\0'))
+            return true;
+    }
+    return false;
+}
+
+static void test_api_read_lower(void) {
+    test_printf("read lower");
+
+    char buffer[256];
+    size_t length = read_file("/ovl/index.html", buffer, sizeof(buffer));
+    assert(length == strlen(INDEX_HTML));
+    assert(strcmp(buffer, INDEX_HTML) == 0);
+    length = read_file("/ovl/a/b/../b/c/./deep.txt", buffer, sizeof(buffer));
+    assert(length == 5 && strcmp(buffer, "deep\n") == 0);
+
+    struct stat finfo;
+    int err = stat("/ovl/data/table.csv", &finfo);
+    assert(err == 0);
+    assert(finfo.st_size == 2304);
+    int fd = open("/ovl/not-exists", O_RDONLY);
+    assert(fd == -1 && errno == ENOENT);
+    fd = open("/ovl/index.html/file", O_RDONLY);
+    assert(fd == -1 && errno == ENOTDIR);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_copy_up(void) {
+    test_printf("copy-up");
+
+    write_file("/ovl/index.html", O_APPEND, "<!-- changed -->\n");
+    char buffer[256];
+    size_t length = read_file("/ovl/index.html", buffer, sizeof(buffer));
+    assert(length == strlen(INDEX_HTML) + 17);
+    assert(strncmp(buffer, INDEX_HTML, strlen(INDEX_HTML)) == 0);
+    assert(strcmp(buffer + strlen(INDEX_HTML), "<!-- changed -->\n") == 0);
+
+    // Truncated on copy-up, the lower content is not copied
+    write_file("/ovl/css/style.css", O_TRUNC, "body{}");
+    length = read_file("/ovl/css/style.css", buffer, sizeof(buffer));
+    assert(length == 6 && strcmp(buffer, "body{}") == 0);
+
+    // Copied with the parent directories
+    write_file("/ovl/a/b/c/deep.txt", O_TRUNC, "deeper\n");
+    length = read_file("/ovl/a/b/c/deep.txt", buffer, sizeof(buffer));
+    assert(length == 7 && strcmp(buffer, "deeper\n") == 0);
+
+    int fd = open("/ovl/index.html", O_WRONLY|O_CREAT|O_EXCL);
+    assert(fd == -1 && errno == EEXIST);
+    fd = open("/ovl/css", O_RDWR);
+    assert(fd == -1 && errno == EISDIR);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_readdir(void) {
+    test_printf("merged readdir");
+
+    write_file("/ovl/a/b/new.txt", O_CREAT, "new");
+    char list[256];
+    list_dir("/ovl/a/b", list, sizeof(list));
+    assert(strcmp(list, "c new.txt") == 0 || strcmp(list, "new.txt c") == 0);
+
+    // Copied-up files are listed once
+    list_dir("/ovl", list, sizeof(list));
+    static const char *const names[] = {"a", "css", "data", "empty.txt", "index.html"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        assert(dir_contains(list, names[i]));
+    assert(strlen(list) == strlen("a css data empty.txt index.html"));
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_whiteout(void) {
+    test_printf("whiteout");
+
+    int err = unlink("/ovl/empty.txt");
+    assert(err == 0);
+    struct stat finfo;
+    err = stat("/ovl/empty.txt", &finfo);
+    assert(err == -1 && errno == ENOENT);
+    char list[256];
+    list_dir("/ovl", list, sizeof(list));
+    assert(!dir_contains(list, "empty.txt"));
+    assert(strstr(list, ".wh.") == NULL);
+
+    // A new file over the whiteout
+    write_file("/ovl/empty.txt", O_CREAT, "again");
+    char buffer[64];
+    size_t length = read_file("/ovl/empty.txt", buffer, sizeof(buffer));
+    assert(length == 5 && strcmp(buffer, "again") == 0);
+    list_dir("/ovl", list, sizeof(list));
+    assert(strlen(list) == strlen("a css data empty.txt index.html"));
+
+    // A copied-up file is whited out too
+    err = unlink("/ovl/index.html");
+    assert(err == 0);
+    err = stat("/ovl/index.html", &finfo);
+    assert(err == -1 && errno == ENOENT);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_opaque_dir(void) {
+    test_printf("rmdir,mkdir over lower dir");
+
+    int err = rmdir("/ovl/a/b/c");
+    assert(err == -1 && errno == ENOTEMPTY);
+    err = unlink("/ovl/a/b/c/deep.txt");
+    assert(err == 0);
+    err = rmdir("/ovl/a/b/c");
+    assert(err == 0);
+    struct stat finfo;
+    err = stat("/ovl/a/b/c", &finfo);
+    assert(err == -1 && errno == ENOENT);
+
+    // The new directory does not show the removed lower content
+    err = mkdir("/ovl/a/b/c", 0777);
+    assert(err == 0);
+    err = stat("/ovl/a/b/c/deep.txt", &finfo);
+    assert(err == -1 && errno == ENOENT);
+    char list[256];
+    list_dir("/ovl/a/b/c", list, sizeof(list));
+    assert(strcmp(list, "") == 0);
+    err = mkdir("/ovl/a/b/c", 0777);
+    assert(err == -1 && errno == EEXIST);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_rename(void) {
+    test_printf("rename");
+
+    int err = rename("/ovl/data/table.csv", "/ovl/table.csv");
+    assert(err == 0);
+    struct stat finfo;
+    err = stat("/ovl/data/table.csv", &finfo);
+    assert(err == -1 && errno == ENOENT);
+    err = stat("/ovl/table.csv", &finfo);
+    assert(err == 0 && finfo.st_size == 2304);
+    int fd = open("/ovl/table.csv", O_RDONLY);
+    assert(fd >= 0);
+    char buffer[16] = {0};
+    ssize_t length = pread(fd, buffer, 9, 2304 - 10);
+    assert(length == 9 && memcmp(buffer, "255,65025", 9) == 0);
+    close(fd);
+
+    // The lower part of a directory cannot move
+    err = rename("/ovl/css", "/ovl/style");
+    assert(err == -1 && errno == EXDEV);
+
+    // A directory of the upper file system can
+    err = mkdir("/ovl/new", 0777);
+    assert(err == 0);
+    write_file("/ovl/new/file", O_CREAT, "file");
+    err = rename("/ovl/new", "/ovl/moved");
+    assert(err == 0);
+    err = stat("/ovl/new", &finfo);
+    assert(err == -1 && errno == ENOENT);
+    err = stat("/ovl/moved/file", &finfo);
+    assert(err == 0 && finfo.st_size == 4);
+
+    // Onto a removed lower directory
+    err = rename("/ovl/moved", "/ovl/data");
+    assert(err == 0);
+    char list[256];
+    list_dir("/ovl/data", list, sizeof(list));
+    assert(strcmp(list, "file") == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_remount(filesystem_t *overlay) {
+    test_printf("remount");
+
+    int err = fs_unmount("/ovl");
+    assert(err == 0);
+    err = fs_mount("/ovl", overlay, NULL);
+    assert(err == 0);
+
+    struct stat finfo;
+    err = stat("/ovl/index.html", &finfo);
+    assert(err == -1 && errno == ENOENT);
+    err = stat("/ovl/a/b/c/deep.txt", &finfo);
+    assert(err == -1 && errno == ENOENT);
+    char buffer[64];
+    size_t length = read_file("/ovl/css/style.css", buffer, sizeof(buffer));
+    assert(length == 6 && strcmp(buffer, "body{}") == 0);
+    char list[256];
+    list_dir("/ovl/data", list, sizeof(list));
+    assert(strcmp(list, "file") == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_format(filesystem_t *overlay) {
+    test_printf("format restores the lower content");
+
+    int err = fs_unmount("/ovl");
+    assert(err == 0);
+    err = fs_format(overlay, NULL);
+    assert(err == 0);
+    err = fs_mount("/ovl", overlay, NULL);
+    assert(err == 0);
+
+    char buffer[256];
+    size_t length = read_file("/ovl/index.html", buffer, sizeof(buffer));
+    assert(length == strlen(INDEX_HTML) && strcmp(buffer, INDEX_HTML) == 0);
+    length = read_file("/ovl/empty.txt", buffer, sizeof(buffer));
+    assert(length == 0);
+    struct stat finfo;
+    err = stat("/ovl/data/table.csv", &finfo);
+    assert(err == 0 && finfo.st_size == 2304);
+    char list[256];
+    list_dir("/ovl", list, sizeof(list));
+    assert(strlen(list) == strlen("a css data empty.txt index.html"));
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_overlay_on(filesystem_t *upper, blockdevice_t *upper_device) {
+    blockdevice_t *flash = blockdevice_flash_create((uint32_t)romfs_test_image - XIP_BASE,
+                                                    romfs_test_image_size);
+    assert(flash != NULL);
+    filesystem_t *romfs = filesystem_romfs_create();
+    assert(romfs != NULL);
+    filesystem_t *overlay = filesystem_overlay_create(romfs, flash, upper, upper_device);
+    assert(overlay != NULL);
+    int err = fs_format(overlay, NULL);
+    assert(err == 0);
+    err = fs_mount("/ovl", overlay, NULL);
+    assert(err == 0);
+
+    test_api_read_lower();
+    test_api_copy_up();
+    test_api_readdir();
+    test_api_whiteout();
+    test_api_opaque_dir();
+    test_api_rename();
+    test_api_remount(overlay);
+    test_api_format(overlay);
+
+    err = fs_unmount("/ovl");
+    assert(err == 0);
+    filesystem_overlay_free(overlay);
+    filesystem_romfs_free(romfs);
+    blockdevice_flash_free(flash);
+}
+
+void test_overlay(void) {
+    printf("overlay romfs + tmpfs:\n");
+
+    filesystem_t *tmpfs = filesystem_tmpfs_create(0);
+    assert(tmpfs != NULL);
+    test_overlay_on(tmpfs, NULL);
+    filesystem_tmpfs_free(tmpfs);
+
+    printf("overlay romfs + FAT:\n");
+
+    blockdevice_t *heap = blockdevice_heap_create(HEAP_STORAGE_SIZE);
+    assert(heap != NULL);
+    filesystem_t *fat = filesystem_fat_create();
+    assert(fat != NULL);
+    test_overlay_on(fat, heap);
+    filesystem_fat_free(fat);
+    blockdevice_heap_free(heap);
+}
@@ -0,0 +1,238 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "blockdevice/heap.h"
+#include "storage/pqueue.h"
+
+#define COLOR_GREEN(format)  ("\e[32m" format "\e[0m")
+#define HEAP_STORAGE_SIZE    (32 * 1024)
+#define MESSAGE_SIZE         64
+
+static void test_printf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+
+    printf(" ");
+    for (size_t i = 0; i < 50 - (size_t)n; i++)
+        printf(".");
+}
+
+static size_t make_message(char *message, int n) {
+    return (size_t)snprintf(message, MESSAGE_SIZE, "message %d", n);
+}
+
+static void push_messages(pq_t *pq, int from, int count) {
+    char message[MESSAGE_SIZE];
+    for (int n = from; n < from + count; n++) {
+        size_t size = make_message(message, n);
+        int err = pq_push(pq, message, size);
+        assert(err == 0);
+    }
+}
+
+static void verify_head(pq_t *pq, int n) {
+    char message[MESSAGE_SIZE];
+    char expected[MESSAGE_SIZE];
+    size_t size = make_message(expected, n);
+    ssize_t length = pq_peek(pq, message, sizeof(message));
+    assert(length == (ssize_t)size);
+    assert(memcmp(message, expected, size) == 0);
+}
+
+static void test_api_push_peek(blockdevice_t *device) {
+    test_printf("pq_push, pq_peek");
+
+    int err = pq_format(device);
+    assert(err == 0);
+    pq_t *pq = pq_open(device);
+    assert(pq != NULL);
+    char message[MESSAGE_SIZE];
+    assert(pq_peek(pq, message, sizeof(message)) == 0);
+
+    push_messages(pq, 0, 10);
+    verify_head(pq, 0);
+    verify_head(pq, 0);  // Peeking does not remove
+    assert(pq_peek(pq, message, 4) == -EMSGSIZE);
+    assert(pq_push(pq, message, 0) == -EINVAL);
+    err = pq_close(pq);
+    assert(err == 0);
+
+    pq = pq_open(device);
+    assert(pq != NULL);
+    verify_head(pq, 0);
+    err = pq_close(pq);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_pop_commit(blockdevice_t *device) {
+    test_printf("pq_pop_commit");
+
+    pq_t *pq = pq_open(device);
+    assert(pq != NULL);
+    ssize_t removed = pq_pop_commit(pq, 3);
+    assert(removed == 3);
+    verify_head(pq, 3);
+    push_messages(pq, 10, 5);
+    removed = pq_pop_commit(pq, 2);
+    assert(removed == 2);
+    verify_head(pq, 5);
+
+    // The commit survives without a close
+    pq_t *reopened = pq_open(device);
+    assert(reopened != NULL);
+    verify_head(reopened, 5);
+    pq_close(reopened);
+    pq_close(pq);
+
+    pq = pq_open(device);
+    assert(pq != NULL);
+    removed = pq_pop_commit(pq, 100);
+    assert(removed == 10);
+    char message[MESSAGE_SIZE];
+    assert(pq_peek(pq, message, sizeof(message)) == 0);
+    assert(pq_pop_commit(pq, 1) == 0);
+    int err = pq_close(pq);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_peek_batch(blockdevice_t *device) {
+    test_printf("pq_peek_batch");
+
+    pq_t *pq = pq_open(device);
+    assert(pq != NULL);
+    push_messages(pq, 100, 20);
+
+    pq_message_t messages[8];
+    char buffer[8 * MESSAGE_SIZE];
+    char expected[MESSAGE_SIZE];
+    int n = 100;
+    while (true) {
+        ssize_t count = pq_peek_batch(pq, messages, 8, buffer, sizeof(buffer));
+        assert(count >= 0);
+        if (count == 0)
+            break;
+        for (ssize_t i = 0; i < count; i++) {
+            size_t size = make_message(expected, n++);
+            assert(messages[i].size == size);
+            assert(memcmp(messages[i].data, expected, size) == 0);
+        }
+        ssize_t removed = pq_pop_commit(pq, (size_t)count);
+        assert(removed == count);
+    }
+    assert(n == 120);
+
+    // A small buffer limits the batch
+    push_messages(pq, 200, 3);
+    ssize_t count = pq_peek_batch(pq, messages, 8, buffer, 20);
+    assert(count == 1);
+    count = pq_peek_batch(pq, messages, 8, buffer, 4);
+    assert(count == -EMSGSIZE);
+    pq_pop_commit(pq, 3);
+    int err = pq_close(pq);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_wrap_around(blockdevice_t *device) {
+    test_printf("pq wrap around");
+
+    // Push and pop many times the device size
+    pq_t *pq = pq_open(device);
+    assert(pq != NULL);
+    int next = 1000;
+    for (int round = 0; round < 50; round++) {
+        push_messages(pq, 1000 + round * 40, 40);
+        for (int i = 0; i < 40; i++) {
+            verify_head(pq, next++);
+            assert(pq_pop_commit(pq, 1) == 1);
+        }
+    }
+    int err = pq_close(pq);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_full(blockdevice_t *device) {
+    test_printf("pq full");
+
+    // A full queue refuses pushes instead of dropping messages that were not removed
+    pq_t *pq = pq_open(device);
+    assert(pq != NULL);
+    char message[MESSAGE_SIZE];
+    int pushed = 0;
+    size_t size;
+    int err;
+    while (true) {
+        size = make_message(message, pushed);
+        err = pq_push(pq, message, size);
+        if (err != 0)
+            break;
+        pushed++;
+        assert(pushed < 10000);  // Several times the device size
+    }
+    assert(err == -ENOSPC);
+    assert(pushed > 100);
+    verify_head(pq, 0);
+    err = pq_close(pq);
+    assert(err == 0);
+
+    pq = pq_open(device);
+    assert(pq != NULL);
+    verify_head(pq, 0);
+    assert(pq_push(pq, message, size) == -ENOSPC);
+
+    // Each removal syncs a commit record, so single removals soon run out of room too
+    int next = 0;
+    ssize_t removed;
+    while ((removed = pq_pop_commit(pq, 1)) == 1)
+        verify_head(pq, ++next);
+    assert(removed == -ENOSPC);
+    assert(next > 0 && next < pushed);
+    verify_head(pq, next);
+
+    // Removing the messages of the oldest sector at once makes room again
+    size_t count = 2;
+    while (pq_push(pq, message, size) == -ENOSPC) {
+        removed = pq_pop_commit(pq, count);
+        if (removed == -ENOSPC) {
+            verify_head(pq, next);  // Nothing was removed
+            count *= 2;
+            continue;
+        }
+        assert(removed == (ssize_t)count);
+        next += (int)count;
+        verify_head(pq, next);
+    }
+    assert(next < pushed);
+    removed = pq_pop_commit(pq, (size_t)(pushed + 1 - next));  // With the one pushed last
+    assert(removed == pushed + 1 - next);
+    assert(pq_peek(pq, message, sizeof(message)) == 0);
+    err = pq_close(pq);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+void test_pqueue(void) {
+    printf("Persistent queue:\n");
+
+    blockdevice_t *heap = blockdevice_heap_create(HEAP_STORAGE_SIZE);
+
+    test_api_push_peek(heap);
+    test_api_pop_commit(heap);
+    test_api_peek_batch(heap);
+    test_api_wrap_around(heap);
+    test_api_full(heap);
+
+    blockdevice_heap_free(heap);
+}
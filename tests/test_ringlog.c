@@ -0,0 +1,216 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "blockdevice/heap.h"
+#include "storage/ringlog.h"
+
+#define COLOR_GREEN(format)  ("\e[32m" format "\e[0m")
+#define HEAP_STORAGE_SIZE    (64 * 1024)
+#define RECORD_SIZE          100
+
+static void test_printf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+
+    printf(" ");
+    for (size_t i = 0; i < 50 - (size_t)n; i++)
+        printf(".");
+}
+
+static size_t record_size(uint64_t sequence) {
+    return 1 + sequence % RECORD_SIZE;
+}
+
+static void fill_record(uint8_t *buffer, uint64_t sequence) {
+    for (size_t i = 0; i < record_size(sequence); i++)
+        buffer[i] = (uint8_t)(sequence + i);
+}
+
+static void append_records(ringlog_t *log, size_t count) {
+    uint8_t buffer[RECORD_SIZE];
+    for (size_t i = 0; i < count; i++) {
+        uint64_t sequence = ringlog_next_sequence(log);
+        fill_record(buffer, sequence);
+        int64_t result = ringlog_append(log, buffer, record_size(sequence));
+        assert(result == (int64_t)sequence);
+    }
+}
+
+static void verify_records(ringlog_t *log, uint64_t from) {
+    ringlog_iter_t iter;
+    int err = ringlog_iter_init(log, &iter, from);
+    assert(err == 0);
+
+    uint64_t expected = from > ringlog_first_sequence(log) ? from : ringlog_first_sequence(log);
+    uint8_t buffer[RECORD_SIZE];
+    uint8_t record[RECORD_SIZE];
+    uint64_t sequence;
+    ssize_t length;
+    while ((length = ringlog_iter_next(&iter, buffer, sizeof(buffer), &sequence)) > 0) {
+        assert(sequence == expected);
+        assert((size_t)length == record_size(sequence));
+        fill_record(record, sequence);
+        assert(memcmp(buffer, record, length) == 0);
+        expected++;
+    }
+    assert(length == 0);
+    assert(expected == ringlog_next_sequence(log));
+}
+
+static void test_api_format(blockdevice_t *device) {
+    test_printf("ringlog_format");
+
+    int err = ringlog_format(device);
+    assert(err == 0);
+    ringlog_t *log = ringlog_open(device);
+    assert(log != NULL);
+    assert(ringlog_first_sequence(log) == 0);
+    assert(ringlog_next_sequence(log) == 0);
+    verify_records(log, 0);
+    err = ringlog_close(log);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_append(blockdevice_t *device) {
+    test_printf("ringlog_append");
+
+    ringlog_t *log = ringlog_open(device);
+    assert(log != NULL);
+    append_records(log, 10);
+    verify_records(log, 0);  // Records still in the page buffer are readable
+    verify_records(log, 7);
+
+    uint8_t buffer[RECORD_SIZE] = {0};
+    int64_t result = ringlog_append(log, buffer, ringlog_max_record_size(log) + 1);
+    assert(result == -EMSGSIZE);
+    result = ringlog_append(log, buffer, 0);
+    assert(result == -EINVAL);
+
+    int err = ringlog_close(log);
+    assert(err == 0);
+
+    log = ringlog_open(device);
+    assert(log != NULL);
+    assert(ringlog_first_sequence(log) == 0);
+    assert(ringlog_next_sequence(log) == 10);
+    verify_records(log, 0);
+    append_records(log, 10);  // Continues after the padded page
+    verify_records(log, 0);
+    err = ringlog_close(log);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_iter(blockdevice_t *device) {
+    test_printf("ringlog_iter_next");
+
+    ringlog_t *log = ringlog_open(device);
+    assert(log != NULL);
+
+    ringlog_iter_t iter;
+    int err = ringlog_iter_init(log, &iter, 5);
+    assert(err == 0);
+    uint8_t buffer[RECORD_SIZE];
+    uint64_t sequence;
+    ssize_t length = ringlog_iter_next(&iter, buffer, record_size(5) - 1, &sequence);
+    assert(length == -EMSGSIZE);
+    length = ringlog_iter_next(&iter, buffer, sizeof(buffer), &sequence);
+    assert(length == (ssize_t)record_size(5));
+    assert(sequence == 5);
+
+    // A reader at the end sees later records
+    err = ringlog_iter_init(log, &iter, 1000);
+    assert(err == 0);
+    length = ringlog_iter_next(&iter, buffer, sizeof(buffer), &sequence);
+    assert(length == 0);
+    append_records(log, 1);
+    length = ringlog_iter_next(&iter, buffer, sizeof(buffer), &sequence);
+    assert(length == (ssize_t)record_size(20));
+    assert(sequence == 20);
+
+    err = ringlog_close(log);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_wrap_around(blockdevice_t *device) {
+    test_printf("ringlog wrap around");
+
+    ringlog_t *log = ringlog_open(device);
+    assert(log != NULL);
+    ringlog_iter_t iter;
+    int err = ringlog_iter_init(log, &iter, 0);
+    assert(err == 0);
+
+    append_records(log, 3000);  // About three times the device
+    assert(ringlog_first_sequence(log) > 0);
+    verify_records(log, 0);
+    verify_records(log, 2500);
+
+    uint8_t buffer[RECORD_SIZE];
+    ssize_t length = ringlog_iter_next(&iter, buffer, sizeof(buffer), NULL);
+    assert(length == -EOVERFLOW);
+
+    uint64_t first = ringlog_first_sequence(log);
+    uint64_t next = ringlog_next_sequence(log);
+    err = ringlog_close(log);
+    assert(err == 0);
+
+    log = ringlog_open(device);
+    assert(log != NULL);
+    assert(ringlog_first_sequence(log) == first);
+    assert(ringlog_next_sequence(log) == next);
+    verify_records(log, 0);
+    err = ringlog_close(log);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_power_loss(blockdevice_t *device) {
+    test_printf("ringlog recovery");
+
+    ringlog_t *log = ringlog_open(device);
+    assert(log != NULL);
+    append_records(log, 50);
+    int err = ringlog_sync(log);
+    assert(err == 0);
+    uint64_t synced = ringlog_next_sequence(log);
+    append_records(log, 3);  // Stays in the page buffer
+
+    // The device as left by a power failure at this point
+    ringlog_t *recovered = ringlog_open(device);
+    assert(recovered != NULL);
+    assert(ringlog_next_sequence(recovered) >= synced);
+    assert(ringlog_next_sequence(recovered) < ringlog_next_sequence(log));
+    verify_records(recovered, 0);
+    err = ringlog_close(recovered);
+    assert(err == 0);
+    err = ringlog_close(log);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+void test_ringlog(void) {
+    printf("Ring log:\n");
+
+    blockdevice_t *heap = blockdevice_heap_create(HEAP_STORAGE_SIZE);
+    assert(heap != NULL);
+
+    test_api_format(heap);
+    test_api_append(heap);
+    test_api_iter(heap);
+    test_api_wrap_around(heap);
+    test_api_power_loss(heap);
+
+    blockdevice_heap_free(heap);
+}
@@ -0,0 +1,219 @@
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <hardware/regs/addressmap.h>
+#include "blockdevice/flash.h"
+#include "blockdevice/heap.h"
+#include "filesystem/romfs.h"
+#include "filesystem/vfs.h"
+
+#define COLOR_GREEN(format)  ("\e[32m" format "\e[0m")
+
+// Built from tests/romfs by pico_add_romfs_image()
+extern const uint8_t romfs_test_image[];
+extern const size_t romfs_test_image_size;
+
+static const char INDEX_HTML[] = "<!DOCTYPE html>\n<html><body><h1>pico-vfs</h1></body></html>\n";
+
+static void test_printf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+
+    printf(" ");
+    for (size_t i = 0; i < 50 - (size_t)n; i++)
+        printf(".");
+}
+
+static void test_api_read(void) {
+    test_printf("open,read");
+
+    int fd = open("/rom/index.html", O_RDONLY);
+    assert(fd >= 0);
+    char buffer[128] = {0};
+    ssize_t length = read(fd, buffer, sizeof(buffer));
+    assert(length == (ssize_t)strlen(INDEX_HTML));
+    assert(strcmp(buffer, INDEX_HTML) == 0);
+    assert(read(fd, buffer, sizeof(buffer)) == 0);
+    int err = close(fd);
+    assert(err == 0);
+
+    // Rows of "n,n*n" spread over several device read units
+    fd = open("/rom/data/table.csv", O_RDONLY);
+    assert(fd >= 0);
+    off_t offset = lseek(fd, 0, SEEK_END);
+    assert(offset == 2304);
+    for (int row = 255; row >= 0; row -= 51) {
+        char expected[16];
+        int n = snprintf(expected, sizeof(expected), "%d,%d\n", row, row * row);
+        off_t position = 0;
+        for (int i = 0; i < row; i++)
+            position += snprintf(buffer, sizeof(buffer), "%d,%d\n", i, i * i);
+        length = pread(fd, buffer, n, position);
+        assert(length == n);
+        assert(memcmp(buffer, expected, n) == 0);
+    }
+    err = close(fd);
+    assert(err == 0);
+
+    fd = open("/rom/a/b/../b/c/./deep.txt", O_RDONLY);
+    assert(fd >= 0);
+    length = read(fd, buffer, sizeof(buffer));
+    assert(length == 5 && memcmp(buffer, "deep\n", 5) == 0);
+    close(fd);
+
+    fd = open("/rom/empty.txt", O_RDONLY);
+    assert(fd >= 0);
+    assert(read(fd, buffer, sizeof(buffer)) == 0);
+    close(fd);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_lookup_error(void) {
+    test_printf("lookup errors");
+
+    int fd = open("/rom/not-exists", O_RDONLY);
+    assert(fd == -1 && errno == ENOENT);
+    fd = open("/rom/css/style.cs", O_RDONLY);
+    assert(fd == -1 && errno == ENOENT);
+    fd = open("/rom/index.html/file", O_RDONLY);
+    assert(fd == -1 && errno == ENOTDIR);
+    fd = open("/rom/css", O_RDONLY);
+    assert(fd == -1 && errno == EISDIR);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_read_only(void) {
+    test_printf("read-only");
+
+    int fd = open("/rom/index.html", O_RDWR);
+    assert(fd == -1 && errno == EROFS);
+    fd = open("/rom/new", O_WRONLY|O_CREAT);
+    assert(fd == -1 && errno == EROFS);
+    int err = unlink("/rom/index.html");
+    assert(err == -1 && errno == EROFS);
+    err = rename("/rom/index.html", "/rom/renamed");
+    assert(err == -1 && errno == EROFS);
+    err = mkdir("/rom/dir", 0777);
+    assert(err == -1 && errno == EROFS);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_stat(void) {
+    test_printf("stat");
+
+    struct stat finfo;
+    int err = stat("/rom/index.html", &finfo);
+    assert(err == 0);
+    assert(finfo.st_mode & S_IFREG);
+    assert(finfo.st_size == (off_t)strlen(INDEX_HTML));
+    err = stat("/rom/a/b", &finfo);
+    assert(err == 0);
+    assert(finfo.st_mode & S_IFDIR);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_readdir(void) {
+    test_printf("readdir");
+
+    static const char *const names[] = {"a", "css", "data", "empty.txt", "index.html"};
+    DIR *dir = opendir("/rom");
+    assert(dir != NULL);
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        struct dirent *ent = readdir(dir);
+        assert(ent != NULL);
+        assert(strcmp(ent->d_name, names[i]) == 0);
+        assert(ent->d_type == (i < 3 ? DT_DIR : DT_REG));
+    }
+    assert(readdir(dir) == NULL);
+    int err = closedir(dir);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_mmap(bool in_place) {
+    test_printf("mmap");
+
+    int fd = open("/rom/index.html", O_RDONLY);
+    assert(fd >= 0);
+    const char *data = mmap(NULL, strlen(INDEX_HTML), PROT_READ, MAP_SHARED, fd, 0);
+    assert(data != MAP_FAILED);
+    assert(memcmp(data, INDEX_HTML, strlen(INDEX_HTML)) == 0);
+    if (in_place) {
+        // A pointer into the image itself, no copy
+        assert(data > (const char *)romfs_test_image);
+        assert(data < (const char *)romfs_test_image + romfs_test_image_size);
+    }
+    int err = munmap((void *)data, strlen(INDEX_HTML));
+    assert(err == 0);
+    close(fd);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+void test_romfs(void) {
+    printf("romfs in flash:\n");
+
+    blockdevice_t *flash = blockdevice_flash_create((uint32_t)romfs_test_image - XIP_BASE,
+                                                    romfs_test_image_size);
+    assert(flash != NULL);
+    filesystem_t *romfs = filesystem_romfs_create();
+    assert(romfs != NULL);
+    int err = fs_format(romfs, flash);
+    assert(err == -1 && errno == EROFS);
+    err = fs_mount("/rom", romfs, flash);
+    assert(err == 0);
+
+    test_api_read();
+    test_api_lookup_error();
+    test_api_read_only();
+    test_api_stat();
+    test_api_readdir();
+    test_api_mmap(true);
+
+    err = fs_unmount("/rom");
+    assert(err == 0);
+    blockdevice_flash_free(flash);
+
+    printf("romfs on a block device without mapping:\n");
+
+    // Read through the device in read_size units
+    blockdevice_t *heap = blockdevice_heap_create(romfs_test_image_size);
+    assert(heap != NULL);
+    err = heap->program(heap, romfs_test_image, 0, romfs_test_image_size);
+    assert(err == 0);
+    heap->map = NULL;
+    err = fs_mount("/rom", romfs, heap);
+    assert(err == 0);
+
+    test_api_read();
+    test_api_lookup_error();
+    test_api_stat();
+    test_api_readdir();
+    test_api_mmap(false);
+
+    err = fs_unmount("/rom");
+    assert(err == 0);
+
+    // A corrupted table is not mounted
+    uint8_t byte = romfs_test_image[40] ^ 0xff;
+    err = heap->program(heap, &byte, 40, 1);
+    assert(err == 0);
+    err = fs_mount("/rom", romfs, heap);
+    assert(err == -1 && errno == EILSEQ);
+
+    filesystem_romfs_free(romfs);
+    blockdevice_heap_free(heap);
+}
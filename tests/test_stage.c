@@ -0,0 +1,244 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pico/time.h>
+#include "blockdevice/heap.h"
+#include "filesystem/fat.h"
+#include "filesystem/stage.h"
+#include "filesystem/tmpfs.h"
+#include "filesystem/vfs.h"
+
+#define COLOR_GREEN(format)  ("\e[32m" format "\e[0m")
+#define HEAP_STORAGE_SIZE    (128 * 1024)
+#define STAGE_SIZE           (4 * PICO_VFS_STAGE_CHUNK_SIZE)
+
+static uint8_t buffer[6 * PICO_VFS_STAGE_CHUNK_SIZE];
+
+static void test_printf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+
+    printf(" ");
+    for (size_t i = 0; i < 50 - (size_t)n; i++)
+        printf(".");
+}
+
+static uint8_t pattern(size_t i) {
+    return (uint8_t)(i * 31 + (i >> 8));
+}
+
+// Size of the file in the backing file system, without the staged data
+static off_t backing_size(filesystem_t *backing, const char *path) {
+    struct stat finfo;
+    int err = backing->stat(backing, path, &finfo);
+    assert(err == 0);
+    return finfo.st_size;
+}
+
+// Size of a file that is open. FAT updates the directory entry only when the file is synced.
+static bool backing_size_is(filesystem_t *backing, const char *path, off_t size) {
+    return backing->type == FILESYSTEM_TYPE_FAT || backing_size(backing, path) == size;
+}
+
+static void test_api_write_read(filesystem_t *backing) {
+    test_printf("write,read staged");
+
+    int fd = open("/stage/burst.bin", O_RDWR|O_CREAT|O_TRUNC);
+    assert(fd >= 0);
+    for (size_t i = 0; i < 1000; i++)
+        buffer[i] = pattern(i);
+    ssize_t length = write(fd, buffer, 1000);
+    assert(length == 1000);
+
+    // Returned before the data is in the backing file system
+    assert(backing_size_is(backing, "/burst.bin", 0));
+    struct stat finfo;
+    int err = fstat(fd, &finfo);
+    assert(err == 0 && finfo.st_size == 1000);
+    err = stat("/stage/burst.bin", &finfo);
+    assert(err == 0 && finfo.st_size == 1000);
+
+    // Reads see the staged data
+    uint8_t data[1000];
+    off_t offset = lseek(fd, 100, SEEK_SET);
+    assert(offset == 100);
+    length = read(fd, data, sizeof(data));
+    assert(length == 900);
+    assert(memcmp(data, buffer + 100, 900) == 0);
+
+    err = fsync(fd);
+    assert(err == 0);
+    assert(backing_size(backing, "/burst.bin") == 1000);
+    err = close(fd);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_overwrite(filesystem_t *backing) {
+    test_printf("overwrite over destaged data");
+
+    int fd = open("/stage/burst.bin", O_RDWR);
+    assert(fd >= 0);
+    ssize_t length = pwrite(fd, "ABCD", 4, 500);
+    assert(length == 4);
+    length = pwrite(fd, "XY", 2, 502);
+    assert(length == 2);
+    off_t offset = lseek(fd, 1200, SEEK_SET);
+    assert(offset == 1200);
+    length = write(fd, "end", 3);
+    assert(length == 3);
+
+    // Staged chunks over the backing data, the newest first, zeros in the hole
+    uint8_t data[1203];
+    length = pread(fd, data, sizeof(data), 0);
+    assert(length == 1203);
+    assert(memcmp(data, buffer, 500) == 0);
+    assert(memcmp(data + 500, "ABXY", 4) == 0);
+    assert(memcmp(data + 504, buffer + 504, 496) == 0);
+    for (size_t i = 1000; i < 1200; i++)
+        assert(data[i] == 0);
+    assert(memcmp(data + 1200, "end", 3) == 0);
+    assert(backing_size_is(backing, "/burst.bin", 1000));
+
+    int err = close(fd);
+    assert(err == 0);
+    assert(backing_size(backing, "/burst.bin") == 1203);
+    fd = open("/stage/burst.bin", O_RDONLY);
+    assert(fd >= 0);
+    uint8_t reread[1203];
+    length = read(fd, reread, sizeof(reread));
+    assert(length == 1203);
+    assert(memcmp(reread, data, sizeof(reread)) == 0);
+    close(fd);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_back_pressure(filesystem_t *backing) {
+    test_printf("write beyond the staging area");
+
+    for (size_t i = 0; i < sizeof(buffer); i++)
+        buffer[i] = pattern(i);
+    int fd = open("/stage/large.bin", O_WRONLY|O_CREAT|O_TRUNC);
+    assert(fd >= 0);
+    // Odd write sizes, chunks start unaligned
+    size_t written = 0;
+    while (written < sizeof(buffer)) {
+        size_t n = sizeof(buffer) - written < 777 ? sizeof(buffer) - written : 777;
+        ssize_t length = write(fd, buffer + written, n);
+        assert(length == (ssize_t)n);
+        written += n;
+    }
+    // Only what did not fit was written out
+    if (backing->type != FILESYSTEM_TYPE_FAT) {
+        off_t size = backing_size(backing, "/large.bin");
+        assert(size >= (off_t)(sizeof(buffer) - STAGE_SIZE));
+        assert(size < (off_t)sizeof(buffer));
+    }
+    int err = close(fd);
+    assert(err == 0);
+    assert(backing_size(backing, "/large.bin") == sizeof(buffer));
+
+    static uint8_t data[sizeof(buffer)];
+    fd = open("/stage/large.bin", O_RDONLY);
+    assert(fd >= 0);
+    ssize_t length = read(fd, data, sizeof(data));
+    assert(length == sizeof(data));
+    assert(memcmp(data, buffer, sizeof(buffer)) == 0);
+    close(fd);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_gc(filesystem_t *backing) {
+    test_printf("destage by fs_gc");
+
+    int fd = open("/stage/log.txt", O_WRONLY|O_CREAT|O_APPEND);
+    assert(fd >= 0);
+    size_t size = 2 * PICO_VFS_STAGE_CHUNK_SIZE + 100;
+    ssize_t length = write(fd, buffer, size);
+    assert(length == (ssize_t)size);
+
+    // The full chunks at once, the last one after the age limit
+    int err = fs_gc("/stage", 1000000);
+    assert(err == 0);
+    assert(backing_size_is(backing, "/log.txt", 2 * PICO_VFS_STAGE_CHUNK_SIZE));
+    sleep_us(PICO_VFS_STAGE_AGE_US);
+    err = fs_gc("/stage", 1000000);
+    assert(err == 0);
+    assert(backing_size_is(backing, "/log.txt", (off_t)size));
+
+    // Appends after a seek go to the end
+    lseek(fd, 0, SEEK_SET);
+    length = write(fd, "tail", 4);
+    assert(length == 4);
+    err = close(fd);
+    assert(err == 0);
+    assert(backing_size(backing, "/log.txt") == (off_t)size + 4);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_truncate(filesystem_t *backing) {
+    test_printf("ftruncate");
+
+    int fd = open("/stage/burst.bin", O_RDWR);
+    assert(fd >= 0);
+    ssize_t length = pwrite(fd, "staged", 6, 2000);
+    assert(length == 6);
+    int err = ftruncate(fd, 10);
+    assert(err == 0);
+    struct stat finfo;
+    err = fstat(fd, &finfo);
+    assert(err == 0 && finfo.st_size == 10);
+    err = close(fd);
+    assert(err == 0);
+    assert(backing_size(backing, "/burst.bin") == 10);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_stage_on(filesystem_t *backing, blockdevice_t *device) {
+    filesystem_t *stage = filesystem_stage_create(backing, NULL, STAGE_SIZE);
+    assert(stage != NULL);
+    int err = fs_format(stage, device);
+    assert(err == 0);
+    err = fs_mount("/stage", stage, device);
+    assert(err == 0);
+
+    test_api_write_read(backing);
+    test_api_overwrite(backing);
+    test_api_back_pressure(backing);
+    test_api_gc(backing);
+    test_api_truncate(backing);
+
+    err = fs_unmount("/stage");
+    assert(err == 0);
+    filesystem_stage_free(stage);
+}
+
+void test_stage(void) {
+    printf("Write staging over tmpfs:\n");
+
+    filesystem_t *tmpfs = filesystem_tmpfs_create(0);
+    assert(tmpfs != NULL);
+    test_stage_on(tmpfs, NULL);
+    filesystem_tmpfs_free(tmpfs);
+
+    printf("Write staging over FAT:\n");
+
+    blockdevice_t *heap = blockdevice_heap_create(HEAP_STORAGE_SIZE);
+    assert(heap != NULL);
+    filesystem_t *fat = filesystem_fat_create();
+    assert(fat != NULL);
+    test_stage_on(fat, heap);
+    filesystem_fat_free(fat);
+    blockdevice_heap_free(heap);
+}
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -7,6 +8,7 @@
 #include "blockdevice/heap.h"
 #include "filesystem/fat.h"
 #include "filesystem/littlefs.h"
+#include "filesystem/tmpfs.h"
 #include "filesystem/vfs.h"
 
 #define COLOR_GREEN(format)      ("\e[32m" format "\e[0m")
@@ -798,10 +800,36 @@ void test_fwscanf(void) {
 void test_tmpfile(void) {
     test_printf("tmpfile");
 
+    // tmpfile creates its file in /tmp and removes it while open
+    filesystem_t *tmpfs = filesystem_tmpfs_create(16 * 1024);
+    int err = fs_mount("/tmp", tmpfs, NULL);
+    assert(err == 0);
+
     FILE *fp = tmpfile();
-    assert(fp == NULL);
+    assert(fp != NULL);
+    fprintf(fp, "hello world");
+    rewind(fp);
+    char buffer[32] = {0};
+    assert(fgets(buffer, sizeof(buffer), fp) != NULL);
+    assert(strcmp(buffer, "hello world") == 0);
+    fclose(fp);
 
-    printf("not support\n"); // tmpfile also requires the  global pointr environ
+    char path[] = "/tmp/mkstemp.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    unlink(path);
+
+    DIR *dir = opendir("/tmp");
+    assert(dir != NULL);
+    assert(readdir(dir) == NULL);
+    closedir(dir);
+
+    err = fs_unmount("/tmp");
+    assert(err == 0);
+    filesystem_tmpfs_free(tmpfs);
+
+    printf(COLOR_GREEN("ok\n"));
 }
 
 void test_tmpnam(void) {
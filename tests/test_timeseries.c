@@ -0,0 +1,253 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "blockdevice/heap.h"
+#include "filesystem/fat.h"
+#include "filesystem/timeseries.h"
+#include "filesystem/vfs.h"
+
+#define COLOR_GREEN(format)  ("\e[32m" format "\e[0m")
+#define HEAP_STORAGE_SIZE    (128 * 1024)
+#define SAMPLE_COUNT         4000
+#define INTERVAL_US          1000
+
+static void test_printf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+
+    printf(" ");
+    for (size_t i = 0; i < 50 - (size_t)n; i++)
+        printf(".");
+}
+
+static void make_sample(int n, float *values) {
+    values[0] = (float)n * 0.5f;
+    values[1] = -(float)(n % 100);
+}
+
+static void append_samples(fs_timeseries_t *ts, int from, int count) {
+    float values[2];
+    for (int n = from; n < from + count; n++) {
+        make_sample(n, values);
+        int err = fs_timeseries_append(ts, (uint64_t)n * INTERVAL_US, values);
+        assert(err == 0);
+    }
+}
+
+// Queries the timestamps of samples `first` to `last` and checks every sample in between
+static void verify_range(fs_timeseries_t *ts, uint64_t from, uint64_t to, int first, int last) {
+    fs_timeseries_iter_t iter;
+    int err = fs_timeseries_query(ts, &iter, from, to);
+    assert(err == 0);
+    uint64_t timestamp;
+    float values[2];
+    float expected[2];
+    int n = first;
+    while ((err = fs_timeseries_next(&iter, &timestamp, values)) == 1) {
+        assert(timestamp == (uint64_t)n * INTERVAL_US);
+        make_sample(n, expected);
+        assert(values[0] == expected[0]);
+        assert(values[1] == expected[1]);
+        n++;
+    }
+    assert(err == 0);
+    assert(n == last + 1);
+}
+
+static void test_api_append_query(void) {
+    test_printf("fs_timeseries_append, fs_timeseries_query");
+
+    fs_timeseries_t *ts = fs_timeseries_open("/sensor.ts", 2);
+    assert(ts != NULL);
+    assert(fs_timeseries_value_count(ts) == 2);
+    verify_range(ts, 0, UINT64_MAX, 0, -1);
+
+    append_samples(ts, 0, SAMPLE_COUNT);
+    verify_range(ts, 0, UINT64_MAX, 0, SAMPLE_COUNT - 1);
+    verify_range(ts, 1234 * INTERVAL_US, 2345 * INTERVAL_US, 1234, 2345);
+    verify_range(ts, 1234 * INTERVAL_US + 1, 2345 * INTERVAL_US - 1, 1235, 2344);
+    verify_range(ts, (SAMPLE_COUNT - 1) * INTERVAL_US, UINT64_MAX, SAMPLE_COUNT - 1, SAMPLE_COUNT - 1);
+    verify_range(ts, SAMPLE_COUNT * INTERVAL_US, UINT64_MAX, 0, -1);
+
+    float values[2] = {0};
+    int err = fs_timeseries_append(ts, 0, values);
+    assert(err == -1);
+    assert(errno == EINVAL);
+
+    err = fs_timeseries_close(ts);
+    assert(err == 0);
+
+    // Delta encoding stores far less than the raw samples
+    struct stat finfo;
+    err = stat("/sensor.ts", &finfo);
+    assert(err == 0);
+    assert(finfo.st_size < SAMPLE_COUNT * (off_t)(sizeof(uint64_t) + sizeof(values)));
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_reopen(void) {
+    test_printf("fs_timeseries_open existing file");
+
+    fs_timeseries_t *ts = fs_timeseries_open("/sensor.ts", 3);
+    assert(ts == NULL);
+    assert(errno == EINVAL);
+
+    ts = fs_timeseries_open("/sensor.ts", 0);
+    assert(ts != NULL);
+    assert(fs_timeseries_value_count(ts) == 2);
+    verify_range(ts, 0, UINT64_MAX, 0, SAMPLE_COUNT - 1);
+
+    // Appending continues in the last chunk
+    append_samples(ts, SAMPLE_COUNT, 1000);
+    verify_range(ts, 3900 * INTERVAL_US, 4100 * INTERVAL_US, 3900, 4100);
+    int err = fs_timeseries_close(ts);
+    assert(err == 0);
+
+    ts = fs_timeseries_open("/sensor.ts", 2);
+    assert(ts != NULL);
+    verify_range(ts, 0, UINT64_MAX, 0, SAMPLE_COUNT + 1000 - 1);
+    err = fs_timeseries_close(ts);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_reopen_group_end(void) {
+    test_printf("fs_timeseries_open at the end of a group");
+
+    fs_timeseries_t *ts = fs_timeseries_open("/group.ts", 2);
+    assert(ts != NULL);
+    append_samples(ts, 0, SAMPLE_COUNT);
+    int err = fs_timeseries_close(ts);
+    assert(err == 0);
+
+    // Cut the file after the first index block, as a power failure before the next chunk would
+    size_t entries = (PICO_VFS_TIMESERIES_BLOCK_SIZE - 16) / 16;  // Index entries per block
+    int fd = open("/group.ts", O_WRONLY);
+    assert(fd != -1);
+    err = ftruncate(fd, (off_t)(1 + entries + 1) * PICO_VFS_TIMESERIES_BLOCK_SIZE);
+    assert(err == 0);
+    err = close(fd);
+    assert(err == 0);
+
+    ts = fs_timeseries_open("/group.ts", 0);
+    assert(ts != NULL);
+    fs_timeseries_iter_t iter;
+    err = fs_timeseries_query(ts, &iter, 0, UINT64_MAX);
+    assert(err == 0);
+    uint64_t timestamp;
+    float values[2];
+    int count = 0;
+    while (fs_timeseries_next(&iter, &timestamp, values) == 1)
+        count++;
+    assert(count > 0 && count < SAMPLE_COUNT);
+
+    // Appending continues after the last stored sample
+    make_sample(count - 2, values);
+    err = fs_timeseries_append(ts, (uint64_t)(count - 2) * INTERVAL_US, values);
+    assert(err == -1);
+    assert(errno == EINVAL);
+    append_samples(ts, count, 100);
+    verify_range(ts, 0, UINT64_MAX, 0, count + 100 - 1);
+    err = fs_timeseries_close(ts);
+    assert(err == 0);
+    unlink("/group.ts");
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_sync(void) {
+    test_printf("fs_timeseries_sync");
+
+    fs_timeseries_t *ts = fs_timeseries_open("/sensor.ts", 0);
+    assert(ts != NULL);
+    append_samples(ts, 5000, 100);
+    int err = fs_timeseries_sync(ts);
+    assert(err == 0);
+
+    // A second reader sees the synced samples
+    fs_timeseries_t *reader = fs_timeseries_open("/sensor.ts", 0);
+    assert(reader != NULL);
+    verify_range(reader, 5000 * INTERVAL_US, UINT64_MAX, 5000, 5099);
+    err = fs_timeseries_close(reader);
+    assert(err == 0);
+
+    // Samples appended during a query are returned
+    fs_timeseries_iter_t iter;
+    err = fs_timeseries_query(ts, &iter, 5099 * INTERVAL_US, UINT64_MAX);
+    assert(err == 0);
+    uint64_t timestamp;
+    float values[2];
+    assert(fs_timeseries_next(&iter, &timestamp, values) == 1);
+    assert(fs_timeseries_next(&iter, &timestamp, values) == 0);
+    append_samples(ts, 5100, 1);
+    assert(fs_timeseries_next(&iter, &timestamp, values) == 1);
+    assert(timestamp == 5100 * INTERVAL_US);
+
+    err = fs_timeseries_close(ts);
+    assert(err == 0);
+    unlink("/sensor.ts");
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_equal_timestamps(void) {
+    test_printf("fs_timeseries equal timestamps");
+
+    // Samples with the same timestamp span several chunks
+    fs_timeseries_t *ts = fs_timeseries_open("/burst.ts", 1);
+    assert(ts != NULL);
+    float value = 1.0f;
+    for (int i = 0; i < 100; i++)
+        assert(fs_timeseries_append(ts, 10, &value) == 0);
+    for (int i = 0; i < 1000; i++)
+        assert(fs_timeseries_append(ts, 20, &value) == 0);
+    for (int i = 0; i < 100; i++)
+        assert(fs_timeseries_append(ts, 30, &value) == 0);
+
+    fs_timeseries_iter_t iter;
+    int err = fs_timeseries_query(ts, &iter, 20, 20);
+    assert(err == 0);
+    uint64_t timestamp;
+    int count = 0;
+    while (fs_timeseries_next(&iter, &timestamp, &value) == 1) {
+        assert(timestamp == 20);
+        count++;
+    }
+    assert(count == 1000);
+    err = fs_timeseries_close(ts);
+    assert(err == 0);
+    unlink("/burst.ts");
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+void test_timeseries(void) {
+    printf("Time-series file(FAT):\n");
+
+    blockdevice_t *heap = blockdevice_heap_create(HEAP_STORAGE_SIZE);
+    filesystem_t *fat = filesystem_fat_create();
+    int err = fs_format(fat, heap);
+    assert(err == 0);
+    err = fs_mount("/", fat, heap);
+    assert(err == 0);
+
+    test_api_append_query();
+    test_api_reopen();
+    test_api_reopen_group_end();
+    test_api_sync();
+    test_api_equal_timestamps();
+
+    err = fs_unmount("/");
+    assert(err == 0);
+    filesystem_fat_free(fat);
+    blockdevice_heap_free(heap);
+}
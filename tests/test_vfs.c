@@ -6,10 +6,13 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include "blockdevice/heap.h"
 #include "blockdevice/loopback.h"
 #include "filesystem/fat.h"
 #include "filesystem/littlefs.h"
+#include "filesystem/tmpfs.h"
 #include "filesystem/vfs.h"
 
 #define COLOR_GREEN(format)      ("\e[32m" format "\e[0m")
@@ -74,6 +77,24 @@ static void test_api_format_error(filesystem_t *fs, blockdevice_t *device) {
     printf(COLOR_GREEN("ok\n"));
 }
 
+static void test_api_format_failure(void) {
+    test_printf("fs_format failure");
+
+    blockdevice_t *device = blockdevice_heap_create(8 * 512);  // Too small for FAT
+    assert(device != NULL);
+    filesystem_t *fs = filesystem_fat_create();
+    assert(fs != NULL);
+
+    int err = fs_format(fs, device);
+    assert(err == -1);  // Callers check for -1 and errno, as for the other calls
+    assert(errno == EIO);
+
+    filesystem_fat_free(fs);
+    blockdevice_heap_free(device);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
 static void test_api_mount_error(filesystem_t *fs, blockdevice_t *device) {
     test_printf("fs_mount error");
 
@@ -139,6 +160,38 @@ static void test_api_file_open_many() {
     printf(COLOR_GREEN("ok\n"));
 }
 
+static void test_api_file_open_limit() {
+    test_printf("open files limit");
+
+    int fds[PICO_VFS_MAX_OPEN_FILES + 1];
+    size_t count = 0;
+    while (count < PICO_VFS_MAX_OPEN_FILES + 1) {
+        char path[32];
+        snprintf(path, sizeof(path), "/file%u", (unsigned)count);
+        int fd = open(path, O_WRONLY|O_CREAT);
+        if (fd == -1) {
+            assert(errno == ENFILE);
+            break;
+        }
+        assert(fd == (int)(MIN_FILENO + count));
+        fds[count++] = fd;
+    }
+    assert(count == PICO_VFS_MAX_OPEN_FILES);
+
+    int err = close(fds[1]);
+    assert(err == 0);
+    int fd = open("/file1", O_RDONLY);
+    assert(fd == fds[1]);
+    fds[1] = fd;
+
+    for (size_t i = 0; i < count; i++) {
+        err = close(fds[i]);
+        assert(err == 0);
+    }
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
 
 static void test_api_file_write_read() {
     test_printf("write,read");
@@ -466,6 +519,447 @@ static void test_api_stat() {
     printf(COLOR_GREEN("ok\n"));
 }
 
+static void test_api_fstat() {
+    test_printf("fstat");
+
+    int fd = open("/fstat", O_RDWR|O_CREAT|O_TRUNC);
+    assert(fd != -1);
+    struct stat finfo;
+    int err = fstat(fd, &finfo);
+    assert(err == 0);
+    assert(finfo.st_size == 0);
+    assert(finfo.st_mode & S_IFREG);
+    assert(finfo.st_blksize > 0);
+
+    char buffer[] = "Hello World!";
+    ssize_t write_length = write(fd, buffer, sizeof(buffer));
+    assert(write_length == sizeof(buffer));
+    err = fstat(fd, &finfo);
+    assert(err == 0);
+    assert(finfo.st_size == sizeof(buffer));
+
+    off_t offset = lseek(fd, 100, SEEK_SET);  // seeking alone does not change the size
+    assert(offset == 100);
+    err = fstat(fd, &finfo);
+    assert(err == 0);
+    assert(finfo.st_size == sizeof(buffer));
+    write_length = write(fd, buffer, sizeof(buffer));
+    assert(write_length == sizeof(buffer));
+    err = fstat(fd, &finfo);
+    assert(err == 0);
+    assert(finfo.st_size == 100 + sizeof(buffer));
+
+    err = ftruncate(fd, 10);
+    assert(err == 0);
+    err = fstat(fd, &finfo);
+    assert(err == 0);
+    assert(finfo.st_size == 10);
+    err = close(fd);
+    assert(err == 0);
+
+    fd = open("/fstat", O_RDONLY);
+    assert(fd != -1);
+    err = fstat(fd, &finfo);
+    assert(err == 0);
+    assert(finfo.st_size == 10);
+    err = close(fd);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+// The size written through another descriptor, on file systems other than FAT
+static void test_api_fstat_shared() {
+    test_printf("fstat shared file");
+
+    int fd = open("/fstat", O_RDONLY|O_CREAT|O_TRUNC);
+    assert(fd != -1);
+    int writer = open("/fstat", O_WRONLY);
+    assert(writer != -1);
+    char buffer[] = "Hello World!";
+    ssize_t write_length = write(writer, buffer, sizeof(buffer));
+    assert(write_length == sizeof(buffer));
+    int err = fsync(writer);
+    assert(err == 0);
+    struct stat finfo;
+    err = fstat(fd, &finfo);
+    assert(err == 0);
+    assert(finfo.st_size == sizeof(buffer));
+
+    err = ftruncate(writer, 5);
+    assert(err == 0);
+    err = fstat(fd, &finfo);
+    assert(err == 0);
+    assert(finfo.st_size == 5);
+    err = close(writer);
+    assert(err == 0);
+    err = close(fd);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_pread_pwrite() {
+    test_printf("pread,pwrite");
+
+    int fd = open("/pread", O_RDWR|O_CREAT|O_TRUNC);
+    assert(fd != -1);
+    char buffer[] = "0123456789";
+    ssize_t length = write(fd, buffer, strlen(buffer));
+    assert(length == (ssize_t)strlen(buffer));
+
+    length = pwrite(fd, "AB", 2, 4);
+    assert(length == 2);
+    off_t offset = lseek(fd, 0, SEEK_CUR);  // positional I/O leaves the file offset alone
+    assert(offset == (off_t)strlen(buffer));
+
+    char read_buffer[16] = {0};
+    length = pread(fd, read_buffer, 4, 3);
+    assert(length == 4);
+    assert(memcmp(read_buffer, "3AB6", 4) == 0);
+    length = pread(fd, read_buffer, sizeof(read_buffer), 100);
+    assert(length == 0);
+    offset = lseek(fd, 0, SEEK_CUR);
+    assert(offset == (off_t)strlen(buffer));
+
+    length = pwrite(fd, "XY", 2, 20);  // writing past the end extends the file
+    assert(length == 2);
+    struct stat finfo;
+    int err = fstat(fd, &finfo);
+    assert(err == 0);
+    assert(finfo.st_size == 22);
+
+    length = pread(fd, read_buffer, 1, -1);
+    assert(length == -1);
+    assert(errno == EINVAL);
+    err = close(fd);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_readv_writev() {
+    test_printf("readv,writev,preadv,pwritev");
+
+    int fd = open("/readv", O_RDWR|O_CREAT|O_TRUNC);
+    assert(fd != -1);
+    char header[] = "head:";
+    char body[] = "body";
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = strlen(header)},
+        {.iov_base = body, .iov_len = strlen(body)},
+    };
+    ssize_t length = writev(fd, iov, 2);
+    assert(length == (ssize_t)(strlen(header) + strlen(body)));
+
+    off_t offset = lseek(fd, 0, SEEK_SET);
+    assert(offset == 0);
+    char first[5] = {0};
+    char second[8] = {0};
+    struct iovec read_iov[2] = {
+        {.iov_base = first, .iov_len = sizeof(first)},
+        {.iov_base = second, .iov_len = sizeof(second)},
+    };
+    length = readv(fd, read_iov, 2);  // stops short at the end of the file
+    assert(length == 9);
+    assert(memcmp(first, "head:", 5) == 0);
+    assert(memcmp(second, "body", 4) == 0);
+
+    iov[0].iov_base = "HEAD";
+    iov[0].iov_len = 4;
+    length = pwritev(fd, iov, 1, 0);
+    assert(length == 4);
+    memset(first, 0, sizeof(first));
+    memset(second, 0, sizeof(second));
+    read_iov[0].iov_len = 2;
+    read_iov[1].iov_len = 2;
+    length = preadv(fd, read_iov, 2, 3);
+    assert(length == 4);
+    assert(memcmp(first, "D:", 2) == 0);
+    assert(memcmp(second, "bo", 2) == 0);
+    offset = lseek(fd, 0, SEEK_CUR);
+    assert(offset == 9);
+
+    length = readv(fd, read_iov, 0);
+    assert(length == -1);
+    assert(errno == EINVAL);
+    int err = close(fd);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_syncfs() {
+    test_printf("fsync,syncfs,fs_sync_all");
+
+    int fd[3];
+    char path[] = "/sync0";
+    for (size_t i = 0; i < 3; i++) {
+        path[5] = '0' + i;
+        fd[i] = open(path, O_RDWR|O_CREAT|O_TRUNC);
+        assert(fd[i] != -1);
+        ssize_t length = write(fd[i], "channel", 7);
+        assert(length == 7);
+    }
+    int err = fsync(fd[0]);
+    assert(err == 0);
+    err = syncfs(fd[1]);
+    assert(err == 0);
+    err = fs_sync_all();
+    assert(err == 0);
+    err = syncfs(100);
+    assert(err == -1);
+    assert(errno == EBADF);
+
+    for (size_t i = 0; i < 3; i++) {
+        err = close(fd[i]);
+        assert(err == 0);
+        path[5] = '0' + i;
+        struct stat finfo;
+        err = stat(path, &finfo);
+        assert(err == 0);
+        assert(finfo.st_size == 7);
+        err = unlink(path);
+        assert(err == 0);
+    }
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_read_buffer() {
+    test_printf("O_RDBUF");
+
+    int fd = open("/rdbuf", O_RDWR|O_CREAT|O_TRUNC|O_RDBUF);
+    assert(fd != -1);
+    uint8_t buffer[1000];
+    for (size_t i = 0; i < sizeof(buffer); i++)
+        buffer[i] = i & 0xFF;
+    ssize_t length = write(fd, buffer, sizeof(buffer));
+    assert(length == (ssize_t)sizeof(buffer));
+    off_t offset = lseek(fd, 0, SEEK_SET);
+    assert(offset == 0);
+
+    for (size_t i = 0; i < 100; i++) {
+        uint8_t c;
+        length = read(fd, &c, 1);
+        assert(length == 1);
+        assert(c == (i & 0xFF));
+    }
+    offset = lseek(fd, 0, SEEK_CUR);  // the position excludes the read-ahead data
+    assert(offset == 100);
+    offset = lseek(fd, 10, SEEK_CUR);
+    assert(offset == 110);
+
+    length = write(fd, "XY", 2);  // lands at the position seen by the caller
+    assert(length == 2);
+    uint8_t read_buffer[4];
+    length = pread(fd, read_buffer, 4, 109);
+    assert(length == 4);
+    assert(read_buffer[0] == 109 && read_buffer[1] == 'X' && read_buffer[2] == 'Y' && read_buffer[3] == 112);
+
+    offset = lseek(fd, 990, SEEK_SET);
+    assert(offset == 990);
+    uint8_t tail[20];
+    length = read(fd, tail, sizeof(tail));
+    assert(length == 10);
+    assert(memcmp(tail, &buffer[990], 10) == 0);
+    length = read(fd, tail, sizeof(tail));
+    assert(length == 0);
+
+    int err = close(fd);
+    assert(err == 0);
+    err = unlink("/rdbuf");
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_write_buffer() {
+    test_printf("O_WRBUF");
+
+    int fd = open("/wrbuf", O_RDWR|O_CREAT|O_TRUNC|O_WRBUF);
+    assert(fd != -1);
+    for (size_t i = 0; i < 100; i++) {
+        char record[10];
+        snprintf(record, sizeof(record), "%08u\n", (unsigned)i);
+        ssize_t length = write(fd, record, 9);
+        assert(length == 9);
+    }
+    struct stat finfo;
+    int err = fstat(fd, &finfo);
+    assert(err == 0);
+    assert(finfo.st_size == 900);
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    assert(offset == 900);
+
+    char read_buffer[10] = {0};
+    ssize_t length = pread(fd, read_buffer, 9, 9 * 42);  // reads see the buffered writes
+    assert(length == 9);
+    assert(memcmp(read_buffer, "00000042\n", 9) == 0);
+
+    length = write(fd, "tail", 4);
+    assert(length == 4);
+    offset = lseek(fd, -4, SEEK_CUR);
+    assert(offset == 900);
+    length = read(fd, read_buffer, 4);
+    assert(length == 4);
+    assert(memcmp(read_buffer, "tail", 4) == 0);
+
+    length = write(fd, "more", 4);
+    assert(length == 4);
+    err = stat("/wrbuf", &finfo);  // stat() writes out the buffered data of the path
+    assert(err == 0);
+    assert(finfo.st_size == 908);
+    length = write(fd, "last", 4);
+    assert(length == 4);
+    int reader = open("/wrbuf", O_RDONLY);  // so does an open() for reading
+    assert(reader != -1);
+    length = pread(reader, read_buffer, 8, 904);
+    assert(length == 8);
+    assert(memcmp(read_buffer, "morelast", 8) == 0);
+    err = close(reader);
+    assert(err == 0);
+    offset = lseek(fd, 9 * 42, SEEK_SET);
+    assert(offset == 9 * 42);
+    length = write(fd, "0000004X\n", 9);
+    assert(length == 9);
+    const char *data = mmap(NULL, 912, PROT_READ, MAP_SHARED, fd, 0);  // so does mmap()
+    assert(data != MAP_FAILED);
+    assert(memcmp(&data[9 * 41], "00000041\n0000004X\n00000043\n", 27) == 0);
+    assert(memcmp(&data[900], "tailmorelast", 12) == 0);
+    err = munmap((void *)data, 912);
+    assert(err == 0);
+    err = fs_flush_buffers(0);
+    assert(err == 0);
+    err = close(fd);
+    assert(err == 0);
+    err = stat("/wrbuf", &finfo);
+    assert(err == 0);
+    assert(finfo.st_size == 912);
+    err = unlink("/wrbuf");
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_mmap() {
+    test_printf("mmap,munmap,msync");
+
+    int fd = open("/mmap", O_RDWR|O_CREAT|O_TRUNC);
+    assert(fd != -1);
+    char buffer[1024];
+    for (size_t i = 0; i < sizeof(buffer); i++)
+        buffer[i] = i & 0xFF;
+    ssize_t length = write(fd, buffer, sizeof(buffer));
+    assert(length == sizeof(buffer));
+
+    const char *data = mmap(NULL, sizeof(buffer), PROT_READ, MAP_SHARED, fd, 0);
+    assert(data != MAP_FAILED);
+    assert(memcmp(data, buffer, sizeof(buffer)) == 0);
+    int err = msync((void *)data, sizeof(buffer), MS_SYNC);
+    assert(err == 0);
+    err = munmap((void *)data, sizeof(buffer));
+    assert(err == 0);
+
+    data = mmap(NULL, 100, PROT_READ, MAP_PRIVATE, fd, 1000);  // extends beyond the end of file
+    assert(data != MAP_FAILED);
+    assert(memcmp(data, &buffer[1000], 24) == 0);
+    assert(data[24] == 0);
+    err = munmap((void *)data, 100);
+    assert(err == 0);
+
+    data = mmap(NULL, sizeof(buffer), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    assert(data == MAP_FAILED);
+    assert(errno == ENOTSUP);
+    err = munmap(buffer, sizeof(buffer));
+    assert(err == -1);
+    assert(errno == EINVAL);
+
+    err = close(fd);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_stat_cache() {
+    test_printf("stat cache");
+
+    struct stat finfo;
+    int err = stat("/cache", &finfo);
+    assert(err == -1 && errno == ENOENT);
+    err = stat("/cache", &finfo);  // negative entry
+    assert(err == -1 && errno == ENOENT);
+
+    int fd = open("/cache", O_WRONLY|O_CREAT);
+    assert(fd != -1);
+    err = stat("/cache", &finfo);
+    assert(err == 0);
+    assert(finfo.st_mode & S_IFREG);
+    char buffer[] = "Hello World!";
+    ssize_t write_length = write(fd, buffer, sizeof(buffer));
+    assert(write_length == sizeof(buffer));
+    err = close(fd);
+    assert(err == 0);
+    err = stat("/cache", &finfo);
+    assert(err == 0);
+    assert(finfo.st_size == sizeof(buffer));
+
+    fd = open("/cache", O_WRONLY);
+    assert(fd != -1);
+    err = ftruncate(fd, 4);
+    assert(err == 0);
+    err = close(fd);
+    assert(err == 0);
+    err = stat("/cache", &finfo);
+    assert(err == 0);
+    assert(finfo.st_size == 4);
+
+    err = mkdir("/cachedir", 0777);
+    assert(err == 0);
+    err = rename("/cache", "/cachedir/cache");
+    assert(err == 0);
+    err = stat("/cache", &finfo);
+    assert(err == -1 && errno == ENOENT);
+    err = stat("/cachedir/cache", &finfo);
+    assert(err == 0);
+    assert(finfo.st_size == 4);
+    err = rename("/cachedir", "/cachedir2");
+    assert(err == 0);
+    err = stat("/cachedir/cache", &finfo);
+    assert(err == -1);
+    err = stat("/cachedir2/cache", &finfo);
+    assert(err == 0);
+
+    err = unlink("/cachedir2/cache");
+    assert(err == 0);
+    err = stat("/cachedir2/cache", &finfo);
+    assert(err == -1 && errno == ENOENT);
+    err = rmdir("/cachedir2");
+    assert(err == 0);
+    err = stat("/cachedir2", &finfo);
+    assert(err == -1 && errno == ENOENT);
+
+    // Changes through a path that is not canonical reach the entries of the canonical path
+    err = mkdir("/aliasdir", 0777);
+    assert(err == 0);
+    err = stat("/alias", &finfo);
+    assert(err == -1 && errno == ENOENT);
+    fd = open("/aliasdir/../alias", O_WRONLY|O_CREAT);
+    assert(fd != -1);
+    err = close(fd);
+    assert(err == 0);
+    err = stat("/alias", &finfo);
+    assert(err == 0);
+    err = unlink("/./alias");
+    assert(err == 0);
+    err = stat("/alias", &finfo);
+    assert(err == -1 && errno == ENOENT);
+    err = rmdir("/aliasdir");
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
 static void test_api_reformat(void) {
     test_printf("fs_reformat");
 
@@ -510,6 +1004,91 @@ static void test_api_mount_unmount_repeat(filesystem_t *fs, blockdevice_t *devic
     printf(COLOR_GREEN("ok\n"));
 }
 
+static unsigned idle_calls = 0;
+
+static void count_idle_call(void) {
+    idle_calls++;
+}
+
+static void test_api_gc(void) {
+    test_printf("fs_gc");
+
+    int fd = open("/gc", O_WRONLY|O_CREAT);
+    assert(fd >= MIN_FILENO);
+    char buffer[512] = {0};
+    for (size_t i = 0; i < 8; i++) {
+        ssize_t write_length = write(fd, buffer, sizeof(buffer));
+        assert(write_length == sizeof(buffer));
+    }
+    int err = close(fd);
+    assert(err == 0);
+    err = unlink("/gc");
+    assert(err == 0);
+
+    while ((err = fs_gc("/", 10 * 1000)) == 1)
+        ;
+    assert(err == 0);
+    err = fs_gc("/", 10 * 1000);
+    assert(err == 0);
+
+    // Registered work runs after the maintenance, once per poll however often it is registered
+    err = fs_gc_register_idle(count_idle_call);
+    assert(err == 0);
+    err = fs_gc_register_idle(count_idle_call);
+    assert(err == 0);
+    idle_calls = 0;
+    bool pending = fs_gc_idle_poll(0, 10 * 1000);
+    assert(!pending);
+    assert(idle_calls == 1);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_unlink_open(void) {
+    test_printf("unlink open file");
+
+    int fd = open("/unlinked", O_RDWR|O_CREAT);
+    assert(fd >= MIN_FILENO);
+    char buffer[] = "Hello World!";
+    ssize_t length = write(fd, buffer, sizeof(buffer));
+    assert(length == sizeof(buffer));
+
+    int err = unlink("/unlinked");
+    assert(err == 0);
+    struct stat finfo;
+    err = stat("/unlinked", &finfo);
+    assert(err == -1 && errno == ENOENT);
+
+    // The data stays accessible until the last close
+    off_t offset = lseek(fd, 0, SEEK_SET);
+    assert(offset == 0);
+    char read_buffer[sizeof(buffer)] = {0};
+    length = read(fd, read_buffer, sizeof(read_buffer));
+    assert(length == sizeof(buffer));
+    assert(memcmp(read_buffer, buffer, sizeof(buffer)) == 0);
+    length = write(fd, buffer, sizeof(buffer));
+    assert(length == sizeof(buffer));
+    err = fstat(fd, &finfo);
+    assert(err == 0);
+    assert(finfo.st_size == 2 * sizeof(buffer));
+
+    // A new file of the same name is a different file
+    int fd2 = open("/unlinked", O_RDWR|O_CREAT|O_EXCL);
+    assert(fd2 >= MIN_FILENO);
+    err = fstat(fd2, &finfo);
+    assert(err == 0);
+    assert(finfo.st_size == 0);
+
+    err = close(fd);
+    assert(err == 0);
+    err = close(fd2);
+    assert(err == 0);
+    err = unlink("/unlinked");
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
 static void test_loopback_file(void) {
     test_printf("loopback image file");
 
@@ -539,15 +1118,25 @@ void test_vfs(void) {
     test_api_file_tell();
     test_api_file_truncate();
     test_api_stat();
+    test_api_fstat();
+    test_api_stat_cache();
+    test_api_pread_pwrite();
+    test_api_readv_writev();
+    test_api_syncfs();
+    test_api_read_buffer();
+    test_api_write_buffer();
+    test_api_mmap();
     test_api_remove();
     test_api_rename();
     test_api_mkdir();
     test_api_dir_open();
     test_api_dir_open_many();
     test_api_dir_read();
+    test_api_gc();
     test_api_reformat();
     test_api_unmount();
     test_api_mount_unmount_repeat(fat, heap);
+    test_api_format_failure();
 
     cleanup(heap);
     filesystem_fat_free(fat);
@@ -565,17 +1154,27 @@ void test_vfs(void) {
     test_api_mount(lfs, heap);
     test_api_file_open_close();
     test_api_file_open_many();
+    test_api_file_open_limit();
     test_api_file_write_read();
     test_api_file_seek();
     test_api_file_tell();
     test_api_file_truncate();
     test_api_stat();
+    test_api_fstat();
+    test_api_stat_cache();
+    test_api_pread_pwrite();
+    test_api_readv_writev();
+    test_api_syncfs();
+    test_api_read_buffer();
+    test_api_write_buffer();
+    test_api_mmap();
     test_api_remove();
     test_api_rename();
     test_api_mkdir();
     test_api_dir_open();
     test_api_dir_open_many();
     test_api_dir_read();
+    test_api_gc();
     test_api_reformat();
     test_api_unmount();
     test_api_mount_unmount_repeat(lfs, heap);
@@ -601,12 +1200,21 @@ void test_vfs(void) {
     test_api_file_tell();
     test_api_file_truncate();
     test_api_stat();
+    test_api_fstat();
+    test_api_stat_cache();
+    test_api_pread_pwrite();
+    test_api_readv_writev();
+    test_api_syncfs();
+    test_api_read_buffer();
+    test_api_write_buffer();
+    test_api_mmap();
     test_api_remove();
     test_api_rename();
     test_api_mkdir();
     test_api_dir_open();
     test_api_dir_open_many();
     test_api_dir_read();
+    test_api_gc();
     test_api_reformat();
     test_api_unmount();
     test_api_mount_unmount_repeat(lfs, heap);
@@ -616,6 +1224,44 @@ void test_vfs(void) {
     blockdevice_heap_free(heap);
 
 
+    printf("VFS tmpfs:\n");
+    filesystem_t *tmpfs = filesystem_tmpfs_create(HEAP_STORAGE_SIZE);
+    assert(tmpfs != NULL);
+
+    test_api_format(tmpfs, NULL);
+    test_api_mount(tmpfs, NULL);
+    test_api_file_open_close();
+    test_api_file_open_many();
+    test_api_file_open_limit();
+    test_api_file_write_read();
+    test_api_file_seek();
+    test_api_file_tell();
+    test_api_file_truncate();
+    test_api_stat();
+    test_api_fstat();
+    test_api_fstat_shared();
+    test_api_stat_cache();
+    test_api_pread_pwrite();
+    test_api_readv_writev();
+    test_api_syncfs();
+    test_api_read_buffer();
+    test_api_write_buffer();
+    test_api_mmap();
+    test_api_remove();
+    test_api_unlink_open();
+    test_api_rename();
+    test_api_mkdir();
+    test_api_dir_open();
+    test_api_dir_open_many();
+    test_api_dir_read();
+    test_api_gc();
+    test_api_reformat();
+    test_api_unmount();
+    test_api_mount_unmount_repeat(tmpfs, NULL);
+
+    filesystem_tmpfs_free(tmpfs);
+
+
     printf("VFS loopback FAT on littlefs:\n");
     heap = blockdevice_heap_create(HEAP_STORAGE_SIZE);
     assert(heap != NULL);
@@ -642,6 +1288,14 @@ void test_vfs(void) {
     test_api_file_tell();
     test_api_file_truncate();
     test_api_stat();
+    test_api_fstat();
+    test_api_stat_cache();
+    test_api_pread_pwrite();
+    test_api_readv_writev();
+    test_api_syncfs();
+    test_api_read_buffer();
+    test_api_write_buffer();
+    test_api_mmap();
     test_api_remove();
     test_api_rename();
     test_api_mkdir();
@@ -649,6 +1303,7 @@ void test_vfs(void) {
     test_api_dir_open_many();
     test_api_dir_read();
     test_api_reformat();
+    test_api_unmount();
     test_api_mount_unmount_repeat(fat, loopback);
 
     filesystem_fat_free(fat);
@@ -0,0 +1,316 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "blockdevice/heap.h"
+#include "filesystem/fat.h"
+#include "filesystem/tmpfs.h"
+#include "filesystem/vfs.h"
+#include "filesystem/zfile.h"
+
+#define COLOR_GREEN(format)  ("\e[32m" format "\e[0m")
+#define HEAP_STORAGE_SIZE    (128 * 1024)
+#define LINE_SIZE            40
+#define LINE_COUNT           7000  // More frames than one index record holds
+#define LOG_SIZE             ((off_t)LINE_COUNT * LINE_SIZE)
+
+static char path[64];
+
+static void test_printf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+
+    printf(" ");
+    for (size_t i = 0; i < 50 - (size_t)n; i++)
+        printf(".");
+}
+
+static const char *file_path(const char *dir, const char *name) {
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return path;
+}
+
+static void make_line(size_t n, char *line) {
+    int length = snprintf(line, LINE_SIZE + 1, "%08u INFO sensor%02u value=%05u     \n",
+                          (unsigned)n * 10, (unsigned)(n % 16), (unsigned)(n * 37 % 100000));
+    assert(length == LINE_SIZE);
+}
+
+// The log text from `position`
+static void expected(off_t position, uint8_t *buffer, size_t size) {
+    char line[LINE_SIZE + 1];
+    size_t n = 0;
+    while (n < size) {
+        size_t row = (size_t)(position + (off_t)n) / LINE_SIZE;
+        size_t column = (size_t)(position + (off_t)n) % LINE_SIZE;
+        make_line(row, line);
+        size_t length = LINE_SIZE - column < size - n ? LINE_SIZE - column : size - n;
+        memcpy(buffer + n, line + column, length);
+        n += length;
+    }
+}
+
+static void append_lines(fs_zfile_t *zf, size_t from, size_t count) {
+    char line[LINE_SIZE + 1];
+    for (size_t n = from; n < from + count; n++) {
+        make_line(n, line);
+        ssize_t length = fs_zfile_write(zf, line, LINE_SIZE);
+        assert(length == LINE_SIZE);
+    }
+}
+
+static void verify_at(fs_zfile_t *zf, off_t position, size_t size) {
+    uint8_t data[1000];
+    uint8_t want[1000];
+    off_t offset = fs_zfile_seek(zf, position, SEEK_SET);
+    assert(offset == position);
+    ssize_t length = fs_zfile_read(zf, data, size);
+    size_t available = position < LOG_SIZE ? (size_t)(LOG_SIZE - position) : 0;
+    assert(length == (ssize_t)(size < available ? size : available));
+    expected(position, want, (size_t)length);
+    assert(memcmp(data, want, (size_t)length) == 0);
+}
+
+static void verify_log(const char *dir) {
+    fs_zfile_t *zf = fs_zfile_open(file_path(dir, "log.z"), O_RDONLY);
+    assert(zf != NULL);
+    assert(fs_zfile_size(zf) == LOG_SIZE);
+
+    // Sequentially
+    static uint8_t data[PICO_VFS_ZFILE_FRAME_SIZE + 123];
+    static uint8_t want[sizeof(data)];
+    off_t position = 0;
+    ssize_t length;
+    while ((length = fs_zfile_read(zf, data, sizeof(data))) > 0) {
+        expected(position, want, (size_t)length);
+        assert(memcmp(data, want, (size_t)length) == 0);
+        position += length;
+    }
+    assert(length == 0);
+    assert(position == LOG_SIZE);
+
+    // Frame boundaries, the end, and anywhere
+    verify_at(zf, 0, 100);
+    verify_at(zf, PICO_VFS_ZFILE_FRAME_SIZE - 10, 20);
+    verify_at(zf, 64 * PICO_VFS_ZFILE_FRAME_SIZE, 100);
+    verify_at(zf, 65 * PICO_VFS_ZFILE_FRAME_SIZE - 1, 2);
+    verify_at(zf, LOG_SIZE - 50, 100);
+    verify_at(zf, LOG_SIZE + 10, 100);
+    uint32_t seed = 1;
+    for (int i = 0; i < 50; i++) {
+        seed = seed * 1103515245 + 12345;
+        verify_at(zf, (off_t)(seed % LOG_SIZE), 1000);
+    }
+    position = fs_zfile_seek(zf, -40, SEEK_END);
+    assert(position == LOG_SIZE - 40);
+    position = fs_zfile_seek(zf, 20, SEEK_CUR);
+    assert(position == LOG_SIZE - 20);
+    position = fs_zfile_seek(zf, -1, SEEK_SET);
+    assert(position == -1 && errno == EINVAL);
+
+    int err = fs_zfile_close(zf);
+    assert(err == 0);
+}
+
+static void test_api_write_read(const char *dir) {
+    test_printf("fs_zfile_write,fs_zfile_read");
+
+    fs_zfile_t *zf = fs_zfile_open(file_path(dir, "log.z"), O_WRONLY|O_CREAT|O_TRUNC);
+    assert(zf != NULL);
+    append_lines(zf, 0, LINE_COUNT);
+    assert(fs_zfile_size(zf) == LOG_SIZE);
+    ssize_t length = fs_zfile_read(zf, path, 1);
+    assert(length == -1 && errno == EBADF);
+    int err = fs_zfile_close(zf);
+    assert(err == 0);
+
+    struct stat finfo;
+    err = stat(file_path(dir, "log.z"), &finfo);
+    assert(err == 0);
+    assert(finfo.st_size < LOG_SIZE / 2);
+
+    verify_log(dir);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_append(const char *dir) {
+    test_printf("append to a closed file");
+
+    fs_zfile_t *zf = fs_zfile_open(file_path(dir, "log.z"), O_WRONLY|O_CREAT|O_TRUNC);
+    assert(zf != NULL);
+    append_lines(zf, 0, 1000);
+    int err = fs_zfile_close(zf);
+    assert(err == 0);
+
+    // Frames continue after the index records of earlier sessions
+    zf = fs_zfile_open(file_path(dir, "log.z"), O_WRONLY);
+    assert(zf != NULL);
+    assert(fs_zfile_size(zf) == 1000 * LINE_SIZE);
+    append_lines(zf, 1000, 5000);
+    err = fs_zfile_close(zf);
+    assert(err == 0);
+    zf = fs_zfile_open(file_path(dir, "log.z"), O_WRONLY);
+    assert(zf != NULL);
+    append_lines(zf, 6000, LINE_COUNT - 6000);
+    err = fs_zfile_close(zf);
+    assert(err == 0);
+
+    verify_log(dir);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_unclosed(const char *dir) {
+    test_printf("read and append without the index");
+
+    fs_zfile_t *writer = fs_zfile_open(file_path(dir, "log.z"), O_WRONLY|O_CREAT|O_TRUNC);
+    assert(writer != NULL);
+    append_lines(writer, 0, LINE_COUNT - 100);
+    int err = fs_zfile_sync(writer);
+    assert(err == 0);
+
+    // The frames of a file that is still being written
+    fs_zfile_t *zf = fs_zfile_open(file_path(dir, "log.z"), O_RDONLY);
+    assert(zf != NULL);
+    assert(fs_zfile_size(zf) == LOG_SIZE - 100 * LINE_SIZE);
+    err = fs_zfile_close(zf);
+    assert(err == 0);
+    append_lines(writer, LINE_COUNT - 100, 100);
+    err = fs_zfile_close(writer);
+    assert(err == 0);
+
+    // A frame torn by a power failure after the footer
+    int fd = open(file_path(dir, "log.z"), O_WRONLY|O_APPEND);
+    assert(fd >= 0);
+    uint32_t torn[6] = {0x4d52465a, 1000, 900, 0, 0x12345678, 0x9abcdef0};
+    ssize_t length = write(fd, torn, sizeof(torn));
+    assert(length == sizeof(torn));
+    err = close(fd);
+    assert(err == 0);
+    verify_log(dir);
+
+    zf = fs_zfile_open(file_path(dir, "log.z"), O_WRONLY);
+    assert(zf != NULL);
+    assert(fs_zfile_size(zf) == LOG_SIZE);
+    err = fs_zfile_close(zf);
+    assert(err == 0);
+    verify_log(dir);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_incompressible(const char *dir) {
+    test_printf("incompressible data");
+
+    static uint8_t data[2 * PICO_VFS_ZFILE_FRAME_SIZE + 100];
+    uint32_t seed = 7;
+    for (size_t i = 0; i < sizeof(data); i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (uint8_t)(seed >> 16);
+    }
+    fs_zfile_t *zf = fs_zfile_open(file_path(dir, "random.z"), O_WRONLY|O_CREAT|O_TRUNC);
+    assert(zf != NULL);
+    ssize_t length = fs_zfile_write(zf, data, sizeof(data));
+    assert(length == sizeof(data));
+    int err = fs_zfile_close(zf);
+    assert(err == 0);
+
+    // Stored as is, not expanded
+    struct stat finfo;
+    err = stat(file_path(dir, "random.z"), &finfo);
+    assert(err == 0);
+    assert(finfo.st_size < (off_t)sizeof(data) + 200);
+
+    static uint8_t reread[sizeof(data)];
+    zf = fs_zfile_open(file_path(dir, "random.z"), O_RDONLY);
+    assert(zf != NULL);
+    length = fs_zfile_read(zf, reread, sizeof(reread));
+    assert(length == sizeof(data));
+    assert(memcmp(reread, data, sizeof(data)) == 0);
+    err = fs_zfile_close(zf);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_api_errors(const char *dir) {
+    test_printf("corrupted and foreign files");
+
+    fs_zfile_t *zf = fs_zfile_open(file_path(dir, "log.z"), O_RDWR);
+    assert(zf == NULL && errno == EINVAL);
+    zf = fs_zfile_open(file_path(dir, "missing.z"), O_RDONLY);
+    assert(zf == NULL && errno == ENOENT);
+
+    int fd = open(file_path(dir, "plain.txt"), O_WRONLY|O_CREAT|O_TRUNC);
+    assert(fd >= 0);
+    ssize_t length = write(fd, "not a compressed file\n", 22);
+    assert(length == 22);
+    close(fd);
+    zf = fs_zfile_open(file_path(dir, "plain.txt"), O_RDONLY);
+    assert(zf == NULL && errno == EILSEQ);
+
+    // A damaged frame is reported, the other frames are still read
+    fd = open(file_path(dir, "log.z"), O_RDWR);
+    assert(fd >= 0);
+    uint8_t byte;
+    length = pread(fd, &byte, 1, 16 + 16 + 200);
+    assert(length == 1);
+    byte ^= 0x55;
+    length = pwrite(fd, &byte, 1, 16 + 16 + 200);
+    assert(length == 1);
+    close(fd);
+
+    zf = fs_zfile_open(file_path(dir, "log.z"), O_RDONLY);
+    assert(zf != NULL);
+    uint8_t data[100];
+    length = fs_zfile_read(zf, data, sizeof(data));
+    assert(length == -1 && errno == EIO);
+    verify_at(zf, PICO_VFS_ZFILE_FRAME_SIZE, 100);
+    int err = fs_zfile_close(zf);
+    assert(err == 0);
+
+    printf(COLOR_GREEN("ok\n"));
+}
+
+static void test_zfile_on(const char *dir) {
+    test_api_write_read(dir);
+    test_api_append(dir);
+    test_api_unclosed(dir);
+    test_api_incompressible(dir);
+    test_api_errors(dir);
+}
+
+void test_zfile(void) {
+    printf("Compressed files on FAT:\n");
+
+    blockdevice_t *heap = blockdevice_heap_create(HEAP_STORAGE_SIZE);
+    assert(heap != NULL);
+    filesystem_t *fat = filesystem_fat_create();
+    assert(fat != NULL);
+    int err = fs_format(fat, heap);
+    assert(err == 0);
+    err = fs_mount("/", fat, heap);
+    assert(err == 0);
+    test_zfile_on("");
+    err = fs_unmount("/");
+    assert(err == 0);
+    filesystem_fat_free(fat);
+    blockdevice_heap_free(heap);
+
+    printf("Compressed files on tmpfs:\n");
+
+    filesystem_t *tmpfs = filesystem_tmpfs_create(0);
+    assert(tmpfs != NULL);
+    err = fs_mount("/tmp", tmpfs, NULL);
+    assert(err == 0);
+    test_zfile_on("/tmp");
+    err = fs_unmount("/tmp");
+    assert(err == 0);
+    filesystem_tmpfs_free(tmpfs);
+}
@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+#
+# Copyright 2024, Hiroyuki OYAMA
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+"""Build a romfs image from a directory tree.
+
+The image is read by filesystem_romfs (src/filesystem/romfs.c). Its layout, little endian:
+
+    header | entries[entry_count] | names | file data
+
+Entry 0 is the root directory. The entries of each directory are consecutive and sorted by
+name in byte order, so a path component is found by binary search. A directory entry points
+to its first entry and holds the number of entries; a file entry holds the offset and the
+size of its data, which is contiguous and aligned to --align bytes.
+"""
+
+import argparse
+import os
+import struct
+import sys
+import zlib
+
+MAGIC = 0x53464D52  # "RMFS"
+VERSION = 1
+TYPE_FILE = 0
+TYPE_DIR = 1
+NAME_MAX = 255
+HEADER = struct.Struct("<IHHIIII")
+ENTRY = struct.Struct("<IHHIII")
+SECTOR_SIZE = 4096
+
+
+class Node:
+    def __init__(self, name, path, is_dir):
+        self.name = name
+        self.path = path
+        self.is_dir = is_dir
+        self.children = []
+        self.index = 0
+        self.parent = 0
+
+
+def scan(path, name=b""):
+    node = Node(name, path, os.path.isdir(path))
+    if node.is_dir:
+        for child in os.listdir(path):
+            encoded = os.fsencode(child)
+            if len(encoded) > NAME_MAX:
+                sys.exit(f"mkromfs: name too long: {os.path.join(path, child)}")
+            node.children.append(scan(os.path.join(path, child), encoded))
+        node.children.sort(key=lambda child: child.name)
+    return node
+
+
+def build(root, align):
+    # Breadth first, so that the entries of each directory are consecutive
+    order = [root]
+    for node in order:
+        for child in node.children:
+            child.parent = node.index
+            child.index = len(order)
+            order.append(child)
+
+    names = bytearray()
+    name_offsets = []
+    for node in order:
+        name_offsets.append(len(names))
+        names += node.name
+
+    data_start = HEADER.size + ENTRY.size * len(order) + len(names)
+    data = bytearray()
+    entries = bytearray()
+    for node, name_offset in zip(order, name_offsets):
+        if node.is_dir:
+            first = node.children[0].index if node.children else 0
+            entries += ENTRY.pack(name_offset, len(node.name), TYPE_DIR, node.parent,
+                                  first, len(node.children))
+            continue
+        with open(node.path, "rb") as f:
+            content = f.read()
+        padding = -(data_start + len(data)) % align
+        data += bytes(padding)
+        entries += ENTRY.pack(name_offset, len(node.name), TYPE_FILE, node.parent,
+                              data_start + len(data), len(content))
+        data += content
+
+    table = bytes(entries) + bytes(names)
+    image_size = data_start + len(data)
+    header = HEADER.pack(MAGIC, VERSION, HEADER.size, len(order), len(names), image_size,
+                         zlib.crc32(table))
+    return header + table + bytes(data), len(order)
+
+
+def c_source(image, symbol):
+    lines = [
+        "// Generated by mkromfs.py. Do not edit.",
+        "#include <stddef.h>",
+        "#include <stdint.h>",
+        "",
+        # Sector aligned, so that it can be used by blockdevice_flash_create()
+        f"const uint8_t {symbol}[{len(image)}] __attribute__((aligned({SECTOR_SIZE}))) = {{",
+    ]
+    for i in range(0, len(image), 16):
+        lines.append("    " + " ".join(f"0x{b:02x}," for b in image[i:i + 16]))
+    lines += ["};", f"const size_t {symbol}_size = sizeof({symbol});", ""]
+    return "\n".join(lines)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("source", help="directory to store in the image")
+    parser.add_argument("-o", "--output", help="write the image to this file")
+    parser.add_argument("--c-source", help="write the image as a C array to this file")
+    parser.add_argument("--symbol", default="romfs_image", help="name of the C array")
+    parser.add_argument("--align", type=int, default=4, help="alignment of file data in bytes")
+    args = parser.parse_args()
+
+    if not os.path.isdir(args.source):
+        sys.exit(f"mkromfs: not a directory: {args.source}")
+    if args.align < 1:
+        sys.exit("mkromfs: --align must be positive")
+    if args.output is None and args.c_source is None:
+        sys.exit("mkromfs: specify --output or --c-source")
+
+    image, count = build(scan(args.source), args.align)
+    if len(image) > 0xFFFFFFFF:
+        sys.exit("mkromfs: image larger than 4 GiB")
+    padded = image + b"\xff" * (-len(image) % SECTOR_SIZE)  # Whole flash sectors
+    if args.output:
+        with open(args.output, "wb") as f:
+            f.write(padded)
+    if args.c_source:
+        with open(args.c_source, "w") as f:
+            f.write(c_source(padded, args.symbol))
+    print(f"mkromfs: {count} entries, {len(image)} bytes")
+
+
+if __name__ == "__main__":
+    main()